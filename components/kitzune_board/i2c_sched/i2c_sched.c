@@ -0,0 +1,294 @@
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "i2c_sched.h"
+
+#define I2C_SCHED_STACK (3 * 1024)
+#define I2C_SCHED_TIMEOUT_MS 50
+
+static const char *TAG = "I2C_SCHED";
+
+// A panel update is queued as a few transfers per changed span, so the
+// display queue needs room for most of a frame
+static const UBaseType_t s_queue_len[I2C_SCHED_CLASS_COUNT] = {
+    [I2C_SCHED_CODEC] = 8,
+    [I2C_SCHED_DISPLAY] = 32,
+};
+
+typedef struct {
+    i2c_sched_xfer_t xfer;
+    size_t sent;            // data bytes already on the bus
+    bool active;
+} sched_job_t;
+
+typedef struct {
+    SemaphoreHandle_t done;
+    esp_err_t ret;
+} sched_sync_t;
+
+typedef enum {
+    SCHED_STOPPED = 0,
+    SCHED_STARTING,
+    SCHED_RUNNING,
+    SCHED_FAILED,
+} sched_state_t;
+
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static volatile sched_state_t s_state = SCHED_STOPPED;
+static i2c_port_t s_port;
+static TaskHandle_t s_task = NULL;
+static QueueHandle_t s_queue[I2C_SCHED_CLASS_COUNT];
+// Only touched by the scheduler task
+static sched_job_t s_jobs[I2C_SCHED_CLASS_COUNT];
+static uint8_t s_link[I2C_LINK_RECOMMENDED_SIZE(2)];
+// Guarded by s_lock
+static i2c_sched_stats_t s_stats[I2C_SCHED_CLASS_COUNT];
+
+static esp_err_t bus_xfer(const i2c_sched_xfer_t *x, const uint8_t *data, size_t len, bool read)
+{
+    i2c_cmd_handle_t cmd = i2c_cmd_link_create_static(s_link, sizeof(s_link));
+    if (cmd == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    i2c_master_start(cmd);
+    if (x->prefix_len != 0 || len != 0) {
+        i2c_master_write_byte(cmd, (x->addr << 1) | I2C_MASTER_WRITE, true);
+        if (x->prefix_len != 0) {
+            i2c_master_write(cmd, x->prefix, x->prefix_len, true);
+        }
+        if (len != 0) {
+            i2c_master_write(cmd, data, len, true);
+        }
+        if (read) {
+            i2c_master_start(cmd);
+        }
+    }
+    if (read) {
+        i2c_master_write_byte(cmd, (x->addr << 1) | I2C_MASTER_READ, true);
+        i2c_master_read(cmd, x->rx, x->rx_len, I2C_MASTER_LAST_NACK);
+    }
+    i2c_master_stop(cmd);
+    esp_err_t ret = i2c_master_cmd_begin(s_port, cmd, pdMS_TO_TICKS(I2C_SCHED_TIMEOUT_MS));
+    i2c_cmd_link_delete_static(cmd);
+    return ret;
+}
+
+// The highest class with work, picking up its next transfer if it has none
+// in progress. Within a class, transfers complete in the order submitted.
+static int next_class(void)
+{
+    for (int c = 0; c < I2C_SCHED_CLASS_COUNT; ++c) {
+        sched_job_t *job = &s_jobs[c];
+        if (!job->active && xQueueReceive(s_queue[c], &job->xfer, 0) == pdTRUE) {
+            job->sent = 0;
+            job->active = true;
+        }
+        if (job->active) {
+            return c;
+        }
+    }
+    return -1;
+}
+
+static void run_chunk(int cls)
+{
+    sched_job_t *job = &s_jobs[cls];
+    i2c_sched_xfer_t *x = &job->xfer;
+    int64_t start = esp_timer_get_time();
+    size_t n = x->len - job->sent;
+    n = n > I2C_SCHED_MAX_CHUNK ? I2C_SCHED_MAX_CHUNK : n;
+    bool last = job->sent + n >= x->len;
+    bool read = last && x->rx_len != 0;
+
+    // A transfer with nothing to send just marks its place in the queue
+    esp_err_t ret = ESP_OK;
+    if (x->prefix_len != 0 || n != 0 || read) {
+        ret = bus_xfer(x, x->data + job->sent, n, read);
+    }
+    uint32_t bytes = 0;
+    if (x->prefix_len != 0 || n != 0) {
+        bytes += 1 + x->prefix_len + n;
+    }
+    if (read) {
+        bytes += 1 + x->rx_len;
+    }
+
+    bool first = job->sent == 0;
+    job->sent += n;
+    bool done = last || ret != ESP_OK;
+    int64_t now = esp_timer_get_time();
+
+    i2c_sched_stats_t *st = &s_stats[cls];
+    taskENTER_CRITICAL(&s_lock);
+    st->chunks++;
+    st->bytes += bytes;
+    if (first && (uint32_t)(start - x->queued_us) > st->max_wait_us) {
+        st->max_wait_us = (uint32_t)(start - x->queued_us);
+    }
+    if (done) {
+        st->xfers++;
+        st->errors += ret != ESP_OK;
+        if ((uint32_t)(now - x->queued_us) > st->max_latency_us) {
+            st->max_latency_us = (uint32_t)(now - x->queued_us);
+        }
+    }
+    taskEXIT_CRITICAL(&s_lock);
+
+    if (done) {
+        if (ret != ESP_OK) {
+            ESP_LOGW(TAG, "Transfer to 0x%02x failed: %s", x->addr, esp_err_to_name(ret));
+        }
+        job->active = false;
+        if (x->cb != NULL) {
+            x->cb(ret, x->arg);
+        }
+    }
+}
+
+static void i2c_sched_task(void *arg)
+{
+    while (1) {
+        int cls = next_class();
+        if (cls < 0) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+        run_chunk(cls);
+    }
+}
+
+esp_err_t i2c_sched_init(i2c_port_t port, const i2c_config_t *cfg)
+{
+    // The codec and the display are brought up in parallel, and either may
+    // be first to ask for the bus
+    taskENTER_CRITICAL(&s_lock);
+    bool first = s_state == SCHED_STOPPED;
+    if (first) {
+        s_state = SCHED_STARTING;
+    }
+    taskEXIT_CRITICAL(&s_lock);
+    if (!first) {
+        while (s_state == SCHED_STARTING) {
+            vTaskDelay(1);
+        }
+        return s_state == SCHED_RUNNING ? ESP_OK : ESP_FAIL;
+    }
+
+    esp_err_t ret = i2c_param_config(port, cfg);
+    if (ret == ESP_OK) {
+        ret = i2c_driver_install(port, cfg->mode, 0, 0, 0);
+    }
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Unable to install the I2C driver: %s", esp_err_to_name(ret));
+        goto cleanup;
+    }
+    s_port = port;
+    for (int c = 0; c < I2C_SCHED_CLASS_COUNT; ++c) {
+        s_queue[c] = xQueueCreate(s_queue_len[c], sizeof(i2c_sched_xfer_t));
+        if (s_queue[c] == NULL) {
+            ret = ESP_ERR_NO_MEM;
+            goto cleanup;
+        }
+    }
+    if (pdPASS != xTaskCreatePinnedToCore(i2c_sched_task, "I2C", I2C_SCHED_STACK, NULL,
+                                          CONFIG_KZ_SCHED_I2C_PRIO, &s_task, CONFIG_KZ_SCHED_IO_CORE)) {
+        ret = ESP_ERR_NO_MEM;
+        goto cleanup;
+    }
+    s_state = SCHED_RUNNING;
+    return ESP_OK;
+
+cleanup:
+    s_state = SCHED_FAILED;
+    return ret;
+}
+
+esp_err_t i2c_sched_submit(i2c_sched_class_t cls, const i2c_sched_xfer_t *xfer, TickType_t wait)
+{
+    if (s_state != SCHED_RUNNING) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (cls >= I2C_SCHED_CLASS_COUNT || xfer->prefix_len > I2C_SCHED_MAX_PREFIX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    i2c_sched_xfer_t x = *xfer;
+    x.queued_us = esp_timer_get_time();
+    if (xQueueSend(s_queue[cls], &x, wait) != pdTRUE) {
+        return ESP_ERR_TIMEOUT;
+    }
+    xTaskNotifyGive(s_task);
+    return ESP_OK;
+}
+
+static void sync_cb(esp_err_t ret, void *arg)
+{
+    sched_sync_t *sync = arg;
+    sync->ret = ret;
+    xSemaphoreGive(sync->done);
+}
+
+esp_err_t i2c_sched_xfer(i2c_sched_class_t cls, i2c_sched_xfer_t *xfer)
+{
+    StaticSemaphore_t sem;
+    sched_sync_t sync = {
+        .done = xSemaphoreCreateBinaryStatic(&sem),
+        .ret = ESP_FAIL,
+    };
+    i2c_sched_xfer_t x = *xfer;
+    x.cb = sync_cb;
+    x.arg = &sync;
+    esp_err_t ret = i2c_sched_submit(cls, &x, portMAX_DELAY);
+    if (ret == ESP_OK) {
+        xSemaphoreTake(sync.done, portMAX_DELAY);
+        ret = sync.ret;
+    }
+    vSemaphoreDelete(sync.done);
+    return ret;
+}
+
+esp_err_t i2c_sched_write_reg(i2c_sched_class_t cls, uint8_t addr, uint8_t reg, const uint8_t *data, size_t len)
+{
+    // The scheduler would resend the same register with every chunk, so
+    // split here and start each chunk at the register its data belongs to
+    size_t off = 0;
+    esp_err_t ret;
+    do {
+        size_t n = len - off > I2C_SCHED_MAX_CHUNK ? I2C_SCHED_MAX_CHUNK : len - off;
+        i2c_sched_xfer_t x = {
+            .addr = addr,
+            .prefix = {(uint8_t)(reg + off)},
+            .prefix_len = 1,
+            .data = data + off,
+            .len = n,
+        };
+        ret = i2c_sched_xfer(cls, &x);
+        off += n;
+    } while (ret == ESP_OK && off < len);
+    return ret;
+}
+
+esp_err_t i2c_sched_read_reg(i2c_sched_class_t cls, uint8_t addr, uint8_t reg, uint8_t *data, size_t len)
+{
+    i2c_sched_xfer_t x = {
+        .addr = addr,
+        .prefix = {reg},
+        .prefix_len = 1,
+        .rx = data,
+        .rx_len = len,
+    };
+    return i2c_sched_xfer(cls, &x);
+}
+
+void i2c_sched_get_stats(i2c_sched_class_t cls, i2c_sched_stats_t *stats)
+{
+    taskENTER_CRITICAL(&s_lock);
+    *stats = s_stats[cls];
+    taskEXIT_CRITICAL(&s_lock);
+}
@@ -0,0 +1,107 @@
+#ifndef __I2C_SCHED_H__
+#define __I2C_SCHED_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+#include "driver/i2c.h"
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Every device on the board's I2C bus goes through one task, so a long
+ * display update can't hold up a codec command for more than one chunk.
+ * Writes longer than I2C_SCHED_MAX_CHUNK are split, resending the prefix
+ * with each chunk, and higher priority transfers run between chunks.
+ */
+#define I2C_SCHED_MAX_CHUNK 32
+#define I2C_SCHED_MAX_PREFIX 8
+
+typedef enum {
+    I2C_SCHED_CODEC = 0,    /*!< Codec control, always served first */
+    I2C_SCHED_DISPLAY,      /*!< Panel updates */
+    I2C_SCHED_CLASS_COUNT,
+} i2c_sched_class_t;
+
+typedef void (*i2c_sched_cb_t)(esp_err_t ret, void *arg);
+
+typedef struct {
+    uint8_t addr;                           /*!< 7-bit device address */
+    uint8_t prefix[I2C_SCHED_MAX_PREFIX];   /*!< Register or control bytes, sent at the start of every chunk */
+    uint8_t prefix_len;
+    const uint8_t *data;                    /*!< Must stay valid until the callback */
+    size_t len;
+    uint8_t *rx;                            /*!< Read after the writes with a repeated start, never split */
+    size_t rx_len;
+    i2c_sched_cb_t cb;                      /*!< Called from the scheduler task, may be NULL */
+    void *arg;
+    int64_t queued_us;                      /*!< Set by the scheduler */
+} i2c_sched_xfer_t;
+
+typedef struct {
+    uint32_t xfers;
+    uint32_t chunks;
+    uint32_t bytes;                         /*!< Including the address bytes */
+    uint32_t errors;
+    uint32_t max_latency_us;                /*!< Worst time from submit to completion */
+    uint32_t max_wait_us;                   /*!< Worst time from submit to the first byte on the bus */
+} i2c_sched_stats_t;
+
+/**
+ * @brief Install the I2C driver and start the scheduler task. Safe to call
+ *        from several tasks; later calls wait for the first to finish.
+ *
+ * @return
+ *     - ESP_OK
+ *     - ESP_FAIL
+ *     - ESP_ERR_NO_MEM
+ */
+esp_err_t i2c_sched_init(i2c_port_t port, const i2c_config_t *cfg);
+
+/**
+ * @brief Queue a transfer and return. The transfer is copied, but not the
+ *        data it points to.
+ *
+ * @param wait ticks to wait for room in the queue
+ *
+ * @return
+ *     - ESP_OK
+ *     - ESP_ERR_INVALID_STATE before i2c_sched_init
+ *     - ESP_ERR_TIMEOUT when the queue stayed full
+ */
+esp_err_t i2c_sched_submit(i2c_sched_class_t cls, const i2c_sched_xfer_t *xfer, TickType_t wait);
+
+/**
+ * @brief Queue a transfer and wait for it to complete. Not from a callback.
+ *
+ * @return the bus result, or as i2c_sched_submit
+ */
+esp_err_t i2c_sched_xfer(i2c_sched_class_t cls, i2c_sched_xfer_t *xfer);
+
+/**
+ * @brief Write to consecutive registers and wait for it to complete. Writes
+ *        longer than I2C_SCHED_MAX_CHUNK go as one transfer per chunk, each
+ *        addressed to the register its first byte belongs in.
+ */
+esp_err_t i2c_sched_write_reg(i2c_sched_class_t cls, uint8_t addr, uint8_t reg, const uint8_t *data, size_t len);
+
+/**
+ * @brief Read from consecutive registers and wait for it to complete
+ */
+esp_err_t i2c_sched_read_reg(i2c_sched_class_t cls, uint8_t addr, uint8_t reg, uint8_t *data, size_t len);
+
+/**
+ * @brief Copy the counters for one class of traffic since boot
+ */
+void i2c_sched_get_stats(i2c_sched_class_t cls, i2c_sched_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
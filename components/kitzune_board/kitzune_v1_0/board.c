@@ -75,11 +75,9 @@ esp_err_t audio_board_sdcard_init(esp_periph_set_handle_t set, periph_sdcard_mod
         .card_detect_pin = get_sdcard_intr_gpio(),
     };
     esp_periph_handle_t sdcard_handle = periph_sdcard_init(&sdcard_cfg);
-    esp_err_t ret = esp_periph_start(set, sdcard_handle);
-    while (!periph_sdcard_is_mounted(sdcard_handle)) {
-        vTaskDelay(500 / portTICK_PERIOD_MS);
-    }
-    return ret;
+    // Mounting follows from the card-detect interrupt, callers wait for the
+    // SDCARD_STATUS_MOUNTED event rather than polling
+    return esp_periph_start(set, sdcard_handle);
 }
 
 audio_board_handle_t audio_board_get_handle(void)
@@ -26,14 +26,15 @@
 #include "driver/gpio.h"
 #include "esp_log.h"
 #include "board.h"
-#include "i2c_bus.h"
+#include "i2c_sched.h"
 
 #include "max9867.h"
 
 static const char *TAG = "MAX9867";
 
+#define MAX9867_ADDR 0x18
+
 static bool codec_init_flag = false;
-static i2c_bus_handle_t i2c_handle;
 static uint8_t s_volume = 25;
 
 audio_hal_func_t AUDIO_MAX9867_DEFAULT_HANDLE = {
@@ -46,6 +47,17 @@ audio_hal_func_t AUDIO_MAX9867_DEFAULT_HANDLE = {
     .audio_codec_get_volume = max9867_get_voice_volume,
 };
 
+// Codec commands go ahead of any display traffic on the shared bus
+static esp_err_t max9867_write(uint8_t reg, const uint8_t *data, size_t len)
+{
+    return i2c_sched_write_reg(I2C_SCHED_CODEC, MAX9867_ADDR, reg, data, len);
+}
+
+static esp_err_t max9867_read(uint8_t reg, uint8_t *data, size_t len)
+{
+    return i2c_sched_read_reg(I2C_SCHED_CODEC, MAX9867_ADDR, reg, data, len);
+}
+
 bool max9867_initialized()
 {
     return codec_init_flag;
@@ -65,19 +77,23 @@ esp_err_t max9867_init(audio_hal_codec_config_t *cfg)
     if (res != ESP_OK) {
         ESP_LOGE(TAG, "i2c pin config error");
     }
-    i2c_handle = i2c_bus_create(I2C_NUM_0, &max_i2c_cfg);
+    res = i2c_sched_init(I2C_NUM_0, &max_i2c_cfg);
+    if (res != ESP_OK) {
+        ESP_LOGE(TAG, "i2c bus unavailable");
+        return res;
+    }
 
     uint8_t regbuf, txbuf[64];
     ESP_LOGE(TAG, "Codec shutdown");
     // Force the device into shutdown and disable the DACs
     regbuf = 0x17;
     txbuf[0] = 0;
-    i2c_bus_write_bytes(i2c_handle, 0x30, &regbuf, 1, txbuf, 1);
+    max9867_write(regbuf, txbuf, 1);
 
     // Shut off the ADC
     regbuf = 0x14;
     txbuf[0] = 0x0;
-    i2c_bus_write_bytes(i2c_handle, 0x30, &regbuf, 1, txbuf, 1);
+    max9867_write(regbuf, txbuf, 1);
 
     // Configure codec clock fixed at 12.288MHz MCLK, 48kHz LRCLK
     ESP_LOGE(TAG, "Codec Clock initial cfg");
@@ -86,48 +102,48 @@ esp_err_t max9867_init(audio_hal_codec_config_t *cfg)
     txbuf[1] = 0x60; // PLL disabled, NI = 0x6000
     txbuf[2] = 0x00;
     txbuf[3] = 0x10; // Slave mode, I2S compatible signal
-    i2c_bus_write_bytes(i2c_handle, 0x30, &regbuf, 1, txbuf, 4);
+    max9867_write(regbuf, txbuf, 4);
 
     // Diable JDETEN
     ESP_LOGE(TAG, "Codec disable JDETEN, enable ADCs, calibration start");
     regbuf = 0x16;
     txbuf[0] = 2; // Headphones set to capless, JDETEN = 0
     txbuf[1] = 0x80 | 0x3; // enable ADCs, !SHDN = 1
-    i2c_bus_write_bytes(i2c_handle, 0x30, &regbuf, 1, txbuf, 2);
+    max9867_write(regbuf, txbuf, 2);
 
     // Calibrate ADC offset
     ESP_LOGE(TAG, "Codec offset calibration");
     regbuf = 0x14;
     txbuf[0] = 0x3; // AUXEN = 1, AUXCAL = 1
-    i2c_bus_write_bytes(i2c_handle, 0x30, &regbuf, 1, txbuf, 1);
+    max9867_write(regbuf, txbuf, 1);
 
     vTaskDelay(pdMS_TO_TICKS(40));
 
     ESP_LOGE(TAG, "Codec offset calibration complete");
     regbuf = 0x14;
     txbuf[0] = 0x1; // AUXEN = 1, AUXCAL = 0
-    i2c_bus_write_bytes(i2c_handle, 0x30, &regbuf, 1, txbuf, 1);
+    max9867_write(regbuf, txbuf, 1);
 
     ESP_LOGE(TAG, "Codec gain calibration");
     regbuf = 0x14;
     txbuf[0] = 0x5; // AUXEN = 1, AUXGAIN = 1
-    i2c_bus_write_bytes(i2c_handle, 0x30, &regbuf, 1, txbuf, 1);
+    max9867_write(regbuf, txbuf, 1);
 
     vTaskDelay(pdMS_TO_TICKS(40));
 
     // Set AUXCAP to freeze result...
     regbuf = 0x14;
     txbuf[0] = 0xD; // AUXEN = 1, AUXGAIN = 1, AUXCAP = 1
-    i2c_bus_write_bytes(i2c_handle, 0x30, &regbuf, 1, txbuf, 1);
+    max9867_write(regbuf, txbuf, 1);
 
     regbuf = 0x2;
     uint8_t gain_result[2] = {0, 0};
-    i2c_bus_read_bytes(i2c_handle, 0x30, &regbuf, 1, gain_result, 2);
+    max9867_read(regbuf, gain_result, 2);
 
     // End calibration!
     regbuf = 0x14;
     txbuf[0] = 0x1; // AUXEN = 1, AUXCAL = 0, AUXGAIN = 0, AUXCAP = 0
-    i2c_bus_write_bytes(i2c_handle, 0x30, &regbuf, 1, txbuf, 1);
+    max9867_write(regbuf, txbuf, 1);
     ESP_LOGE(TAG, "Codec gain calibration complete - 0x%" PRIx8 "%" PRIx8, gain_result[0], gain_result[1]);
 
     // Get a baseline reading for AUX
@@ -137,16 +153,16 @@ esp_err_t max9867_init(audio_hal_codec_config_t *cfg)
     // Freeze base reading
     regbuf = 0x14;
     txbuf[0] = 0x9; // AUXEN = 1, AUXCAP = 1
-    i2c_bus_write_bytes(i2c_handle, 0x30, &regbuf, 1, txbuf, 1);
+    max9867_write(regbuf, txbuf, 1);
 
     // Read AUX register
     regbuf = 0x2;
     uint8_t aux_result[2] = {0, 0};
-    i2c_bus_read_bytes(i2c_handle, 0x30, &regbuf, 1, gain_result, 2);
+    max9867_read(regbuf, gain_result, 2);
 
     regbuf = 0x14;
     txbuf[0] = 0x1; // AUXEN = 1
-    i2c_bus_write_bytes(i2c_handle, 0x30, &regbuf, 1, txbuf, 1);
+    max9867_write(regbuf, txbuf, 1);
 
     ESP_LOGE(TAG, "Codec get base AUX reading complete: 0x%" PRIx8 "%" PRIx8, aux_result[0], aux_result[1]);
 
@@ -154,7 +170,7 @@ esp_err_t max9867_init(audio_hal_codec_config_t *cfg)
     // Force the device into shutdown and disable the DACs
     regbuf = 0x17;
     txbuf[0] = 0;
-    i2c_bus_write_bytes(i2c_handle, 0x30, &regbuf, 1, txbuf, 1);
+    max9867_write(regbuf, txbuf, 1);
 
     // Configure codec clock
     ESP_LOGE(TAG, "Codec Clock cfg");
@@ -163,28 +179,28 @@ esp_err_t max9867_init(audio_hal_codec_config_t *cfg)
     txbuf[1] = 0x80;
     txbuf[2] = 0x00;
     txbuf[3] = 0x10;
-    i2c_bus_write_bytes(i2c_handle, 0x30, &regbuf, 1, txbuf, 4);
+    max9867_write(regbuf, txbuf, 4);
 
     // Configure volume
     ESP_LOGE(TAG, "Codec Volume");
     regbuf = 0x10;
     txbuf[0] = (50 - s_volume);
     txbuf[1] = (50 - s_volume);
-    i2c_bus_write_bytes(i2c_handle, 0x30, &regbuf, 1, txbuf, 2);
+    max9867_write(regbuf, txbuf, 2);
 
     // Configure the microphone
     ESP_LOGE(TAG, "Codec Mic Enable");
     regbuf = 0x12;
     txbuf[0] = (1 << 5);
     txbuf[1] = (0);
-    i2c_bus_write_bytes(i2c_handle, 0x30, &regbuf, 1, txbuf, 2);
+    max9867_write(regbuf, txbuf, 2);
 
     // Configure headphone amplifier mode, take device out of shutdown, enable dacs
     ESP_LOGE(TAG, "Codec ACTIVATE");
     regbuf = 0x16;
     txbuf[0] = (1 << 3) | 2;
     txbuf[1] = (1 << 7) | (0x3 << 2) | (0x3);
-    i2c_bus_write_bytes(i2c_handle, 0x30, &regbuf, 1, txbuf, 2);
+    max9867_write(regbuf, txbuf, 2);
 
     codec_init_flag  = true;
 
@@ -218,7 +234,7 @@ esp_err_t max9867_set_voice_volume(int volume)
     regbuf = 0x10;
     txbuf[0] = (50 - s_volume);
     txbuf[1] = (50 - s_volume);
-    i2c_bus_write_bytes(i2c_handle, 0x30, &regbuf, 1, txbuf, 2);
+    max9867_write(regbuf, txbuf, 2);
     return ESP_OK;
 }
 
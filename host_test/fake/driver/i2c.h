@@ -0,0 +1,36 @@
+// The legacy I2C master API, as far as i2c_sched uses it. test_i2c_sched.c
+// stands a fake bus behind it.
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_err.h"
+
+typedef int i2c_port_t;
+typedef void *i2c_cmd_handle_t;
+typedef enum {
+    I2C_MODE_SLAVE = 0,
+    I2C_MODE_MASTER,
+} i2c_mode_t;
+typedef struct {
+    i2c_mode_t mode;
+} i2c_config_t;
+
+#define I2C_MASTER_WRITE 0
+#define I2C_MASTER_READ 1
+#define I2C_MASTER_LAST_NACK 2
+#define I2C_LINK_RECOMMENDED_SIZE(n) (64 * (n))
+
+esp_err_t i2c_param_config(i2c_port_t port, const i2c_config_t *cfg);
+esp_err_t i2c_driver_install(i2c_port_t port, i2c_mode_t mode, size_t rx_buf, size_t tx_buf, int flags);
+i2c_cmd_handle_t i2c_cmd_link_create_static(uint8_t *buf, uint32_t size);
+void i2c_cmd_link_delete_static(i2c_cmd_handle_t cmd);
+esp_err_t i2c_master_start(i2c_cmd_handle_t cmd);
+esp_err_t i2c_master_stop(i2c_cmd_handle_t cmd);
+esp_err_t i2c_master_write_byte(i2c_cmd_handle_t cmd, uint8_t data, bool ack);
+esp_err_t i2c_master_write(i2c_cmd_handle_t cmd, const uint8_t *data, size_t len, bool ack);
+esp_err_t i2c_master_read(i2c_cmd_handle_t cmd, uint8_t *data, size_t len, int ack);
+esp_err_t i2c_master_cmd_begin(i2c_port_t port, i2c_cmd_handle_t cmd, TickType_t wait);
@@ -0,0 +1,46 @@
+// Just enough of FreeRTOS for the I2C scheduler and tag database to build
+// on the host. The tests call into them directly, so there are no real
+// tasks; each test provides the functions it needs.
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef void *QueueHandle_t;
+typedef void *SemaphoreHandle_t;
+typedef void *TaskHandle_t;
+typedef struct {
+    int unused;
+} StaticSemaphore_t;
+typedef int portMUX_TYPE;
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdPASS 1
+#define portMAX_DELAY UINT32_MAX
+#define pdMS_TO_TICKS(ms) (ms)
+#define portMUX_INITIALIZER_UNLOCKED 0
+#define tskIDLE_PRIORITY 0
+#define PRO_CPU_NUM 0
+#define taskENTER_CRITICAL(mux) (void)(mux)
+#define taskEXIT_CRITICAL(mux) (void)(mux)
+
+QueueHandle_t xQueueCreate(UBaseType_t len, UBaseType_t item_size);
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t wait);
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t wait);
+
+BaseType_t xTaskCreatePinnedToCore(void (*fn)(void *), const char *name, uint32_t stack, void *arg,
+                                   UBaseType_t prio, TaskHandle_t *task, BaseType_t core);
+void xTaskNotifyGive(TaskHandle_t task);
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t wait);
+void vTaskDelay(TickType_t ticks);
+void vTaskDelete(TaskHandle_t task);
+
+SemaphoreHandle_t xSemaphoreCreateBinaryStatic(StaticSemaphore_t *buf);
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t wait);
+void vSemaphoreDelete(SemaphoreHandle_t sem);
@@ -0,0 +1,36 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+// Shared by the host tests. A failed check is reported and counted but the
+// test carries on, so one run shows every case that's broken.
+static int s_failures = 0;
+
+#define KZ_CHECK(cond, ...) do {                                    \
+    if (!(cond)) {                                                  \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__);                 \
+        printf(__VA_ARGS__);                                        \
+        printf("\n");                                               \
+        s_failures++;                                               \
+    }                                                               \
+} while (0)
+
+#define KZ_HOST_RESULT() (s_failures == 0 ? 0 : (printf("%d failed\n", s_failures), 1))
+
+// Cycle counts are TSC ticks on x86, which is what the figures quoted in
+// the commit log are, and nanoseconds elsewhere
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define KZ_HOST_CYCLE_UNIT "TSC cycles"
+static inline uint64_t kz_host_cycles(void) {
+    return __rdtsc();
+}
+#else
+#define KZ_HOST_CYCLE_UNIT "ns"
+static inline uint64_t kz_host_cycles(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+#endif
@@ -0,0 +1,132 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kz_eq.h"
+#include "kz_host.h"
+
+#define RATE 48000
+#define FRAMES (4 * RATE)
+// The element filters in blocks of this many frames
+#define BLOCK_FRAMES 512
+#define BENCH_RUNS 5
+
+static int16_t s_in[FRAMES * 2], s_fast[FRAMES * 2], s_ref[FRAMES * 2];
+static double s_exact[FRAMES * 2];
+
+// Shelves at either end and alternating +/-6 dB peaks between, the worst a
+// preset is likely to ask of the cascade
+static void make_bands(kz_eq_band_t *bands) {
+    static const float freqs[KZ_EQ_MAX_BANDS] = {31, 62, 125, 250, 500, 1000, 2000, 4000, 8000, 16000};
+    for (int i = 0; i < KZ_EQ_MAX_BANDS; ++i) {
+        bands[i] = (kz_eq_band_t){KZ_EQ_PEAK, freqs[i], i % 2 ? -6.0f : 6.0f, 1.41f};
+    }
+    bands[0] = (kz_eq_band_t){KZ_EQ_LOW_SHELF, 60.0f, 9.0f, 0.707f};
+    bands[KZ_EQ_MAX_BANDS - 1] = (kz_eq_band_t){KZ_EQ_HIGH_SHELF, 16000.0f, -9.0f, 0.707f};
+}
+
+// The same cascade in double precision, with the quantized coefficients,
+// so what's left is the kernels' own rounding
+static void run_exact(const kz_eq_coefs_t *c) {
+    double st[KZ_EQ_MAX_BANDS][2][4] = {{{0}}};
+    const double scale = 1.0 / (1 << KZ_EQ_COEF_SHIFT);
+    for (size_t i = 0; i < FRAMES * 2; ++i) {
+        double v = s_in[i];
+        for (int k = 0; k < c->bands; ++k) {
+            double *s = st[k][i % 2];
+            double y = (c->c[k][0] * v + c->c[k][1] * s[0] + c->c[k][2] * s[1] - c->c[k][3] * s[2] -
+                        c->c[k][4] * s[3]) * scale;
+            s[1] = s[0];
+            s[0] = v;
+            s[3] = s[2];
+            s[2] = y;
+            v = y;
+        }
+        s_exact[i] = v;
+    }
+}
+
+static void run_blocks(void (*process)(const kz_eq_coefs_t *, kz_eq_state_t *, int16_t *, size_t, int),
+                       const kz_eq_coefs_t *c, int16_t *pcm, int channels) {
+    kz_eq_state_t st;
+    kz_eq_reset(&st);
+    for (size_t off = 0; off < FRAMES; off += BLOCK_FRAMES) {
+        process(c, &st, pcm + off * channels, BLOCK_FRAMES, channels);
+    }
+}
+
+static double bench(void (*process)(const kz_eq_coefs_t *, kz_eq_state_t *, int16_t *, size_t, int),
+                    const kz_eq_coefs_t *c, int16_t *pcm) {
+    uint64_t best = UINT64_MAX;
+    for (int r = 0; r < BENCH_RUNS; ++r) {
+        memcpy(pcm, s_in, sizeof(s_in));
+        uint64_t t0 = kz_host_cycles();
+        run_blocks(process, c, pcm, 2);
+        uint64_t t1 = kz_host_cycles();
+        best = t1 - t0 < best ? t1 - t0 : best;
+    }
+    return (double)best / (FRAMES * 2);
+}
+
+static void test_bands(const kz_eq_band_t *bands, int count) {
+    kz_eq_coefs_t c;
+    kz_eq_design(bands, count, RATE, &c);
+    double fast = bench(kz_eq_process, &c, s_fast);
+    double ref = bench(kz_eq_process_ref, &c, s_ref);
+    KZ_CHECK(memcmp(s_fast, s_ref, sizeof(s_fast)) == 0, "%d bands: kernels differ in stereo", count);
+
+    // Mono goes down a path of its own in the fast kernel
+    memcpy(s_fast, s_in, FRAMES * sizeof(int16_t));
+    memcpy(s_ref, s_in, FRAMES * sizeof(int16_t));
+    run_blocks(kz_eq_process, &c, s_fast, 1);
+    run_blocks(kz_eq_process_ref, &c, s_ref, 1);
+    KZ_CHECK(memcmp(s_fast, s_ref, FRAMES * sizeof(int16_t)) == 0, "%d bands: kernels differ in mono", count);
+
+    memcpy(s_fast, s_in, sizeof(s_in));
+    run_blocks(kz_eq_process, &c, s_fast, 2);
+    run_exact(&c);
+    double worst = 0.0, err = 0.0, sig = 0.0;
+    for (size_t i = 0; i < FRAMES * 2; ++i) {
+        // Clipping isn't the kernels' error
+        if (fabs(s_exact[i]) > INT16_MAX) {
+            continue;
+        }
+        double e = s_fast[i] - s_exact[i];
+        worst = fabs(e) > worst ? fabs(e) : worst;
+        err += e * e;
+        sig += s_exact[i] * s_exact[i];
+    }
+    double snr = 10.0 * log10(sig / err);
+    printf("%2d bands: fast %5.1f, reference %5.1f %s per sample; max error %.2f LSB, %.1f dB below\n",
+           count, fast, ref, KZ_HOST_CYCLE_UNIT, worst, snr);
+    KZ_CHECK(worst < 2.0, "%d bands: error %.2f LSB against double precision", count, worst);
+    KZ_CHECK(snr > 75.0, "%d bands: error only %.1f dB below the signal", count, snr);
+}
+
+int main(void) {
+    // Something like music at about -6 dBFS: a few tones and some noise,
+    // louder on the left
+    srand(1);
+    for (size_t i = 0; i < FRAMES; ++i) {
+        double t = (double)i / RATE;
+        double v = 0.2 * sin(2 * M_PI * 40 * t) + 0.15 * sin(2 * M_PI * 440 * t) +
+                   0.1 * sin(2 * M_PI * 3000 * t) + 0.05 * (rand() / (double)RAND_MAX * 2 - 1);
+        s_in[2 * i] = (int16_t)lrint(v * 32767 * 0.9);
+        s_in[2 * i + 1] = (int16_t)lrint(v * 32767 * 0.8);
+    }
+
+    kz_eq_band_t bands[KZ_EQ_MAX_BANDS];
+    make_bands(bands);
+    kz_eq_band_t five[5] = {bands[0], bands[3], bands[5], bands[7], bands[9]};
+    test_bands(five, 5);
+    test_bands(bands, KZ_EQ_MAX_BANDS);
+
+    // Flat bands are left out altogether
+    kz_eq_coefs_t c;
+    for (int i = 0; i < KZ_EQ_MAX_BANDS; ++i) {
+        bands[i].gain_db = 0.0f;
+    }
+    kz_eq_design(bands, KZ_EQ_MAX_BANDS, RATE, &c);
+    KZ_CHECK(c.bands == 0, "%d stages for a flat EQ", c.bands);
+    return KZ_HOST_RESULT();
+}
@@ -0,0 +1,427 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "kz_host.h"
+
+// Built straight in, so the test can step the scheduler a chunk at a time
+// through next_class() and run_chunk() instead of running its task
+#include "i2c_sched.c"
+
+#define BUS_HZ 400000
+#define CODEC_ADDR 0x18
+#define PANEL_ADDR 0x3c
+#define LOG_LEN 64
+#define RUN_US (2 * 1000 * 1000)
+// Codec commands land every couple of ms, never lined up with the chunks
+#define CODEC_PERIOD_US 1700
+#define CODEC_JITTER_US 613
+// What i2c_sched.h promises: a codec write waits behind one 32-byte chunk at
+// most, which is 770 us at 400 kHz
+#define CODEC_MAX_WAIT_US 800
+
+typedef struct {
+    uint8_t addr;
+    uint8_t tx[1 + I2C_SCHED_MAX_PREFIX + 128];
+    size_t tx_len;
+    size_t rx_len;
+    int64_t start_us;
+} bus_txn_t;
+
+typedef struct {
+    UBaseType_t len;
+    UBaseType_t item_size;
+    UBaseType_t head;
+    UBaseType_t count;
+    uint8_t *items;
+} fake_queue_t;
+
+// The fake bus: a 400 kHz clock, nine bits a byte plus start and stop
+static int64_t s_now_us;
+static bus_txn_t s_txn;
+static bus_txn_t s_log[LOG_LEN];
+static int s_log_count;
+// Codec commands submitted partway through a bus transaction
+static bool s_codec_traffic;
+static int64_t s_codec_next_us;
+static int s_codec_sent;
+static int s_codec_done;
+static bool s_codec_in_order = true;
+static const uint8_t s_volume[2] = {0x12, 0x12};
+
+static void run_idle(void);
+
+int64_t esp_timer_get_time(void)
+{
+    return s_now_us;
+}
+
+const char *esp_err_to_name(esp_err_t code)
+{
+    return code == ESP_OK ? "ESP_OK" : "error";
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t len, UBaseType_t item_size)
+{
+    fake_queue_t *q = calloc(1, sizeof(fake_queue_t));
+    q->len = len;
+    q->item_size = item_size;
+    q->items = calloc(len, item_size);
+    return q;
+}
+
+BaseType_t xQueueSend(QueueHandle_t h, const void *item, TickType_t wait)
+{
+    fake_queue_t *q = h;
+    if (q->count == q->len) {
+        return pdFALSE;
+    }
+    memcpy(q->items + (q->head + q->count) % q->len * q->item_size, item, q->item_size);
+    q->count++;
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t h, void *item, TickType_t wait)
+{
+    fake_queue_t *q = h;
+    if (q->count == 0) {
+        return pdFALSE;
+    }
+    memcpy(item, q->items + q->head * q->item_size, q->item_size);
+    q->head = (q->head + 1) % q->len;
+    q->count--;
+    return pdTRUE;
+}
+
+BaseType_t xTaskCreatePinnedToCore(void (*fn)(void *), const char *name, uint32_t stack, void *arg,
+                                   UBaseType_t prio, TaskHandle_t *task, BaseType_t core)
+{
+    *task = (TaskHandle_t)fn;
+    return pdPASS;
+}
+
+void xTaskNotifyGive(TaskHandle_t task)
+{
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t wait)
+{
+    return 0;
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinaryStatic(StaticSemaphore_t *buf)
+{
+    return buf;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    return pdTRUE;
+}
+
+// A blocking transfer waits while the scheduler task runs it
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t wait)
+{
+    run_idle();
+    return pdTRUE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem)
+{
+}
+
+esp_err_t i2c_param_config(i2c_port_t port, const i2c_config_t *cfg)
+{
+    return ESP_OK;
+}
+
+esp_err_t i2c_driver_install(i2c_port_t port, i2c_mode_t mode, size_t rx_buf, size_t tx_buf, int flags)
+{
+    return ESP_OK;
+}
+
+i2c_cmd_handle_t i2c_cmd_link_create_static(uint8_t *buf, uint32_t size)
+{
+    memset(&s_txn, 0, sizeof(s_txn));
+    return buf;
+}
+
+void i2c_cmd_link_delete_static(i2c_cmd_handle_t cmd)
+{
+}
+
+esp_err_t i2c_master_start(i2c_cmd_handle_t cmd)
+{
+    return ESP_OK;
+}
+
+esp_err_t i2c_master_stop(i2c_cmd_handle_t cmd)
+{
+    return ESP_OK;
+}
+
+esp_err_t i2c_master_write_byte(i2c_cmd_handle_t cmd, uint8_t data, bool ack)
+{
+    // Only ever an address byte; a write and its read share the address
+    s_txn.addr = data >> 1;
+    return ESP_OK;
+}
+
+esp_err_t i2c_master_write(i2c_cmd_handle_t cmd, const uint8_t *data, size_t len, bool ack)
+{
+    if (s_txn.tx_len + len > sizeof(s_txn.tx)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memcpy(s_txn.tx + s_txn.tx_len, data, len);
+    s_txn.tx_len += len;
+    return ESP_OK;
+}
+
+esp_err_t i2c_master_read(i2c_cmd_handle_t cmd, uint8_t *data, size_t len, int ack)
+{
+    for (size_t i = 0; i < len; ++i) {
+        data[i] = 0xa0 + i;
+    }
+    s_txn.rx_len += len;
+    return ESP_OK;
+}
+
+static void codec_done(esp_err_t ret, void *arg)
+{
+    s_codec_in_order &= (intptr_t)arg == s_codec_done && ret == ESP_OK;
+    s_codec_done++;
+}
+
+esp_err_t i2c_master_cmd_begin(i2c_port_t port, i2c_cmd_handle_t cmd, TickType_t wait)
+{
+    size_t bytes = 1 + s_txn.tx_len + (s_txn.rx_len != 0 ? 1 + s_txn.rx_len : 0);
+    int64_t start = s_now_us;
+    int64_t end = start + (9 * bytes + 2) * 1000000 / BUS_HZ;
+
+    while (s_codec_traffic && s_codec_next_us < end) {
+        s_now_us = s_codec_next_us > start ? s_codec_next_us : start;
+        i2c_sched_xfer_t x = {
+            .addr = CODEC_ADDR,
+            .prefix = {0x10},
+            .prefix_len = 1,
+            .data = s_volume,
+            .len = sizeof(s_volume),
+            .cb = codec_done,
+            .arg = (void *)(intptr_t)s_codec_sent,
+        };
+        if (i2c_sched_submit(I2C_SCHED_CODEC, &x, 0) == ESP_OK) {
+            s_codec_sent++;
+        }
+        s_codec_next_us += CODEC_PERIOD_US + (s_codec_sent * 7919) % CODEC_JITTER_US;
+    }
+
+    s_txn.start_us = start;
+    if (s_log_count < LOG_LEN) {
+        s_log[s_log_count++] = s_txn;
+    }
+    s_now_us = end;
+    return ESP_OK;
+}
+
+static int64_t bus_us(size_t bytes)
+{
+    return (9 * bytes + 2) * 1000000 / BUS_HZ;
+}
+
+static void reset(void)
+{
+    memset(s_stats, 0, sizeof(s_stats));
+    s_log_count = 0;
+}
+
+static void run_idle(void)
+{
+    int cls;
+    while ((cls = next_class()) >= 0) {
+        run_chunk(cls);
+    }
+}
+
+static void count_done(esp_err_t ret, void *arg)
+{
+    *(int *)arg += ret == ESP_OK ? 1 : 1000;
+}
+
+// A long write goes out in chunks, each with the prefix again, and the data
+// comes out whole and in order
+static void test_chunking(void)
+{
+    uint8_t span[100];
+    for (size_t i = 0; i < sizeof(span); ++i) {
+        span[i] = i;
+    }
+    int done = 0;
+    i2c_sched_xfer_t x = {
+        .addr = PANEL_ADDR,
+        .prefix = {0x40},
+        .prefix_len = 1,
+        .data = span,
+        .len = sizeof(span),
+        .cb = count_done,
+        .arg = &done,
+    };
+    reset();
+    KZ_CHECK(i2c_sched_submit(I2C_SCHED_DISPLAY, &x, 0) == ESP_OK, "submit failed");
+    run_idle();
+
+    KZ_CHECK(done == 1, "callback ran %d times", done);
+    KZ_CHECK(s_log_count == 4, "%d transactions for %zu bytes", s_log_count, sizeof(span));
+    uint8_t out[sizeof(span)];
+    size_t n = 0;
+    for (int i = 0; i < s_log_count; ++i) {
+        bus_txn_t *t = &s_log[i];
+        KZ_CHECK(t->addr == PANEL_ADDR && t->tx_len >= 1 && t->tx[0] == 0x40,
+                 "chunk %d lost its prefix", i);
+        KZ_CHECK(t->tx_len <= 1 + I2C_SCHED_MAX_CHUNK, "chunk %d is %zu bytes", i, t->tx_len);
+        if (t->tx_len > 1 && n + t->tx_len - 1 <= sizeof(out)) {
+            memcpy(out + n, t->tx + 1, t->tx_len - 1);
+            n += t->tx_len - 1;
+        }
+    }
+    KZ_CHECK(n == sizeof(span) && memcmp(out, span, n) == 0, "data came out wrong");
+    i2c_sched_stats_t st;
+    i2c_sched_get_stats(I2C_SCHED_DISPLAY, &st);
+    KZ_CHECK(st.xfers == 1 && st.chunks == 4 && st.bytes == 4 * 2 + sizeof(span),
+             "stats %u xfers %u chunks %u bytes", st.xfers, st.chunks, st.bytes);
+}
+
+// The read of a write-then-read goes with the last chunk only
+static void test_read(void)
+{
+    uint8_t regs[40] = {0};
+    uint8_t rx[3] = {0};
+    int done = 0;
+    i2c_sched_xfer_t x = {
+        .addr = CODEC_ADDR,
+        .prefix = {0x04},
+        .prefix_len = 1,
+        .data = regs,
+        .len = sizeof(regs),
+        .rx = rx,
+        .rx_len = sizeof(rx),
+        .cb = count_done,
+        .arg = &done,
+    };
+    reset();
+    KZ_CHECK(i2c_sched_submit(I2C_SCHED_CODEC, &x, 0) == ESP_OK, "submit failed");
+    run_idle();
+
+    KZ_CHECK(done == 1, "callback ran %d times", done);
+    KZ_CHECK(s_log_count == 2, "%d transactions", s_log_count);
+    KZ_CHECK(s_log[0].rx_len == 0 && s_log[1].rx_len == sizeof(rx), "read with the wrong chunk");
+    KZ_CHECK(rx[0] == 0xa0 && rx[2] == 0xa2, "read data not delivered");
+}
+
+// A register write longer than a chunk carries on from where the last chunk
+// left off, rather than writing each chunk over the first registers again
+static void test_write_reg(void)
+{
+    uint8_t regs[70];
+    for (size_t i = 0; i < sizeof(regs); ++i) {
+        regs[i] = 0x80 + i;
+    }
+    reset();
+    KZ_CHECK(i2c_sched_write_reg(I2C_SCHED_CODEC, CODEC_ADDR, 0x04, regs, sizeof(regs)) == ESP_OK,
+             "write failed");
+    KZ_CHECK(s_log_count == 3, "%d transactions for %zu bytes", s_log_count, sizeof(regs));
+    size_t off = 0;
+    for (int i = 0; i < s_log_count; ++i) {
+        bus_txn_t *t = &s_log[i];
+        KZ_CHECK(t->tx_len >= 2 && t->tx[0] == 0x04 + off, "chunk %d starts at register 0x%02x, not 0x%02zx",
+                 i, t->tx[0], 0x04 + off);
+        KZ_CHECK(memcmp(t->tx + 1, regs + off, t->tx_len - 1) == 0, "chunk %d has the wrong data", i);
+        off += t->tx_len - 1;
+    }
+    KZ_CHECK(off == sizeof(regs), "%zu of %zu bytes written", off, sizeof(regs));
+
+    // A short one is still a single transaction
+    reset();
+    i2c_sched_write_reg(I2C_SCHED_CODEC, CODEC_ADDR, 0x10, s_volume, sizeof(s_volume));
+    KZ_CHECK(s_log_count == 1 && s_log[0].tx_len == 3 && s_log[0].tx[0] == 0x10, "short write in %d transactions",
+             s_log_count);
+}
+
+// Keep the panel queue full of whole frames, as a busy screen does, and
+// drop codec writes in at odd moments. Each may wait for the chunk already
+// on the bus but nothing more.
+static void test_codec_latency(void)
+{
+    static uint8_t frame[8 * 128];
+    static const uint8_t range[6] = {0x21, 0, 127, 0x22, 0, 7};
+    int frames = 0;
+    int page = 0;
+    reset();
+    s_codec_traffic = true;
+    s_codec_next_us = s_now_us + 250;
+    int64_t stop = s_now_us + RUN_US;
+
+    while (s_now_us < stop) {
+        // Top up the panel queue: a range command and a page of pixels per
+        // page, and a marker at the end of each frame
+        while (1) {
+            i2c_sched_xfer_t d = {.addr = PANEL_ADDR, .prefix_len = 1};
+            int step = page % 3;
+            if (step == 0) {
+                d.prefix[0] = 0x00;
+                d.data = range;
+                d.len = sizeof(range);
+            } else if (step == 1) {
+                d.prefix[0] = 0x40;
+                d.data = frame + page / 3 * 128;
+                d.len = 128;
+            } else if (page / 3 == 7) {
+                d.prefix_len = 0;
+                d.cb = count_done;
+                d.arg = &frames;
+            }
+            if (i2c_sched_submit(I2C_SCHED_DISPLAY, &d, 0) != ESP_OK) {
+                break;
+            }
+            page = (page + 1) % (8 * 3);
+        }
+        int cls = next_class();
+        if (cls >= 0) {
+            run_chunk(cls);
+        }
+    }
+    s_codec_traffic = false;
+    run_idle();
+
+    i2c_sched_stats_t codec, disp;
+    i2c_sched_get_stats(I2C_SCHED_CODEC, &codec);
+    i2c_sched_get_stats(I2C_SCHED_DISPLAY, &disp);
+    int64_t chunk_us = bus_us(1 + 1 + I2C_SCHED_MAX_CHUNK);
+    int64_t codec_us = bus_us(1 + 1 + sizeof(s_volume));
+    printf("%d codec writes, worst wait %u us, worst latency %u us (one chunk %lld us, "
+           "a whole page %lld us)\n", s_codec_done, codec.max_wait_us, codec.max_latency_us,
+           (long long)chunk_us, (long long)bus_us(1 + 1 + 128));
+    printf("%d frames, %u display chunks in %d ms\n", frames, disp.chunks, RUN_US / 1000);
+
+    KZ_CHECK(s_codec_sent > 500 && s_codec_done == s_codec_sent, "%d of %d codec writes done",
+             s_codec_done, s_codec_sent);
+    KZ_CHECK(s_codec_in_order, "codec writes completed out of order");
+    KZ_CHECK(codec.max_wait_us <= CODEC_MAX_WAIT_US, "codec waited %u us behind the panel",
+             codec.max_wait_us);
+    KZ_CHECK(codec.max_latency_us <= CODEC_MAX_WAIT_US + codec_us, "codec latency %u us",
+             codec.max_latency_us);
+    KZ_CHECK(frames > 10, "panel starved, %d frames", frames);
+}
+
+int main(void)
+{
+    i2c_config_t cfg = {.mode = I2C_MODE_MASTER};
+    KZ_CHECK(i2c_sched_init(0, &cfg) == ESP_OK, "init failed");
+    test_chunking();
+    test_read();
+    test_write_reg();
+    test_codec_latency();
+    return KZ_HOST_RESULT();
+}
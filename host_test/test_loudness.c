@@ -0,0 +1,100 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kz_host.h"
+#include "kz_loudness.h"
+
+#define RATE KZ_LOUDNESS_RATE
+#define SECONDS 10
+#define BENCH_RUNS 5
+
+// Blocks are binned, so the result is only good to half a bin
+#define TOLERANCE_LU 0.13f
+
+static int16_t s_pcm[SECONDS * RATE * 2];
+
+static void make_tone(int channels, double dbfs, size_t frames) {
+    double amp = fmin(32768.0 * pow(10.0, dbfs / 20.0), INT16_MAX);
+    for (size_t i = 0; i < frames; ++i) {
+        int16_t v = (int16_t)lrint(amp * sin(2.0 * M_PI * 1000.0 * i / RATE));
+        for (int c = 0; c < channels; ++c) {
+            s_pcm[i * channels + c] = v;
+        }
+    }
+}
+
+static float measure(int channels, size_t frames) {
+    kz_loudness_t ld;
+    float lufs = 0.0f;
+    kz_loudness_reset(&ld);
+    kz_loudness_feed(&ld, s_pcm, frames, channels);
+    KZ_CHECK(kz_loudness_integrated(&ld, 1, &lufs), "no loudness from %zu frames", frames);
+    return lufs;
+}
+
+// BS.1770's reference: a 1 kHz sine is K-weighted by +0.691 dB, which the
+// formula takes back off, so a full scale tone in one channel reads
+// -3.01 LUFS and in both 0 LUFS
+static void test_reference_tone(void) {
+    make_tone(2, -20.0, SECONDS * RATE);
+    float stereo = measure(2, SECONDS * RATE);
+    make_tone(1, -20.0, SECONDS * RATE);
+    float mono = measure(1, SECONDS * RATE);
+    make_tone(2, 0.0, SECONDS * RATE);
+    float full = measure(2, SECONDS * RATE);
+    printf("1 kHz at -20 dBFS: %.2f LUFS stereo, %.2f LUFS mono; at 0 dBFS %.2f LUFS\n", stereo, mono, full);
+    KZ_CHECK(fabsf(stereo + 20.0f) < TOLERANCE_LU, "stereo tone read %.2f LUFS", stereo);
+    KZ_CHECK(fabsf(mono + 23.01f) < TOLERANCE_LU, "mono tone read %.2f LUFS", mono);
+    KZ_CHECK(fabsf(full) < TOLERANCE_LU, "full scale tone read %.2f LUFS", full);
+}
+
+// Silence is under the absolute gate and a quiet stretch under the relative
+// one, so neither pulls the result down
+static void test_gates(void) {
+    const size_t half = SECONDS * RATE / 2;
+    make_tone(2, -20.0, half);
+    memset(&s_pcm[half * 2], 0, half * 2 * sizeof(int16_t));
+    float with_silence = measure(2, SECONDS * RATE);
+    KZ_CHECK(fabsf(with_silence + 20.0f) < TOLERANCE_LU, "with silence %.2f LUFS", with_silence);
+
+    make_tone(2, -20.0, SECONDS * RATE);
+    double amp = 32768.0 * pow(10.0, -45.0 / 20.0);
+    for (size_t i = half; i < SECONDS * RATE; ++i) {
+        s_pcm[2 * i] = s_pcm[2 * i + 1] = (int16_t)lrint(amp * sin(2.0 * M_PI * 1000.0 * i / RATE));
+    }
+    float with_quiet = measure(2, SECONDS * RATE);
+    printf("Half silent %.2f LUFS, half 25 LU down %.2f LUFS\n", with_silence, with_quiet);
+    KZ_CHECK(fabsf(with_quiet + 20.0f) < TOLERANCE_LU, "with a quiet half %.2f LUFS", with_quiet);
+
+    // Not enough blocks yet, and nothing at all
+    kz_loudness_t ld;
+    float lufs;
+    kz_loudness_reset(&ld);
+    kz_loudness_feed(&ld, s_pcm, RATE, 2);
+    KZ_CHECK(!kz_loudness_integrated(&ld, 10, &lufs), "a second of audio gave ten blocks");
+    kz_loudness_reset(&ld);
+    KZ_CHECK(!kz_loudness_integrated(&ld, 0, &lufs), "loudness of nothing");
+}
+
+// Stereo through the K-weighting, the quickest of a few runs
+static void bench(void) {
+    make_tone(2, -20.0, SECONDS * RATE);
+    kz_loudness_t ld;
+    uint64_t best = UINT64_MAX;
+    for (int r = 0; r < BENCH_RUNS; ++r) {
+        kz_loudness_reset(&ld);
+        uint64_t t0 = kz_host_cycles();
+        kz_loudness_feed(&ld, s_pcm, SECONDS * RATE, 2);
+        uint64_t t1 = kz_host_cycles();
+        best = t1 - t0 < best ? t1 - t0 : best;
+    }
+    printf("%.1f %s per stereo frame\n", (double)best / (SECONDS * RATE), KZ_HOST_CYCLE_UNIT);
+}
+
+int main(void) {
+    test_reference_tone();
+    test_gates();
+    bench();
+    return KZ_HOST_RESULT();
+}
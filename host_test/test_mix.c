@@ -0,0 +1,111 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kz_host.h"
+#include "kz_mix.h"
+
+#define RATE 48000
+#define FADE_FRAMES (10 * RATE)
+// The mixer element works in blocks of this many frames
+#define BLOCK_FRAMES 512
+#define BENCH_BLOCKS 20000
+#define BENCH_RUNS 5
+
+static double seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// The gains hold equal power all the way through the longest fade, and
+// only ever move one way
+static void test_gains(void) {
+    double worst = 0.0;
+    bool monotonic = true;
+    int32_t last_a = INT32_MAX, last_b = INT32_MIN;
+    for (uint32_t pos = 0; pos < FADE_FRAMES; ++pos) {
+        int32_t ga, gb;
+        kz_mix_gains(pos, FADE_FRAMES, &ga, &gb);
+        double power = (ga / 32767.0) * (ga / 32767.0) + (gb / 32767.0) * (gb / 32767.0);
+        worst = fabs(10.0 * log10(power)) > worst ? fabs(10.0 * log10(power)) : worst;
+        monotonic &= ga <= last_a && gb >= last_b;
+        last_a = ga;
+        last_b = gb;
+    }
+    int32_t ga, gb;
+    kz_mix_gains(0, FADE_FRAMES, &ga, &gb);
+    KZ_CHECK(ga == 32767 && gb == 0, "gains at the start (%d, %d)", (int)ga, (int)gb);
+    printf("Power within %.4f dB of 0 dB over a %u frame fade\n", worst, FADE_FRAMES);
+    KZ_CHECK(worst < 0.001, "power off by %.4f dB", worst);
+    KZ_CHECK(monotonic, "gains not monotonic");
+}
+
+// Past the end of the fade the output is the new track exactly, and a
+// missing input is silence
+static void test_fade(void) {
+    int16_t a[BLOCK_FRAMES * 2], b[BLOCK_FRAMES * 2], out[BLOCK_FRAMES * 2];
+    for (size_t i = 0; i < BLOCK_FRAMES * 2; ++i) {
+        a[i] = (int16_t)(rand() - RAND_MAX / 2);
+        b[i] = (int16_t)(rand() - RAND_MAX / 2);
+    }
+    kz_mix_fade(a, b, out, BLOCK_FRAMES, 2, FADE_FRAMES - 100, FADE_FRAMES);
+    KZ_CHECK(memcmp(out + 200, b + 200, (BLOCK_FRAMES - 100) * 4) == 0,
+             "not the new track after the fade");
+
+    kz_mix_fade(a, b, out, BLOCK_FRAMES, 2, 0, FADE_FRAMES);
+    KZ_CHECK(abs(out[0] - a[0]) <= 1, "start of the fade %d, old track %d", out[0], a[0]);
+
+    kz_mix_fade(NULL, b, out, BLOCK_FRAMES, 2, FADE_FRAMES / 2, FADE_FRAMES);
+    int32_t ga, gb;
+    kz_mix_gains(FADE_FRAMES / 2, FADE_FRAMES, &ga, &gb);
+    int32_t expect = b[0] * gb >> 15;
+    KZ_CHECK(abs(out[0] - expect) <= 1, "fade in alone %d, expected %d", out[0], (int)expect);
+    kz_mix_fade(a, NULL, out, BLOCK_FRAMES, 2, FADE_FRAMES, FADE_FRAMES);
+    bool silent = true;
+    for (size_t i = 0; i < BLOCK_FRAMES * 2; ++i) {
+        silent &= out[i] == 0;
+    }
+    KZ_CHECK(silent, "no new track past the fade should be silence");
+}
+
+// Stereo through the fade in the element's blocks, the quickest of a few
+// runs
+static void bench(const char *name, bool with_a) {
+    int16_t *a = malloc(BLOCK_FRAMES * 2 * sizeof(int16_t));
+    int16_t *b = malloc(BLOCK_FRAMES * 2 * sizeof(int16_t));
+    int16_t *out = malloc(BLOCK_FRAMES * 2 * sizeof(int16_t));
+    for (size_t i = 0; i < BLOCK_FRAMES * 2; ++i) {
+        a[i] = (int16_t)(rand() - RAND_MAX / 2);
+        b[i] = (int16_t)(rand() - RAND_MAX / 2);
+    }
+    uint64_t best = UINT64_MAX;
+    double best_s = 1e9;
+    for (int r = 0; r < BENCH_RUNS; ++r) {
+        uint32_t pos = 0;
+        double t0 = seconds();
+        uint64_t c0 = kz_host_cycles();
+        for (int i = 0; i < BENCH_BLOCKS; ++i) {
+            kz_mix_fade(with_a ? a : NULL, b, out, BLOCK_FRAMES, 2, pos, FADE_FRAMES);
+            pos = (pos + BLOCK_FRAMES) % FADE_FRAMES;
+        }
+        uint64_t c1 = kz_host_cycles();
+        double t1 = seconds();
+        best = c1 - c0 < best ? c1 - c0 : best;
+        best_s = t1 - t0 < best_s ? t1 - t0 : best_s;
+    }
+    double samples = (double)BENCH_BLOCKS * BLOCK_FRAMES * 2;
+    printf("%-16s %6.1f Msamples/s  %5.2f %s per sample\n", name, samples / best_s / 1e6,
+           best / samples, KZ_HOST_CYCLE_UNIT);
+    free(a);
+    free(b);
+    free(out);
+}
+
+int main(void) {
+    test_gains();
+    test_fade();
+    bench("fade", true);
+    bench("fade in alone", false);
+    return KZ_HOST_RESULT();
+}
@@ -0,0 +1,106 @@
+#include <string.h>
+
+#include "kz_host.h"
+#include "kz_order.h"
+
+static uint32_t s_seed = 12345;
+
+static uint32_t lcg(void) {
+    s_seed = s_seed * 1664525u + 1013904223u;
+    return s_seed >> 8;
+}
+
+static kz_order_t s_order = {.next = -1, .random = lcg};
+
+// In order: stops at the end without repeat, wraps with it
+static void test_in_order(void) {
+    uint32_t index;
+    kz_order_reset(&s_order, 5, 0);
+    for (uint32_t i = 1; i < 5; ++i) {
+        KZ_CHECK(!kz_order_at_end(&s_order, false), "at the end on track %u", i - 1);
+        KZ_CHECK(kz_order_peek(&s_order, false, false, &index) && index == i, "peek %u", index);
+        KZ_CHECK(kz_order_next(&s_order, false, 1) == i, "next from %u", i - 1);
+    }
+    KZ_CHECK(kz_order_at_end(&s_order, false), "not at the end on the last track");
+    KZ_CHECK(!kz_order_peek(&s_order, false, false, &index), "peeked past the end without repeat");
+    KZ_CHECK(kz_order_peek(&s_order, false, true, &index) && index == 0, "repeat peeked %u", index);
+    KZ_CHECK(kz_order_next(&s_order, false, 2) == 1, "a double skip should wrap to 1");
+    KZ_CHECK(kz_order_first(&s_order, false) == 0, "starting over should be at the top");
+}
+
+// Previous goes back through what played, then on back through the list
+static void test_prev(void) {
+    kz_order_reset(&s_order, 5, 2);
+    kz_order_next(&s_order, false, 1);
+    kz_order_next(&s_order, false, 2);
+    KZ_CHECK(s_order.current == 0, "on %u", s_order.current);
+    KZ_CHECK(kz_order_prev(&s_order, false, 1) == 3, "back to 3");
+    KZ_CHECK(kz_order_prev(&s_order, false, 1) == 2, "back to 2");
+    KZ_CHECK(kz_order_prev(&s_order, false, 1) == 1, "back past the history to 1");
+    KZ_CHECK(kz_order_prev(&s_order, false, 3) == 3, "three back wraps to 3");
+
+    // Shuffling with no history, previous stays put
+    kz_order_reset(&s_order, 5, 4);
+    KZ_CHECK(kz_order_prev(&s_order, true, 1) == 4, "shuffle previous moved");
+
+    // Only so much is remembered
+    kz_order_reset(&s_order, 100, 0);
+    for (int i = 0; i < 40; ++i) {
+        kz_order_next(&s_order, false, 1);
+    }
+    KZ_CHECK(kz_order_prev(&s_order, false, KZ_ORDER_HISTORY_LEN) == 40 - KZ_ORDER_HISTORY_LEN,
+             "history back to %u", s_order.current);
+    KZ_CHECK(kz_order_prev(&s_order, false, 1) == 40 - KZ_ORDER_HISTORY_LEN - 1,
+             "past the history to %u", s_order.current);
+}
+
+// A shuffle plays every track once, then ends without repeat or starts a
+// new round with it
+static void test_shuffle(void) {
+    enum { LEN = 50 };
+    bool seen[LEN] = {false};
+    uint32_t index;
+    kz_order_reset(&s_order, LEN, 17);
+    seen[17] = true;
+    int played = 1;
+    while (!kz_order_at_end(&s_order, true) && played < 2 * LEN) {
+        KZ_CHECK(kz_order_peek(&s_order, true, false, &index), "no next after %d tracks", played);
+        uint32_t next = kz_order_next(&s_order, true, 1);
+        KZ_CHECK(next == index, "peeked %u but moved to %u", index, next);
+        KZ_CHECK(!seen[next], "track %u came round twice after %d tracks", next, played);
+        seen[next] = true;
+        played++;
+    }
+    KZ_CHECK(played == LEN, "shuffle ended after %d of %d tracks", played, LEN);
+    KZ_CHECK(!kz_order_peek(&s_order, true, false, &index), "shuffle carried on without repeat");
+
+    // With repeat a new round starts, and it doesn't open on the track
+    // that just played
+    uint32_t last = s_order.current;
+    KZ_CHECK(kz_order_peek(&s_order, true, true, &index) && index != last, "repeat picked %u", index);
+    kz_order_next(&s_order, true, 1);
+    KZ_CHECK(!kz_order_at_end(&s_order, true), "new round already over");
+
+    // Play after the end starts a whole new shuffle
+    kz_order_first(&s_order, true);
+    KZ_CHECK(s_order.unplayed == LEN - 1, "%u left after starting over", s_order.unplayed);
+
+    // Going back doesn't make a shuffle forget what it's played
+    kz_order_reset(&s_order, 3, 0);
+    kz_order_next(&s_order, true, 1);
+    kz_order_prev(&s_order, true, 1);
+    kz_order_next(&s_order, true, 1);
+    KZ_CHECK(kz_order_at_end(&s_order, true), "three tracks played but not at the end");
+
+    kz_order_reset(&s_order, 1, 0);
+    KZ_CHECK(kz_order_at_end(&s_order, true), "one track shuffle should be over at once");
+    KZ_CHECK(kz_order_next(&s_order, true, 1) == 0, "one track shuffle moved");
+}
+
+int main(void) {
+    test_in_order();
+    test_prev();
+    test_shuffle();
+    kz_order_free(&s_order);
+    return KZ_HOST_RESULT();
+}
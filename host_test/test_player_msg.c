@@ -0,0 +1,138 @@
+#include <string.h>
+
+#include "kz_host.h"
+#include "player_msg.h"
+
+#define BATCH_LEN 16
+
+static player_be_msg_u s_batch[BATCH_LEN];
+static size_t s_len;
+// Stands in for the playlist operators a PLAYLIST_MSG carries
+static int s_lists[2];
+
+static void add(player_be_msg_u msg) {
+    s_len = player_msg_batch_add(s_batch, s_len, &msg);
+}
+
+static player_be_msg_u skip(player_be_msg_type type, int64_t sent_us) {
+    return (player_be_msg_u) {.skip_msg = {.type = type, .count = 1, .presses = 1, .sent_us = sent_us}};
+}
+
+static player_be_msg_u seek(int32_t ms, bool relative) {
+    return (player_be_msg_u) {.seek_msg = {.type = PLAYER_BE_SEEK_MSG, .ms = ms, .relative = relative}};
+}
+
+static player_be_msg_u playlist(int which) {
+    return (player_be_msg_u) {.pl_msg = {.type = PLAYER_BE_PLAYLIST_MSG,
+                                         .pl_op = (playlist_operator_t *)&s_lists[which], .start = which}};
+}
+
+static player_be_msg_u simple(player_be_msg_type type) {
+    return (player_be_msg_u) {.type = type};
+}
+
+// The batch as one letter per command, to compare against in one go
+static const char *kinds(void) {
+    static char out[BATCH_LEN + 1];
+    static const char letters[] = {
+        [PLAYER_BE_PLAYLIST_MSG] = 'L', [PLAYER_BE_PLAYPAUSE_MSG] = 'P', [PLAYER_BE_NEXT_MSG] = 'N',
+        [PLAYER_BE_PREV_MSG] = 'B', [PLAYER_BE_SEEK_MSG] = 'S', [PLAYER_BE_CARD_MSG] = 'C',
+    };
+    for (size_t i = 0; i < s_len; ++i) {
+        out[i] = letters[s_batch[i].type];
+    }
+    out[s_len] = '\0';
+    return out;
+}
+
+// A burst of presses becomes one skip by all of them, timed by the last
+static void test_skips(void) {
+    s_len = 0;
+    for (int i = 0; i < 5; ++i) {
+        add(skip(PLAYER_BE_NEXT_MSG, 1000 + i * 100));
+    }
+    KZ_CHECK(strcmp(kinds(), "N") == 0, "five nexts left %s", kinds());
+    KZ_CHECK(s_batch[0].skip_msg.count == 5 && s_batch[0].skip_msg.presses == 5 &&
+             s_batch[0].skip_msg.sent_us == 1400, "folded into %d tracks, %u presses, sent %lld",
+             (int)s_batch[0].skip_msg.count, (unsigned)s_batch[0].skip_msg.presses,
+             (long long)s_batch[0].skip_msg.sent_us);
+
+    // Next and previous don't cancel out - each press still moves
+    add(skip(PLAYER_BE_PREV_MSG, 2000));
+    add(skip(PLAYER_BE_PREV_MSG, 2100));
+    KZ_CHECK(strcmp(kinds(), "NB") == 0 && s_batch[1].skip_msg.count == 2, "next then prev left %s", kinds());
+
+    // A card change between two runs keeps them apart
+    s_len = 0;
+    add(skip(PLAYER_BE_NEXT_MSG, 0));
+    add(simple(PLAYER_BE_CARD_MSG));
+    add(skip(PLAYER_BE_NEXT_MSG, 0));
+    KZ_CHECK(strcmp(kinds(), "NCN") == 0, "next, card, next left %s", kinds());
+}
+
+static void test_seeks(void) {
+    // Relative seeks add up, onto an absolute one if that came first
+    s_len = 0;
+    add(seek(30000, false));
+    add(seek(5000, true));
+    add(seek(-2000, true));
+    KZ_CHECK(strcmp(kinds(), "S") == 0 && s_batch[0].seek_msg.ms == 33000 && !s_batch[0].seek_msg.relative,
+             "seeks folded to %s %d ms", kinds(), (int)s_batch[0].seek_msg.ms);
+
+    // An absolute one replaces whatever came before
+    add(seek(10000, false));
+    KZ_CHECK(s_batch[0].seek_msg.ms == 10000 && !s_batch[0].seek_msg.relative, "absolute seek left %d ms",
+             (int)s_batch[0].seek_msg.ms);
+    s_len = 0;
+    add(seek(5000, true));
+    add(seek(5000, true));
+    KZ_CHECK(s_batch[0].seek_msg.ms == 10000 && s_batch[0].seek_msg.relative, "relative seeks left %d ms",
+             (int)s_batch[0].seek_msg.ms);
+
+    // A skip leaves the track the seek was for
+    add(skip(PLAYER_BE_PREV_MSG, 0));
+    KZ_CHECK(strcmp(kinds(), "B") == 0, "seek then prev left %s", kinds());
+
+    // But a seek after a skip is for the track the skip lands on
+    add(seek(1000, false));
+    KZ_CHECK(strcmp(kinds(), "BS") == 0, "prev then seek left %s", kinds());
+}
+
+static void test_playlist(void) {
+    // A new list makes any seek or skip before it pointless, however many
+    s_len = 0;
+    add(simple(PLAYER_BE_PLAYPAUSE_MSG));
+    add(seek(1000, false));
+    add(skip(PLAYER_BE_NEXT_MSG, 0));
+    add(playlist(0));
+    KZ_CHECK(strcmp(kinds(), "PL") == 0, "playpause, seek, next, playlist left %s", kinds());
+
+    // Each list is kept, since each carries an operator to be freed
+    add(playlist(1));
+    KZ_CHECK(strcmp(kinds(), "PLL") == 0 && s_batch[2].pl_msg.pl_op == (playlist_operator_t *)&s_lists[1],
+             "two playlists left %s", kinds());
+
+    // Play/pause toggles, so two in a row both stay
+    s_len = 0;
+    add(simple(PLAYER_BE_PLAYPAUSE_MSG));
+    add(simple(PLAYER_BE_PLAYPAUSE_MSG));
+    KZ_CHECK(strcmp(kinds(), "PP") == 0, "two play/pauses left %s", kinds());
+}
+
+// The worst a full queue can make of a batch: nothing folds, so it's as
+// long as the queue
+static void test_full(void) {
+    s_len = 0;
+    for (int i = 0; i < BATCH_LEN; ++i) {
+        add(i % 2 ? skip(PLAYER_BE_NEXT_MSG, i) : simple(PLAYER_BE_PLAYPAUSE_MSG));
+    }
+    KZ_CHECK(s_len == BATCH_LEN, "%zu of %d kept", s_len, BATCH_LEN);
+}
+
+int main(void) {
+    test_skips();
+    test_seeks();
+    test_playlist();
+    test_full();
+    return KZ_HOST_RESULT();
+}
@@ -0,0 +1,219 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "kz_host.h"
+#include "kz_rbsize.h"
+
+// Decode timing traces: how long the decoder takes over each chunk it
+// writes to its output buffer, including waits on the card. They're modelled
+// on what the decoders look like on the device - steady work per frame, a
+// little jitter, and now and then a long stall while the card is busy - and
+// replayed against a buffer drained at the I2S byte rate, sampled the way
+// kz_rbtune samples the real one.
+#define BYTE_RATE (44100 * 4)
+#define TRACK_MS (30 * 1000)
+#define MAX_CHUNKS 20000
+
+typedef struct {
+    const char *name;
+    uint32_t chunk;         // bytes of PCM per decoded frame
+    uint32_t decode_us;     // typical time to decode one
+    uint32_t stall_every;   // frames between card stalls, on average
+    uint32_t stall_ms;      // the longest stall
+} trace_model_t;
+
+typedef struct {
+    uint32_t chunk;
+    size_t count;
+    uint32_t us[MAX_CHUNKS];
+} trace_t;
+
+static const trace_model_t s_mp3 = {"mp3", 1152 * 4, 4000, 400, 60};
+static const trace_model_t s_flac = {"flac", 4096 * 4, 9000, 60, 250};
+static const trace_model_t s_quiet = {"quiet", 1152 * 4, 4000, 0, 0};
+
+static trace_t s_trace;
+static uint32_t s_seed;
+
+static uint32_t lcg(void) {
+    s_seed = s_seed * 1664525u + 1013904223u;
+    return s_seed >> 8;
+}
+
+static void make_trace(const trace_model_t *m, uint32_t seed, uint32_t ms) {
+    s_seed = seed;
+    s_trace.chunk = m->chunk;
+    s_trace.count = 0;
+    uint64_t audio_us = 0;
+    while (audio_us < ms * 1000ull && s_trace.count < MAX_CHUNKS) {
+        // Up to a quarter either side of the typical time
+        uint32_t us = m->decode_us * 3 / 4 + lcg() % (m->decode_us / 2);
+        if (m->stall_every != 0 && lcg() % m->stall_every == 0) {
+            us += 1000 * (m->stall_ms / 4 + lcg() % (m->stall_ms * 3 / 4 + 1));
+        }
+        s_trace.us[s_trace.count++] = us;
+        audio_us += m->chunk * 1000000ull / BYTE_RATE;
+    }
+}
+
+// Play the trace through a buffer of size bytes, a millisecond at a time.
+// The decoder blocks while the buffer is full, the writer takes BYTE_RATE
+// out of it whatever happens. Returns how long it was sampled for.
+static int64_t replay(int size, kz_rbsize_track_t *track) {
+    kz_rbsize_track_reset(track);
+    int64_t fill = 0, pending = 0;
+    int64_t busy_us = s_trace.us[0];
+    size_t next = 1;
+    int64_t drained = 0;
+    int64_t ms = 0;
+    bool running = true;
+    for (; running || fill > 0; ++ms) {
+        // The decoder's time for this millisecond
+        int64_t left_us = 1000;
+        while (running && left_us > 0) {
+            if (busy_us > 0) {
+                int64_t step = busy_us < left_us ? busy_us : left_us;
+                busy_us -= step;
+                left_us -= step;
+                if (busy_us == 0) {
+                    pending = s_trace.chunk;
+                }
+            }
+            if (pending > 0) {
+                int64_t room = size - fill;
+                int64_t put = pending < room ? pending : room;
+                fill += put;
+                pending -= put;
+                if (pending > 0) {
+                    break;
+                }
+                if (next == s_trace.count) {
+                    running = false;
+                } else {
+                    busy_us = s_trace.us[next++];
+                }
+            }
+        }
+
+        int64_t want = (ms + 1) * BYTE_RATE / 1000 - drained;
+        drained += want;
+        fill = fill > want ? fill - want : 0;
+
+        if (running && ms >= KZ_RBSIZE_WARMUP_MS && ms % KZ_RBSIZE_SAMPLE_MS == 0) {
+            kz_rbsize_sample(track, (int)fill);
+        }
+    }
+    return ms - KZ_RBSIZE_WARMUP_MS;
+}
+
+// Tracks in a row of one model from the default size. Returns the underruns
+// seen while settling.
+static uint32_t settle(const trace_model_t *m, kz_rbsize_state_t *st, int tracks) {
+    kz_rbsize_track_t track;
+    memset(st, 0, sizeof(*st));
+    st->size = 16 * 1024;
+    printf("%-6s", m->name);
+    for (int t = 0; t < tracks; ++t) {
+        make_trace(m, 1000 + t, TRACK_MS);
+        int size = st->size;
+        int64_t observed = replay(size, &track);
+        KZ_CHECK(kz_rbsize_fold(st, &track, size, observed), "%s track %d not folded in", m->name, t);
+        printf(" %2uk%s", (unsigned)(st->size / 1024), track.empty ? "!" : "");
+    }
+    printf("\n");
+    return st->underruns;
+}
+
+// What the size settled on has to play tracks it hasn't seen without
+// running dry
+static void check_holds(const trace_model_t *m, const kz_rbsize_state_t *st) {
+    kz_rbsize_track_t track;
+    uint32_t empty = 0;
+    for (int t = 0; t < 10; ++t) {
+        make_trace(m, 5000 + t, TRACK_MS);
+        replay(st->size, &track);
+        empty += track.empty;
+    }
+    KZ_CHECK(empty == 0, "%s: %u empty samples at the settled %u bytes", m->name, (unsigned)empty,
+             (unsigned)st->size);
+}
+
+static void test_settle(void) {
+    kz_rbsize_state_t mp3, flac, quiet;
+    printf("Size after each track, ! where it ran dry:\n");
+
+    // Stalls that fit the default size, so it never runs dry
+    KZ_CHECK(settle(&s_mp3, &mp3, 12) == 0, "mp3 ran dry %u times", (unsigned)mp3.underruns);
+    check_holds(&s_mp3, &mp3);
+
+    // Stalls far deeper than the default: it grows until they fit
+    uint32_t underruns = settle(&s_flac, &flac, 12);
+    KZ_CHECK(underruns > 0 && underruns <= 2, "flac ran dry %u times", (unsigned)underruns);
+    KZ_CHECK(flac.size > 16 * 1024, "flac stayed at %u bytes", (unsigned)flac.size);
+    check_holds(&s_flac, &flac);
+
+    // No stalls at all: it shrinks, but not before the third track
+    settle(&s_quiet, &quiet, 12);
+    KZ_CHECK(quiet.size < 16 * 1024 && quiet.size >= KZ_RBSIZE_MIN, "quiet settled on %u bytes",
+             (unsigned)quiet.size);
+    check_holds(&s_quiet, &quiet);
+}
+
+static void test_rules(void) {
+    kz_rbsize_state_t st = {.size = 16 * 1024};
+    kz_rbsize_track_t track;
+
+    // Too short to say anything
+    make_trace(&s_quiet, 1, 8000);
+    int64_t observed = replay(st.size, &track);
+    KZ_CHECK(!kz_rbsize_fold(&st, &track, st.size, observed) && st.tracks == 0 && st.size == 16 * 1024,
+             "an %lld ms track was folded in", (long long)observed);
+
+    // The first two quiet tracks can't shrink it, the third can
+    for (int t = 0; t < 3; ++t) {
+        make_trace(&s_quiet, 10 + t, TRACK_MS);
+        kz_rbsize_fold(&st, &track, st.size, replay(st.size, &track));
+        KZ_CHECK((t < 2) == (st.size == 16 * 1024), "%u bytes after %d quiet tracks", (unsigned)st.size, t + 1);
+    }
+
+    // Running dry doubles it, up to the most there is
+    kz_rbsize_track_t dry = {.min_fill = 0, .empty = 3};
+    st.size = 48 * 1024;
+    kz_rbsize_fold(&st, &dry, st.size, TRACK_MS);
+    KZ_CHECK(st.size == KZ_RBSIZE_MAX, "%u bytes after running dry at 48k", (unsigned)st.size);
+}
+
+static void test_budget(void) {
+    kz_rbsize_state_t states[6];
+    for (int i = 0; i < 6; ++i) {
+        states[i] = (kz_rbsize_state_t) {.size = (i + 1) * 8 * 1024};
+    }
+    // 8k to 48k, plus 48k more for a prefetch
+    KZ_CHECK(kz_rbsize_total(states, 6) == 216 * 1024, "total %u", (unsigned)kz_rbsize_total(states, 6));
+
+    // A lowered budget comes off the biggest first
+    kz_rbsize_share_cut(states, 6, 160 * 1024);
+    KZ_CHECK(kz_rbsize_total(states, 6) <= 160 * 1024, "total %u over the budget",
+             (unsigned)kz_rbsize_total(states, 6));
+    KZ_CHECK(states[0].size == 8 * 1024 && states[1].size == 16 * 1024, "small ones cut to %u and %u",
+             (unsigned)states[0].size, (unsigned)states[1].size);
+
+    // One that's grown is held back so the rest still fit
+    states[2].size = KZ_RBSIZE_MAX;
+    kz_rbsize_fit(states, 6, 2, 160 * 1024);
+    KZ_CHECK(kz_rbsize_total(states, 6) <= 160 * 1024, "total %u after fitting",
+             (unsigned)kz_rbsize_total(states, 6));
+
+    // And nothing goes under the smallest size, whatever the budget
+    kz_rbsize_share_cut(states, 6, 0);
+    for (int i = 0; i < 6; ++i) {
+        KZ_CHECK(states[i].size == KZ_RBSIZE_MIN, "%d cut to %u", i, (unsigned)states[i].size);
+    }
+}
+
+int main(void) {
+    test_settle();
+    test_rules();
+    test_budget();
+    return KZ_HOST_RESULT();
+}
@@ -0,0 +1,107 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kz_host.h"
+#include "kz_resample.h"
+
+#define SRC_RATE 44100
+#define TONE_HZ 1000.0
+#define TONE_AMP 16000.0
+// Fed in odd sized blocks, as the element sees reads that don't line up
+#define BLOCK_FRAMES 300
+#define BENCH_RUNS 5
+
+static const struct {
+    kz_resample_quality_e quality;
+    const char *name;
+    double max_thdn_db;
+} s_tiers[] = {
+    {KZ_RESAMPLE_LOW, "low", -60.0},
+    {KZ_RESAMPLE_MEDIUM, "medium", -80.0},
+    {KZ_RESAMPLE_HIGH, "high", -82.0},
+};
+
+static size_t run(kz_rsp_handle_t rsp, const int16_t *in, size_t frames, int16_t *out) {
+    size_t n = 0;
+    for (size_t i = 0; i < frames; i += BLOCK_FRAMES) {
+        size_t len = frames - i < BLOCK_FRAMES ? frames - i : BLOCK_FRAMES;
+        n += kz_rsp_process(rsp, in + 2 * i, len, out + 2 * n);
+    }
+    return n;
+}
+
+// Fit a sine at the tone's frequency by least squares over the middle of
+// the output, leaving out the filter's settling at either end. Whatever is
+// left over is distortion and noise.
+static double thdn_db(const int16_t *out, size_t frames, double *amp) {
+    size_t a = KZ_RESAMPLE_DST_RATE / 10, b = frames - KZ_RESAMPLE_DST_RATE / 10;
+    double s = 0.0, c = 0.0;
+    for (size_t i = a; i < b; ++i) {
+        double t = 2.0 * M_PI * TONE_HZ * i / KZ_RESAMPLE_DST_RATE;
+        s += out[2 * i] * sin(t);
+        c += out[2 * i] * cos(t);
+    }
+    s *= 2.0 / (b - a);
+    c *= 2.0 / (b - a);
+    double err = 0.0, sig = 0.0;
+    for (size_t i = a; i < b; ++i) {
+        double t = 2.0 * M_PI * TONE_HZ * i / KZ_RESAMPLE_DST_RATE;
+        double fit = s * sin(t) + c * cos(t);
+        err += (out[2 * i] - fit) * (out[2 * i] - fit);
+        sig += fit * fit;
+    }
+    *amp = sqrt(s * s + c * c);
+    return 10.0 * log10(err / sig);
+}
+
+int main(void) {
+    const size_t frames = SRC_RATE;
+    int16_t *in = malloc(frames * 2 * sizeof(int16_t));
+    for (size_t i = 0; i < frames; ++i) {
+        in[2 * i] = in[2 * i + 1] = (int16_t)lrint(TONE_AMP * sin(2.0 * M_PI * TONE_HZ * i / SRC_RATE));
+    }
+
+    KZ_CHECK(kz_rsp_is_supported(44100, 48000), "44.1 kHz should be supported");
+    KZ_CHECK(kz_rsp_is_supported(22050, 48000), "22.05 kHz should be supported");
+
+    printf("44.1 -> 48 kHz stereo, 1 kHz at %.0f\n", TONE_AMP);
+    double thdn_by_tier[sizeof(s_tiers) / sizeof(*s_tiers)] = {0};
+    for (size_t t = 0; t < sizeof(s_tiers) / sizeof(*s_tiers); ++t) {
+        kz_rsp_handle_t rsp = kz_rsp_new(s_tiers[t].quality, SRC_RATE, KZ_RESAMPLE_DST_RATE, 2);
+        KZ_CHECK(rsp != NULL, "%s: no resampler", s_tiers[t].name);
+        if (rsp == NULL) {
+            continue;
+        }
+        int16_t *out = malloc(kz_rsp_max_out_frames(rsp, frames) * 2 * sizeof(int16_t));
+        size_t n = run(rsp, in, frames, out);
+        double amp;
+        double thdn = thdn_db(out, n, &amp);
+        KZ_CHECK(labs((long)n - KZ_RESAMPLE_DST_RATE) <= 64, "%s: %zu frames out", s_tiers[t].name, n);
+        KZ_CHECK(fabs(amp - TONE_AMP) < TONE_AMP * 0.02, "%s: amplitude %.1f", s_tiers[t].name, amp);
+        KZ_CHECK(thdn <= s_tiers[t].max_thdn_db, "%s: THD+N %.1f dB", s_tiers[t].name, thdn);
+        thdn_by_tier[t] = thdn;
+
+        // The quickest run is the one nothing else got in the way of
+        uint64_t best = UINT64_MAX;
+        for (int r = 0; r < BENCH_RUNS; ++r) {
+            kz_rsp_reset(rsp);
+            uint64_t t0 = kz_host_cycles();
+            n = run(rsp, in, frames, out);
+            uint64_t t1 = kz_host_cycles();
+            best = t1 - t0 < best ? t1 - t0 : best;
+        }
+        printf("%-6s THD+N %6.1f dB  %6.1f %s per output frame\n", s_tiers[t].name, thdn,
+               (double)best / n, KZ_HOST_CYCLE_UNIT);
+        free(out);
+        kz_rsp_destroy(rsp);
+    }
+    // Each tier costs more than the one below, so it has to sound at least
+    // as good
+    for (size_t t = 1; t < sizeof(s_tiers) / sizeof(*s_tiers); ++t) {
+        KZ_CHECK(thdn_by_tier[t] <= thdn_by_tier[t - 1], "%s worse than %s: %.1f against %.1f dB",
+                 s_tiers[t].name, s_tiers[t - 1].name, thdn_by_tier[t], thdn_by_tier[t - 1]);
+    }
+    free(in);
+    return KZ_HOST_RESULT();
+}
@@ -0,0 +1,224 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <utime.h>
+
+#include "kz_host.h"
+#include "kz_seek.h"
+
+// Files are written to the working directory, which under ctest is the
+// build directory
+#define MP3_PATH "test_seek.mp3"
+#define WAV_PATH "test_seek.wav"
+#define FLAC_PATH "test_seek.flac"
+
+// FLAC: 300 fixed 4096 sample frames at 44.1 kHz, 1500 bytes each, with a
+// seek table that only has a point every 100 frames
+#define FLAC_FRAMES 300
+#define FLAC_BLOCK 4096
+#define FLAC_FRAME_LEN 1500
+#define FLAC_META_LEN (4 + 4 + 34 + 4 + 3 * 18)
+
+// Room for the longest WAV, three seconds of 44.1 kHz stereo
+static uint8_t s_buf[44 + 44100 * 4 * 3];
+
+static void write_file(const char *path, const uint8_t *buf, size_t len) {
+    FILE *fp = fopen(path, "wb");
+    fwrite(buf, 1, len, fp);
+    fclose(fp);
+}
+
+static void put_be32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void put_le32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+// An ID3 tag of tag_len bytes, then a 128 kbps 44.1 kHz frame header and
+// silence. With toc set, the frame carries a Xing header whose TOC puts
+// k% of the time at (k/100)^2 of the bytes.
+static size_t write_mp3(uint32_t tag_len, size_t audio_len, bool toc) {
+    memset(s_buf, 0, 10 + tag_len + audio_len);
+    uint8_t *p = s_buf;
+    memcpy(p, "ID3\x03\x00\x00", 6);
+    p[6] = (tag_len >> 21) & 0x7F;
+    p[7] = (tag_len >> 14) & 0x7F;
+    p[8] = (tag_len >> 7) & 0x7F;
+    p[9] = tag_len & 0x7F;
+    p += 10 + tag_len;
+    memcpy(p, "\xFF\xFB\x90\x64", 4);
+    if (toc) {
+        uint8_t *x = &p[4 + 32];
+        memcpy(x, "Xing", 4);
+        put_be32(&x[4], 7);
+        put_be32(&x[8], 1000);
+        put_be32(&x[12], audio_len);
+        for (int k = 0; k < 100; ++k) {
+            x[16 + k] = (uint8_t)(k * k * 256 / 10000);
+        }
+    }
+    write_file(MP3_PATH, s_buf, 10 + tag_len + audio_len);
+    return 10 + tag_len;
+}
+
+static void write_wav(uint32_t rate, uint32_t data_len) {
+    uint8_t *p = s_buf;
+    memset(p, 0, 44 + data_len);
+    memcpy(p, "RIFF", 4);
+    put_le32(&p[4], 36 + data_len);
+    memcpy(&p[8], "WAVEfmt ", 8);
+    put_le32(&p[16], 16);
+    p[20] = 1;
+    p[22] = 2;
+    put_le32(&p[24], rate);
+    put_le32(&p[28], rate * 4);
+    p[32] = 4;
+    p[34] = 16;
+    memcpy(&p[36], "data", 4);
+    put_le32(&p[40], data_len);
+    write_file(WAV_PATH, s_buf, 44 + data_len);
+}
+
+static uint8_t crc8(const uint8_t *p, size_t len) {
+    uint8_t crc = 0;
+    for (size_t i = 0; i < len; ++i) {
+        crc ^= p[i];
+        for (int b = 0; b < 8; ++b) {
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+static void write_flac(void) {
+    uint8_t *p = s_buf;
+    memset(s_buf, 0, FLAC_META_LEN + FLAC_FRAMES * FLAC_FRAME_LEN);
+    memcpy(p, "fLaC\x00\x00\x00\x22", 8);
+    static const uint8_t si[18] = {0x10, 0x00, 0x10, 0x00, [10] = 0x0A, 0xC4, 0x42, 0xF0};
+    memcpy(&p[8], si, sizeof(si));
+    put_be32(&p[8 + 14], FLAC_FRAMES * FLAC_BLOCK);
+    p = &s_buf[8 + 34];
+    p[0] = 0x83;
+    p[3] = 3 * 18;
+    for (int i = 0; i < 3; ++i) {
+        uint8_t *pt = &p[4 + i * 18];
+        put_be32(&pt[4], i * 100 * FLAC_BLOCK);
+        put_be32(&pt[12], i * 100 * FLAC_FRAME_LEN);
+        pt[17] = FLAC_BLOCK & 0xFF;
+        pt[16] = FLAC_BLOCK >> 8;
+    }
+    for (int f = 0; f < FLAC_FRAMES; ++f) {
+        uint8_t *fr = &s_buf[FLAC_META_LEN + f * FLAC_FRAME_LEN];
+        size_t len = 4;
+        memcpy(fr, "\xFF\xF8\xC9\x18", 4);
+        if (f < 0x80) {
+            fr[len++] = f;
+        } else {
+            fr[len++] = 0xC0 | (f >> 6);
+            fr[len++] = 0x80 | (f & 0x3F);
+        }
+        fr[len] = crc8(fr, len);
+    }
+    write_file(FLAC_PATH, s_buf, FLAC_META_LEN + FLAC_FRAMES * FLAC_FRAME_LEN);
+}
+
+static void test_mp3(void) {
+    kz_seek_pos_t pos;
+    // CBR: 16 bytes a millisecond
+    size_t start = write_mp3(1000, 160000, false);
+    KZ_CHECK(kz_seek_find(MP3_PATH, 4000, &pos) == ESP_OK, "CBR not seekable");
+    KZ_CHECK(pos.duration_ms == 10000, "CBR duration %u ms", (unsigned)pos.duration_ms);
+    KZ_CHECK(pos.byte_pos == start + 64000 && pos.ms == 4000, "CBR 4 s at %u, %u ms", (unsigned)pos.byte_pos,
+             (unsigned)pos.ms);
+
+    // Halfway through the time is a quarter of the way through the bytes
+    start = write_mp3(1000, 200000, true);
+    kz_seek_find(MP3_PATH, 13061, &pos);
+    KZ_CHECK(pos.duration_ms == 26122, "Xing duration %u ms", (unsigned)pos.duration_ms);
+    KZ_CHECK(pos.byte_pos == start + 50000, "Xing halfway at %u, expected %zu", (unsigned)pos.byte_pos,
+             start + 50000);
+
+    // A tag size running past the end of the file isn't audio
+    write_mp3(1000, 0, false);
+    s_buf[6] = s_buf[7] = s_buf[8] = s_buf[9] = 0x7F;
+    write_file(MP3_PATH, s_buf, 100);
+    KZ_CHECK(kz_seek_find(MP3_PATH, 1000, &pos) != ESP_OK, "seekable with a bogus tag size");
+}
+
+static void test_wav(void) {
+    kz_seek_pos_t pos;
+    write_wav(44100, 44100 * 4 * 2);
+    KZ_CHECK(kz_seek_find(WAV_PATH, 1500, &pos) == ESP_OK, "WAV not seekable");
+    KZ_CHECK(pos.byte_pos == 44 + 66150 * 4 && pos.duration_ms == 2000, "WAV 1.5 s at %u of %u ms",
+             (unsigned)pos.byte_pos, (unsigned)pos.duration_ms);
+    KZ_CHECK(pos.prefix_len == 44 && memcmp(pos.prefix, "RIFF", 4) == 0, "WAV prefix of %zu", pos.prefix_len);
+    kz_seek_find(WAV_PATH, 500, &pos);
+    KZ_CHECK(pos.reads == 0, "cached WAV took %u reads", (unsigned)pos.reads);
+
+    // The same path with other contents, as on another card, isn't served
+    // the old table: first a different length
+    write_wav(44100, 44100 * 4 * 3);
+    kz_seek_find(WAV_PATH, 500, &pos);
+    KZ_CHECK(pos.duration_ms == 3000 && pos.reads != 0, "rewritten WAV read as %u ms after %u reads",
+             (unsigned)pos.duration_ms, (unsigned)pos.reads);
+
+    // Then the same length at another rate, only the time tells them apart
+    write_wav(48000, 44100 * 4 * 3);
+    struct stat st;
+    stat(WAV_PATH, &st);
+    struct utimbuf times = {st.st_atime, st.st_mtime + 10};
+    utime(WAV_PATH, &times);
+    kz_seek_find(WAV_PATH, 500, &pos);
+    KZ_CHECK(pos.duration_ms == 2756, "same size WAV read as %u ms", (unsigned)pos.duration_ms);
+
+    // Nothing tells these two apart, but a card change flushes the cache
+    write_wav(44100, 44100 * 4 * 3);
+    utime(WAV_PATH, &times);
+    kz_seek_flush();
+    kz_seek_find(WAV_PATH, 500, &pos);
+    KZ_CHECK(pos.duration_ms == 3000, "WAV after a flush read as %u ms", (unsigned)pos.duration_ms);
+
+    remove(WAV_PATH);
+    KZ_CHECK(kz_seek_find(WAV_PATH, 500, &pos) != ESP_OK, "seek in a file that's gone");
+}
+
+// The seek table brackets 15 s between frames 100 and 200, so bisection has
+// to find the rest. It lands on a frame within the last span it gave up on,
+// and the points it found make a second seek there free.
+static void test_flac(void) {
+    kz_seek_pos_t pos;
+    write_flac();
+    KZ_CHECK(kz_seek_find(FLAC_PATH, 15000, &pos) == ESP_OK, "FLAC not seekable");
+    uint32_t off = pos.byte_pos - FLAC_META_LEN;
+    uint32_t frame = off / FLAC_FRAME_LEN;
+    printf("FLAC 15 s: frame %u at %u ms, %u reads\n", (unsigned)frame, (unsigned)pos.ms, (unsigned)pos.reads);
+    KZ_CHECK(off % FLAC_FRAME_LEN == 0, "FLAC seek to %u isn't on a frame", (unsigned)pos.byte_pos);
+    KZ_CHECK(pos.ms == (uint32_t)((uint64_t)frame * FLAC_BLOCK * 1000 / 44100), "frame %u said to be %u ms",
+             (unsigned)frame, (unsigned)pos.ms);
+    KZ_CHECK(pos.ms <= 15000 && 15000 - pos.ms < 1000, "FLAC 15 s landed at %u ms", (unsigned)pos.ms);
+    KZ_CHECK(pos.prefix_len == 42 && memcmp(pos.prefix, "fLaC", 4) == 0, "FLAC prefix of %zu", pos.prefix_len);
+    KZ_CHECK(pos.duration_ms == FLAC_FRAMES * FLAC_BLOCK * 1000ull / 44100, "FLAC duration %u ms",
+             (unsigned)pos.duration_ms);
+
+    kz_seek_pos_t again;
+    kz_seek_find(FLAC_PATH, 15000, &again);
+    KZ_CHECK(again.byte_pos == pos.byte_pos && again.reads == 0, "second FLAC seek to %u after %u reads",
+             (unsigned)again.byte_pos, (unsigned)again.reads);
+}
+
+int main(void) {
+    test_mp3();
+    test_wav();
+    test_flac();
+    remove(MP3_PATH);
+    remove(FLAC_PATH);
+    return KZ_HOST_RESULT();
+}
@@ -0,0 +1,257 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <utime.h>
+
+#include "kz_host.h"
+
+// Built straight in, so the test can index a card of its own instead of
+// /sdcard and write the database where it likes
+#include "kz_tagdb.c"
+
+// A 20000 track library, written to the working directory the first time
+// and kept for later runs
+#define CARD_DIR "tagdb_card"
+#define DB_PATH "tagdb_test.bin"
+#define ARTISTS 500
+#define ALBUMS 4
+#define TRACKS 10
+#define TRACK_COUNT (ARTISTS * ALBUMS * TRACKS)
+// What the library screen asks for at a time
+#define PAGE 16
+#define BENCH_PAGES 2000
+
+static char s_pool_before[16];
+
+int64_t esp_timer_get_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+    return &s_pool_before;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t wait) {
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem) {
+    return pdTRUE;
+}
+
+BaseType_t xTaskCreatePinnedToCore(void (*fn)(void *), const char *name, uint32_t stack, void *arg,
+                                   UBaseType_t prio, TaskHandle_t *task, BaseType_t core) {
+    return pdFALSE;
+}
+
+void vTaskDelete(TaskHandle_t task) {
+}
+
+static void put_frame(FILE *fp, const char *id, const char *text) {
+    uint8_t hdr[11] = {0};
+    memcpy(hdr, id, 4);
+    hdr[7] = (uint8_t)(strlen(text) + 1);
+    fwrite(hdr, 1, sizeof(hdr), fp);
+    fwrite(text, 1, strlen(text), fp);
+}
+
+static void track_path(char *path, size_t len, int artist, int album, int track) {
+    snprintf(path, len, CARD_DIR "/Artist %03d/Album %d/%02d Track.mp3", artist, album, track);
+}
+
+// Artists are numbered out of order on the card, so sorting has work to do
+static int artist_on_card(int i) {
+    return (i * 7919) % ARTISTS;
+}
+
+static void make_card(void) {
+    char path[128], title[32], artist[32], album[48];
+    struct stat st;
+    if (stat(CARD_DIR "/done", &st) == 0) {
+        return;
+    }
+    mkdir(CARD_DIR, 0775);
+    for (int a = 0; a < ARTISTS; ++a) {
+        snprintf(path, sizeof(path), CARD_DIR "/Artist %03d", artist_on_card(a));
+        mkdir(path, 0775);
+        snprintf(artist, sizeof(artist), "Artist %03d", artist_on_card(a));
+        for (int al = 0; al < ALBUMS; ++al) {
+            snprintf(path, sizeof(path), CARD_DIR "/Artist %03d/Album %d", artist_on_card(a), al);
+            mkdir(path, 0775);
+            snprintf(album, sizeof(album), "Album %d of %s", al, artist);
+            for (int t = 0; t < TRACKS; ++t) {
+                track_path(path, sizeof(path), artist_on_card(a), al, t);
+                snprintf(title, sizeof(title), "Track %02d", t);
+                FILE *fp = fopen(path, "wb");
+                uint32_t size = 3 * 11 + strlen(title) + strlen(artist) + strlen(album);
+                uint8_t hdr[10] = {'I', 'D', '3', 3, 0, 0, 0, 0, size >> 7, size & 0x7F};
+                fwrite(hdr, 1, sizeof(hdr), fp);
+                put_frame(fp, "TIT2", title);
+                put_frame(fp, "TPE1", artist);
+                put_frame(fp, "TALB", album);
+                static const uint8_t sync[4] = {0xFF, 0xFB, 0x90, 0x64};
+                fwrite(sync, 1, sizeof(sync), fp);
+                fclose(fp);
+            }
+        }
+    }
+    fclose(fopen(CARD_DIR "/done", "wb"));
+}
+
+static double ms_since(int64_t start) {
+    return (esp_timer_get_time() - start) / 1000.0;
+}
+
+static uint32_t index_card(uint32_t *reused, double *ms) {
+    tagdb_build_t b = {0};
+    tagdb_prev_t prev;
+    int64_t start = esp_timer_get_time();
+    prev_open(&prev, DB_PATH);
+    KZ_CHECK(scan_card(CARD_DIR, &b, &prev, reused), "scan failed");
+    prev_close(&prev);
+    KZ_CHECK(write_db(&b, DB_PATH ".tmp"), "write failed");
+    *ms = ms_since(start);
+    rename(DB_PATH ".tmp", DB_PATH);
+
+    // What the version 1 pool held: every string of every track
+    size_t flat = 0;
+    for (size_t i = 0; i < b.rec_count; ++i) {
+        flat += strlen(&b.pool[b.recs[i].path_off]) + strlen(&b.pool[b.recs[i].title_off]) +
+                strlen(&b.pool[b.recs[i].artist_off]) + strlen(&b.pool[b.recs[i].album_off]) + 4;
+    }
+    snprintf(s_pool_before, sizeof(s_pool_before), "%zu", flat);
+    uint32_t count = b.rec_count;
+    free(b.recs);
+    free(b.names);
+    free(b.pool);
+    return count;
+}
+
+static bool unchanged(double *ms) {
+    tagdb_prev_t prev;
+    int64_t start = esp_timer_get_time();
+    prev_open(&prev, DB_PATH);
+    bool same = card_unchanged(CARD_DIR, &prev);
+    prev_close(&prev);
+    *ms = ms_since(start);
+    return same;
+}
+
+static void open_db(void) {
+    if (s_fp != NULL) {
+        fclose(s_fp);
+    }
+    s_fp = fopen(DB_PATH, "rb");
+    KZ_CHECK(s_fp != NULL && read_hdr(s_fp, &s_hdr), "no database to read");
+}
+
+// Every table in order, with each name once, and the pool as long as the
+// strings it's meant to hold
+static void test_layout(void) {
+    kz_tagdb_item_t items[PAGE], prev_item = {0};
+    KZ_CHECK(kz_tagdb_count(KZ_TAGDB_ARTISTS, 0) == ARTISTS, "%u artists",
+             (unsigned)kz_tagdb_count(KZ_TAGDB_ARTISTS, 0));
+    bool sorted = true;
+    for (uint32_t first = 0; first < ARTISTS; first += PAGE) {
+        size_t n = kz_tagdb_fetch(KZ_TAGDB_ARTISTS, 0, first, PAGE, items);
+        for (size_t i = 0; i < n; ++i) {
+            sorted &= strcasecmp(prev_item.name, items[i].name) < 0;
+            prev_item = items[i];
+        }
+    }
+    KZ_CHECK(sorted, "artists out of order at %s", prev_item.name);
+
+    uint32_t albums = kz_tagdb_count(KZ_TAGDB_ALBUMS, 123);
+    KZ_CHECK(albums == ALBUMS, "%u albums", (unsigned)albums);
+    kz_tagdb_fetch(KZ_TAGDB_ALBUMS, 123, 2, 1, items);
+    KZ_CHECK(strcmp(items[0].name, "Album 2 of Artist 123") == 0, "album '%s'", items[0].name);
+    uint32_t album = items[0].id;
+    KZ_CHECK(kz_tagdb_count(KZ_TAGDB_TRACKS, album) == TRACKS, "%u tracks",
+             (unsigned)kz_tagdb_count(KZ_TAGDB_TRACKS, album));
+    kz_tagdb_fetch(KZ_TAGDB_TRACKS, album, 7, 1, items);
+    char path[128], expect[128];
+    track_path(expect, sizeof(expect), 123, 2, 7);
+    KZ_CHECK(strcmp(items[0].name, "Track 07") == 0, "track '%s'", items[0].name);
+    KZ_CHECK(kz_tagdb_track_path(items[0].id, path, sizeof(path)) == ESP_OK && strcmp(path, expect) == 0,
+             "path '%s'", path);
+
+    // The pool runs from its offset to the end of the file
+    fseek(s_fp, 0, SEEK_END);
+    long pool = ftell(s_fp) - s_hdr.pool_off;
+    size_t strings = 0;
+    for (int a = 0; a < ARTISTS; ++a) {
+        strings += strlen("Artist 000") + 1 + ALBUMS * (strlen("Album 0 of Artist 000") + 1);
+        for (int al = 0; al < ALBUMS; ++al) {
+            track_path(path, sizeof(path), a, al, 0);
+            strings += TRACKS * (strlen(path) + 1 + strlen("Track 00") + 1);
+        }
+    }
+    printf("%ld byte file, %ld byte pool (%s before names were shared)\n", ftell(s_fp), pool, s_pool_before);
+    KZ_CHECK(pool == (long)strings, "pool is %ld bytes, %zu of strings", pool, strings);
+}
+
+// Pages from anywhere in each table, the quickest of a few runs
+static void bench_fetch(void) {
+    static const char *names[] = {"artists", "albums", "tracks"};
+    kz_tagdb_item_t items[PAGE];
+    uint32_t seed = 1;
+    for (int level = KZ_TAGDB_ARTISTS; level <= KZ_TAGDB_TRACKS; ++level) {
+        int64_t start = esp_timer_get_time();
+        for (int i = 0; i < BENCH_PAGES; ++i) {
+            seed = seed * 1664525u + 1013904223u;
+            uint32_t parent = level == KZ_TAGDB_ALBUMS ? seed % ARTISTS : seed % (ARTISTS * ALBUMS);
+            uint32_t first = level == KZ_TAGDB_ARTISTS ? (seed >> 8) % (ARTISTS - PAGE) : 0;
+            kz_tagdb_fetch(level, parent, first, PAGE, items);
+        }
+        printf("Page of %-7s %6.1f us\n", names[level], ms_since(start) * 1000.0 / BENCH_PAGES);
+    }
+}
+
+int main(void) {
+    char path[128], moved[128];
+    uint32_t reused;
+    double ms;
+    make_card();
+    remove(DB_PATH);
+
+    uint32_t count = index_card(&reused, &ms);
+    printf("%u tracks indexed in %.0f ms\n", (unsigned)count, ms);
+    KZ_CHECK(count == TRACK_COUNT && reused == 0, "%u tracks, %u reused", (unsigned)count, (unsigned)reused);
+    KZ_CHECK(unchanged(&ms), "card changed with nothing touched");
+    printf("Checked unchanged in %.0f ms\n", ms);
+
+    s_lock = xSemaphoreCreateMutex();
+    open_db();
+    test_layout();
+    bench_fetch();
+
+    // A file touched since is picked up, with every other row reused
+    track_path(path, sizeof(path), 42, 1, 3);
+    struct stat st;
+    stat(path, &st);
+    struct utimbuf times = {st.st_atime, st.st_mtime + 10};
+    utime(path, &times);
+    KZ_CHECK(!unchanged(&ms), "touched file missed");
+    count = index_card(&reused, &ms);
+    printf("Reindexed with one file touched in %.0f ms\n", ms);
+    KZ_CHECK(count == TRACK_COUNT && reused == TRACK_COUNT - 1, "%u tracks, %u reused", (unsigned)count,
+             (unsigned)reused);
+    times.modtime = st.st_mtime;
+    utime(path, &times);
+
+    // So is one gone, and one renamed
+    snprintf(moved, sizeof(moved), "%s.txt", path);
+    rename(path, moved);
+    KZ_CHECK(!unchanged(&ms), "missing file missed");
+    rename(moved, path);
+    snprintf(moved, sizeof(moved), CARD_DIR "/Artist 042/Album 1/03 Renamed.mp3");
+    rename(path, moved);
+    KZ_CHECK(!unchanged(&ms), "renamed file missed");
+    rename(moved, path);
+
+    fclose(s_fp);
+    remove(DB_PATH);
+    return KZ_HOST_RESULT();
+}
@@ -0,0 +1,249 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "kz_host.h"
+#include "kz_tags.h"
+
+// Files are written to the working directory, which under ctest is the
+// build directory
+#define MP3_PATH "test_tags.mp3"
+#define FLAC_PATH "test_tags.flac"
+#define ART_LEN (300 * 1024)
+#define BENCH_RUNS 200
+
+typedef struct {
+    uint8_t *buf;
+    size_t len;
+} bytes_t;
+
+static uint8_t s_buf[2][ART_LEN + 4096];
+static bytes_t s_file = {s_buf[0], 0};
+static bytes_t s_tag = {s_buf[1], 0};
+
+static void put(bytes_t *b, const void *p, size_t len) {
+    memcpy(&b->buf[b->len], p, len);
+    b->len += len;
+}
+
+static void put_be32(bytes_t *b, uint32_t v) {
+    uint8_t p[4] = {v >> 24, v >> 16, v >> 8, v};
+    put(b, p, 4);
+}
+
+static void put_le32(bytes_t *b, uint32_t v) {
+    uint8_t p[4] = {v, v >> 8, v >> 16, v >> 24};
+    put(b, p, 4);
+}
+
+static void put_syncsafe(bytes_t *b, uint32_t v) {
+    uint8_t p[4] = {(v >> 21) & 0x7F, (v >> 14) & 0x7F, (v >> 7) & 0x7F, v & 0x7F};
+    put(b, p, 4);
+}
+
+// A v2.3/2.4 frame; the size is of what's stored
+static void put_frame(bytes_t *b, int ver, const char *id, uint8_t flags, const void *data, size_t len) {
+    put(b, id, 4);
+    if (ver == 4) {
+        put_syncsafe(b, len);
+    } else {
+        put_be32(b, len);
+    }
+    uint8_t f[2] = {0, flags};
+    put(b, f, 2);
+    put(b, data, len);
+}
+
+static void put_text_frame(bytes_t *b, int ver, const char *id, const char *text) {
+    uint8_t data[256] = {0};
+    memcpy(&data[1], text, strlen(text));
+    put_frame(b, ver, id, 0, data, strlen(text) + 1);
+}
+
+// "Tëst" as UTF-16 with a little endian BOM, which starts with 0xFF
+static size_t utf16_title(uint8_t *data) {
+    static const uint8_t s[] = {1, 0xFF, 0xFE, 'T', 0, 0xEB, 0, 's', 0, 't', 0, 0, 0};
+    memcpy(data, s, sizeof(s));
+    return sizeof(s);
+}
+
+static size_t unsync(uint8_t *out, const uint8_t *in, size_t len) {
+    size_t o = 0;
+    for (size_t i = 0; i < len; ++i) {
+        out[o++] = in[i];
+        if (in[i] == 0xFF) {
+            out[o++] = 0;
+        }
+    }
+    return o;
+}
+
+// The tag built up in s_tag, then an MPEG-1 layer III 128 kbps frame header
+// and audio_len bytes of what passes for audio
+static void write_mp3(int ver, uint8_t flags, size_t audio_len) {
+    s_file.len = 0;
+    uint8_t hdr[6] = {'I', 'D', '3', ver, 0, flags};
+    put(&s_file, hdr, sizeof(hdr));
+    put_syncsafe(&s_file, s_tag.len);
+    put(&s_file, s_tag.buf, s_tag.len);
+    static const uint8_t sync[4] = {0xFF, 0xFB, 0x90, 0x64};
+    put(&s_file, sync, sizeof(sync));
+    memset(&s_file.buf[s_file.len], 0x55, audio_len);
+    s_file.len += audio_len;
+
+    FILE *fp = fopen(MP3_PATH, "wb");
+    fwrite(s_file.buf, 1, s_file.len, fp);
+    fclose(fp);
+}
+
+static void test_id3(void) {
+    kz_tags_t tags;
+    s_tag.len = 0;
+    put_text_frame(&s_tag, 3, "TIT2", "Title");
+    put_text_frame(&s_tag, 3, "TPE1", "Artist");
+    put_text_frame(&s_tag, 3, "TALB", "Album");
+    static const char gain[] = "\0REPLAYGAIN_TRACK_GAIN\0-6.50 dB";
+    put_frame(&s_tag, 3, "TXXX", 0, gain, sizeof(gain));
+    write_mp3(3, 0, 16000 - 4);
+    KZ_CHECK(kz_tags_read(MP3_PATH, &tags) == ESP_OK, "v2.3 not read");
+    KZ_CHECK(strcmp(tags.title, "Title") == 0 && strcmp(tags.artist, "Artist") == 0 &&
+             strcmp(tags.album, "Album") == 0, "v2.3 read '%s' '%s' '%s'", tags.title, tags.artist, tags.album);
+    KZ_CHECK(tags.has_track_gain && tags.track_gain_db == -6.5f, "v2.3 gain %.2f", tags.track_gain_db);
+    // 16000 bytes at 128 kbps
+    KZ_CHECK(tags.duration_ms == 1000, "v2.3 duration %u ms", (unsigned)tags.duration_ms);
+
+    // v2.3 with the whole tag unsynchronised, a title that needed it and
+    // another frame behind it to show the sizes still line up
+    uint8_t frame[64], raw[256];
+    bytes_t plain = {raw, 0};
+    put_frame(&plain, 3, "TIT2", 0, frame, utf16_title(frame));
+    put_text_frame(&plain, 3, "TPE1", "Artist");
+    s_tag.len = unsync(s_tag.buf, raw, plain.len);
+    write_mp3(3, 0x80, 1000);
+    kz_tags_read(MP3_PATH, &tags);
+    KZ_CHECK(strcmp(tags.title, "T\xC3\xABst") == 0, "v2.3 unsync title '%s'", tags.title);
+    KZ_CHECK(strcmp(tags.artist, "Artist") == 0, "v2.3 unsync artist '%s'", tags.artist);
+
+    // v2.4 unsynchronises frame by frame, here with a data length in front
+    size_t len = utf16_title(frame);
+    uint8_t data[64] = {0, 0, 0, len};
+    size_t stored = 4 + unsync(&data[4], frame, len);
+    s_tag.len = 0;
+    put_frame(&s_tag, 4, "TIT2", 0x03, data, stored);
+    put_text_frame(&s_tag, 4, "TPE1", "Artist");
+    write_mp3(4, 0, 1000);
+    kz_tags_read(MP3_PATH, &tags);
+    KZ_CHECK(strcmp(tags.title, "T\xC3\xABst") == 0, "v2.4 unsync title '%s'", tags.title);
+    KZ_CHECK(strcmp(tags.artist, "Artist") == 0, "v2.4 unsync artist '%s'", tags.artist);
+
+    // A v2.4 extended header that's too short to include its own size
+    // field gives up on the tag instead of skipping 4 GB
+    s_tag.len = 0;
+    put_syncsafe(&s_tag, 2);
+    put_text_frame(&s_tag, 4, "TIT2", "Title");
+    write_mp3(4, 0x40, 1000);
+    KZ_CHECK(kz_tags_read(MP3_PATH, &tags) == ESP_OK, "short extended header");
+    KZ_CHECK(tags.title[0] == '\0', "title '%s' behind a bad extended header", tags.title);
+    KZ_CHECK(tags.bytes_read < 2048, "read %zu bytes of a bad tag", tags.bytes_read);
+
+    // And a good one
+    s_tag.len = 0;
+    put_syncsafe(&s_tag, 6);
+    static const uint8_t ext[2] = {1, 0};
+    put(&s_tag, ext, sizeof(ext));
+    put_text_frame(&s_tag, 4, "TIT2", "Title");
+    write_mp3(4, 0x40, 1000);
+    kz_tags_read(MP3_PATH, &tags);
+    KZ_CHECK(strcmp(tags.title, "Title") == 0, "v2.4 extended header title '%s'", tags.title);
+
+    // A tag size past the end of the file leaves the duration alone
+    s_file.len = 0;
+    static const uint8_t huge[10] = {'I', 'D', '3', 3, 0, 0, 0x7F, 0x7F, 0x7F, 0x7F};
+    FILE *fp = fopen(MP3_PATH, "wb");
+    fwrite(huge, 1, sizeof(huge), fp);
+    fclose(fp);
+    KZ_CHECK(kz_tags_read(MP3_PATH, &tags) == ESP_OK && tags.duration_ms == 0,
+             "%u ms from a truncated tag", (unsigned)tags.duration_ms);
+}
+
+static void write_flac(uint32_t vendor_len) {
+    s_file.len = 0;
+    put(&s_file, "fLaC", 4);
+    // STREAMINFO: 44.1 kHz, 441000 samples
+    static const uint8_t si[38] = {0, 0, 0, 34, [14] = 0x0A, 0xC4, 0x42, 0xF0, 0, 0x06, 0xBA, 0xA8};
+    put(&s_file, si, sizeof(si));
+    bytes_t vc = {s_tag.buf, 0};
+    put_le32(&vc, vendor_len);
+    put(&vc, "kz", 2);
+    put_le32(&vc, 2);
+    put_le32(&vc, 11);
+    put(&vc, "TITLE=Title", 11);
+    put_le32(&vc, 13);
+    put(&vc, "ARTIST=Artist", 13);
+    uint8_t hdr[4] = {0x84, 0, vc.len >> 8, vc.len};
+    put(&s_file, hdr, sizeof(hdr));
+    put(&s_file, vc.buf, vc.len);
+
+    FILE *fp = fopen(FLAC_PATH, "wb");
+    fwrite(s_file.buf, 1, s_file.len, fp);
+    fclose(fp);
+}
+
+static void test_vorbis(void) {
+    kz_tags_t tags;
+    write_flac(2);
+    kz_tags_read(FLAC_PATH, &tags);
+    KZ_CHECK(strcmp(tags.title, "Title") == 0 && strcmp(tags.artist, "Artist") == 0,
+             "FLAC read '%s' '%s'", tags.title, tags.artist);
+    KZ_CHECK(tags.duration_ms == 10000, "FLAC duration %u ms", (unsigned)tags.duration_ms);
+
+    // A vendor length that would wrap the offset around to the fields
+    write_flac(0xFFFFFFFE);
+    kz_tags_read(FLAC_PATH, &tags);
+    KZ_CHECK(tags.title[0] == '\0', "title '%s' from a bogus vendor length", tags.title);
+}
+
+// The common case on a card: v2.3 text frames in front of a few hundred KB
+// of cover art, which is skipped, then the first frame for the duration
+static void bench(const char *name, bool unsynced) {
+    uint8_t frame[64];
+    s_tag.len = 0;
+    put_text_frame(&s_tag, 3, "TIT2", "Title");
+    put_text_frame(&s_tag, 3, "TPE1", "Artist");
+    put_text_frame(&s_tag, 3, "TALB", "Album");
+    put_frame(&s_tag, 3, "TIT3", 0, frame, utf16_title(frame));
+    put(&s_tag, "APIC", 4);
+    put_be32(&s_tag, ART_LEN);
+    put(&s_tag, "\0", 2);
+    for (size_t i = 0; i < ART_LEN; ++i) {
+        s_tag.buf[s_tag.len++] = (uint8_t)(i * 7);
+    }
+    if (unsynced) {
+        size_t len = s_tag.len;
+        memmove(s_file.buf, s_tag.buf, len);
+        s_tag.len = unsync(s_tag.buf, s_file.buf, len);
+    }
+    write_mp3(3, unsynced ? 0x80 : 0, 1000);
+
+    kz_tags_t tags;
+    uint64_t best = UINT64_MAX;
+    for (int r = 0; r < BENCH_RUNS; ++r) {
+        uint64_t t0 = kz_host_cycles();
+        kz_tags_read(MP3_PATH, &tags);
+        uint64_t t1 = kz_host_cycles();
+        best = t1 - t0 < best ? t1 - t0 : best;
+    }
+    KZ_CHECK(strcmp(tags.album, "Album") == 0 && tags.duration_ms != 0, "%s: album '%s', %u ms", name,
+             tags.album, (unsigned)tags.duration_ms);
+    printf("%-20s %8llu %s, %6zu bytes read\n", name, (unsigned long long)best, KZ_HOST_CYCLE_UNIT,
+           tags.bytes_read);
+}
+
+int main(void) {
+    test_id3();
+    test_vorbis();
+    bench("MP3 with art", false);
+    bench("unsynced with art", true);
+    remove(MP3_PATH);
+    remove(FLAC_PATH);
+    return KZ_HOST_RESULT();
+}
@@ -0,0 +1,92 @@
+#include <math.h>
+#include <string.h>
+
+#include "kz_host.h"
+#include "kz_vis.h"
+
+#define N KZ_VIS_FFT_LEN
+#define TONE_BIN 16
+#define BENCH_RUNS 2000
+
+static double magnitude(const int16_t *re, const int16_t *im, int k) {
+    return hypot(re[k], im[k]);
+}
+
+// A full scale sine through the window lands at a quarter of full scale in
+// its bin, which is what the bars are scaled by, and half that either side
+static void test_tone(void) {
+    int16_t re[N], im[N];
+    for (int i = 0; i < N; ++i) {
+        re[i] = (int16_t)lrint(INT16_MAX * sin(2.0 * M_PI * TONE_BIN * i / N));
+        im[i] = 0;
+    }
+    kz_vis_window(re);
+    kz_vis_fft(re, im, KZ_VIS_FFT_BITS);
+    double peak = magnitude(re, im, TONE_BIN);
+    printf("Full scale sine: %.0f in its bin, %.0f and %.0f either side\n", peak,
+           magnitude(re, im, TONE_BIN - 1), magnitude(re, im, TONE_BIN + 1));
+    KZ_CHECK(fabs(peak - 8192.0) < 16.0, "tone bin at %.0f", peak);
+    KZ_CHECK(fabs(magnitude(re, im, TONE_BIN - 1) - 4096.0) < 16.0, "bin below the tone");
+    KZ_CHECK(fabs(magnitude(re, im, TONE_BIN + 1) - 4096.0) < 16.0, "bin above the tone");
+    double leak = 0.0;
+    for (int k = 0; k < N / 2; ++k) {
+        if (k < TONE_BIN - 1 || k > TONE_BIN + 1) {
+            leak = magnitude(re, im, k) > leak ? magnitude(re, im, k) : leak;
+        }
+    }
+    KZ_CHECK(leak < 8.0, "%.1f leaked away from the tone", leak);
+}
+
+// Full scale DC is as far as the values can go, and must not wrap
+static void test_full_scale(void) {
+    int16_t re[N], im[N];
+    for (int i = 0; i < N; ++i) {
+        re[i] = -INT16_MAX;
+        im[i] = 0;
+    }
+    kz_vis_fft(re, im, KZ_VIS_FFT_BITS);
+    KZ_CHECK(re[0] <= -INT16_MAX + 8, "DC came out at %d", re[0]);
+}
+
+// Against a DFT in double precision, scaled the same, on something with
+// content in every bin. Each stage truncates, so the error is bounded by
+// about an LSB a stage.
+static void test_error(void) {
+    int16_t x[N], re[N], im[N];
+    for (int i = 0; i < N; ++i) {
+        x[i] = (int16_t)((i * 7919 + i * i * 131) % 60000 - 30000);
+        re[i] = x[i];
+        im[i] = 0;
+    }
+    kz_vis_fft(re, im, KZ_VIS_FFT_BITS);
+    double worst = 0.0;
+    for (int k = 0; k < N; ++k) {
+        double a = 0.0, b = 0.0;
+        for (int n = 0; n < N; ++n) {
+            a += x[n] * cos(2.0 * M_PI * k * n / N);
+            b -= x[n] * sin(2.0 * M_PI * k * n / N);
+        }
+        double e = hypot(a / N - re[k], b / N - im[k]);
+        worst = e > worst ? e : worst;
+    }
+
+    uint64_t best = UINT64_MAX;
+    for (int r = 0; r < BENCH_RUNS; ++r) {
+        memcpy(re, x, sizeof(re));
+        memset(im, 0, sizeof(im));
+        uint64_t t0 = kz_host_cycles();
+        kz_vis_fft(re, im, KZ_VIS_FFT_BITS);
+        uint64_t t1 = kz_host_cycles();
+        best = t1 - t0 < best ? t1 - t0 : best;
+    }
+    printf("%d point FFT: max error %.2f LSB, %llu %s\n", N, worst, (unsigned long long)best,
+           KZ_HOST_CYCLE_UNIT);
+    KZ_CHECK(worst < KZ_VIS_FFT_BITS, "error %.2f LSB against double precision", worst);
+}
+
+int main(void) {
+    test_tone();
+    test_full_scale();
+    test_error();
+    return KZ_HOST_RESULT();
+}
@@ -3,20 +3,29 @@
 #include <inttypes.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "nvs.h"
 #include "nvs_flash.h"
 #include "esp_system.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
 #include "esp_bt.h"
 #include "esp_bt_main.h"
 #include "esp_bt_device.h"
 #include "esp_a2dp_api.h"
 #include "esp_gap_bt_api.h"
 
+#include "esp_peripherals.h"
+#include "a2dp_stream.h"
+
 #include "bt_be.h"
 
 #define TAG "BT_BE"
 
+// How long the stack is kept up once nothing is using it
+#define BT_BE_IDLE_TIMEOUT_MS (60 * 1000)
+
 typedef enum {
     APP_GAP_STATE_IDLE = 0,
     APP_GAP_STATE_DEVICE_DISCOVERING,
@@ -30,6 +39,15 @@ static size_t s_dev_count = 0;
 static app_gap_state_t s_state;
 static bt_be_disc_cb_t s_disc_complete_cb = NULL;
 
+// The stack only runs while something holds it, or a link is up
+static SemaphoreHandle_t s_lock = NULL;
+static esp_periph_set_handle_t s_set = NULL;
+static esp_periph_handle_t s_bt_periph = NULL;
+static bool s_up = false;
+static uint32_t s_holds = 0;
+static volatile uint32_t s_links = 0;
+static int64_t s_last_used = 0;
+
 static char *bda2str(esp_bd_addr_t bda, char *str, size_t size)
 {
     if (bda == NULL || str == NULL || size < 18) {
@@ -43,6 +61,9 @@ static char *bda2str(esp_bd_addr_t bda, char *str, size_t size)
 }
 
 esp_err_t bt_be_connect_ad2p(esp_bd_addr_t bda) {
+    if (!s_up) {
+        return ESP_ERR_INVALID_STATE;
+    }
     char bda_str[18];
     ESP_LOGI(TAG, "Connecting: %s", bda2str(bda, bda_str, 18));
     return esp_a2d_source_connect(bda);
@@ -187,6 +208,16 @@ static void bt_app_gap_cb(esp_bt_gap_cb_event_t event, esp_bt_gap_cb_param_t *pa
         }
         break;
     }
+    case ESP_BT_GAP_ACL_CONN_CMPL_STAT_EVT:
+        if (param->acl_conn_cmpl_stat.stat == ESP_BT_STATUS_SUCCESS) {
+            s_links++;
+        }
+        break;
+    case ESP_BT_GAP_ACL_DISCONN_CMPL_STAT_EVT:
+        if (s_links > 0) {
+            s_links--;
+        }
+        break;
     case ESP_BT_GAP_PIN_REQ_EVT: {
             ESP_LOGI(TAG, "ESP_BT_GAP_PIN_REQ_EVT min_16_digit:%d", param->pin_req.min_16_digit);
             if (param->pin_req.min_16_digit) {
@@ -212,6 +243,9 @@ bool bt_be_is_discovery_complete(void) {
 }
 
 esp_err_t bt_be_start_discovery(bt_be_disc_cb_t disc_comp_cb) {
+    if (!s_up) {
+        return ESP_ERR_INVALID_STATE;
+    }
     if (s_state != APP_GAP_STATE_DEVICE_DISCOVER_COMPLETE && s_state != APP_GAP_STATE_IDLE) {
         return ESP_FAIL;
     }
@@ -239,30 +273,29 @@ static void bt_be_gap_start_up(void)
     esp_bt_dev_set_device_name(dev_name);
 }
 
-void bt_be_init(void)
+static esp_err_t bt_be_start_stack(void)
 {
     esp_err_t ret;
-    ESP_ERROR_CHECK(esp_bt_controller_mem_release(ESP_BT_MODE_BLE));
 
     esp_bt_controller_config_t bt_cfg = BT_CONTROLLER_INIT_CONFIG_DEFAULT();
     if ((ret = esp_bt_controller_init(&bt_cfg)) != ESP_OK) {
         ESP_LOGE(TAG, "%s initialize controller failed: %s\n", __func__, esp_err_to_name(ret));
-        return;
+        return ret;
     }
 
     if ((ret = esp_bt_controller_enable(ESP_BT_MODE_CLASSIC_BT)) != ESP_OK) {
         ESP_LOGE(TAG, "%s enable controller failed: %s\n", __func__, esp_err_to_name(ret));
-        return;
+        return ret;
     }
 
     if ((ret = esp_bluedroid_init()) != ESP_OK) {
         ESP_LOGE(TAG, "%s initialize bluedroid failed: %s\n", __func__, esp_err_to_name(ret));
-        return;
+        return ret;
     }
 
     if ((ret = esp_bluedroid_enable()) != ESP_OK) {
         ESP_LOGE(TAG, "%s enable bluedroid failed: %s\n", __func__, esp_err_to_name(ret));
-        return;
+        return ret;
     }
 
     /* set default parameters for Secure Simple Pairing */
@@ -279,4 +312,103 @@ void bt_be_init(void)
     esp_bt_gap_set_pin(pin_type, 0, pin_code);
 
     bt_be_gap_start_up();
+    return ESP_OK;
+}
+
+static void bt_be_stop_stack(void)
+{
+    esp_bluedroid_disable();
+    esp_bluedroid_deinit();
+    esp_bt_controller_disable();
+    esp_bt_controller_deinit();
+}
+
+static bool bt_be_is_busy(void)
+{
+    return s_holds > 0 || s_links > 0 || s_state == APP_GAP_STATE_DEVICE_DISCOVERING;
+}
+
+// Must be called with s_lock held
+static void bt_be_teardown(void)
+{
+    size_t before = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    if (s_bt_periph != NULL) {
+        esp_periph_remove_from_set(s_set, s_bt_periph);
+        esp_periph_destroy(s_bt_periph);
+        s_bt_periph = NULL;
+    }
+    bt_be_stop_stack();
+    s_up = false;
+    s_links = 0;
+    s_state = APP_GAP_STATE_IDLE;
+    ESP_LOGI(TAG, "Bluetooth idle, torn down. Internal heap %u -> %u", (unsigned)before,
+             (unsigned)heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+}
+
+// Only exists while the stack is up
+static void bt_be_idle_task(void *arg)
+{
+    while (1) {
+        vTaskDelay(pdMS_TO_TICKS(1000));
+        xSemaphoreTake(s_lock, portMAX_DELAY);
+        int64_t now = esp_timer_get_time();
+        if (bt_be_is_busy()) {
+            s_last_used = now;
+        } else if (now - s_last_used > BT_BE_IDLE_TIMEOUT_MS * 1000LL) {
+            bt_be_teardown();
+            xSemaphoreGive(s_lock);
+            vTaskDelete(NULL);
+        }
+        xSemaphoreGive(s_lock);
+    }
+}
+
+esp_err_t bt_be_acquire(void)
+{
+    esp_err_t ret = ESP_OK;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    s_holds++;
+    s_last_used = esp_timer_get_time();
+    if (s_up) {
+        goto acquire_cleanup;
+    }
+
+    int64_t start = esp_timer_get_time();
+    size_t before = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    if ((ret = bt_be_start_stack()) != ESP_OK) {
+        bt_be_stop_stack();
+        goto acquire_cleanup;
+    }
+    s_bt_periph = bt_create_periph();
+    esp_periph_start(s_set, s_bt_periph);
+    if (pdPASS != xTaskCreatePinnedToCore(bt_be_idle_task, "BT_IDLE", (2 * 1024), NULL,
+                                          tskIDLE_PRIORITY + 1, NULL, PRO_CPU_NUM)) {
+        ESP_LOGW(TAG, "No idle task, Bluetooth will stay up");
+    }
+    s_up = true;
+    ESP_LOGI(TAG, "Bluetooth up in %lld ms. Internal heap %u -> %u",
+             (esp_timer_get_time() - start) / 1000, (unsigned)before,
+             (unsigned)heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+
+acquire_cleanup:
+    xSemaphoreGive(s_lock);
+    return ret;
+}
+
+void bt_be_release(void)
+{
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (s_holds > 0) {
+        s_holds--;
+    }
+    s_last_used = esp_timer_get_time();
+    xSemaphoreGive(s_lock);
+}
+
+void bt_be_init(esp_periph_set_handle_t set)
+{
+    s_set = set;
+    s_lock = xSemaphoreCreateMutex();
+    // BLE is never used, so its share of the controller memory can go for good
+    ESP_ERROR_CHECK(esp_bt_controller_mem_release(ESP_BT_MODE_BLE));
 }
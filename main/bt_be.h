@@ -1,5 +1,6 @@
 #include "esp_bt.h"
 #include "esp_gap_bt_api.h"
+#include "esp_peripherals.h"
 
 typedef struct {
     esp_bd_addr_t bda;
@@ -16,6 +17,10 @@ typedef void (*bt_be_disc_cb_t)(bt_dev_info_t *dev, size_t dev_count);
 bool bt_be_is_discovery_complete(void);
 esp_err_t bt_be_start_discovery(bt_be_disc_cb_t disc_comp_cb);
 esp_err_t bt_be_connect_ad2p(esp_bd_addr_t bda);
-void bt_be_init(void);
+// Nothing is started here - the stack is brought up by the first
+// bt_be_acquire() and torn down again once it has sat idle for a while
+void bt_be_init(esp_periph_set_handle_t set);
+esp_err_t bt_be_acquire(void);
+void bt_be_release(void);
 
 
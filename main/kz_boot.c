@@ -0,0 +1,91 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "kz_boot.h"
+
+static const char *TAG = "KZ_BOOT";
+
+typedef struct {
+    int64_t start_us;
+    int64_t end_us;
+    int core;
+} kz_boot_time_t;
+
+static const kz_boot_stage_t *s_stages = NULL;
+static kz_boot_time_t s_times[KZ_BOOT_MAX_STAGES];
+static EventGroupHandle_t s_done = NULL;
+
+static void stage_task(void *arg) {
+    size_t i = (size_t)arg;
+    const kz_boot_stage_t *stage = &s_stages[i];
+
+    if (stage->deps != 0) {
+        xEventGroupWaitBits(s_done, stage->deps, pdFALSE, pdTRUE, portMAX_DELAY);
+    }
+
+    s_times[i].core = xPortGetCoreID();
+    s_times[i].start_us = esp_timer_get_time();
+    stage->fn();
+    s_times[i].end_us = esp_timer_get_time();
+
+    xEventGroupSetBits(s_done, KZ_BOOT_DEP(i));
+    vTaskDelete(NULL);
+}
+
+esp_err_t kz_boot_run(const kz_boot_stage_t *stages, size_t count) {
+    if (count == 0 || count > KZ_BOOT_MAX_STAGES) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    // Only depending on earlier stages keeps the graph acyclic
+    for (size_t i = 0; i < count; ++i) {
+        if (stages[i].deps & ~(KZ_BOOT_DEP(i) - 1)) {
+            ESP_LOGE(TAG, "Stage %s depends on a later stage", stages[i].name);
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+
+    s_done = xEventGroupCreate();
+    if (s_done == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    s_stages = stages;
+
+    int64_t start = esp_timer_get_time();
+    UBaseType_t prio = uxTaskPriorityGet(NULL);
+    for (size_t i = 0; i < count; ++i) {
+        if (pdPASS != xTaskCreatePinnedToCore(stage_task, stages[i].name, stages[i].stack,
+                                              (void *)i, prio, NULL, stages[i].core)) {
+            // Can't back out of stages which are already running, so run
+            // this one here once everything it needs is done
+            ESP_LOGW(TAG, "Running stage %s inline", stages[i].name);
+            xEventGroupWaitBits(s_done, stages[i].deps, pdFALSE, pdTRUE, portMAX_DELAY);
+            s_times[i].core = xPortGetCoreID();
+            s_times[i].start_us = esp_timer_get_time();
+            stages[i].fn();
+            s_times[i].end_us = esp_timer_get_time();
+            xEventGroupSetBits(s_done, KZ_BOOT_DEP(i));
+        }
+    }
+    xEventGroupWaitBits(s_done, KZ_BOOT_DEP(count) - 1, pdFALSE, pdTRUE, portMAX_DELAY);
+
+    ESP_LOGI(TAG, "Boot timeline (ms since boot):");
+    for (size_t i = 0; i < count; ++i) {
+        ESP_LOGI(TAG, "  %-8s core %d  %5lld -> %5lld  (%lld ms)", stages[i].name, s_times[i].core,
+                 s_times[i].start_us / 1000, s_times[i].end_us / 1000,
+                 (s_times[i].end_us - s_times[i].start_us) / 1000);
+    }
+    ESP_LOGI(TAG, "Staged init took %lld ms", (esp_timer_get_time() - start) / 1000);
+
+    vEventGroupDelete(s_done);
+    s_done = NULL;
+    s_stages = NULL;
+    return ESP_OK;
+}
+
+void kz_boot_mark(const char *what) {
+    ESP_LOGI(TAG, "%s at %lld ms after boot", what, esp_timer_get_time() / 1000);
+}
@@ -0,0 +1,23 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#define KZ_BOOT_MAX_STAGES 16
+#define KZ_BOOT_DEP(stage) (1u << (stage))
+
+typedef struct {
+    const char *name;
+    void (*fn)(void);
+    uint32_t deps;          // KZ_BOOT_DEP() of earlier stages that must finish first
+    uint32_t stack;
+    int core;
+} kz_boot_stage_t;
+
+// Run every stage on its own task as soon as its dependencies are done and
+// block until they all have, then log the timeline. A stage may only depend
+// on stages listed before it.
+esp_err_t kz_boot_run(const kz_boot_stage_t *stages, size_t count);
+
+// Log a milestone against time since boot, e.g. the first frame or first audio
+void kz_boot_mark(const char *what);
@@ -0,0 +1,26 @@
+#include "esp_console.h"
+#include "esp_log.h"
+
+#include "kz_console.h"
+
+static const char *TAG = "KZ_CONSOLE";
+
+static esp_console_repl_t *s_repl = NULL;
+
+esp_err_t kz_console_init(void) {
+    if (s_repl != NULL) {
+        return ESP_OK;
+    }
+    esp_console_repl_config_t repl_cfg = ESP_CONSOLE_REPL_CONFIG_DEFAULT();
+    repl_cfg.prompt = "kitzune>";
+    repl_cfg.task_stack_size = (4 * 1024);
+    esp_console_dev_uart_config_t uart_cfg = ESP_CONSOLE_DEV_UART_CONFIG_DEFAULT();
+
+    esp_err_t ret = esp_console_new_repl_uart(&uart_cfg, &repl_cfg, &s_repl);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Unable to create the console: %s", esp_err_to_name(ret));
+        return ret;
+    }
+    esp_console_register_help_command();
+    return esp_console_start_repl(s_repl);
+}
@@ -0,0 +1,5 @@
+#include "esp_err.h"
+
+// Start the serial command prompt. Modules add their own commands with
+// esp_console_cmd_register() once this has run.
+esp_err_t kz_console_init(void);
@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_console.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "audio_element.h"
+#include "audio_pipeline.h"
+#include "raw_stream.h"
+
+#include "playlist.h"
+#include "player_be.h"
+#include "kz_util.h"
+#include "kz_decoder.h"
+#include "kz_rbtune.h"
+#include "kz_sdcard.h"
+#include "kz_decbench.h"
+
+#define KZ_DECBENCH_DEFAULT_S 20
+// Give up on a decoder which stops producing anything
+#define KZ_DECBENCH_TIMEOUT_MS 2000
+// The decoder is registered under its own name so its task can't be
+// confused with the player's
+#define KZ_DECBENCH_TAG "bench"
+
+static const char *TAG = "KZ_DECBENCH";
+
+typedef struct {
+    const char *name;
+    const char *file;
+} bench_clip_t;
+
+static const bench_clip_t s_clips[] = {
+    {"MP3 CBR", "mp3_cbr.mp3"},
+    {"MP3 VBR", "mp3_vbr.mp3"},
+    {"FLAC 16", "flac_16.flac"},
+    {"FLAC 24", "flac_24.flac"},
+    {"Opus", "opus.opus"},
+    {"Vorbis", "vorbis.ogg"},
+    {"AAC-LC", "aac_lc.m4a"},
+    {"HE-AAC", "aac_he.m4a"},
+    {"WAV", "wav.wav"},
+};
+#define KZ_DECBENCH_CLIP_COUNT (sizeof(s_clips) / sizeof(*s_clips))
+
+typedef struct {
+    uint32_t audio_ms;
+    uint32_t wall_ms;
+    int32_t int_cost;       // bytes of internal RAM taken once decoding
+    int32_t psram_cost;
+    int32_t int_peak;       // most taken at any point, sampled per read
+    int32_t psram_peak;
+    uint32_t stack_free;    // decoder task stack never touched
+} bench_result_t;
+
+static uint8_t s_buf[4 * 1024];
+
+// Decode url into a raw sink as fast as it will go
+static esp_err_t bench_run(kz_decoder_stack_t stack, const char *url, uint32_t max_ms, bench_result_t *res) {
+    size_t int_before = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    size_t psram_before = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+    memset(res, 0, sizeof(*res));
+
+    raw_stream_cfg_t raw_cfg = RAW_STREAM_CFG_DEFAULT();
+    raw_cfg.type = AUDIO_STREAM_READER;
+    audio_element_handle_t sink = raw_stream_init(&raw_cfg);
+
+    audio_element_handle_t decoder;
+    audio_pipeline_handle_t pipeline = kz_decoder_pipeline_create(url, stack, CONFIG_KZ_SCHED_FS_PRIO, &sink, 1,
+                                                                  (const char *[]) {"fs", KZ_DECBENCH_TAG, "raw"},
+                                                                  &decoder);
+    if (pipeline == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    audio_element_set_input_timeout(sink, pdMS_TO_TICKS(KZ_DECBENCH_TIMEOUT_MS));
+
+    uint64_t bytes = 0;
+    uint32_t byte_rate = 0;
+    size_t int_min = int_before;
+    size_t psram_min = psram_before;
+    int64_t start = esp_timer_get_time();
+    audio_pipeline_run(pipeline);
+    while (byte_rate == 0 || bytes * 1000 / byte_rate < max_ms) {
+        int len = raw_stream_read(sink, (char *)s_buf, sizeof(s_buf));
+        if (len <= 0) {
+            break;
+        }
+        if (byte_rate == 0) {
+            // Everything has been allocated once audio is coming out
+            res->int_cost = (int32_t)(int_before - heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+            res->psram_cost = (int32_t)(psram_before - heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
+            audio_element_info_t info = {0};
+            audio_element_getinfo(decoder, &info);
+            byte_rate = info.sample_rates * info.channels * info.bits / 8;
+        }
+        bytes += len;
+        size_t int_free = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+        size_t psram_free = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+        int_min = int_free < int_min ? int_free : int_min;
+        psram_min = psram_free < psram_min ? psram_free : psram_min;
+    }
+    res->wall_ms = (uint32_t)((esp_timer_get_time() - start) / 1000);
+    res->audio_ms = byte_rate != 0 ? (uint32_t)(bytes * 1000 / byte_rate) : 0;
+    res->int_peak = (int32_t)(int_before - int_min);
+    res->psram_peak = (int32_t)(psram_before - psram_min);
+    // Before stopping, which ends the task
+    TaskHandle_t task = xTaskGetHandle(KZ_DECBENCH_TAG);
+    res->stack_free = task != NULL ? uxTaskGetStackHighWaterMark(task) : 0;
+
+    kz_decoder_pipeline_destroy(pipeline);
+    return res->audio_ms > 0 ? ESP_OK : ESP_FAIL;
+}
+
+// Decodes each reference clip on the card with the player's decoder setup,
+// or in every stack placement when compare is set
+static void run_bench(uint32_t seconds, bool compare) {
+    char url[64];
+    printf("clip      stack       audio    wall    rtf   internal (peak)     psram (peak)  stack free\n");
+    for (int i = 0; i < KZ_DECBENCH_CLIP_COUNT; ++i) {
+        struct stat st;
+        const bench_clip_t *clip = &s_clips[i];
+        kz_decoder_t dec = kz_decoder_for_ext(kz_get_ext(clip->file));
+        snprintf(url, sizeof(url), "file:/" KZ_DECODER_BENCH_DIR "/%s", clip->file);
+        if (stat(url + FILE_PREFIX_LEN, &st) != 0) {
+            printf("%-9s missing %s\n", clip->name, url + FILE_PREFIX_LEN);
+            continue;
+        }
+        int first = compare ? KZ_DECODER_STACK_INTERNAL : kz_decoder_get_stack(dec);
+        int last = compare ? KZ_DECODER_STACK_PSRAM : first;
+        for (int s = first; s <= last; ++s) {
+            bench_result_t res;
+            if (ESP_OK != bench_run(s, url, seconds * 1000, &res)) {
+                printf("%-9s %-8s  failed\n", clip->name, kz_decoder_stack_name(s));
+                continue;
+            }
+            // Fraction of real time spent decoding, lower is better
+            unsigned rtf = (unsigned)((uint64_t)res.wall_ms * 1000 / res.audio_ms);
+            printf("%-9s %-8s %6u ms %5u ms  %u.%03u  %7d (%7d)  %7d (%7d)  %10u\n", clip->name,
+                   kz_decoder_stack_name(s), (unsigned)res.audio_ms, (unsigned)res.wall_ms, rtf / 1000,
+                   rtf % 1000, (int)res.int_cost, (int)res.int_peak, (int)res.psram_cost,
+                   (int)res.psram_peak, (unsigned)res.stack_free);
+            ESP_LOGI(TAG, "%s/%s rtf %u/1000", clip->name, kz_decoder_stack_name(s), rtf);
+        }
+    }
+}
+
+static void print_policy(void) {
+    printf("decoder  stack     out buffer\n");
+    for (int i = 0; i < KZ_DECODER_COUNT; ++i) {
+        printf("%-8s %-8s  %u\n", kz_decoder_tag(i), kz_decoder_stack_name(kz_decoder_get_stack(i)),
+               (unsigned)kz_rbtune_get_size(kz_decoder_tag(i)));
+    }
+}
+
+static int decoder_cmd(int argc, char **argv) {
+    bool bench = argc > 1 && strcmp(argv[1], "bench") == 0;
+    bool compare = argc > 1 && strcmp(argv[1], "compare") == 0;
+    if (bench || compare) {
+        int seconds = argc > 2 ? atoi(argv[2]) : KZ_DECBENCH_DEFAULT_S;
+        if (seconds <= 0) {
+            return 1;
+        }
+        // Anything else decoding at the same time would skew the numbers
+        if (player_is_playing()) {
+            printf("Pause playback first\n");
+            return 1;
+        }
+        run_bench(seconds, compare);
+    } else if (argc > 2) {
+        kz_decoder_t dec = kz_decoder_from_tag(argv[1]);
+        bool psram = strcmp(argv[2], "psram") == 0;
+        if (dec == KZ_DECODER_NONE || (!psram && strcmp(argv[2], "internal") != 0)) {
+            printf("Usage: decoder <mp3|flac|opus|ogg|wav|aac> <internal|psram>\n");
+            return 1;
+        }
+        kz_decoder_set_stack(dec, psram ? KZ_DECODER_STACK_PSRAM : KZ_DECODER_STACK_INTERNAL);
+    } else {
+        print_policy();
+    }
+    return 0;
+}
+
+#ifdef CONFIG_KZ_DECBENCH_AT_BOOT
+static void bench_boot_task(void *arg) {
+    kz_sdcard_wait_mounted(portMAX_DELAY);
+    if (player_is_playing()) {
+        player_playpause();
+        vTaskDelay(pdMS_TO_TICKS(500));
+    }
+    ESP_LOGI(TAG, "Running the decoder benchmark");
+    run_bench(CONFIG_KZ_DECBENCH_SECONDS, false);
+    vTaskDelete(NULL);
+}
+#endif
+
+esp_err_t kz_decbench_init(void) {
+    const esp_console_cmd_t cmd = {
+        .command = "decoder",
+        .help = "Show where each decoder's stack lives or move one. 'bench' decodes the reference clips in "
+                KZ_DECODER_BENCH_DIR " as the player would, 'compare' in every stack placement",
+        .hint = "[<format> internal|psram] [bench|compare [seconds]]",
+        .func = decoder_cmd,
+    };
+    esp_err_t ret = esp_console_cmd_register(&cmd);
+#ifdef CONFIG_KZ_DECBENCH_AT_BOOT
+    xTaskCreatePinnedToCore(bench_boot_task, "DECBENCH", (4 * 1024), NULL, tskIDLE_PRIORITY + 1, NULL,
+                            PRO_CPU_NUM);
+#endif
+    return ret;
+}
@@ -0,0 +1,6 @@
+#include "esp_err.h"
+
+// Add the "decoder" console command, which shows and changes where each
+// decoder's stack lives and benchmarks the choices. Call after
+// kz_console_init().
+esp_err_t kz_decbench_init(void);
@@ -0,0 +1,224 @@
+#include <string.h>
+
+#include "esp_log.h"
+#include "nvs.h"
+
+#include "mp3_decoder.h"
+#include "opus_decoder.h"
+#include "ogg_decoder.h"
+#include "flac_decoder.h"
+#include "wav_decoder.h"
+#include "aac_decoder.h"
+#include "fatfs_stream.h"
+
+#include "kz_util.h"
+#include "kz_decoder.h"
+#include "kz_rbtune.h"
+
+#define KZ_DECODER_NVS_NAMESPACE "kz_decoder"
+#define KZ_DECODER_NVS_KEY "stack"
+// Elements after the decoder in a pipeline of its own
+#define KZ_DECODER_MAX_TAIL 2
+
+#ifdef CONFIG_KZ_SCHED_DECODE_STACK_IN_PSRAM
+#define KZ_DECODER_DEFAULT_STACK KZ_DECODER_STACK_PSRAM
+#else
+#define KZ_DECODER_DEFAULT_STACK KZ_DECODER_STACK_INTERNAL
+#endif
+
+static const char *TAG = "KZ_DECODER";
+
+static const char *s_tags[KZ_DECODER_COUNT] = {"mp3", "flac", "opus", "ogg", "wav", "aac"};
+
+static uint8_t s_stack[KZ_DECODER_COUNT];
+
+kz_decoder_t kz_decoder_for_ext(audio_extension_e ext) {
+    switch (ext) {
+        case AUD_EXT_MP3:
+            return KZ_DECODER_MP3;
+        case AUD_EXT_FLAC:
+            return KZ_DECODER_FLAC;
+        case AUD_EXT_OPUS:
+            return KZ_DECODER_OPUS;
+        case AUD_EXT_OGG:
+            return KZ_DECODER_OGG;
+        case AUD_EXT_WAV:
+            return KZ_DECODER_WAV;
+        case AUD_EXT_MP4:
+        case AUD_EXT_AAC:
+        case AUD_EXT_M4A:
+        case AUD_EXT_TS:
+            return KZ_DECODER_AAC;
+        default:
+            return KZ_DECODER_NONE;
+    }
+}
+
+kz_decoder_t kz_decoder_from_tag(const char *tag) {
+    for (int i = 0; tag != NULL && i < KZ_DECODER_COUNT; ++i) {
+        if (strcmp(s_tags[i], tag) == 0) {
+            return (kz_decoder_t)i;
+        }
+    }
+    return KZ_DECODER_NONE;
+}
+
+const char *kz_decoder_tag(kz_decoder_t dec) {
+    return dec < KZ_DECODER_COUNT ? s_tags[dec] : NULL;
+}
+
+const char *kz_decoder_stack_name(kz_decoder_stack_t stack) {
+    return stack == KZ_DECODER_STACK_PSRAM ? "psram" : "internal";
+}
+
+audio_element_handle_t kz_decoder_create(kz_decoder_t dec, kz_decoder_stack_t stack, int out_rb_size) {
+    bool in_ext = (stack == KZ_DECODER_STACK_PSRAM);
+    switch (dec) {
+        case KZ_DECODER_MP3: {
+            mp3_decoder_cfg_t cfg = DEFAULT_MP3_DECODER_CONFIG();
+            cfg.out_rb_size = out_rb_size;
+            cfg.task_core = CONFIG_KZ_SCHED_AUDIO_CORE;
+            cfg.task_prio = CONFIG_KZ_SCHED_DECODE_PRIO;
+            cfg.stack_in_ext = in_ext;
+            return mp3_decoder_init(&cfg);
+        }
+        case KZ_DECODER_FLAC: {
+            flac_decoder_cfg_t cfg = DEFAULT_FLAC_DECODER_CONFIG();
+            cfg.out_rb_size = out_rb_size;
+            cfg.task_core = CONFIG_KZ_SCHED_AUDIO_CORE;
+            cfg.task_prio = CONFIG_KZ_SCHED_DECODE_PRIO;
+            cfg.stack_in_ext = in_ext;
+            return flac_decoder_init(&cfg);
+        }
+        case KZ_DECODER_OPUS: {
+            opus_decoder_cfg_t cfg = DEFAULT_OPUS_DECODER_CONFIG();
+            cfg.out_rb_size = out_rb_size;
+            cfg.task_core = CONFIG_KZ_SCHED_AUDIO_CORE;
+            cfg.task_prio = CONFIG_KZ_SCHED_DECODE_PRIO;
+            cfg.stack_in_ext = in_ext;
+            return decoder_opus_init(&cfg);
+        }
+        case KZ_DECODER_OGG: {
+            ogg_decoder_cfg_t cfg = DEFAULT_OGG_DECODER_CONFIG();
+            cfg.out_rb_size = out_rb_size;
+            cfg.task_core = CONFIG_KZ_SCHED_AUDIO_CORE;
+            cfg.task_prio = CONFIG_KZ_SCHED_DECODE_PRIO;
+            cfg.stack_in_ext = in_ext;
+            return ogg_decoder_init(&cfg);
+        }
+        case KZ_DECODER_WAV: {
+            wav_decoder_cfg_t cfg = DEFAULT_WAV_DECODER_CONFIG();
+            cfg.out_rb_size = out_rb_size;
+            cfg.task_core = CONFIG_KZ_SCHED_AUDIO_CORE;
+            cfg.task_prio = CONFIG_KZ_SCHED_DECODE_PRIO;
+            cfg.stack_in_ext = in_ext;
+            return wav_decoder_init(&cfg);
+        }
+        case KZ_DECODER_AAC: {
+            aac_decoder_cfg_t cfg = DEFAULT_AAC_DECODER_CONFIG();
+            cfg.out_rb_size = out_rb_size;
+            cfg.task_core = CONFIG_KZ_SCHED_AUDIO_CORE;
+            cfg.task_prio = CONFIG_KZ_SCHED_DECODE_PRIO;
+            cfg.stack_in_ext = in_ext;
+            return aac_decoder_init(&cfg);
+        }
+        default:
+            return NULL;
+    }
+}
+
+audio_pipeline_handle_t kz_decoder_pipeline_create(const char *url, kz_decoder_stack_t stack, int fs_prio,
+                                                   audio_element_handle_t *tail, int n, const char *tags[],
+                                                   audio_element_handle_t *decoder) {
+    audio_element_handle_t els[2 + KZ_DECODER_MAX_TAIL] = {NULL};
+    audio_pipeline_handle_t pipeline = NULL;
+    kz_decoder_t dec = kz_decoder_for_ext(kz_get_ext(url));
+    if (n >= 0 && n <= KZ_DECODER_MAX_TAIL && dec != KZ_DECODER_NONE) {
+        audio_pipeline_cfg_t pipeline_cfg = DEFAULT_AUDIO_PIPELINE_CONFIG();
+        pipeline = audio_pipeline_init(&pipeline_cfg);
+
+        fatfs_stream_cfg_t fatfs_cfg = FATFS_STREAM_CFG_DEFAULT();
+        fatfs_cfg.type = AUDIO_STREAM_READER;
+        fatfs_cfg.task_core = CONFIG_KZ_SCHED_IO_CORE;
+        fatfs_cfg.task_prio = fs_prio;
+        els[0] = fatfs_stream_init(&fatfs_cfg);
+        els[1] = kz_decoder_create(dec, stack, kz_rbtune_get_size(kz_decoder_tag(dec)));
+    }
+
+    bool ok = pipeline != NULL && els[0] != NULL && els[1] != NULL;
+    for (int i = 0; i < n && i < KZ_DECODER_MAX_TAIL; ++i) {
+        els[2 + i] = tail[i];
+        ok = ok && tail[i] != NULL;
+    }
+    if (!ok) {
+        for (int i = 0; i < sizeof(els) / sizeof(*els); ++i) {
+            if (els[i] != NULL) {
+                audio_element_deinit(els[i]);
+            }
+        }
+        if (pipeline != NULL) {
+            audio_pipeline_deinit(pipeline);
+        }
+        ESP_LOGW(TAG, "Couldn't make a pipeline for %s", url);
+        return NULL;
+    }
+    for (int i = 0; i < 2 + n; ++i) {
+        audio_pipeline_register(pipeline, els[i], tags[i]);
+    }
+    audio_pipeline_link(pipeline, tags, 2 + n);
+    audio_element_set_uri(els[0], url);
+    if (decoder != NULL) {
+        *decoder = els[1];
+    }
+    return pipeline;
+}
+
+void kz_decoder_pipeline_destroy(audio_pipeline_handle_t pipeline) {
+    if (pipeline == NULL) {
+        return;
+    }
+    audio_pipeline_stop(pipeline);
+    audio_pipeline_wait_for_stop(pipeline);
+    audio_pipeline_terminate(pipeline);
+    // Takes the registered elements with it
+    audio_pipeline_deinit(pipeline);
+}
+
+void kz_decoder_load_policy(void) {
+    memset(s_stack, KZ_DECODER_DEFAULT_STACK, sizeof(s_stack));
+
+    nvs_handle_t nvs;
+    if (ESP_OK != nvs_open(KZ_DECODER_NVS_NAMESPACE, NVS_READONLY, &nvs)) {
+        return;
+    }
+    uint8_t stack[KZ_DECODER_COUNT];
+    size_t len = sizeof(stack);
+    if (ESP_OK == nvs_get_blob(nvs, KZ_DECODER_NVS_KEY, stack, &len) && len == sizeof(stack)) {
+        memcpy(s_stack, stack, sizeof(s_stack));
+    }
+    nvs_close(nvs);
+}
+
+kz_decoder_stack_t kz_decoder_get_stack(kz_decoder_t dec) {
+    return dec < KZ_DECODER_COUNT ? (kz_decoder_stack_t)s_stack[dec] : KZ_DECODER_DEFAULT_STACK;
+}
+
+esp_err_t kz_decoder_set_stack(kz_decoder_t dec, kz_decoder_stack_t stack) {
+    if (dec >= KZ_DECODER_COUNT) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    s_stack[dec] = stack;
+
+    nvs_handle_t nvs;
+    esp_err_t ret = nvs_open(KZ_DECODER_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    ret = nvs_set_blob(nvs, KZ_DECODER_NVS_KEY, s_stack, sizeof(s_stack));
+    if (ret == ESP_OK) {
+        ret = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    ESP_LOGI(TAG, "%s stack now in %s", s_tags[dec], kz_decoder_stack_name(stack));
+    return ret;
+}
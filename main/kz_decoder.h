@@ -0,0 +1,55 @@
+#include <stdbool.h>
+
+#include "esp_err.h"
+#include "audio_element.h"
+#include "audio_pipeline.h"
+
+// The benchmarks' reference clips, copied to the card from wherever they're
+// kept
+#define KZ_DECODER_BENCH_DIR "/sdcard/.kitzune/bench"
+
+// One decoder element per family of formats, registered in the pipeline
+// under its tag
+typedef enum {
+    KZ_DECODER_MP3 = 0,
+    KZ_DECODER_FLAC,
+    KZ_DECODER_OPUS,
+    KZ_DECODER_OGG,
+    KZ_DECODER_WAV,
+    KZ_DECODER_AAC,
+    KZ_DECODER_COUNT,
+    KZ_DECODER_NONE = KZ_DECODER_COUNT,
+} kz_decoder_t;
+
+// Where a decoder's task stack goes. The ring buffers and the codecs' own
+// working buffers always come from ADF's allocator, which prefers PSRAM.
+typedef enum {
+    KZ_DECODER_STACK_INTERNAL = 0,
+    KZ_DECODER_STACK_PSRAM,
+} kz_decoder_stack_t;
+
+kz_decoder_t kz_decoder_for_ext(audio_extension_e ext);
+kz_decoder_t kz_decoder_from_tag(const char *tag);
+const char *kz_decoder_tag(kz_decoder_t dec);
+const char *kz_decoder_stack_name(kz_decoder_stack_t stack);
+
+// Create a decoder on the audio core, as set in "Kitzune task scheduling"
+audio_element_handle_t kz_decoder_create(kz_decoder_t dec, kz_decoder_stack_t stack, int out_rb_size);
+
+// A pipeline of its own reading url off the card: a fatfs stream at fs_prio
+// on the IO core, the decoder for url's extension with its stack where asked,
+// then the n elements of tail. They're registered and linked under tags, the
+// stream's and decoder's first, and url is set, but nothing is run. The tail
+// is the caller's to create; if it or anything else couldn't be, all of it is
+// deinitialised and NULL returned.
+audio_pipeline_handle_t kz_decoder_pipeline_create(const char *url, kz_decoder_stack_t stack, int fs_prio,
+                                                   audio_element_handle_t *tail, int n, const char *tags[],
+                                                   audio_element_handle_t *decoder);
+// Stop one made by kz_decoder_pipeline_create and free it, elements and all
+void kz_decoder_pipeline_destroy(audio_pipeline_handle_t pipeline);
+
+// Per-decoder stack placement, kept in NVS. Changes take effect the next
+// time the player switches to that decoder.
+void kz_decoder_load_policy(void);
+kz_decoder_stack_t kz_decoder_get_stack(kz_decoder_t dec);
+esp_err_t kz_decoder_set_stack(kz_decoder_t dec, kz_decoder_stack_t stack);
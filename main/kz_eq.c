@@ -0,0 +1,478 @@
+#include <math.h>
+#include <string.h>
+
+#include "kz_eq.h"
+
+#ifdef ESP_PLATFORM
+#include "esp_attr.h"
+#define KZ_EQ_HOT IRAM_ATTR
+#else
+#define KZ_EQ_HOT
+#endif
+
+// Q28 coefficients are enough for the +12 dB shelves' b0 of about 4 and
+// the a1 of a low band close to -2. Samples carry 8 bits of fraction
+// through the cascade, so each product is under 2^51 and five of them
+// still fit in 64 bits.
+#define KZ_EQ_FRAC_BITS 8
+// Bands this close to flat are left out
+#define KZ_EQ_FLAT_DB (0.05)
+// Frames converted to the cascade's width at a time by the fast path
+#define KZ_EQ_CHUNK_FRAMES 64
+// Points the response is checked at when working out the headroom
+#define KZ_EQ_RESPONSE_POINTS 96
+
+// One stage's coefficients, normalised by a0
+typedef struct {
+    double b0, b1, b2, a1, a2;
+} eq_biquad_t;
+
+// The RBJ audio EQ cookbook filters
+static void design_band(const kz_eq_band_t *band, int rate, eq_biquad_t *bq) {
+    double gain = band->gain_db;
+    gain = gain > KZ_EQ_MAX_GAIN_DB ? KZ_EQ_MAX_GAIN_DB : gain;
+    gain = gain < -KZ_EQ_MAX_GAIN_DB ? -KZ_EQ_MAX_GAIN_DB : gain;
+    double freq = band->freq_hz;
+    freq = freq > 0.45 * rate ? 0.45 * rate : freq;
+    freq = freq < 10.0 ? 10.0 : freq;
+    double q = band->q;
+    q = q < 0.1 ? 0.1 : (q > 10.0 ? 10.0 : q);
+
+    double a = pow(10.0, gain / 40.0);
+    double w0 = 2.0 * M_PI * freq / rate;
+    double cw = cos(w0);
+    double alpha = sin(w0) / (2.0 * q);
+    double sa = 2.0 * sqrt(a) * alpha;
+    double b0, b1, b2, a0, a1, a2;
+    switch (band->type) {
+        case KZ_EQ_LOW_SHELF:
+            b0 = a * ((a + 1) - (a - 1) * cw + sa);
+            b1 = 2 * a * ((a - 1) - (a + 1) * cw);
+            b2 = a * ((a + 1) - (a - 1) * cw - sa);
+            a0 = (a + 1) + (a - 1) * cw + sa;
+            a1 = -2 * ((a - 1) + (a + 1) * cw);
+            a2 = (a + 1) + (a - 1) * cw - sa;
+            break;
+        case KZ_EQ_HIGH_SHELF:
+            b0 = a * ((a + 1) + (a - 1) * cw + sa);
+            b1 = -2 * a * ((a - 1) + (a + 1) * cw);
+            b2 = a * ((a + 1) + (a - 1) * cw - sa);
+            a0 = (a + 1) - (a - 1) * cw + sa;
+            a1 = 2 * ((a - 1) - (a + 1) * cw);
+            a2 = (a + 1) - (a - 1) * cw - sa;
+            break;
+        default:
+            b0 = 1 + alpha * a;
+            b1 = -2 * cw;
+            b2 = 1 - alpha * a;
+            a0 = 1 + alpha / a;
+            a1 = -2 * cw;
+            a2 = 1 - alpha / a;
+            break;
+    }
+    bq->b0 = b0 / a0;
+    bq->b1 = b1 / a0;
+    bq->b2 = b2 / a0;
+    bq->a1 = a1 / a0;
+    bq->a2 = a2 / a0;
+}
+
+// Squared magnitude of the cascade at w radians per sample
+static double response_sq(const eq_biquad_t *bq, int count, double w) {
+    double c1 = cos(w), s1 = sin(w), c2 = cos(2 * w), s2 = sin(2 * w);
+    double mag = 1.0;
+    for (int i = 0; i < count; ++i) {
+        double nr = bq[i].b0 + bq[i].b1 * c1 + bq[i].b2 * c2;
+        double ni = -bq[i].b1 * s1 - bq[i].b2 * s2;
+        double dr = 1.0 + bq[i].a1 * c1 + bq[i].a2 * c2;
+        double di = -bq[i].a1 * s1 - bq[i].a2 * s2;
+        mag *= (nr * nr + ni * ni) / (dr * dr + di * di);
+    }
+    return mag;
+}
+
+static int32_t to_q28(double v) {
+    return (int32_t)lrint(v * (1 << KZ_EQ_COEF_SHIFT));
+}
+
+void kz_eq_design(const kz_eq_band_t *bands, int count, int rate, kz_eq_coefs_t *coefs) {
+    eq_biquad_t bq[KZ_EQ_MAX_BANDS];
+    int n = 0;
+    count = count > KZ_EQ_MAX_BANDS ? KZ_EQ_MAX_BANDS : count;
+    for (int i = 0; i < count && rate > 0; ++i) {
+        if (fabs(bands[i].gain_db) >= KZ_EQ_FLAT_DB) {
+            design_band(&bands[i], rate, &bq[n++]);
+        }
+    }
+
+    // The loudest point of the response, from a log sweep plus each band's
+    // own frequency, is brought back down to 0 dB
+    double peak = 1.0;
+    for (int i = 0; i < KZ_EQ_RESPONSE_POINTS && n > 0; ++i) {
+        double f = 20.0 * pow(1000.0, (double)i / (KZ_EQ_RESPONSE_POINTS - 1));
+        if (f < 0.5 * rate) {
+            double m = response_sq(bq, n, 2.0 * M_PI * f / rate);
+            peak = m > peak ? m : peak;
+        }
+    }
+    for (int i = 0; i < count && n > 0; ++i) {
+        double f = bands[i].freq_hz;
+        if (f > 0.0 && f < 0.5 * rate) {
+            double m = response_sq(bq, n, 2.0 * M_PI * f / rate);
+            peak = m > peak ? m : peak;
+        }
+    }
+    double pre = 1.0 / sqrt(peak);
+
+    coefs->bands = n;
+    for (int i = 0; i < n; ++i) {
+        double scale = i == 0 ? pre : 1.0;
+        coefs->c[i][0] = to_q28(bq[i].b0 * scale);
+        coefs->c[i][1] = to_q28(bq[i].b1 * scale);
+        coefs->c[i][2] = to_q28(bq[i].b2 * scale);
+        coefs->c[i][3] = to_q28(bq[i].a1);
+        coefs->c[i][4] = to_q28(bq[i].a2);
+    }
+}
+
+void kz_eq_reset(kz_eq_state_t *st) {
+    memset(st, 0, sizeof(*st));
+}
+
+static inline int16_t sat_out(int32_t y) {
+    y = (y + (1 << (KZ_EQ_FRAC_BITS - 1))) >> KZ_EQ_FRAC_BITS;
+    if (y > INT16_MAX) {
+        return INT16_MAX;
+    } else if (y < INT16_MIN) {
+        return INT16_MIN;
+    }
+    return (int16_t)y;
+}
+
+// Direct form I, one sample through one stage. What the shift drops is
+// added back into the next sample's sum.
+static inline int32_t biquad(const int32_t *c, kz_eq_hist_t *h, int32_t x) {
+    int64_t acc = (int64_t)c[0] * x + (int64_t)c[1] * h->x1 + (int64_t)c[2] * h->x2 -
+                  (int64_t)c[3] * h->y1 - (int64_t)c[4] * h->y2 + h->err;
+    int32_t y = (int32_t)(acc >> KZ_EQ_COEF_SHIFT);
+    h->err = (int32_t)(acc - ((int64_t)y * (1 << KZ_EQ_COEF_SHIFT)));
+    h->x2 = h->x1;
+    h->x1 = x;
+    h->y2 = h->y1;
+    h->y1 = y;
+    return y;
+}
+
+void kz_eq_process_ref(const kz_eq_coefs_t *coefs, kz_eq_state_t *st, int16_t *pcm, size_t frames,
+                       int channels) {
+    for (size_t i = 0; i < frames; ++i) {
+        for (int ch = 0; ch < channels; ++ch) {
+            int32_t v = (int32_t)pcm[i * channels + ch] * (1 << KZ_EQ_FRAC_BITS);
+            for (int b = 0; b < coefs->bands; ++b) {
+                v = biquad(coefs->c[b], &st->h[b][ch], v);
+            }
+            pcm[i * channels + ch] = sat_out(v);
+        }
+    }
+}
+
+// One stage over a chunk with its coefficients and history held in locals
+// rather than reloaded for every sample
+static void KZ_EQ_HOT run_stage_mono(const int32_t *c, kz_eq_hist_t *h, int32_t *buf, size_t n) {
+    const int32_t b0 = c[0], b1 = c[1], b2 = c[2], a1 = c[3], a2 = c[4];
+    int32_t x1 = h->x1, x2 = h->x2, y1 = h->y1, y2 = h->y2, err = h->err;
+    for (size_t i = 0; i < n; ++i) {
+        int32_t x = buf[i];
+        int64_t acc = (int64_t)b0 * x + (int64_t)b1 * x1 + (int64_t)b2 * x2 -
+                      (int64_t)a1 * y1 - (int64_t)a2 * y2 + err;
+        int32_t y = (int32_t)(acc >> KZ_EQ_COEF_SHIFT);
+        err = (int32_t)(acc - ((int64_t)y * (1 << KZ_EQ_COEF_SHIFT)));
+        x2 = x1;
+        x1 = x;
+        y2 = y1;
+        y1 = y;
+        buf[i] = y;
+    }
+    h->x1 = x1;
+    h->x2 = x2;
+    h->y1 = y1;
+    h->y2 = y2;
+    h->err = err;
+}
+
+// Both channels side by side. Each sample waits on the one before it in
+// the same channel, so working on two independent ones at once keeps the
+// multiplier busy.
+static void KZ_EQ_HOT run_stage_stereo(const int32_t *c, kz_eq_hist_t *hl, kz_eq_hist_t *hr, int32_t *buf,
+                                       size_t frames) {
+    const int32_t b0 = c[0], b1 = c[1], b2 = c[2], a1 = c[3], a2 = c[4];
+    int32_t lx1 = hl->x1, lx2 = hl->x2, ly1 = hl->y1, ly2 = hl->y2, lerr = hl->err;
+    int32_t rx1 = hr->x1, rx2 = hr->x2, ry1 = hr->y1, ry2 = hr->y2, rerr = hr->err;
+    for (size_t i = 0; i < frames; ++i) {
+        int32_t lx = buf[2 * i];
+        int32_t rx = buf[2 * i + 1];
+        int64_t lacc = (int64_t)b0 * lx + (int64_t)b1 * lx1 + (int64_t)b2 * lx2 -
+                       (int64_t)a1 * ly1 - (int64_t)a2 * ly2 + lerr;
+        int64_t racc = (int64_t)b0 * rx + (int64_t)b1 * rx1 + (int64_t)b2 * rx2 -
+                       (int64_t)a1 * ry1 - (int64_t)a2 * ry2 + rerr;
+        int32_t ly = (int32_t)(lacc >> KZ_EQ_COEF_SHIFT);
+        int32_t ry = (int32_t)(racc >> KZ_EQ_COEF_SHIFT);
+        lerr = (int32_t)(lacc - ((int64_t)ly * (1 << KZ_EQ_COEF_SHIFT)));
+        rerr = (int32_t)(racc - ((int64_t)ry * (1 << KZ_EQ_COEF_SHIFT)));
+        lx2 = lx1;
+        lx1 = lx;
+        ly2 = ly1;
+        ly1 = ly;
+        rx2 = rx1;
+        rx1 = rx;
+        ry2 = ry1;
+        ry1 = ry;
+        buf[2 * i] = ly;
+        buf[2 * i + 1] = ry;
+    }
+    hl->x1 = lx1;
+    hl->x2 = lx2;
+    hl->y1 = ly1;
+    hl->y2 = ly2;
+    hl->err = lerr;
+    hr->x1 = rx1;
+    hr->x2 = rx2;
+    hr->y1 = ry1;
+    hr->y2 = ry2;
+    hr->err = rerr;
+}
+
+// A chunk at a time, widened once and narrowed once, with each stage run
+// over the whole chunk in turn
+void KZ_EQ_HOT kz_eq_process(const kz_eq_coefs_t *coefs, kz_eq_state_t *st, int16_t *pcm, size_t frames,
+                             int channels) {
+    int32_t buf[KZ_EQ_CHUNK_FRAMES * 2];
+    if (coefs->bands == 0 || channels < 1 || channels > 2) {
+        return;
+    }
+    while (frames > 0) {
+        size_t n = frames < KZ_EQ_CHUNK_FRAMES ? frames : KZ_EQ_CHUNK_FRAMES;
+        size_t samples = n * channels;
+        for (size_t i = 0; i < samples; ++i) {
+            buf[i] = (int32_t)pcm[i] * (1 << KZ_EQ_FRAC_BITS);
+        }
+        for (int b = 0; b < coefs->bands; ++b) {
+            if (channels == 2) {
+                run_stage_stereo(coefs->c[b], &st->h[b][0], &st->h[b][1], buf, n);
+            } else {
+                run_stage_mono(coefs->c[b], &st->h[b][0], buf, n);
+            }
+        }
+        for (size_t i = 0; i < samples; ++i) {
+            pcm[i] = sat_out(buf[i]);
+        }
+        pcm += samples;
+        frames -= n;
+    }
+}
+
+#ifdef ESP_PLATFORM
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "audio_mem.h"
+#include "audio_error.h"
+#include "kz_vis.h"
+
+static const char *TAG = "KZ_EQ";
+
+#define KZ_EQ_BUF_SIZE (2048)
+// Old and new settings are both run and faded between for this long
+#define KZ_EQ_RAMP_MS (20)
+
+typedef struct {
+    // Shared with the task setting the bands, guarded by lock
+    portMUX_TYPE lock;
+    kz_eq_band_t bands[KZ_EQ_MAX_BANDS];
+    int count;
+    int rate;
+    uint32_t gen;           // of the bands and rate
+    kz_eq_coefs_t next;     // worked out for them, waiting to be picked up
+    bool has_next;
+    // Only touched by the element task
+    kz_eq_coefs_t cur, old;
+    kz_eq_state_t st, old_st;
+    uint32_t ramp_pos, ramp_len;    // frames
+    int16_t *scratch;
+    uint8_t carry[4];
+    size_t carry_len;
+    int cur_bits, cur_ch;
+} kz_eq_t;
+
+// Work the coefficients out for the bands and rate as they stand, unless
+// they've changed again meanwhile, in which case whoever changed them will
+// do it
+static void update(kz_eq_t *eq) {
+    kz_eq_band_t bands[KZ_EQ_MAX_BANDS];
+    portENTER_CRITICAL(&eq->lock);
+    uint32_t gen = eq->gen;
+    int count = eq->count;
+    int rate = eq->rate;
+    memcpy(bands, eq->bands, sizeof(bands));
+    portEXIT_CRITICAL(&eq->lock);
+
+    kz_eq_coefs_t coefs;
+    kz_eq_design(bands, count, rate, &coefs);
+
+    portENTER_CRITICAL(&eq->lock);
+    if (gen == eq->gen) {
+        eq->next = coefs;
+        eq->has_next = true;
+    }
+    portEXIT_CRITICAL(&eq->lock);
+}
+
+// New coefficients take over from the old gradually. The new stages start
+// from the old ones' history, which is exact when only the gains have
+// moved and close enough otherwise for the fade to cover.
+static void take_next(kz_eq_t *eq, int rate) {
+    bool has_next = false;
+    portENTER_CRITICAL(&eq->lock);
+    if (eq->has_next) {
+        eq->old = eq->cur;
+        eq->cur = eq->next;
+        eq->has_next = false;
+        has_next = true;
+    }
+    portEXIT_CRITICAL(&eq->lock);
+    if (!has_next) {
+        return;
+    }
+    eq->old_st = eq->st;
+    eq->ramp_len = (uint32_t)(rate * KZ_EQ_RAMP_MS / 1000);
+    eq->ramp_pos = 0;
+    ESP_LOGI(TAG, "%d bands", eq->cur.bands);
+}
+
+// The outgoing filter's output in from, the incoming one's in pcm
+static void ramp(kz_eq_t *eq, int16_t *pcm, const int16_t *from, size_t frames, int channels) {
+    for (size_t i = 0; i < frames && eq->ramp_pos < eq->ramp_len; ++i, ++eq->ramp_pos) {
+        int32_t g = (int32_t)(((uint64_t)eq->ramp_pos << 15) / eq->ramp_len);
+        for (int ch = 0; ch < channels; ++ch) {
+            size_t k = i * channels + ch;
+            pcm[k] = (int16_t)(from[k] + (((pcm[k] - from[k]) * g) >> 15));
+        }
+    }
+}
+
+static esp_err_t kz_eq_open(audio_element_handle_t self) {
+    kz_eq_t *eq = (kz_eq_t *)audio_element_getdata(self);
+    kz_eq_reset(&eq->st);
+    eq->ramp_pos = eq->ramp_len;
+    eq->carry_len = 0;
+    eq->cur_bits = 0;
+    eq->cur_ch = 0;
+    return ESP_OK;
+}
+
+static audio_element_err_t kz_eq_process_el(audio_element_handle_t self, char *in_buffer, int in_len) {
+    kz_eq_t *eq = (kz_eq_t *)audio_element_getdata(self);
+    audio_element_info_t info = {0};
+    audio_element_getinfo(self, &info);
+    if (info.bits != eq->cur_bits || info.channels != eq->cur_ch) {
+        kz_eq_reset(&eq->st);
+        eq->ramp_pos = eq->ramp_len;
+        eq->carry_len = 0;
+        eq->cur_bits = info.bits;
+        eq->cur_ch = info.channels;
+    }
+    if (info.bits != 16 || info.channels < 1 || info.channels > 2) {
+        int r = audio_element_input(self, in_buffer, in_len);
+        return r > 0 ? audio_element_output(self, in_buffer, r) : r;
+    }
+
+    // Reads aren't guaranteed to be frame aligned, so carry any partial
+    // frame over to the front of the next one
+    memcpy(in_buffer, eq->carry, eq->carry_len);
+    int r = audio_element_input(self, in_buffer + eq->carry_len, in_len - eq->carry_len);
+    if (r <= 0) {
+        return r;
+    }
+    const size_t frame_bytes = sizeof(int16_t) * info.channels;
+    const size_t total = eq->carry_len + r;
+    const size_t frames = total / frame_bytes;
+    eq->carry_len = total - frames * frame_bytes;
+    memcpy(eq->carry, in_buffer + frames * frame_bytes, eq->carry_len);
+
+    take_next(eq, info.sample_rates);
+    int16_t *pcm = (int16_t *)in_buffer;
+    if (eq->ramp_pos < eq->ramp_len) {
+        memcpy(eq->scratch, pcm, frames * frame_bytes);
+        kz_eq_process(&eq->old, &eq->old_st, eq->scratch, frames, info.channels);
+        kz_eq_process(&eq->cur, &eq->st, pcm, frames, info.channels);
+        ramp(eq, pcm, eq->scratch, frames, info.channels);
+    } else {
+        kz_eq_process(&eq->cur, &eq->st, pcm, frames, info.channels);
+    }
+    // Last stop before the I2S writer, so the visualizer sees what's heard
+    kz_vis_tap(pcm, frames, info.channels, info.sample_rates);
+    return frames > 0 ? audio_element_output(self, in_buffer, frames * frame_bytes) : r;
+}
+
+static esp_err_t kz_eq_destroy(audio_element_handle_t self) {
+    kz_eq_t *eq = (kz_eq_t *)audio_element_getdata(self);
+    audio_free(eq->scratch);
+    audio_free(eq);
+    return ESP_OK;
+}
+
+void kz_eq_set_bands(audio_element_handle_t self, const kz_eq_band_t *bands, int count) {
+    kz_eq_t *eq = (kz_eq_t *)audio_element_getdata(self);
+    count = count > KZ_EQ_MAX_BANDS ? KZ_EQ_MAX_BANDS : (count < 0 ? 0 : count);
+    portENTER_CRITICAL(&eq->lock);
+    memcpy(eq->bands, bands, sizeof(*bands) * count);
+    eq->count = count;
+    eq->gen++;
+    portEXIT_CRITICAL(&eq->lock);
+    update(eq);
+}
+
+void kz_eq_set_rate(audio_element_handle_t self, int rate) {
+    kz_eq_t *eq = (kz_eq_t *)audio_element_getdata(self);
+    portENTER_CRITICAL(&eq->lock);
+    bool changed = rate != eq->rate;
+    if (changed) {
+        eq->rate = rate;
+        eq->gen++;
+    }
+    portEXIT_CRITICAL(&eq->lock);
+    if (changed) {
+        update(eq);
+    }
+}
+
+audio_element_handle_t kz_eq_init(kz_eq_cfg_t *cfg) {
+    kz_eq_t *eq = audio_calloc(1, sizeof(kz_eq_t));
+    AUDIO_MEM_CHECK(TAG, eq, return NULL);
+    portMUX_INITIALIZE(&eq->lock);
+    eq->scratch = audio_malloc(KZ_EQ_BUF_SIZE);
+    AUDIO_MEM_CHECK(TAG, eq->scratch, goto kz_eq_init_cleanup);
+
+    audio_element_cfg_t el_cfg = DEFAULT_AUDIO_ELEMENT_CONFIG();
+    el_cfg.open = kz_eq_open;
+    el_cfg.process = kz_eq_process_el;
+    el_cfg.destroy = kz_eq_destroy;
+    el_cfg.buffer_len = KZ_EQ_BUF_SIZE;
+    el_cfg.out_rb_size = cfg->out_rb_size;
+    el_cfg.task_stack = cfg->task_stack;
+    el_cfg.task_prio = cfg->task_prio;
+    el_cfg.task_core = cfg->task_core;
+    el_cfg.stack_in_ext = cfg->stack_in_ext;
+    el_cfg.tag = "eq";
+
+    audio_element_handle_t el = audio_element_init(&el_cfg);
+    AUDIO_MEM_CHECK(TAG, el, goto kz_eq_init_cleanup);
+    audio_element_setdata(el, eq);
+    return el;
+
+kz_eq_init_cleanup:
+    audio_free(eq->scratch);
+    audio_free(eq);
+    return NULL;
+}
+#endif
@@ -0,0 +1,79 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define KZ_EQ_MAX_BANDS (10)
+#define KZ_EQ_MAX_GAIN_DB (12.0f)
+#define KZ_EQ_COEF_SHIFT (28)
+
+typedef enum {
+    KZ_EQ_PEAK = 0,
+    KZ_EQ_LOW_SHELF,
+    KZ_EQ_HIGH_SHELF,
+} kz_eq_type_e;
+
+typedef struct {
+    kz_eq_type_e type;
+    float freq_hz;
+    float gain_db;
+    float q;
+} kz_eq_band_t;
+
+// Portable fixed point biquad cascade. Coefficients are Q28 and each stage
+// keeps 8 bits below the 16 bit sample in its state, with its rounding error
+// fed back, so deep low frequency cuts stay clean. host_test/test_eq.c checks
+// it against double precision.
+typedef struct {
+    int bands;                          // stages actually run, flat ones are left out
+    int32_t c[KZ_EQ_MAX_BANDS][5];      // b0, b1, b2, a1, a2
+} kz_eq_coefs_t;
+
+typedef struct {
+    int32_t x1, x2, y1, y2, err;
+} kz_eq_hist_t;
+
+typedef struct {
+    kz_eq_hist_t h[KZ_EQ_MAX_BANDS][2];
+} kz_eq_state_t;
+
+// Work out the coefficients for count bands at rate. This is floating point
+// and meant for the caller's task, not the audio path. The first stage also
+// takes the cascade's largest boost back off so boosts don't clip.
+void kz_eq_design(const kz_eq_band_t *bands, int count, int rate, kz_eq_coefs_t *coefs);
+void kz_eq_reset(kz_eq_state_t *st);
+// Filter frames of interleaved 16 bit mono or stereo in place. The two give
+// the same output to the bit; the first is arranged to run fast, the other
+// to be read.
+void kz_eq_process(const kz_eq_coefs_t *coefs, kz_eq_state_t *st, int16_t *pcm, size_t frames, int channels);
+void kz_eq_process_ref(const kz_eq_coefs_t *coefs, kz_eq_state_t *st, int16_t *pcm, size_t frames,
+                       int channels);
+
+#ifdef ESP_PLATFORM
+#include "audio_element.h"
+
+typedef struct {
+    int out_rb_size;
+    int task_stack;
+    int task_prio;
+    int task_core;
+    bool stack_in_ext;
+} kz_eq_cfg_t;
+
+#define DEFAULT_KZ_EQ_CONFIG() {                    \
+    .out_rb_size = (8 * 1024),                      \
+    .task_stack = (3 * 1024),                       \
+    .task_prio = 5,                                 \
+    .task_core = 1,                                 \
+    .stack_in_ext = false,                          \
+}
+
+// ADF audio element running the cascade, sits between the mixer and the I2S
+// writer. Anything other than 16 bit mono or stereo goes through untouched.
+audio_element_handle_t kz_eq_init(kz_eq_cfg_t *cfg);
+// Change the bands, or turn the EQ off with count 0. The coefficients are
+// worked out here, in the caller's task, and the element fades from the old
+// ones to the new over a few milliseconds so the change doesn't click.
+void kz_eq_set_bands(audio_element_handle_t self, const kz_eq_band_t *bands, int count);
+// The rate coming through, set along with the I2S clocks
+void kz_eq_set_rate(audio_element_handle_t self, int rate);
+#endif
@@ -0,0 +1,100 @@
+#include <math.h>
+#include <string.h>
+
+#include "kz_loudness.h"
+
+#define KZ_LOUDNESS_BLOCK_FRAMES (KZ_LOUDNESS_RATE * 4 / 10)
+#define KZ_LOUDNESS_BIN_LU (0.25f)
+
+// BS.1770 K-weighting at 48kHz: a high shelf followed by the RLB high pass
+static const float s_shelf_b[3] = {1.53512485958697f, -2.69169618940638f, 1.19839281085285f};
+static const float s_shelf_a[2] = {-1.69065929318241f, 0.73248077421585f};
+static const float s_hpf_b[3] = {1.0f, -2.0f, 1.0f};
+static const float s_hpf_a[2] = {-1.99004745483398f, 0.99007225036621f};
+
+static inline float biquad(kz_biquad_state_t *s, const float *b, const float *a, float x) {
+    float y = b[0] * x + s->z1;
+    s->z1 = b[1] * x - a[0] * y + s->z2;
+    s->z2 = b[2] * x - a[1] * y;
+    return y;
+}
+
+static float energy_to_lufs(float z) {
+    return -0.691f + 10.0f * log10f(z);
+}
+
+static void finish_block(kz_loudness_t *ld) {
+    float z = ld->block_sum / ld->block_frames;
+    ld->block_sum = 0.0f;
+    ld->block_frames = 0;
+    if (z <= 0.0f) {
+        return;
+    }
+
+    // Anything under the absolute gate is dropped here
+    int bin = (int)((energy_to_lufs(z) - KZ_LOUDNESS_FLOOR_LUFS) / KZ_LOUDNESS_BIN_LU);
+    if (bin < 0) {
+        return;
+    }
+    if (bin >= KZ_LOUDNESS_BINS) {
+        bin = KZ_LOUDNESS_BINS - 1;
+    }
+    ld->hist[bin]++;
+    ld->block_count++;
+}
+
+void kz_loudness_reset(kz_loudness_t *ld) {
+    memset(ld, 0, sizeof(*ld));
+}
+
+void kz_loudness_feed(kz_loudness_t *ld, const int16_t *pcm, size_t frames, int channels) {
+    if (channels < 1 || channels > 2) {
+        return;
+    }
+    for (size_t i = 0; i < frames; ++i) {
+        for (int c = 0; c < channels; ++c) {
+            float x = pcm[i * channels + c] * (1.0f / 32768.0f);
+            x = biquad(&ld->shelf[c], s_shelf_b, s_shelf_a, x);
+            x = biquad(&ld->hpf[c], s_hpf_b, s_hpf_a, x);
+            ld->block_sum += x * x;
+        }
+        if (++ld->block_frames == KZ_LOUDNESS_BLOCK_FRAMES) {
+            finish_block(ld);
+        }
+    }
+}
+
+static float bin_energy(int bin) {
+    float lufs = KZ_LOUDNESS_FLOOR_LUFS + (bin + 0.5f) * KZ_LOUDNESS_BIN_LU;
+    return powf(10.0f, (lufs + 0.691f) / 10.0f);
+}
+
+bool kz_loudness_integrated(const kz_loudness_t *ld, uint32_t min_blocks, float *lufs) {
+    if (ld->block_count < min_blocks || ld->block_count == 0) {
+        return false;
+    }
+
+    // First pass gives the ungated mean, which sets the relative gate 10 LU down
+    float sum = 0.0f;
+    for (int i = 0; i < KZ_LOUDNESS_BINS; ++i) {
+        sum += ld->hist[i] * bin_energy(i);
+    }
+    float rel_gate = energy_to_lufs(sum / ld->block_count) - 10.0f;
+
+    int first = (int)ceilf((rel_gate - KZ_LOUDNESS_FLOOR_LUFS) / KZ_LOUDNESS_BIN_LU);
+    if (first < 0) {
+        first = 0;
+    }
+    sum = 0.0f;
+    uint32_t count = 0;
+    for (int i = first; i < KZ_LOUDNESS_BINS; ++i) {
+        sum += ld->hist[i] * bin_energy(i);
+        count += ld->hist[i];
+    }
+    if (count == 0) {
+        return false;
+    }
+    *lufs = energy_to_lufs(sum / count);
+
+    return true;
+}
@@ -0,0 +1,27 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Gated loudness estimate after EBU R128 / BS.1770, fed with 48kHz PCM as it
+// is played so no extra decode pass is needed. Blocks are 400ms without
+// overlap and are binned at 0.25 LU, which is close enough to pick a gain.
+#define KZ_LOUDNESS_RATE 48000
+#define KZ_LOUDNESS_BINS 300
+#define KZ_LOUDNESS_FLOOR_LUFS (-70.0f)
+
+typedef struct {
+    float z1, z2;
+} kz_biquad_state_t;
+
+typedef struct {
+    kz_biquad_state_t shelf[2];
+    kz_biquad_state_t hpf[2];
+    float block_sum;
+    uint32_t block_frames;
+    uint32_t block_count;
+    uint32_t hist[KZ_LOUDNESS_BINS];
+} kz_loudness_t;
+
+void kz_loudness_reset(kz_loudness_t *ld);
+void kz_loudness_feed(kz_loudness_t *ld, const int16_t *pcm, size_t frames, int channels);
+bool kz_loudness_integrated(const kz_loudness_t *ld, uint32_t min_blocks, float *lufs);
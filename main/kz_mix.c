@@ -0,0 +1,462 @@
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "kz_mix.h"
+
+#ifdef ESP_PLATFORM
+#include "esp_attr.h"
+#define KZ_MIX_HOT IRAM_ATTR
+#else
+#define KZ_MIX_HOT
+#endif
+
+// The quarter sine is tabulated in this many steps and interpolated between
+// them; the error is well under one Q15 step
+#define KZ_MIX_CURVE_STEPS 256
+#define KZ_MIX_SHIFT 15
+
+static int16_t s_curve[KZ_MIX_CURVE_STEPS + 1];
+static bool s_curve_built = false;
+
+static const int16_t *mix_curve(void) {
+    if (!s_curve_built) {
+        for (int i = 0; i <= KZ_MIX_CURVE_STEPS; ++i) {
+            s_curve[i] = (int16_t)lrint(sin(M_PI / 2.0 * i / KZ_MIX_CURVE_STEPS) * INT16_MAX);
+        }
+        s_curve_built = true;
+    }
+    return s_curve;
+}
+
+// The fade's phase is a Q32 index into the curve, so a 10 s fade still
+// steps smoothly from one frame to the next
+static inline void KZ_MIX_HOT gains_at(const int16_t *curve, uint64_t phase, int32_t *ga, int32_t *gb) {
+    uint32_t i = (uint32_t)(phase >> 32);
+    int32_t frac = (int32_t)((phase >> 17) & 0x7fff);
+    *gb = curve[i] + (((curve[i + 1] - curve[i]) * frac) >> KZ_MIX_SHIFT);
+    *ga = curve[KZ_MIX_CURVE_STEPS - i] +
+          (((curve[KZ_MIX_CURVE_STEPS - i - 1] - curve[KZ_MIX_CURVE_STEPS - i]) * frac) >> KZ_MIX_SHIFT);
+}
+
+void kz_mix_gains(uint32_t pos, uint32_t len, int32_t *gain_a, int32_t *gain_b) {
+    const int16_t *curve = mix_curve();
+    if (pos >= len) {
+        *gain_a = 0;
+        *gain_b = curve[KZ_MIX_CURVE_STEPS];
+        return;
+    }
+    uint64_t step = ((uint64_t)KZ_MIX_CURVE_STEPS << 32) / len;
+    gains_at(curve, step * pos, gain_a, gain_b);
+}
+
+static inline int16_t sat_q15(int32_t acc) {
+    acc = (acc + (1 << (KZ_MIX_SHIFT - 1))) >> KZ_MIX_SHIFT;
+    if (acc > INT16_MAX) {
+        return INT16_MAX;
+    } else if (acc < INT16_MIN) {
+        return INT16_MIN;
+    }
+    return (int16_t)acc;
+}
+
+// The gains of an equal-power pair never add up to more than sqrt(2), so
+// the sum of both products always fits in 32 bits
+void KZ_MIX_HOT kz_mix_fade(const int16_t *a, const int16_t *b, int16_t *out, size_t frames, int channels,
+                            uint32_t pos, uint32_t len) {
+    const int16_t *curve = mix_curve();
+    // A missing input is read from the other with no gain, which keeps the
+    // loop free of branches
+    int32_t mask_a = a != NULL ? -1 : 0;
+    int32_t mask_b = b != NULL ? -1 : 0;
+    const int16_t *pa = a != NULL ? a : (b != NULL ? b : out);
+    const int16_t *pb = b != NULL ? b : pa;
+
+    size_t i = 0;
+    if (pos < len) {
+        size_t n = len - pos < frames ? len - pos : frames;
+        uint64_t step = ((uint64_t)KZ_MIX_CURVE_STEPS << 32) / len;
+        uint64_t phase = step * pos;
+        for (; i < n; ++i, phase += step) {
+            int32_t ga, gb;
+            gains_at(curve, phase, &ga, &gb);
+            ga &= mask_a;
+            gb &= mask_b;
+            for (int c = 0; c < channels; ++c) {
+                size_t k = i * channels + c;
+                out[k] = sat_q15(pa[k] * ga + pb[k] * gb);
+            }
+        }
+    }
+    // Past the end of the fade only b is left
+    size_t rest = (frames - i) * channels;
+    if (rest == 0) {
+        return;
+    }
+    if (b != NULL) {
+        memmove(&out[i * channels], &b[i * channels], sizeof(*out) * rest);
+    } else {
+        memset(&out[i * channels], 0, sizeof(*out) * rest);
+    }
+}
+
+#ifdef ESP_PLATFORM
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "audio_mem.h"
+#include "audio_error.h"
+
+static const char *TAG = "KZ_MIX";
+
+#define KZ_MIX_BUF_SIZE (2048)
+// Reads during a fade give up after this long, so the element task can
+// still see its commands while an input is stalled
+#define KZ_MIX_WAIT_MS (20)
+
+typedef enum {
+    KZ_MIX_PASS = 0,        // the input only
+    KZ_MIX_WAIT,            // ... until the next track's first audio turns up
+    KZ_MIX_FADE,            // fading over, then the next track alone
+    KZ_MIX_CATCH_UP,        // the input is back on the next track, being dropped until level
+} kz_mix_state_e;
+
+typedef struct {
+    // Shared with the player, guarded by lock
+    portMUX_TYPE lock;
+    uint32_t fade_ms;       // a fade asked for and not yet started
+    bool hand_over;
+    bool ended;             // the input ran out with no fade asked for
+    bool input_ended;       // ... or part way through one
+    bool released;
+    // Only touched by the element task
+    kz_mix_state_e state;
+    int channels;
+    size_t block;           // bytes mixed at a time, whole frames
+    uint32_t pos, len;      // frames into the fade, and its length
+    uint64_t next_bytes;    // of the next track played so far
+    uint64_t dropped;       // of the input dropped since the hand over
+    bool in_done;
+    bool next_done;
+    uint8_t *a_buf, *b_buf;
+    size_t a_fill, b_fill;
+} kz_mix_t;
+
+// Top buf up to want bytes. Only whole reads count, so a timeout leaves
+// what's been read so far for the next try.
+static int fill(ringbuf_handle_t rb, uint8_t *buf, size_t *len, size_t want, TickType_t ticks) {
+    while (*len < want) {
+        int r = rb_read(rb, (char *)buf + *len, want - *len, ticks);
+        if (r <= 0) {
+            return r == 0 ? AEL_IO_TIMEOUT : r;
+        }
+        *len += r;
+    }
+    return AEL_IO_OK;
+}
+
+static void set_input_ended(kz_mix_t *mx) {
+    mx->in_done = true;
+    portENTER_CRITICAL(&mx->lock);
+    mx->input_ended = true;
+    portEXIT_CRITICAL(&mx->lock);
+}
+
+static void start_fade(kz_mix_t *mx, audio_element_handle_t self, uint32_t fade_ms) {
+    audio_element_info_t info = {0};
+    audio_element_getinfo(self, &info);
+    mx->channels = info.channels > 0 ? info.channels : 2;
+    size_t frame = sizeof(int16_t) * mx->channels;
+    mx->block = (KZ_MIX_BUF_SIZE / frame) * frame;
+    mx->len = (uint32_t)((uint64_t)fade_ms * info.sample_rates / 1000);
+    mx->pos = 0;
+    mx->next_bytes = 0;
+    mx->dropped = 0;
+    mx->in_done = false;
+    mx->next_done = false;
+    mx->a_fill = 0;
+    mx->b_fill = 0;
+    mx->state = KZ_MIX_WAIT;
+}
+
+static int pass_step(kz_mix_t *mx, audio_element_handle_t self, char *buf, int len) {
+    int r = audio_element_input(self, buf, len);
+    if (r > 0) {
+        return audio_element_output(self, buf, r);
+    }
+    if (r != AEL_IO_DONE) {
+        return r;
+    }
+    portENTER_CRITICAL(&mx->lock);
+    uint32_t fade_ms = mx->fade_ms;
+    mx->fade_ms = 0;
+    mx->ended = fade_ms == 0;
+    portEXIT_CRITICAL(&mx->lock);
+    if (fade_ms == 0) {
+        return r;
+    }
+    // The fade was asked for just as the input ran out
+    start_fade(mx, self, fade_ms);
+    set_input_ended(mx);
+    return AEL_IO_TIMEOUT;
+}
+
+static int out_frames(kz_mix_t *mx, audio_element_handle_t self, const int16_t *a, const int16_t *b,
+                      char *buf, size_t bytes) {
+    size_t frames = bytes / (sizeof(int16_t) * mx->channels);
+    kz_mix_fade(a, b, (int16_t *)buf, frames, mx->channels, mx->pos, mx->len);
+    mx->pos = mx->len - mx->pos > frames ? mx->pos + frames : mx->len;
+    return audio_element_output(self, buf, frames * sizeof(int16_t) * mx->channels);
+}
+
+static int fade_step(kz_mix_t *mx, audio_element_handle_t self, char *buf) {
+    ringbuf_handle_t in = audio_element_get_input_ringbuf(self);
+    ringbuf_handle_t next = audio_element_get_multi_input_ringbuf(self, 0);
+    TickType_t wait = pdMS_TO_TICKS(KZ_MIX_WAIT_MS);
+
+    if (!mx->next_done) {
+        int r = fill(next, mx->b_buf, &mx->b_fill, mx->block, wait);
+        if (r == AEL_IO_DONE) {
+            mx->next_done = true;
+        } else if (r != AEL_IO_OK) {
+            return r;
+        }
+    }
+    bool fading = !mx->in_done && mx->pos < mx->len;
+    if (fading) {
+        int r = fill(in, mx->a_buf, &mx->a_fill, mx->block, wait);
+        if (r == AEL_IO_DONE) {
+            set_input_ended(mx);
+        } else if (r != AEL_IO_OK) {
+            return r;
+        }
+    } else if (!mx->in_done) {
+        // Faded out already, so whatever's left of it is dropped as it comes
+        int r = rb_read(in, (char *)mx->a_buf, mx->block, 0);
+        if (r == AEL_IO_DONE) {
+            set_input_ended(mx);
+        } else if (r == AEL_IO_ABORT) {
+            return r;
+        }
+        mx->a_fill = 0;
+    }
+
+    size_t a_len = fading ? mx->a_fill : 0;
+    size_t b_len = mx->b_fill;
+    size_t bytes = a_len > b_len ? a_len : b_len;
+    mx->a_fill = 0;
+    mx->b_fill = 0;
+    if (bytes == 0) {
+        // Both have run out, and there's nothing to do until the hand over
+        vTaskDelay(wait);
+        return AEL_IO_TIMEOUT;
+    }
+    memset(mx->a_buf + a_len, 0, bytes - a_len);
+    memset(mx->b_buf + b_len, 0, bytes - b_len);
+    mx->next_bytes += b_len;
+    return out_frames(mx, self, a_len > 0 ? (int16_t *)mx->a_buf : NULL,
+                      b_len > 0 ? (int16_t *)mx->b_buf : NULL, buf, bytes);
+}
+
+// Keep the last track going until the next one's first audio turns up
+static int wait_step(kz_mix_t *mx, audio_element_handle_t self, char *buf) {
+    ringbuf_handle_t next = audio_element_get_multi_input_ringbuf(self, 0);
+    if (mx->in_done || rb_bytes_filled(next) >= mx->block) {
+        mx->state = KZ_MIX_FADE;
+        return fade_step(mx, self, buf);
+    }
+    int r = fill(audio_element_get_input_ringbuf(self), mx->a_buf, &mx->a_fill, mx->block,
+                 pdMS_TO_TICKS(KZ_MIX_WAIT_MS));
+    if (r == AEL_IO_DONE) {
+        set_input_ended(mx);
+    } else if (r != AEL_IO_OK) {
+        return r;
+    }
+    size_t n = mx->a_fill;
+    mx->a_fill = 0;
+    return n > 0 ? audio_element_output(self, (char *)mx->a_buf, n) : AEL_IO_TIMEOUT;
+}
+
+// The input restarted on the next track from its start, and is dropped
+// until it's at the same point as the copy being played. Its decoder runs
+// faster than real time so it soon catches up.
+static int catch_up_step(kz_mix_t *mx, audio_element_handle_t self, char *buf) {
+    ringbuf_handle_t in = audio_element_get_input_ringbuf(self);
+    ringbuf_handle_t next = audio_element_get_multi_input_ringbuf(self, 0);
+    TickType_t wait = pdMS_TO_TICKS(KZ_MIX_WAIT_MS);
+
+    if (!mx->next_done) {
+        int r = fill(next, mx->b_buf, &mx->b_fill, mx->block, wait);
+        if (r == AEL_IO_DONE) {
+            mx->next_done = true;
+        } else if (r != AEL_IO_OK) {
+            return r;
+        }
+    }
+    size_t b_len = mx->b_fill;
+    uint64_t target = mx->next_bytes + b_len;
+    // With nothing left to play meanwhile, wait for the input to get there
+    while (mx->dropped < target) {
+        size_t n = target - mx->dropped < mx->block ? (size_t)(target - mx->dropped) : mx->block;
+        int r = rb_read(in, (char *)mx->a_buf, n, mx->next_done ? wait : 0);
+        if (r == AEL_IO_ABORT) {
+            return r;
+        }
+        if (r == AEL_IO_DONE) {
+            // Shorter than the copy, so there's nothing more of it to play
+            mx->dropped = target;
+            break;
+        }
+        if (r <= 0) {
+            break;
+        }
+        mx->dropped += r;
+    }
+
+    int ret = AEL_IO_TIMEOUT;
+    if (b_len > 0) {
+        mx->b_fill = 0;
+        mx->next_bytes += b_len;
+        ret = out_frames(mx, self, NULL, (int16_t *)mx->b_buf, buf, b_len);
+    }
+    // Only switch once the fade is over, as the input plays at full level
+    if (mx->dropped == mx->next_bytes && (mx->pos >= mx->len || mx->next_done)) {
+        mx->state = KZ_MIX_PASS;
+        portENTER_CRITICAL(&mx->lock);
+        mx->released = true;
+        portEXIT_CRITICAL(&mx->lock);
+        ESP_LOGI(TAG, "Back on the input after %llu bytes of the next track", mx->next_bytes);
+    }
+    return ret;
+}
+
+static esp_err_t kz_mix_open(audio_element_handle_t self) {
+    kz_mix_t *mx = (kz_mix_t *)audio_element_getdata(self);
+    portENTER_CRITICAL(&mx->lock);
+    mx->fade_ms = 0;
+    mx->hand_over = false;
+    mx->ended = false;
+    mx->input_ended = false;
+    mx->released = false;
+    portEXIT_CRITICAL(&mx->lock);
+    mx->state = KZ_MIX_PASS;
+    mx->a_fill = 0;
+    mx->b_fill = 0;
+    return ESP_OK;
+}
+
+static audio_element_err_t kz_mix_process(audio_element_handle_t self, char *in_buffer, int in_len) {
+    kz_mix_t *mx = (kz_mix_t *)audio_element_getdata(self);
+
+    uint32_t fade_ms = 0;
+    bool hand_over = false;
+    portENTER_CRITICAL(&mx->lock);
+    if (mx->state == KZ_MIX_PASS) {
+        fade_ms = mx->fade_ms;
+        mx->fade_ms = 0;
+    } else {
+        hand_over = mx->hand_over;
+        mx->hand_over = false;
+    }
+    portEXIT_CRITICAL(&mx->lock);
+    if (fade_ms != 0) {
+        start_fade(mx, self, fade_ms);
+    }
+    if (hand_over) {
+        mx->state = KZ_MIX_CATCH_UP;
+        mx->dropped = 0;
+        mx->in_done = false;
+        mx->a_fill = 0;
+    }
+
+    switch (mx->state) {
+        case KZ_MIX_WAIT:
+            return wait_step(mx, self, in_buffer);
+        case KZ_MIX_FADE:
+            return fade_step(mx, self, in_buffer);
+        case KZ_MIX_CATCH_UP:
+            return catch_up_step(mx, self, in_buffer);
+        default:
+            return pass_step(mx, self, in_buffer, in_len);
+    }
+}
+
+static esp_err_t kz_mix_destroy(audio_element_handle_t self) {
+    kz_mix_t *mx = (kz_mix_t *)audio_element_getdata(self);
+    audio_free(mx->a_buf);
+    audio_free(mx->b_buf);
+    audio_free(mx);
+    return ESP_OK;
+}
+
+bool kz_mix_start_fade(audio_element_handle_t self, uint32_t fade_ms) {
+    kz_mix_t *mx = (kz_mix_t *)audio_element_getdata(self);
+    portENTER_CRITICAL(&mx->lock);
+    bool ok = !mx->ended;
+    if (ok) {
+        mx->fade_ms = fade_ms > 0 ? fade_ms : 1;
+        mx->hand_over = false;
+        mx->input_ended = false;
+        mx->released = false;
+    }
+    portEXIT_CRITICAL(&mx->lock);
+    return ok;
+}
+
+bool kz_mix_input_ended(audio_element_handle_t self) {
+    kz_mix_t *mx = (kz_mix_t *)audio_element_getdata(self);
+    portENTER_CRITICAL(&mx->lock);
+    bool ret = mx->input_ended;
+    portEXIT_CRITICAL(&mx->lock);
+    return ret;
+}
+
+void kz_mix_hand_over(audio_element_handle_t self) {
+    kz_mix_t *mx = (kz_mix_t *)audio_element_getdata(self);
+    portENTER_CRITICAL(&mx->lock);
+    mx->hand_over = true;
+    mx->input_ended = false;
+    portEXIT_CRITICAL(&mx->lock);
+}
+
+bool kz_mix_released(audio_element_handle_t self) {
+    kz_mix_t *mx = (kz_mix_t *)audio_element_getdata(self);
+    portENTER_CRITICAL(&mx->lock);
+    bool ret = mx->released;
+    portEXIT_CRITICAL(&mx->lock);
+    return ret;
+}
+
+audio_element_handle_t kz_mix_init(kz_mix_cfg_t *cfg) {
+    kz_mix_t *mx = audio_calloc(1, sizeof(kz_mix_t));
+    AUDIO_MEM_CHECK(TAG, mx, return NULL);
+    portMUX_INITIALIZE(&mx->lock);
+    mx->a_buf = audio_malloc(KZ_MIX_BUF_SIZE);
+    mx->b_buf = audio_malloc(KZ_MIX_BUF_SIZE);
+    AUDIO_MEM_CHECK(TAG, mx->a_buf && mx->b_buf, goto kz_mix_init_cleanup);
+
+    audio_element_cfg_t el_cfg = DEFAULT_AUDIO_ELEMENT_CONFIG();
+    el_cfg.open = kz_mix_open;
+    el_cfg.process = kz_mix_process;
+    el_cfg.destroy = kz_mix_destroy;
+    el_cfg.buffer_len = KZ_MIX_BUF_SIZE;
+    el_cfg.out_rb_size = cfg->out_rb_size;
+    el_cfg.multi_in_rb_num = 1;
+    el_cfg.task_stack = cfg->task_stack;
+    el_cfg.task_prio = cfg->task_prio;
+    el_cfg.task_core = cfg->task_core;
+    el_cfg.stack_in_ext = cfg->stack_in_ext;
+    el_cfg.tag = "mix";
+
+    audio_element_handle_t el = audio_element_init(&el_cfg);
+    AUDIO_MEM_CHECK(TAG, el, goto kz_mix_init_cleanup);
+    audio_element_setdata(el, mx);
+    return el;
+
+kz_mix_init_cleanup:
+    audio_free(mx->a_buf);
+    audio_free(mx->b_buf);
+    audio_free(mx);
+    return NULL;
+}
+#endif
@@ -0,0 +1,53 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Portable equal-power crossfade kernel. Gains follow a Q15 quarter sine, so
+// the two always sum to the same power; host_test/test_mix.c holds it to
+// that and times it.
+//
+// Mixes frames of interleaved 16 bit a and b into out, fading a out and b in
+// from frame pos of a fade len frames long. Either input may be NULL for
+// silence. From len on, out is b unchanged.
+void kz_mix_fade(const int16_t *a, const int16_t *b, int16_t *out, size_t frames, int channels,
+                 uint32_t pos, uint32_t len);
+// The Q15 gains at frame pos of a fade len frames long
+void kz_mix_gains(uint32_t pos, uint32_t len, int32_t *gain_a, int32_t *gain_b);
+
+#ifdef ESP_PLATFORM
+#include "audio_element.h"
+
+typedef struct {
+    int out_rb_size;
+    int task_stack;
+    int task_prio;
+    int task_core;
+    bool stack_in_ext;
+} kz_mix_cfg_t;
+
+#define DEFAULT_KZ_MIX_CONFIG() {                   \
+    .out_rb_size = (8 * 1024),                      \
+    .task_stack = (3 * 1024),                       \
+    .task_prio = 5,                                 \
+    .task_core = 1,                                 \
+    .stack_in_ext = false,                          \
+}
+
+// ADF audio element with two inputs, sitting between the resampler and the
+// I2S writer. Normally it just passes its input, the current track, through.
+// For a crossfade the next track comes in on multi-input 0 in the same
+// format, which must be 16 bit and set with audio_element_setinfo().
+audio_element_handle_t kz_mix_init(kz_mix_cfg_t *cfg);
+// Fade from the input to multi-input 0 over fade_ms, starting as soon as
+// that has audio. False if the input has already run out, which finishes
+// the element as usual.
+bool kz_mix_start_fade(audio_element_handle_t self, uint32_t fade_ms);
+// The input ran out part way through a fade. Nothing reads it from then
+// until kz_mix_hand_over(), so it can be reset and restarted.
+bool kz_mix_input_ended(audio_element_handle_t self);
+// The input now carries multi-input 0's track again from its start. It's
+// dropped until it's level with multi-input 0, then played instead.
+void kz_mix_hand_over(audio_element_handle_t self);
+// Multi-input 0 is no longer read, and whatever feeds it can be stopped
+bool kz_mix_released(audio_element_handle_t self);
+#endif
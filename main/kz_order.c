@@ -0,0 +1,144 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "kz_order.h"
+
+static bool was_played(const kz_order_t *order, uint32_t index) {
+    return order->played != NULL && (order->played[index / 32] >> (index % 32) & 1) != 0;
+}
+
+static void mark_played(kz_order_t *order, uint32_t index) {
+    if (was_played(order, index) || order->unplayed == 0) {
+        return;
+    }
+    if (order->played != NULL) {
+        order->played[index / 32] |= 1u << (index % 32);
+    }
+    order->unplayed--;
+}
+
+static void new_round(kz_order_t *order) {
+    if (order->played != NULL) {
+        memset(order->played, 0, (order->len + 31) / 32 * sizeof(uint32_t));
+    }
+    order->unplayed = order->len;
+}
+
+static void set_current(kz_order_t *order, uint32_t index) {
+    order->current = index;
+    order->next = -1;
+    mark_played(order, index);
+}
+
+// A track not yet played this round, starting a new round once they all
+// have. The current one only comes round again if it's all there is.
+static uint32_t pick_unplayed(kz_order_t *order) {
+    if (order->unplayed == 0) {
+        new_round(order);
+        mark_played(order, order->current);
+    }
+    if (order->unplayed == 0) {
+        return order->current;
+    }
+    if (order->played == NULL) {
+        return order->random() % order->len;
+    }
+    uint32_t n = order->random() % order->unplayed;
+    for (uint32_t i = 0; i < order->len; ++i) {
+        if (!was_played(order, i) && n-- == 0) {
+            return i;
+        }
+    }
+    return order->current;
+}
+
+static void history_push(kz_order_t *order, uint32_t index) {
+    order->history_head = (order->history_head + 1) % KZ_ORDER_HISTORY_LEN;
+    order->history[order->history_head] = index;
+    if (order->history_count < KZ_ORDER_HISTORY_LEN) {
+        order->history_count++;
+    }
+}
+
+static bool history_pop(kz_order_t *order, uint32_t *index) {
+    if (order->history_count == 0) {
+        return false;
+    }
+    *index = order->history[order->history_head];
+    order->history_head = (order->history_head + KZ_ORDER_HISTORY_LEN - 1) % KZ_ORDER_HISTORY_LEN;
+    order->history_count--;
+    return true;
+}
+
+bool kz_order_reset(kz_order_t *order, uint32_t len, uint32_t current) {
+    free(order->played);
+    order->len = len;
+    order->played = len > 0 ? calloc((len + 31) / 32, sizeof(uint32_t)) : NULL;
+    order->history_count = 0;
+    new_round(order);
+    set_current(order, current < len ? current : 0);
+    return order->played != NULL || len == 0;
+}
+
+void kz_order_free(kz_order_t *order) {
+    free(order->played);
+    order->played = NULL;
+    order->len = 0;
+}
+
+uint32_t kz_order_first(kz_order_t *order, bool shuffle) {
+    new_round(order);
+    uint32_t index = shuffle && order->len > 0 ? order->random() % order->len : 0;
+    set_current(order, index);
+    return index;
+}
+
+bool kz_order_at_end(const kz_order_t *order, bool shuffle) {
+    return shuffle ? order->unplayed == 0 : order->current + 1 >= order->len;
+}
+
+bool kz_order_peek(kz_order_t *order, bool shuffle, bool wrap, uint32_t *index) {
+    if (order->len == 0 || (!wrap && kz_order_at_end(order, shuffle))) {
+        return false;
+    }
+    if (!shuffle) {
+        *index = (order->current + 1) % order->len;
+        return true;
+    }
+    if (order->next < 0) {
+        order->next = (int32_t)pick_unplayed(order);
+    }
+    *index = (uint32_t)order->next;
+    return true;
+}
+
+uint32_t kz_order_next(kz_order_t *order, bool shuffle, int32_t count) {
+    if (order->len == 0) {
+        return 0;
+    }
+    // A jump over several tracks only remembers where it started
+    history_push(order, order->current);
+    uint32_t index;
+    if (shuffle) {
+        // Any number of random picks is the same as one
+        index = order->next >= 0 ? (uint32_t)order->next : pick_unplayed(order);
+    } else {
+        index = (order->current + (uint32_t)count % order->len) % order->len;
+    }
+    set_current(order, index);
+    return index;
+}
+
+uint32_t kz_order_prev(kz_order_t *order, bool shuffle, int32_t count) {
+    uint32_t index = order->current;
+    for (; count > 0 && order->len > 0; --count) {
+        if (!history_pop(order, &index)) {
+            if (shuffle) {
+                break;
+            }
+            index = (index + order->len - 1) % order->len;
+        }
+    }
+    set_current(order, index);
+    return index;
+}
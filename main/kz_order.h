@@ -0,0 +1,39 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Which playlist index plays next, in order or shuffled, and what was played
+// before for going back. The player maps the indexes to tracks. A shuffle
+// plays every track once before any comes round again, so without repeat it
+// ends like the list in order does.
+#define KZ_ORDER_HISTORY_LEN 32
+
+typedef struct {
+    uint32_t len;
+    uint32_t current;
+    int32_t next;           // the shuffle pick for the next track, -1 until made
+    uint32_t *played;       // a bit per track this shuffle round, NULL if no memory
+    uint32_t unplayed;
+    // Indexes played before the current one, newest at the head
+    uint32_t history[KZ_ORDER_HISTORY_LEN];
+    size_t history_head;
+    size_t history_count;
+    uint32_t (*random)(void);
+} kz_order_t;
+
+// Start on a new list at current, forgetting everything played. False when
+// there's no memory to remember the shuffle by, which then may repeat tracks.
+bool kz_order_reset(kz_order_t *order, uint32_t len, uint32_t current);
+void kz_order_free(kz_order_t *order);
+// Where a fresh start of the list begins, the first track or a random one
+uint32_t kz_order_first(kz_order_t *order, bool shuffle);
+// True once the current track is the last, or every track of a shuffle has played
+bool kz_order_at_end(const kz_order_t *order, bool shuffle);
+// The track a single next would play, without moving to it. False at the
+// end when not wrapping.
+bool kz_order_peek(kz_order_t *order, bool shuffle, bool wrap, uint32_t *index);
+// Move on by count tracks, wrapping at the end, and return the new current
+uint32_t kz_order_next(kz_order_t *order, bool shuffle, int32_t count);
+// Back through what was played. With nothing remembered, step back through
+// the list in order, or stay on the current track when shuffling.
+uint32_t kz_order_prev(kz_order_t *order, bool shuffle, int32_t count);
@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "esp_console.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "audio_element.h"
+#include "audio_pipeline.h"
+#include "raw_stream.h"
+
+#include "kz_util.h"
+#include "kz_decoder.h"
+#include "kz_prefetch.h"
+
+#define KZ_PREFETCH_MS 500
+// 500 ms of 48 kHz stereo at 32 bits, or 96 kHz at 16. Anything denser
+// gets a shorter head.
+#define KZ_PREFETCH_BUF_SIZE (48000 * 2 * 4 * KZ_PREFETCH_MS / 1000)
+#define KZ_PREFETCH_MAX_URL 256
+#define KZ_PREFETCH_READ (4 * 1024)
+#define KZ_PREFETCH_TIMEOUT_MS 2000
+// Registered under their own names so their tasks can't be confused with
+// the player's
+#define KZ_PREFETCH_FS_TAG "pf_fs"
+#define KZ_PREFETCH_DEC_TAG "pf_dec"
+
+static const char *TAG = "KZ_PREFETCH";
+
+typedef struct {
+    kz_prefetch_head_t head;
+    char url[KZ_PREFETCH_MAX_URL];
+} prefetch_buf_t;
+
+// Two buffers, so the next head can be decoded while the one handed over
+// last is still playing
+static uint8_t *s_pcm[2];
+static prefetch_buf_t s_bufs[2];
+static TaskHandle_t s_task = NULL;
+// Everything below is guarded by s_lock
+static SemaphoreHandle_t s_lock = NULL;
+static bool s_enabled = true;
+static char s_want[KZ_PREFETCH_MAX_URL];
+static char s_asked[KZ_PREFETCH_MAX_URL];  // the last url asked for, until its head is taken
+static uint32_t s_gen = 0;          // bumped to abandon a decode under way
+static int s_handed = 0;            // the buffer the player may be playing
+static int s_ready = -1;
+static kz_prefetch_stats_t s_stats;
+
+static bool abandoned(uint32_t gen) {
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    bool ret = gen != s_gen;
+    xSemaphoreGive(s_lock);
+    return ret;
+}
+
+// Decode the start of url into buf with a pipeline of its own, giving up
+// early if another track is asked for
+static esp_err_t decode_head(const char *url, uint32_t gen, uint8_t *buf, kz_prefetch_head_t *head) {
+    kz_decoder_t dec = kz_decoder_for_ext(kz_get_ext(url));
+    if (dec == KZ_DECODER_NONE) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    raw_stream_cfg_t raw_cfg = RAW_STREAM_CFG_DEFAULT();
+    raw_cfg.type = AUDIO_STREAM_READER;
+    audio_element_handle_t sink = raw_stream_init(&raw_cfg);
+
+    // Off to the side of the audio, so internal RAM is better spent elsewhere
+    audio_element_handle_t decoder;
+    audio_pipeline_handle_t pipeline = kz_decoder_pipeline_create(url, KZ_DECODER_STACK_PSRAM,
+                                                                  CONFIG_KZ_SCHED_PREFETCH_PRIO, &sink, 1,
+                                                                  (const char *[]) {KZ_PREFETCH_FS_TAG,
+                                                                                    KZ_PREFETCH_DEC_TAG, "pf_raw"},
+                                                                  &decoder);
+    if (pipeline == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    audio_element_set_input_timeout(sink, pdMS_TO_TICKS(KZ_PREFETCH_TIMEOUT_MS));
+
+    audio_pipeline_run(pipeline);
+    // Decoders are always created at the player's decoder priority
+    TaskHandle_t task = xTaskGetHandle(KZ_PREFETCH_DEC_TAG);
+    if (task != NULL) {
+        vTaskPrioritySet(task, CONFIG_KZ_SCHED_PREFETCH_PRIO);
+    }
+
+    esp_err_t ret = ESP_OK;
+    size_t len = 0;
+    size_t want = KZ_PREFETCH_READ;
+    size_t frame_bytes = 0;
+    audio_element_info_t info = {0};
+    while (len < want) {
+        if (abandoned(gen)) {
+            ret = ESP_ERR_INVALID_STATE;
+            break;
+        }
+        size_t n = want - len < KZ_PREFETCH_READ ? want - len : KZ_PREFETCH_READ;
+        int r = raw_stream_read(sink, (char *)buf + len, n);
+        if (r <= 0) {
+            // A track shorter than the head is decoded whole
+            break;
+        }
+        len += r;
+        if (frame_bytes == 0) {
+            audio_element_getinfo(decoder, &info);
+            frame_bytes = info.channels * info.bits / 8;
+            if (frame_bytes == 0) {
+                ret = ESP_FAIL;
+                break;
+            }
+            size_t frames = (size_t)info.sample_rates * KZ_PREFETCH_MS / 1000;
+            if (frames * frame_bytes > KZ_PREFETCH_BUF_SIZE) {
+                frames = KZ_PREFETCH_BUF_SIZE / frame_bytes;
+            }
+            want = frames * frame_bytes;
+            len = len < want ? len : want;
+        }
+    }
+
+    kz_decoder_pipeline_destroy(pipeline);
+
+    if (ret == ESP_OK && frame_bytes != 0) {
+        len -= len % frame_bytes;
+    }
+    if (ret == ESP_OK && len == 0) {
+        ret = ESP_FAIL;
+    }
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    head->pcm = buf;
+    head->len = len;
+    head->rate = info.sample_rates;
+    head->bits = info.bits;
+    head->channels = info.channels;
+    head->ms = (uint32_t)((uint64_t)len * 1000 / (frame_bytes * info.sample_rates));
+    return ESP_OK;
+}
+
+static void kz_prefetch_task(void *arg) {
+    static char url[KZ_PREFETCH_MAX_URL];
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        xSemaphoreTake(s_lock, portMAX_DELAY);
+        bool run = s_enabled && s_want[0] != '\0';
+        uint32_t gen = s_gen;
+        int b = !s_handed;
+        if (run) {
+            strlcpy(url, s_want, sizeof(url));
+            s_want[0] = '\0';
+            // About to be written over
+            s_ready = -1;
+        }
+        xSemaphoreGive(s_lock);
+        if (!run) {
+            continue;
+        }
+
+        kz_prefetch_head_t head;
+        int64_t start = esp_timer_get_time();
+        esp_err_t ret = decode_head(url, gen, s_pcm[b], &head);
+        uint32_t took_ms = (uint32_t)((esp_timer_get_time() - start) / 1000);
+
+        xSemaphoreTake(s_lock, portMAX_DELAY);
+        if (ret == ESP_OK && gen == s_gen) {
+            s_bufs[b].head = head;
+            strlcpy(s_bufs[b].url, url, sizeof(s_bufs[b].url));
+            s_ready = b;
+            s_stats.decoded++;
+            s_stats.last_ms = head.ms;
+            s_stats.last_decode_ms = took_ms;
+        }
+        xSemaphoreGive(s_lock);
+        if (ret == ESP_OK) {
+            ESP_LOGI(TAG, "Decoded the first %u ms of the next track in %u ms", (unsigned)head.ms,
+                     (unsigned)took_ms);
+        } else if (ret != ESP_ERR_INVALID_STATE) {
+            ESP_LOGW(TAG, "Unable to decode the start of %s: %s", url, esp_err_to_name(ret));
+        }
+    }
+}
+
+void kz_prefetch_start(const char *url) {
+    if (s_task == NULL) {
+        return;
+    }
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    // Seeking or pausing don't change what plays next
+    if (strcmp(s_asked, url) == 0) {
+        xSemaphoreGive(s_lock);
+        return;
+    }
+    s_gen++;
+    s_ready = -1;
+    if (strlcpy(s_want, url, sizeof(s_want)) >= sizeof(s_want)) {
+        s_want[0] = '\0';
+    }
+    strlcpy(s_asked, s_want, sizeof(s_asked));
+    xSemaphoreGive(s_lock);
+    xTaskNotifyGive(s_task);
+}
+
+bool kz_prefetch_take(const char *url, kz_prefetch_head_t *head) {
+    if (s_task == NULL) {
+        return false;
+    }
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    bool hit = s_enabled && s_ready >= 0 && strcmp(s_bufs[s_ready].url, url) == 0;
+    if (hit) {
+        *head = s_bufs[s_ready].head;
+        s_handed = s_ready;
+        s_ready = -1;
+        s_asked[0] = '\0';
+        s_stats.hits++;
+    } else if (s_enabled) {
+        s_stats.misses++;
+    }
+    if (!hit && strcmp(s_asked, url) == 0) {
+        // Too late, the player's own decoder is about to start on it
+        s_gen++;
+        s_asked[0] = '\0';
+        s_want[0] = '\0';
+    }
+    xSemaphoreGive(s_lock);
+    return hit;
+}
+
+void kz_prefetch_set_enabled(bool enabled) {
+    if (s_task == NULL) {
+        return;
+    }
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    s_enabled = enabled;
+    xSemaphoreGive(s_lock);
+    xTaskNotifyGive(s_task);
+}
+
+bool kz_prefetch_get_enabled(void) {
+    return s_enabled;
+}
+
+void kz_prefetch_get_stats(kz_prefetch_stats_t *stats) {
+    if (s_lock == NULL) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    *stats = s_stats;
+    xSemaphoreGive(s_lock);
+}
+
+esp_err_t kz_prefetch_init(void) {
+    for (int i = 0; i < 2; ++i) {
+        s_pcm[i] = heap_caps_malloc(KZ_PREFETCH_BUF_SIZE, MALLOC_CAP_SPIRAM);
+        if (s_pcm[i] == NULL) {
+            ESP_LOGW(TAG, "No PSRAM for the next track's head, skips will wait for the decoder");
+            goto cleanup;
+        }
+    }
+    s_lock = xSemaphoreCreateMutex();
+    if (s_lock == NULL) {
+        goto cleanup;
+    }
+    if (pdPASS != xTaskCreatePinnedToCore(kz_prefetch_task, "PREFETCH", (3 * 1024), NULL,
+                                          CONFIG_KZ_SCHED_PREFETCH_PRIO, &s_task, CONFIG_KZ_SCHED_IO_CORE)) {
+        goto cleanup;
+    }
+    return ESP_OK;
+
+cleanup:
+    if (s_lock != NULL) {
+        vSemaphoreDelete(s_lock);
+        s_lock = NULL;
+    }
+    for (int i = 0; i < 2; ++i) {
+        heap_caps_free(s_pcm[i]);
+        s_pcm[i] = NULL;
+    }
+    return ESP_ERR_NO_MEM;
+}
+
+static int prefetch_cmd(int argc, char **argv) {
+    if (argc > 1) {
+        bool on = strcmp(argv[1], "on") == 0;
+        if (!on && strcmp(argv[1], "off") != 0) {
+            printf("Usage: prefetch [on|off]\n");
+            return 1;
+        }
+        kz_prefetch_set_enabled(on);
+    }
+    kz_prefetch_stats_t st;
+    kz_prefetch_get_stats(&st);
+    printf("prefetch %s, %u heads decoded, last %u ms in %u ms\n", s_enabled ? "on" : "off",
+           (unsigned)st.decoded, (unsigned)st.last_ms, (unsigned)st.last_decode_ms);
+    printf("track changes from a head %u, without %u\n", (unsigned)st.hits, (unsigned)st.misses);
+    return 0;
+}
+
+esp_err_t kz_prefetch_console_init(void) {
+    const esp_console_cmd_t cmd = {
+        .command = "prefetch",
+        .help = "Show how often track changes started from the next track's pre-decoded head, or turn "
+                "decoding it on or off",
+        .hint = "[on|off]",
+        .func = prefetch_cmd,
+    };
+    return esp_console_cmd_register(&cmd);
+}
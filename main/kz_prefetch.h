@@ -0,0 +1,39 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+// The first part of a track, decoded ahead of time so a skip to it can
+// start playing straight away
+typedef struct {
+    const uint8_t *pcm;         // the decoder's own output format
+    size_t len;                 // whole frames
+    int rate;
+    int bits;
+    int channels;
+    uint32_t ms;
+} kz_prefetch_head_t;
+
+typedef struct {
+    uint32_t decoded;           // heads decoded in full
+    uint32_t hits;              // track changes that started from a head
+    uint32_t misses;            // ... and that had to wait for the decoder
+    uint32_t last_ms;           // length of the last head
+    uint32_t last_decode_ms;    // how long that took to decode
+} kz_prefetch_stats_t;
+
+// Start the background decoder. Only the player task starts and takes
+// heads, and whatever it is handed stays valid until it next takes one.
+esp_err_t kz_prefetch_init(void);
+// Decode the start of url, dropping whatever was being decoded before
+void kz_prefetch_start(const char *url);
+// Hand over the head of url if it has been decoded
+bool kz_prefetch_take(const char *url, kz_prefetch_head_t *head);
+// While off nothing is decoded or handed over. The last url asked for is
+// remembered, and decoded as soon as it's switched back on.
+void kz_prefetch_set_enabled(bool enabled);
+bool kz_prefetch_get_enabled(void);
+void kz_prefetch_get_stats(kz_prefetch_stats_t *stats);
+// Add the "prefetch" console command
+esp_err_t kz_prefetch_console_init(void);
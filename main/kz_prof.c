@@ -0,0 +1,339 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "esp_console.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "mbedtls/base64.h"
+
+#include "kz_prof.h"
+
+#define KZ_PROF_PERIOD_MS 1000
+// Tables are sized from the task count plus this much, for tasks started
+// between counting them and taking the sample
+#define KZ_PROF_TASK_HEADROOM 8
+// The snapshot carries its task count in a byte
+#define KZ_PROF_MAX_TASKS 255
+
+// Snapshot framing for the "prof stream" output
+#define KZ_PROF_MAGIC 0x4b5a
+#define KZ_PROF_VERSION 1
+#define KZ_PROF_HDR_LEN 18
+#define KZ_PROF_TASK_LEN 5
+#define KZ_PROF_SNAP_LEN(n) (KZ_PROF_HDR_LEN + (n) * KZ_PROF_TASK_LEN)
+#define KZ_PROF_B64_LEN(n) (((KZ_PROF_SNAP_LEN(n) + 2) / 3) * 4 + 1)
+
+static const char *TAG = "KZ_PROF";
+
+typedef struct {
+    UBaseType_t number;
+    TaskHandle_t handle;
+    uint32_t counter;       // run time counter at the last sample
+    uint16_t load;
+    int8_t core;            // -1 when not pinned
+    char name[configMAX_TASK_NAME_LEN];
+} prof_task_t;
+
+// Decoder load is tracked per format by the name of its element task, and
+// only over periods where it actually ran
+typedef struct {
+    const char *name;
+    uint64_t busy_us;
+    uint64_t active_us;
+    uint16_t peak;
+} prof_format_t;
+
+static prof_format_t s_formats[] = {
+    {"mp3"}, {"flac"}, {"opus"}, {"ogg"}, {"wav"}, {"aac"},
+};
+#define KZ_PROF_FORMAT_COUNT (sizeof(s_formats) / sizeof(*s_formats))
+
+static SemaphoreHandle_t s_lock = NULL;
+static TaskStatus_t *s_status = NULL;
+// Both tables are kept sorted by task number, so each sample is matched to
+// the last one in a single merge pass. s_table[s_cur] is the latest.
+static prof_task_t *s_table[2] = {NULL, NULL};
+static size_t s_cap = 0;
+static size_t s_cur = 0;
+static size_t s_count = 0;
+static uint32_t s_last_total = 0;
+static kz_prof_summary_t s_summary;
+static bool s_valid = false;
+
+static volatile bool s_streaming = false;
+static uint32_t s_seq = 0;
+static uint8_t *s_snap = NULL;
+static unsigned char *s_snap_b64 = NULL;
+
+static bool grow_one(void **p, size_t size) {
+    void *n = realloc(*p, size);
+    if (n == NULL) {
+        return false;
+    }
+    *p = n;
+    return true;
+}
+
+// Make room for cap tasks. Only the profiler task calls this, and the
+// tables the console reads are only moved with s_lock held.
+static bool grow(size_t cap) {
+    cap = cap > KZ_PROF_MAX_TASKS ? KZ_PROF_MAX_TASKS : cap;
+    if (cap <= s_cap) {
+        return true;
+    }
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    bool ok = grow_one((void **)&s_table[0], cap * sizeof(prof_task_t)) &&
+              grow_one((void **)&s_table[1], cap * sizeof(prof_task_t));
+    xSemaphoreGive(s_lock);
+    ok = ok && grow_one((void **)&s_status, cap * sizeof(TaskStatus_t)) &&
+         grow_one((void **)&s_snap, KZ_PROF_SNAP_LEN(cap)) &&
+         grow_one((void **)&s_snap_b64, KZ_PROF_B64_LEN(cap));
+    // Whatever did grow is kept, but only used once all of it has
+    if (ok) {
+        s_cap = cap;
+    }
+    return ok;
+}
+
+static void sort_status(size_t n) {
+    for (size_t i = 1; i < n; ++i) {
+        TaskStatus_t t = s_status[i];
+        size_t j = i;
+        while (j > 0 && s_status[j - 1].xTaskNumber > t.xTaskNumber) {
+            s_status[j] = s_status[j - 1];
+            j--;
+        }
+        s_status[j] = t;
+    }
+}
+
+static uint16_t load_of(uint32_t delta, uint32_t elapsed) {
+    if (elapsed == 0) {
+        return 0;
+    }
+    uint64_t load = (uint64_t)delta * 10000 / elapsed;
+    return load > 10000 ? 10000 : (uint16_t)load;
+}
+
+static void print_name(const prof_task_t *t) {
+    printf("KZN %u %d %s\n", (unsigned)t->number, t->core, t->name);
+}
+
+static uint8_t *put16(uint8_t *p, uint16_t v) {
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+    return p + 2;
+}
+
+static uint8_t *put32(uint8_t *p, uint32_t v) {
+    p = put16(p, v & 0xffff);
+    return put16(p, v >> 16);
+}
+
+// One line per sample, base64 so it survives sharing the console with logs
+static void print_snapshot(const prof_task_t *tasks, size_t count) {
+    uint8_t *p = put16(s_snap, KZ_PROF_MAGIC);
+    *p++ = KZ_PROF_VERSION;
+    *p++ = (uint8_t)count;
+    p = put32(p, s_seq++);
+    p = put32(p, (uint32_t)(esp_timer_get_time() / 1000));
+    p = put16(p, s_summary.core_load[0]);
+    p = put16(p, s_summary.core_load[1]);
+    p = put16(p, s_summary.overhead);
+    for (size_t i = 0; i < count; ++i) {
+        p = put16(p, (uint16_t)tasks[i].number);
+        *p++ = (uint8_t)tasks[i].core;
+        p = put16(p, tasks[i].load);
+    }
+    size_t len = 0;
+    if (0 == mbedtls_base64_encode(s_snap_b64, KZ_PROF_B64_LEN(s_cap), &len, s_snap, p - s_snap)) {
+        printf("KZP %s\n", s_snap_b64);
+    }
+}
+
+static void sample(void) {
+    int64_t start = esp_timer_get_time();
+    configRUN_TIME_COUNTER_TYPE total = 0;
+    if (!grow(uxTaskGetNumberOfTasks() + KZ_PROF_TASK_HEADROOM)) {
+        ESP_LOGW(TAG, "No room to sample %u tasks", (unsigned)uxTaskGetNumberOfTasks());
+        return;
+    }
+    size_t n = uxTaskGetSystemState(s_status, s_cap, &total);
+    if (n == 0) {
+        // More tasks started since they were counted than the headroom
+        // allows for. The next sample makes room for them.
+        return;
+    }
+    sort_status(n);
+
+    uint32_t elapsed = (uint32_t)(total - s_last_total);
+    s_last_total = total;
+    const prof_task_t *prev = s_table[s_cur];
+    prof_task_t *next = s_table[!s_cur];
+    size_t p = 0;
+    for (size_t i = 0; i < n; ++i) {
+        const TaskStatus_t *st = &s_status[i];
+        while (p < s_count && prev[p].number < st->xTaskNumber) {
+            p++;
+        }
+        bool seen = p < s_count && prev[p].number == st->xTaskNumber;
+        uint32_t delta = (uint32_t)(st->ulRunTimeCounter - (seen ? prev[p].counter : 0));
+
+        next[i].number = st->xTaskNumber;
+        next[i].handle = st->xHandle;
+        next[i].counter = st->ulRunTimeCounter;
+        next[i].load = load_of(delta, elapsed);
+        if (seen) {
+            next[i].core = prev[p].core;
+            memcpy(next[i].name, prev[p].name, sizeof(next[i].name));
+        } else {
+            BaseType_t core = xTaskGetCoreID(st->xHandle);
+            next[i].core = core == tskNO_AFFINITY ? -1 : (int8_t)core;
+            strlcpy(next[i].name, st->pcTaskName, sizeof(next[i].name));
+            if (s_streaming) {
+                print_name(&next[i]);
+            }
+        }
+    }
+
+    kz_prof_summary_t summary = {0};
+    for (int c = 0; c < 2; ++c) {
+        TaskHandle_t idle = xTaskGetIdleTaskHandleForCore(c);
+        for (size_t i = 0; i < n; ++i) {
+            if (next[i].handle == idle) {
+                summary.core_load[c] = 10000 - next[i].load;
+                break;
+            }
+        }
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    for (size_t f = 0; f < KZ_PROF_FORMAT_COUNT; ++f) {
+        for (size_t i = 0; i < n; ++i) {
+            if (next[i].load != 0 && strcmp(next[i].name, s_formats[f].name) == 0) {
+                s_formats[f].busy_us += (uint64_t)next[i].load * elapsed / 10000;
+                s_formats[f].active_us += elapsed;
+                if (next[i].load > s_formats[f].peak) {
+                    s_formats[f].peak = next[i].load;
+                }
+                break;
+            }
+        }
+    }
+    s_cur = !s_cur;
+    s_count = n;
+    summary.overhead = load_of((uint32_t)(esp_timer_get_time() - start), elapsed);
+    s_summary = summary;
+    s_valid = elapsed != 0;
+    xSemaphoreGive(s_lock);
+
+    if (s_streaming) {
+        print_snapshot(next, n);
+    }
+}
+
+static void kz_prof_task(void *arg) {
+    TickType_t last_wake = xTaskGetTickCount();
+    while (1) {
+        vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(KZ_PROF_PERIOD_MS));
+        sample();
+    }
+}
+
+bool kz_prof_get_summary(kz_prof_summary_t *summary) {
+    if (s_lock == NULL) {
+        return false;
+    }
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    *summary = s_summary;
+    bool ok = s_valid;
+    xSemaphoreGive(s_lock);
+    return ok;
+}
+
+bool kz_prof_get_task_load(const char *name, uint16_t *load) {
+    if (s_lock == NULL) {
+        return false;
+    }
+    bool found = false;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    for (size_t i = 0; i < s_count && !found; ++i) {
+        if (strcmp(s_table[s_cur][i].name, name) == 0) {
+            *load = s_table[s_cur][i].load;
+            found = true;
+        }
+    }
+    xSemaphoreGive(s_lock);
+    return found;
+}
+
+static void print_table(void) {
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    const prof_task_t *tasks = s_table[s_cur];
+    printf("core0 %u.%02u%%  core1 %u.%02u%%  profiler %u.%02u%%\n",
+           s_summary.core_load[0] / 100, s_summary.core_load[0] % 100,
+           s_summary.core_load[1] / 100, s_summary.core_load[1] % 100,
+           s_summary.overhead / 100, s_summary.overhead % 100);
+    printf(" num name             core    load\n");
+    for (size_t i = 0; i < s_count; ++i) {
+        printf("%4u %-16s %4d %4u.%02u%%\n", (unsigned)tasks[i].number, tasks[i].name, tasks[i].core,
+               tasks[i].load / 100, tasks[i].load % 100);
+    }
+    printf("decoder  avg     peak    decoding\n");
+    for (size_t f = 0; f < KZ_PROF_FORMAT_COUNT; ++f) {
+        const prof_format_t *fmt = &s_formats[f];
+        if (fmt->active_us == 0) {
+            continue;
+        }
+        unsigned avg = (unsigned)(fmt->busy_us * 10000 / fmt->active_us);
+        printf("%-8s %2u.%02u%%  %2u.%02u%%  %u s\n", fmt->name, avg / 100, avg % 100,
+               fmt->peak / 100, fmt->peak % 100, (unsigned)(fmt->active_us / 1000000));
+    }
+    xSemaphoreGive(s_lock);
+}
+
+static int prof_cmd(int argc, char **argv) {
+    if (argc > 2 && strcmp(argv[1], "stream") == 0) {
+        bool on = strcmp(argv[2], "on") == 0;
+        if (on && !s_streaming) {
+            // Names are only sent when a task is first seen, so start with
+            // all of the current ones
+            xSemaphoreTake(s_lock, portMAX_DELAY);
+            for (size_t i = 0; i < s_count; ++i) {
+                print_name(&s_table[s_cur][i]);
+            }
+            xSemaphoreGive(s_lock);
+        }
+        s_streaming = on;
+    } else {
+        print_table();
+    }
+    return 0;
+}
+
+esp_err_t kz_prof_init(void) {
+    s_lock = xSemaphoreCreateMutex();
+    if (s_lock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    const esp_console_cmd_t cmd = {
+        .command = "prof",
+        .help = "Show per-task and per-core CPU load. 'prof stream on' prints a snapshot every second",
+        .hint = "[stream on|off]",
+        .func = prof_cmd,
+    };
+    esp_console_cmd_register(&cmd);
+
+    // Just above the background scanners so sampling stays on time
+    if (pdPASS != xTaskCreatePinnedToCore(kz_prof_task, "PROF", (3 * 1024), NULL,
+                                          tskIDLE_PRIORITY + 2, NULL, PRO_CPU_NUM)) {
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
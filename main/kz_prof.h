@@ -0,0 +1,17 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+// Loads are in hundredths of a percent of one core
+typedef struct {
+    uint16_t core_load[2];
+    uint16_t overhead;          // the profiler's own sampling cost
+} kz_prof_summary_t;
+
+// Start sampling per-task run time once a second and add the "prof"
+// console command. Needs CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS.
+esp_err_t kz_prof_init(void);
+bool kz_prof_get_summary(kz_prof_summary_t *summary);
+// Load over the last second of the first task with this name
+bool kz_prof_get_task_load(const char *name, uint16_t *load);
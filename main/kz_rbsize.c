@@ -0,0 +1,75 @@
+#include "kz_rbsize.h"
+
+// Size for twice the deepest drain seen
+#define KZ_RBSIZE_HEADROOM 2
+// Tracks shorter than this say too little to act on
+#define KZ_RBSIZE_MIN_OBSERVE_MS (10 * 1000)
+// Never shrink on the strength of fewer tracks than this
+#define KZ_RBSIZE_MIN_TRACKS 3
+
+void kz_rbsize_track_reset(kz_rbsize_track_t *track) {
+    track->min_fill = -1;
+    track->empty = 0;
+}
+
+void kz_rbsize_sample(kz_rbsize_track_t *track, int fill) {
+    if (track->min_fill < 0 || fill < track->min_fill) {
+        track->min_fill = fill;
+    }
+    if (fill == 0) {
+        track->empty++;
+    }
+}
+
+bool kz_rbsize_fold(kz_rbsize_state_t *st, const kz_rbsize_track_t *track, int size, int64_t observed_ms) {
+    if (observed_ms < KZ_RBSIZE_MIN_OBSERVE_MS || track->min_fill < 0) {
+        return false;
+    }
+
+    uint32_t drawdown = (uint32_t)(size - track->min_fill);
+    st->tracks++;
+    if (track->empty > 0) {
+        // Ran dry - this size is too small, however deep the drain looked
+        st->underruns++;
+        st->drawdown = size;
+        st->size = st->size * 2;
+    } else {
+        uint32_t decayed = st->drawdown - st->drawdown / 8;
+        st->drawdown = drawdown > decayed ? drawdown : decayed;
+        uint32_t want = (st->drawdown * KZ_RBSIZE_HEADROOM + KZ_RBSIZE_STEP - 1) / KZ_RBSIZE_STEP * KZ_RBSIZE_STEP;
+        if (want > st->size || st->tracks >= KZ_RBSIZE_MIN_TRACKS) {
+            st->size = want;
+        }
+    }
+    st->size = st->size < KZ_RBSIZE_MIN ? KZ_RBSIZE_MIN : st->size;
+    st->size = st->size > KZ_RBSIZE_MAX ? KZ_RBSIZE_MAX : st->size;
+    return true;
+}
+
+uint32_t kz_rbsize_total(const kz_rbsize_state_t *states, size_t count) {
+    uint32_t sum = 0, largest = 0;
+    for (size_t i = 0; i < count; ++i) {
+        sum += states[i].size;
+        largest = states[i].size > largest ? states[i].size : largest;
+    }
+    return sum + largest;
+}
+
+void kz_rbsize_fit(kz_rbsize_state_t *states, size_t count, size_t i, uint32_t budget) {
+    while (kz_rbsize_total(states, count) > budget && states[i].size > KZ_RBSIZE_MIN) {
+        states[i].size -= KZ_RBSIZE_STEP;
+    }
+}
+
+void kz_rbsize_share_cut(kz_rbsize_state_t *states, size_t count, uint32_t budget) {
+    while (count > 0 && kz_rbsize_total(states, count) > budget) {
+        size_t largest = 0;
+        for (size_t i = 1; i < count; ++i) {
+            largest = states[i].size > states[largest].size ? i : largest;
+        }
+        if (states[largest].size <= KZ_RBSIZE_MIN) {
+            break;
+        }
+        states[largest].size -= KZ_RBSIZE_STEP;
+    }
+}
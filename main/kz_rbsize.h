@@ -0,0 +1,46 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// How big a decoder's output buffer should be, learnt from how far it drains
+// while tracks play. kz_rbtune samples the buffer on the device and keeps the
+// state in NVS; the rules live here so host_test/test_rbsize.c can replay
+// decode timing traces through them.
+#define KZ_RBSIZE_MIN (4 * 1024)
+#define KZ_RBSIZE_MAX (64 * 1024)
+#define KZ_RBSIZE_STEP (4 * 1024)
+#define KZ_RBSIZE_SAMPLE_MS 20
+// Ignore the initial fill after a track starts
+#define KZ_RBSIZE_WARMUP_MS 2000
+
+// Stored in NVS as is, so the layout can't change
+typedef struct {
+    uint32_t size;
+    uint32_t drawdown;      // deepest drain worth sizing for, decays slowly
+    uint16_t tracks;
+    uint16_t underruns;
+} kz_rbsize_state_t;
+
+// What the samples of one track showed
+typedef struct {
+    int min_fill;           // -1 until the first sample
+    uint32_t empty;         // samples which found the buffer empty
+} kz_rbsize_track_t;
+
+void kz_rbsize_track_reset(kz_rbsize_track_t *track);
+// One sample of the buffer's fill. Only take them past the warm up and while
+// the decoder is still running - once it's done the buffer drains to nothing,
+// which says nothing about its size.
+void kz_rbsize_sample(kz_rbsize_track_t *track, int fill);
+// Fold in a track which was sampled for observed_ms with a buffer of size
+// bytes. False, leaving st alone, when it says too little to act on.
+bool kz_rbsize_fold(kz_rbsize_state_t *st, const kz_rbsize_track_t *track, int size, int64_t observed_ms);
+
+// Bytes of buffer live at once: a decoder is kept for every format, and a
+// prefetch or crossfade adds one more of any of them
+uint32_t kz_rbsize_total(const kz_rbsize_state_t *states, size_t count);
+// Take states[i] down until they all fit budget again
+void kz_rbsize_fit(kz_rbsize_state_t *states, size_t count, size_t i, uint32_t budget);
+// Share a cut out starting with the biggest buffers, for when the budget was
+// lowered since the sizes were learnt
+void kz_rbsize_share_cut(kz_rbsize_state_t *states, size_t count, uint32_t budget);
@@ -0,0 +1,158 @@
+#include <stdbool.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "nvs.h"
+
+#include "kz_rbsize.h"
+#include "kz_rbtune.h"
+
+#define KZ_RBTUNE_NVS_NAMESPACE "kz_rbtune"
+// ADF takes its ring buffers from PSRAM whenever the heap has it
+#if CONFIG_SPIRAM_BOOT_INIT
+#define KZ_RBTUNE_BUDGET (CONFIG_KZ_RBTUNE_PSRAM_BUDGET_KB * 1024)
+#define KZ_RBTUNE_MEM_NAME "PSRAM"
+#else
+#define KZ_RBTUNE_BUDGET (CONFIG_KZ_RBTUNE_INTERNAL_BUDGET_KB * 1024)
+#define KZ_RBTUNE_MEM_NAME "internal"
+#endif
+
+static const char *TAG = "KZ_RBTUNE";
+
+static const char *s_names[] = {"mp3", "flac", "opus", "ogg", "wav", "aac"};
+#define KZ_RBTUNE_FMT_COUNT (sizeof(s_names) / sizeof(*s_names))
+static kz_rbsize_state_t s_states[KZ_RBTUNE_FMT_COUNT];
+
+// The sampling timer and the player share the current track's numbers
+static portMUX_TYPE s_mux = portMUX_INITIALIZER_UNLOCKED;
+static esp_timer_handle_t s_timer = NULL;
+static int s_fmt = -1;
+static audio_element_handle_t s_decoder = NULL;
+static uint32_t s_byte_rate = 0;
+static int64_t s_start_us = 0;
+static kz_rbsize_track_t s_track;
+
+static int find_fmt(const char *fmt) {
+    if (fmt == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < KZ_RBTUNE_FMT_COUNT; ++i) {
+        if (strcmp(s_names[i], fmt) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void sample_cb(void *arg) {
+    portENTER_CRITICAL(&s_mux);
+    if (s_decoder != NULL && audio_element_get_state(s_decoder) == AEL_STATE_RUNNING &&
+        esp_timer_get_time() - s_start_us > KZ_RBSIZE_WARMUP_MS * 1000LL) {
+        kz_rbsize_sample(&s_track, rb_bytes_filled(audio_element_get_output_ringbuf(s_decoder)));
+    }
+    portEXIT_CRITICAL(&s_mux);
+}
+
+static void save_fmt(int f) {
+    nvs_handle_t nvs;
+    if (ESP_OK != nvs_open(KZ_RBTUNE_NVS_NAMESPACE, NVS_READWRITE, &nvs)) {
+        return;
+    }
+    if (ESP_OK == nvs_set_blob(nvs, s_names[f], &s_states[f], sizeof(s_states[f]))) {
+        nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+}
+
+void kz_rbtune_load(void) {
+    nvs_handle_t nvs;
+    bool have_nvs = (ESP_OK == nvs_open(KZ_RBTUNE_NVS_NAMESPACE, NVS_READONLY, &nvs));
+    for (size_t i = 0; i < KZ_RBTUNE_FMT_COUNT; ++i) {
+        kz_rbsize_state_t *st = &s_states[i];
+        size_t len = sizeof(*st);
+        if (!have_nvs || ESP_OK != nvs_get_blob(nvs, s_names[i], st, &len) || len != sizeof(*st) ||
+            st->size < KZ_RBSIZE_MIN || st->size > KZ_RBSIZE_MAX) {
+            memset(st, 0, sizeof(*st));
+            st->size = KZ_RBTUNE_DEFAULT_SIZE;
+        }
+        ESP_LOGI(TAG, "%s: %u byte buffer after %u tracks", s_names[i], (unsigned)st->size,
+                 (unsigned)st->tracks);
+    }
+    if (have_nvs) {
+        nvs_close(nvs);
+    }
+    kz_rbsize_share_cut(s_states, KZ_RBTUNE_FMT_COUNT, KZ_RBTUNE_BUDGET);
+    ESP_LOGI(TAG, "%u of %u bytes of %s budget in use", (unsigned)kz_rbsize_total(s_states, KZ_RBTUNE_FMT_COUNT),
+             (unsigned)KZ_RBTUNE_BUDGET,
+             KZ_RBTUNE_MEM_NAME);
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = sample_cb,
+        .name = "rbtune",
+    };
+    if (ESP_OK != esp_timer_create(&timer_args, &s_timer)) {
+        s_timer = NULL;
+    }
+}
+
+int kz_rbtune_get_size(const char *fmt) {
+    int f = find_fmt(fmt);
+    return f >= 0 ? (int)s_states[f].size : KZ_RBTUNE_DEFAULT_SIZE;
+}
+
+void kz_rbtune_track_start(const char *fmt, audio_element_handle_t decoder, uint32_t byte_rate) {
+    kz_rbtune_track_stop();
+    int f = find_fmt(fmt);
+    if (f < 0 || decoder == NULL || s_timer == NULL) {
+        return;
+    }
+    portENTER_CRITICAL(&s_mux);
+    s_fmt = f;
+    s_decoder = decoder;
+    s_byte_rate = byte_rate;
+    s_start_us = esp_timer_get_time();
+    kz_rbsize_track_reset(&s_track);
+    portEXIT_CRITICAL(&s_mux);
+    esp_timer_start_periodic(s_timer, KZ_RBSIZE_SAMPLE_MS * 1000);
+}
+
+void kz_rbtune_track_stop(void) {
+    if (s_timer == NULL || s_decoder == NULL) {
+        return;
+    }
+    esp_timer_stop(s_timer);
+
+    portENTER_CRITICAL(&s_mux);
+    int f = s_fmt;
+    int size = rb_get_size(audio_element_get_output_ringbuf(s_decoder));
+    kz_rbsize_track_t track = s_track;
+    uint32_t byte_rate = s_byte_rate;
+    int64_t observed_ms = (esp_timer_get_time() - s_start_us) / 1000 - KZ_RBSIZE_WARMUP_MS;
+    s_decoder = NULL;
+    s_fmt = -1;
+    portEXIT_CRITICAL(&s_mux);
+
+    kz_rbsize_state_t *st = &s_states[f];
+    uint32_t old_size = st->size;
+    if (!kz_rbsize_fold(st, &track, size, observed_ms)) {
+        return;
+    }
+    uint32_t wanted = st->size;
+    kz_rbsize_fit(s_states, KZ_RBTUNE_FMT_COUNT, f, KZ_RBTUNE_BUDGET);
+    if (st->size < wanted) {
+        ESP_LOGW(TAG, "%s: held to %u bytes of the %u wanted by the %s budget", s_names[f], (unsigned)st->size,
+                 (unsigned)wanted, KZ_RBTUNE_MEM_NAME);
+    }
+
+    uint32_t drawdown = (uint32_t)(size - track.min_fill);
+    ESP_LOGI(TAG, "%s: drained %u of %d bytes (%u ms at %u B/s), %u empty samples, size %u -> %u",
+             s_names[f], (unsigned)drawdown, size, byte_rate ? (unsigned)(drawdown * 1000ULL / byte_rate) : 0,
+             (unsigned)byte_rate, (unsigned)track.empty, (unsigned)old_size, (unsigned)st->size);
+    // Only the size matters next boot, so don't wear the flash otherwise
+    if (st->size != old_size) {
+        save_fmt(f);
+    }
+}
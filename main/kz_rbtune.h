@@ -0,0 +1,17 @@
+#include <stdint.h>
+
+#include "audio_element.h"
+
+#define KZ_RBTUNE_DEFAULT_SIZE (16 * 1024)
+
+// Load the per-format decoder output buffer sizes learnt so far. All of
+// them together, plus one more for a prefetch or crossfade, are held to the
+// KZ_RBTUNE_*_BUDGET_KB budget for the memory they come from.
+void kz_rbtune_load(void);
+// Output ring buffer size to give a decoder, by its pipeline tag ("mp3", ...)
+int kz_rbtune_get_size(const char *fmt);
+
+// Watch how far the decoder's output buffer drains while a track plays.
+// Stopping folds what was seen into that format's size for next time.
+void kz_rbtune_track_start(const char *fmt, audio_element_handle_t decoder, uint32_t byte_rate);
+void kz_rbtune_track_stop(void);
@@ -0,0 +1,574 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kz_resample.h"
+#include "kz_loudness.h"
+
+#ifdef ESP_PLATFORM
+#include "esp_attr.h"
+#define KZ_RSP_HOT IRAM_ATTR
+#else
+#define KZ_RSP_HOT
+#endif
+
+// Coefficients are as fine as Q15 as long as the largest still fits in 16
+// bits and a whole phase can be accumulated in 32: the absolute sum of a
+// phase at most 2^31 / 2^15 / 2^shift. Rounding them is most of the error,
+// more so the more taps there are, so the shift is picked per filter.
+#define KZ_RSP_MAX_SHIFT 15
+#define KZ_RSP_MAX_PHASES 640
+#define KZ_RSP_CHUNK_FRAMES 256
+
+typedef struct {
+    int taps;
+    double rolloff;
+    double beta;
+} kz_rsp_tier_t;
+
+static const kz_rsp_tier_t s_tiers[] = {
+    [KZ_RESAMPLE_OFF]    = {0, 0.0, 0.0},
+    [KZ_RESAMPLE_LOW]    = {8, 0.80, 5.0},
+    [KZ_RESAMPLE_MEDIUM] = {16, 0.88, 7.0},
+    [KZ_RESAMPLE_HIGH]   = {32, 0.91, 10.0},
+};
+
+typedef struct kz_rsp {
+    int16_t *coef;      // up phases of taps coefficients, each phase time-reversed
+    int16_t *hist;      // interleaved input history
+    size_t hist_frames;
+    size_t hist_cap;
+    uint32_t up, down;
+    uint32_t phase;
+    int taps;
+    int shift;
+    int channels;
+} kz_rsp_t;
+
+static uint32_t gcd_u32(uint32_t a, uint32_t b) {
+    while (b != 0) {
+        uint32_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Zeroth order modified Bessel function, used by the Kaiser window
+static double bessel_i0(double x) {
+    double sum = 1.0, term = 1.0;
+    for (int k = 1; k < 32; ++k) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+        if (term < sum * 1e-12) {
+            break;
+        }
+    }
+    return sum;
+}
+
+bool kz_rsp_is_supported(int src_rate, int dst_rate) {
+    if (src_rate <= 0 || dst_rate <= 0) {
+        return false;
+    }
+    uint32_t g = gcd_u32(src_rate, dst_rate);
+    uint32_t up = dst_rate / g;
+    uint32_t down = src_rate / g;
+
+    // Keep the coefficient table bounded and make sure a single output never
+    // advances the history by more than the shortest filter
+    return up <= KZ_RSP_MAX_PHASES && down <= up * s_tiers[KZ_RESAMPLE_LOW].taps;
+}
+
+// Build a Kaiser windowed sinc prototype and split it into fixed point
+// phases. Each phase is normalized to unity DC gain so there is no
+// phase-dependent ripple.
+static bool build_coefs(kz_rsp_t *rsp, const kz_rsp_tier_t *tier) {
+    const size_t n_total = (size_t)rsp->taps * rsp->up;
+    double *proto = malloc(sizeof(*proto) * n_total);
+    if (proto == NULL) {
+        return false;
+    }
+
+    double fc = 0.5 * tier->rolloff;
+    if (rsp->down > rsp->up) {
+        fc = fc * rsp->up / rsp->down;
+    }
+    const double center = (n_total - 1) / 2.0;
+    const double i0_beta = bessel_i0(tier->beta);
+    for (size_t n = 0; n < n_total; ++n) {
+        double t = (n - center) / rsp->up;
+        double r = (n - center) / (center + 1.0);
+        double w = bessel_i0(tier->beta * sqrt(1.0 - r * r)) / i0_beta;
+        double s = (t == 0.0) ? 1.0 : sin(2.0 * M_PI * fc * t) / (2.0 * M_PI * fc * t);
+        proto[n] = 2.0 * fc * s * w;
+    }
+
+    // Normalize in place, then find the largest tap and phase to pick the
+    // shift from. Rounding moves each tap by at most half an LSB, and the
+    // residue all lands on the center tap, so leave taps LSBs of headroom.
+    double max_tap = 0.0, max_abs = 0.0;
+    for (uint32_t p = 0; p < rsp->up; ++p) {
+        double sum = 0.0, abs_sum = 0.0;
+        for (int j = 0; j < rsp->taps; ++j) {
+            sum += proto[j * rsp->up + p];
+        }
+        for (int j = 0; j < rsp->taps; ++j) {
+            double v = proto[j * rsp->up + p] / sum;
+            proto[j * rsp->up + p] = v;
+            max_tap = fabs(v) > max_tap ? fabs(v) : max_tap;
+            abs_sum += fabs(v);
+        }
+        max_abs = abs_sum > max_abs ? abs_sum : max_abs;
+    }
+    rsp->shift = KZ_RSP_MAX_SHIFT;
+    while (rsp->shift > 1 && (max_tap * (1 << rsp->shift) + rsp->taps > INT16_MAX ||
+                              max_abs * (1 << rsp->shift) + rsp->taps > (1 << (31 - 15)))) {
+        rsp->shift--;
+    }
+
+    for (uint32_t p = 0; p < rsp->up; ++p) {
+        int16_t *c = &rsp->coef[p * rsp->taps];
+        int32_t qsum = 0;
+        for (int j = 0; j < rsp->taps; ++j) {
+            c[j] = (int16_t)lrint(proto[(rsp->taps - 1 - j) * rsp->up + p] * (1 << rsp->shift));
+            qsum += c[j];
+        }
+        // Push any rounding residue into the center tap
+        c[rsp->taps / 2] += (int16_t)((1 << rsp->shift) - qsum);
+    }
+
+    free(proto);
+    return true;
+}
+
+kz_rsp_handle_t kz_rsp_new(kz_resample_quality_e quality, int src_rate, int dst_rate, int channels) {
+    if (quality <= KZ_RESAMPLE_OFF || quality > KZ_RESAMPLE_HIGH ||
+        channels < 1 || channels > 2 || !kz_rsp_is_supported(src_rate, dst_rate)) {
+        return NULL;
+    }
+    const kz_rsp_tier_t *tier = &s_tiers[quality];
+
+    kz_rsp_t *rsp = calloc(1, sizeof(kz_rsp_t));
+    if (rsp == NULL) {
+        return NULL;
+    }
+    uint32_t g = gcd_u32(src_rate, dst_rate);
+    rsp->up = dst_rate / g;
+    rsp->down = src_rate / g;
+    rsp->taps = tier->taps;
+    rsp->channels = channels;
+    rsp->hist_cap = rsp->taps + KZ_RSP_CHUNK_FRAMES;
+
+    rsp->coef = malloc(sizeof(*rsp->coef) * rsp->taps * rsp->up);
+    if (rsp->coef == NULL) {
+        goto kz_rsp_new_cleanup;
+    }
+    rsp->hist = malloc(sizeof(*rsp->hist) * rsp->hist_cap * channels);
+    if (rsp->hist == NULL) {
+        goto kz_rsp_new_cleanup;
+    }
+    if (!build_coefs(rsp, tier)) {
+        goto kz_rsp_new_cleanup;
+    }
+    kz_rsp_reset(rsp);
+
+    return rsp;
+
+kz_rsp_new_cleanup:
+    kz_rsp_destroy(rsp);
+    return NULL;
+}
+
+void kz_rsp_reset(kz_rsp_handle_t rsp) {
+    // Prime the history with silence so output starts with the very first
+    // input frame instead of waiting for a full filter's worth of input
+    rsp->hist_frames = rsp->taps - 1;
+    memset(rsp->hist, 0, sizeof(*rsp->hist) * rsp->hist_frames * rsp->channels);
+    rsp->phase = 0;
+}
+
+size_t kz_rsp_max_out_frames(kz_rsp_handle_t rsp, size_t in_frames) {
+    return ((in_frames + rsp->taps) * rsp->up) / rsp->down + 1;
+}
+
+// Four independent accumulators keep the MAC pipeline busy on the Xtensa
+// cores (and let GCC emit a zero-overhead loop); taps is always a multiple of 8
+static inline int32_t KZ_RSP_HOT dot_stride(const int16_t *c, const int16_t *x, int taps, int stride) {
+    int32_t a0 = 0, a1 = 0, a2 = 0, a3 = 0;
+    for (int k = 0; k < taps; k += 4) {
+        a0 += (int32_t)c[k] * x[k * stride];
+        a1 += (int32_t)c[k + 1] * x[(k + 1) * stride];
+        a2 += (int32_t)c[k + 2] * x[(k + 2) * stride];
+        a3 += (int32_t)c[k + 3] * x[(k + 3) * stride];
+    }
+    return (a0 + a1) + (a2 + a3);
+}
+
+static inline int16_t sat_shift(int32_t acc, int shift) {
+    acc = (acc + (1 << (shift - 1))) >> shift;
+    if (acc > INT16_MAX) {
+        return INT16_MAX;
+    } else if (acc < INT16_MIN) {
+        return INT16_MIN;
+    }
+    return (int16_t)acc;
+}
+
+static size_t KZ_RSP_HOT run_filter(kz_rsp_t *rsp, int16_t *out) {
+    const int ch = rsp->channels;
+    size_t pos = 0, produced = 0;
+
+    while (pos + rsp->taps <= rsp->hist_frames) {
+        const int16_t *c = &rsp->coef[rsp->phase * rsp->taps];
+        const int16_t *x = &rsp->hist[pos * ch];
+        for (int i = 0; i < ch; ++i) {
+            out[produced * ch + i] = sat_shift(dot_stride(c, x + i, rsp->taps, ch), rsp->shift);
+        }
+        produced++;
+
+        rsp->phase += rsp->down;
+        while (rsp->phase >= rsp->up) {
+            rsp->phase -= rsp->up;
+            pos++;
+        }
+    }
+
+    // Slide the unconsumed tail back to the start of the history
+    size_t keep = rsp->hist_frames - pos;
+    memmove(rsp->hist, &rsp->hist[pos * ch], sizeof(*rsp->hist) * keep * ch);
+    rsp->hist_frames = keep;
+
+    return produced;
+}
+
+size_t kz_rsp_process(kz_rsp_handle_t rsp, const int16_t *in, size_t in_frames, int16_t *out) {
+    const int ch = rsp->channels;
+    size_t produced = 0;
+
+    while (in_frames > 0) {
+        size_t space = rsp->hist_cap - rsp->hist_frames;
+        size_t n = in_frames < space ? in_frames : space;
+        memcpy(&rsp->hist[rsp->hist_frames * ch], in, sizeof(*in) * n * ch);
+        rsp->hist_frames += n;
+        in += n * ch;
+        in_frames -= n;
+
+        produced += run_filter(rsp, &out[produced * ch]);
+    }
+
+    return produced;
+}
+
+void kz_rsp_destroy(kz_rsp_handle_t rsp) {
+    if (rsp == NULL) {
+        return;
+    }
+    free(rsp->coef);
+    rsp->coef = NULL;
+    free(rsp->hist);
+    rsp->hist = NULL;
+    free(rsp);
+}
+
+#ifdef ESP_PLATFORM
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "audio_mem.h"
+#include "audio_error.h"
+
+static const char *TAG = "KZ_RESAMPLE";
+
+#define KZ_RESAMPLE_BUF_SIZE (2048)
+#define KZ_RESAMPLE_GAIN_SHIFT 14
+#define KZ_RESAMPLE_UNITY_GAIN (1 << KZ_RESAMPLE_GAIN_SHIFT)
+
+typedef struct {
+    kz_rsp_handle_t rsp;
+    volatile kz_resample_quality_e quality;
+    kz_resample_quality_e cur_quality;
+    int dst_rate;
+    int cur_rate, cur_bits, cur_ch;
+    int16_t *out_buf;
+    size_t out_frames;
+    uint8_t carry[4];
+    size_t carry_len;
+    volatile int32_t gain_q;
+    bool measure;
+    kz_loudness_t loudness;
+    // Copy of loudness as of its last whole block, for the player to read
+    // while the element carries on, guarded by lock
+    portMUX_TYPE lock;
+    kz_loudness_t measured;
+    // Pre-decoded start of the track, and how much of the decoder's own
+    // copy of it is still to be thrown away
+    const uint8_t *head;
+    size_t head_left;
+    size_t drop_left;
+    volatile int64_t first_out_us;
+} kz_resample_t;
+
+// (Re)build the kernel for the stream described by info. This runs on the
+// element task so the audio path never sees a half-built table.
+static void kz_resample_configure(kz_resample_t *rs, audio_element_info_t *info) {
+    kz_rsp_destroy(rs->rsp);
+    rs->rsp = NULL;
+    audio_free(rs->out_buf);
+    rs->out_buf = NULL;
+
+    rs->cur_rate = info->sample_rates;
+    rs->cur_bits = info->bits;
+    rs->cur_ch = info->channels;
+    rs->cur_quality = rs->quality;
+    rs->carry_len = 0;
+    rs->measure = (info->bits == 16 && info->sample_rates == KZ_LOUDNESS_RATE);
+
+    if (info->bits != 16 || info->sample_rates == rs->dst_rate) {
+        return;
+    }
+    rs->rsp = kz_rsp_new(rs->cur_quality, info->sample_rates, rs->dst_rate, info->channels);
+    if (rs->rsp == NULL) {
+        ESP_LOGW(TAG, "Passing %d Hz through without resampling", info->sample_rates);
+        return;
+    }
+    size_t in_frames = KZ_RESAMPLE_BUF_SIZE / (sizeof(int16_t) * info->channels);
+    rs->out_frames = kz_rsp_max_out_frames(rs->rsp, in_frames);
+    rs->out_buf = audio_malloc(rs->out_frames * sizeof(int16_t) * info->channels);
+    if (rs->out_buf == NULL) {
+        ESP_LOGE(TAG, "Unable to allocate output buffer, passing through");
+        kz_rsp_destroy(rs->rsp);
+        rs->rsp = NULL;
+        return;
+    }
+    rs->measure = (rs->dst_rate == KZ_LOUDNESS_RATE);
+    ESP_LOGI(TAG, "Resampling %d -> %d Hz, quality %d", info->sample_rates, rs->dst_rate, rs->cur_quality);
+}
+
+static void apply_gain(int16_t *pcm, size_t samples, int32_t gain_q) {
+    for (size_t i = 0; i < samples; ++i) {
+        int32_t v = (pcm[i] * gain_q + (1 << (KZ_RESAMPLE_GAIN_SHIFT - 1))) >> KZ_RESAMPLE_GAIN_SHIFT;
+        if (v > INT16_MAX) {
+            v = INT16_MAX;
+        } else if (v < INT16_MIN) {
+            v = INT16_MIN;
+        }
+        pcm[i] = (int16_t)v;
+    }
+}
+
+static esp_err_t kz_resample_open(audio_element_handle_t self) {
+    kz_resample_t *rs = (kz_resample_t *)audio_element_getdata(self);
+    if (rs->rsp != NULL) {
+        kz_rsp_reset(rs->rsp);
+    }
+    rs->carry_len = 0;
+    kz_loudness_reset(&rs->loudness);
+    portENTER_CRITICAL(&rs->lock);
+    rs->measured = rs->loudness;
+    portEXIT_CRITICAL(&rs->lock);
+    return ESP_OK;
+}
+
+static esp_err_t kz_resample_close(audio_element_handle_t self) {
+    kz_resample_t *rs = (kz_resample_t *)audio_element_getdata(self);
+    rs->head = NULL;
+    rs->head_left = 0;
+    rs->drop_left = 0;
+    rs->first_out_us = 0;
+    return ESP_OK;
+}
+
+// Input comes from the head until it runs out, then from the decoder once
+// it's past the same point. While the head plays, whatever the decoder has
+// ready is thrown away, so it's rarely behind when the head ends.
+static int read_input(kz_resample_t *rs, audio_element_handle_t self, char *buf, int len) {
+    if (rs->head_left > 0) {
+        ringbuf_handle_t rb = audio_element_get_input_ringbuf(self);
+        size_t ready = rb != NULL ? rb_bytes_filled(rb) : 0;
+        ready = ready < rs->drop_left ? ready : rs->drop_left;
+        ready = ready < len ? ready : len;
+        if (ready > 0) {
+            int r = audio_element_input(self, buf, ready);
+            if (r > 0) {
+                rs->drop_left -= r;
+            }
+        }
+        size_t n = rs->head_left < len ? rs->head_left : len;
+        memcpy(buf, rs->head, n);
+        rs->head += n;
+        rs->head_left -= n;
+        return n;
+    }
+    while (rs->drop_left > 0) {
+        int r = audio_element_input(self, buf, rs->drop_left < len ? rs->drop_left : len);
+        if (r <= 0) {
+            return r;
+        }
+        rs->drop_left -= r;
+    }
+    return audio_element_input(self, buf, len);
+}
+
+static int write_output(kz_resample_t *rs, audio_element_handle_t self, char *buf, int len) {
+    if (rs->first_out_us == 0) {
+        rs->first_out_us = esp_timer_get_time();
+    }
+    return audio_element_output(self, buf, len);
+}
+
+static audio_element_err_t kz_resample_process(audio_element_handle_t self, char *in_buffer, int in_len) {
+    kz_resample_t *rs = (kz_resample_t *)audio_element_getdata(self);
+
+    // The player publishes the decoder's format to us; until it has, we
+    // don't know what the incoming bytes are so leave them in the ringbuffer
+    audio_element_info_t info = {0};
+    audio_element_getinfo(self, &info);
+    if (info.sample_rates == 0 || info.channels == 0) {
+        vTaskDelay(1);
+        return AEL_IO_TIMEOUT;
+    }
+    if (info.sample_rates != rs->cur_rate || info.bits != rs->cur_bits ||
+        info.channels != rs->cur_ch || rs->quality != rs->cur_quality) {
+        kz_resample_configure(rs, &info);
+    }
+
+    if (rs->cur_bits != 16) {
+        int r_size = read_input(rs, self, in_buffer, in_len);
+        if (r_size <= 0) {
+            return r_size;
+        }
+        return write_output(rs, self, in_buffer, r_size);
+    }
+
+    // Input reads aren't guaranteed to be frame aligned, so carry any partial
+    // frame over to the front of the next read
+    memcpy(in_buffer, rs->carry, rs->carry_len);
+    int r_size = read_input(rs, self, in_buffer + rs->carry_len, in_len - rs->carry_len);
+    if (r_size <= 0) {
+        return r_size;
+    }
+    const size_t frame_bytes = sizeof(int16_t) * rs->cur_ch;
+    const size_t total = rs->carry_len + r_size;
+    const size_t in_frames = total / frame_bytes;
+    rs->carry_len = total - in_frames * frame_bytes;
+    memcpy(rs->carry, in_buffer + in_frames * frame_bytes, rs->carry_len);
+
+    int16_t *pcm = (int16_t *)in_buffer;
+    size_t out_frames = in_frames;
+    if (rs->rsp != NULL) {
+        out_frames = kz_rsp_process(rs->rsp, pcm, in_frames, rs->out_buf);
+        pcm = rs->out_buf;
+    }
+    if (out_frames == 0) {
+        return r_size;
+    }
+
+    // Loudness is measured before the gain so it describes the track itself
+    if (rs->measure) {
+        kz_loudness_feed(&rs->loudness, pcm, out_frames, rs->cur_ch);
+        // Only the histogram counts toward the result, and it only changes
+        // once a block is done
+        if (rs->loudness.block_count != rs->measured.block_count) {
+            portENTER_CRITICAL(&rs->lock);
+            rs->measured = rs->loudness;
+            portEXIT_CRITICAL(&rs->lock);
+        }
+    }
+    int32_t gain_q = rs->gain_q;
+    if (gain_q != KZ_RESAMPLE_UNITY_GAIN) {
+        apply_gain(pcm, out_frames * rs->cur_ch, gain_q);
+    }
+
+    return write_output(rs, self, (char *)pcm, out_frames * frame_bytes);
+}
+
+static esp_err_t kz_resample_destroy(audio_element_handle_t self) {
+    kz_resample_t *rs = (kz_resample_t *)audio_element_getdata(self);
+    kz_rsp_destroy(rs->rsp);
+    audio_free(rs->out_buf);
+    audio_free(rs);
+    return ESP_OK;
+}
+
+void kz_resample_set_quality(audio_element_handle_t self, kz_resample_quality_e quality) {
+    kz_resample_t *rs = (kz_resample_t *)audio_element_getdata(self);
+    rs->quality = quality;
+}
+
+void kz_resample_set_gain(audio_element_handle_t self, float gain_db) {
+    kz_resample_t *rs = (kz_resample_t *)audio_element_getdata(self);
+    if (gain_db > KZ_RESAMPLE_MAX_GAIN_DB) {
+        gain_db = KZ_RESAMPLE_MAX_GAIN_DB;
+    }
+    rs->gain_q = (int32_t)(powf(10.0f, gain_db / 20.0f) * KZ_RESAMPLE_UNITY_GAIN);
+}
+
+bool kz_resample_get_loudness(audio_element_handle_t self, uint32_t min_blocks, float *lufs) {
+    kz_resample_t *rs = (kz_resample_t *)audio_element_getdata(self);
+    kz_loudness_t measured;
+    portENTER_CRITICAL(&rs->lock);
+    measured = rs->measured;
+    portEXIT_CRITICAL(&rs->lock);
+    return kz_loudness_integrated(&measured, min_blocks, lufs);
+}
+
+void kz_resample_set_src_info(audio_element_handle_t self, int rate, int bits, int channels) {
+    audio_element_info_t info = {0};
+    audio_element_getinfo(self, &info);
+    info.sample_rates = rate;
+    info.bits = bits;
+    info.channels = channels;
+    audio_element_setinfo(self, &info);
+}
+
+void kz_resample_set_head(audio_element_handle_t self, const uint8_t *pcm, size_t len) {
+    kz_resample_t *rs = (kz_resample_t *)audio_element_getdata(self);
+    rs->head = pcm;
+    rs->head_left = len;
+    rs->drop_left = len;
+}
+
+int64_t kz_resample_first_output_us(audio_element_handle_t self) {
+    kz_resample_t *rs = (kz_resample_t *)audio_element_getdata(self);
+    return rs->first_out_us;
+}
+
+int kz_resample_out_rate(audio_element_handle_t self, int src_rate, int bits, int channels) {
+    kz_resample_t *rs = (kz_resample_t *)audio_element_getdata(self);
+    if (rs->quality == KZ_RESAMPLE_OFF || bits != 16 || channels < 1 || channels > 2 ||
+        !kz_rsp_is_supported(src_rate, rs->dst_rate)) {
+        return src_rate;
+    }
+    return rs->dst_rate;
+}
+
+audio_element_handle_t kz_resample_init(kz_resample_cfg_t *cfg) {
+    kz_resample_t *rs = audio_calloc(1, sizeof(kz_resample_t));
+    AUDIO_MEM_CHECK(TAG, rs, return NULL);
+    rs->quality = cfg->quality;
+    rs->dst_rate = cfg->dst_rate;
+    rs->gain_q = KZ_RESAMPLE_UNITY_GAIN;
+    portMUX_INITIALIZE(&rs->lock);
+
+    audio_element_cfg_t el_cfg = DEFAULT_AUDIO_ELEMENT_CONFIG();
+    el_cfg.open = kz_resample_open;
+    el_cfg.close = kz_resample_close;
+    el_cfg.process = kz_resample_process;
+    el_cfg.destroy = kz_resample_destroy;
+    el_cfg.buffer_len = KZ_RESAMPLE_BUF_SIZE;
+    el_cfg.out_rb_size = cfg->out_rb_size;
+    el_cfg.task_stack = cfg->task_stack;
+    el_cfg.task_prio = cfg->task_prio;
+    el_cfg.task_core = cfg->task_core;
+    el_cfg.stack_in_ext = cfg->stack_in_ext;
+    el_cfg.tag = "rsp";
+
+    audio_element_handle_t el = audio_element_init(&el_cfg);
+    AUDIO_MEM_CHECK(TAG, el, {audio_free(rs); return NULL;});
+    audio_element_setdata(el, rs);
+
+    return el;
+}
+#endif
@@ -0,0 +1,67 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define KZ_RESAMPLE_DST_RATE (48000)
+#define KZ_RESAMPLE_MAX_GAIN_DB (12.0f)
+
+typedef enum {
+    KZ_RESAMPLE_OFF = 0,
+    KZ_RESAMPLE_LOW,
+    KZ_RESAMPLE_MEDIUM,
+    KZ_RESAMPLE_HIGH,
+} kz_resample_quality_e;
+
+// Portable polyphase kernel, free of ADF/IDF. host_test/test_resample.c
+// measures its THD+N and cost per frame.
+typedef struct kz_rsp* kz_rsp_handle_t;
+
+bool kz_rsp_is_supported(int src_rate, int dst_rate);
+kz_rsp_handle_t kz_rsp_new(kz_resample_quality_e quality, int src_rate, int dst_rate, int channels);
+size_t kz_rsp_max_out_frames(kz_rsp_handle_t rsp, size_t in_frames);
+size_t kz_rsp_process(kz_rsp_handle_t rsp, const int16_t *in, size_t in_frames, int16_t *out);
+void kz_rsp_reset(kz_rsp_handle_t rsp);
+void kz_rsp_destroy(kz_rsp_handle_t rsp);
+
+#ifdef ESP_PLATFORM
+#include "audio_element.h"
+
+typedef struct {
+    kz_resample_quality_e quality;
+    int dst_rate;
+    int out_rb_size;
+    int task_stack;
+    int task_prio;
+    int task_core;
+    bool stack_in_ext;
+} kz_resample_cfg_t;
+
+#define DEFAULT_KZ_RESAMPLE_CONFIG() {              \
+    .quality = KZ_RESAMPLE_MEDIUM,                  \
+    .dst_rate = KZ_RESAMPLE_DST_RATE,               \
+    .out_rb_size = (8 * 1024),                      \
+    .task_stack = (3 * 1024),                       \
+    .task_prio = 5,                                 \
+    .task_core = 1,                                 \
+    .stack_in_ext = false,                          \
+}
+
+// ADF audio element wrapping the kernel, sits between the decoder and the I2S
+// writer. It also applies the per-track gain and measures loudness on the way.
+audio_element_handle_t kz_resample_init(kz_resample_cfg_t *cfg);
+void kz_resample_set_quality(audio_element_handle_t self, kz_resample_quality_e quality);
+void kz_resample_set_gain(audio_element_handle_t self, float gain_db);
+// Loudness of what has gone through since the track started, as of the last
+// whole 400ms block. Safe to call while the element is running.
+bool kz_resample_get_loudness(audio_element_handle_t self, uint32_t min_blocks, float *lufs);
+void kz_resample_set_src_info(audio_element_handle_t self, int rate, int bits, int channels);
+// Play len bytes of pcm, the start of the track already decoded in the
+// source format, before any input, then drop as many bytes of input as the
+// decoder produces the same audio again. Only while the element is
+// stopped; it's forgotten the next time it stops.
+void kz_resample_set_head(audio_element_handle_t self, const uint8_t *pcm, size_t len);
+// When audio first left the element since it was last stopped, 0 if it
+// hasn't yet
+int64_t kz_resample_first_output_us(audio_element_handle_t self);
+int kz_resample_out_rate(audio_element_handle_t self, int src_rate, int bits, int channels);
+#endif
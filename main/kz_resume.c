@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "esp_log.h"
+#include "nvs.h"
+
+#include "dram_list.h"
+#include "kz_util.h"
+#include "kz_rgcache.h"
+#include "kz_resume.h"
+
+#define KZ_RESUME_NVS_NAMESPACE "kz_resume"
+#define KZ_RESUME_NVS_KEY "state"
+#define KZ_RESUME_MAX_URL 512
+
+static const char *TAG = "KZ_RESUME";
+
+// Last state known to be in flash, so repeated checkpoints of an unchanged
+// position cost nothing
+static kz_resume_t s_saved;
+static bool s_saved_valid = false;
+
+static uint32_t hash_step(uint32_t hash, const char *url) {
+    return (hash * 16777619u) ^ kz_path_hash(url);
+}
+
+esp_err_t kz_resume_load(kz_resume_t *state) {
+    nvs_handle_t nvs;
+    esp_err_t ret = nvs_open(KZ_RESUME_NVS_NAMESPACE, NVS_READONLY, &nvs);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    size_t len = sizeof(*state);
+    ret = nvs_get_blob(nvs, KZ_RESUME_NVS_KEY, state, &len);
+    nvs_close(nvs);
+    if (ret == ESP_OK && len != sizeof(*state)) {
+        ret = ESP_ERR_INVALID_SIZE;
+    }
+    if (ret == ESP_OK) {
+        s_saved = *state;
+        s_saved_valid = true;
+    }
+    return ret;
+}
+
+esp_err_t kz_resume_checkpoint(const kz_resume_t *state) {
+    if (s_saved_valid && memcmp(&s_saved, state, sizeof(*state)) == 0) {
+        return ESP_OK;
+    }
+
+    nvs_handle_t nvs;
+    esp_err_t ret = nvs_open(KZ_RESUME_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    // A single blob keeps this to one flash write per checkpoint
+    ret = nvs_set_blob(nvs, KZ_RESUME_NVS_KEY, state, sizeof(*state));
+    if (ret == ESP_OK) {
+        ret = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    if (ret == ESP_OK) {
+        s_saved = *state;
+        s_saved_valid = true;
+    } else {
+        ESP_LOGW(TAG, "Unable to checkpoint: %s", esp_err_to_name(ret));
+    }
+    return ret;
+}
+
+esp_err_t kz_resume_save_playlist(playlist_operator_handle_t pl, uint32_t *pl_hash) {
+    playlist_operation_t pl_op;
+    pl->get_operation(&pl_op);
+    int count = pl_op.get_url_num(pl);
+    int cur = pl_op.get_url_id(pl);
+    uint32_t hash = 0;
+    char *url = NULL;
+
+    mkdir(KZ_RGCACHE_DIR, 0775);
+    FILE *fp = fopen(KZ_RESUME_PLAYLIST_PATH, "w");
+    if (fp == NULL) {
+        return ESP_FAIL;
+    }
+    // Step through with next() rather than choose() as that walks the list
+    // from the start every time
+    esp_err_t ret = pl_op.choose(pl, 0, &url);
+    for (int i = 0; i < count && ret == ESP_OK; ++i) {
+        if ((i > 0 && ESP_OK != pl_op.next(pl, 1, &url)) || fprintf(fp, "%s\n", url) < 0) {
+            ret = ESP_FAIL;
+            break;
+        }
+        hash = hash_step(hash, url);
+    }
+    if (fclose(fp) != 0) {
+        ret = ESP_FAIL;
+    }
+    pl_op.choose(pl, cur, &url);
+
+    *pl_hash = hash;
+    return ret;
+}
+
+esp_err_t kz_resume_load_playlist(uint32_t pl_hash, playlist_operator_handle_t *pl) {
+    FILE *fp = fopen(KZ_RESUME_PLAYLIST_PATH, "r");
+    if (fp == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    esp_err_t ret = dram_list_create(pl);
+    if (ret != ESP_OK) {
+        fclose(fp);
+        return ret;
+    }
+
+    char *line = malloc(KZ_RESUME_MAX_URL);
+    uint32_t hash = 0;
+    if (line == NULL) {
+        ret = ESP_ERR_NO_MEM;
+        goto kz_resume_load_playlist_cleanup;
+    }
+    while (fgets(line, KZ_RESUME_MAX_URL, fp) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0') {
+            continue;
+        }
+        dram_list_save(*pl, line);
+        hash = hash_step(hash, line);
+    }
+    if (hash != pl_hash) {
+        ESP_LOGW(TAG, "Saved playlist doesn't match the checkpoint");
+        ret = ESP_ERR_INVALID_CRC;
+    }
+
+kz_resume_load_playlist_cleanup:
+    free(line);
+    fclose(fp);
+    if (ret != ESP_OK) {
+        playlist_operation_t pl_op;
+        (*pl)->get_operation(&pl_op);
+        pl_op.destroy(*pl);
+        *pl = NULL;
+    }
+    return ret;
+}
@@ -0,0 +1,27 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "playlist.h"
+
+#define KZ_RESUME_PLAYLIST_PATH "/sdcard/.kitzune/playlist.m3u"
+
+// Where playback was, checkpointed to NVS. The playlist itself is too big
+// for NVS so it is kept on the card and identified here by its hash.
+typedef struct {
+    uint32_t pl_hash;
+    uint32_t index;
+    uint32_t pos_ms;
+    uint8_t shuffle;
+    uint8_t repeat;         // player_repeat_t, 0 in checkpoints from before it existed
+    uint8_t reserved[2];
+} kz_resume_t;
+
+esp_err_t kz_resume_load(kz_resume_t *state);
+// Only writes to flash when the state differs from what is already stored
+esp_err_t kz_resume_checkpoint(const kz_resume_t *state);
+
+// Write every URL in the playlist to the card, leaving it on url_id
+esp_err_t kz_resume_save_playlist(playlist_operator_handle_t pl, uint32_t *pl_hash);
+// Rebuild the saved playlist, failing if it doesn't match pl_hash
+esp_err_t kz_resume_load_playlist(uint32_t pl_hash, playlist_operator_handle_t *pl);
@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "esp_log.h"
+
+#include "kz_rgcache.h"
+
+#define KZ_RGCACHE_MAGIC "KZRG"
+#define KZ_RGCACHE_VERSION 1
+
+static const char *TAG = "KZ_RGCACHE";
+
+// One record per file, kept sorted by key in RAM. On the card the records
+// are an append-only log so saving a new gain is a single small write. Keys
+// are only appended when they are missing, so duplicates are not expected.
+typedef struct {
+    uint32_t key;
+    int16_t gain_cdb;
+    uint8_t src;
+    uint8_t reserved;
+} kz_rgcache_rec_t;
+
+static kz_rgcache_rec_t *s_recs = NULL;
+static size_t s_rec_count = 0;
+static size_t s_rec_size = 0;
+
+// Returns the index of key, or the position it should be inserted at
+static size_t find_pos(uint32_t key, bool *found) {
+    size_t lo = 0, hi = s_rec_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (s_recs[mid].key < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *found = (lo < s_rec_count && s_recs[lo].key == key);
+    return lo;
+}
+
+static bool insert_rec(const kz_rgcache_rec_t *rec) {
+    bool found;
+    size_t pos = find_pos(rec->key, &found);
+    if (found) {
+        s_recs[pos] = *rec;
+        return true;
+    }
+
+    if (s_rec_count == s_rec_size) {
+        size_t new_size = s_rec_size == 0 ? 64 : s_rec_size * 2;
+        kz_rgcache_rec_t *new_recs = realloc(s_recs, sizeof(*s_recs) * new_size);
+        if (new_recs == NULL) {
+            return false;
+        }
+        s_recs = new_recs;
+        s_rec_size = new_size;
+    }
+    memmove(&s_recs[pos + 1], &s_recs[pos], sizeof(*s_recs) * (s_rec_count - pos));
+    s_recs[pos] = *rec;
+    s_rec_count++;
+
+    return true;
+}
+
+static int rec_cmp(const void *a, const void *b) {
+    uint32_t ka = ((const kz_rgcache_rec_t *)a)->key;
+    uint32_t kb = ((const kz_rgcache_rec_t *)b)->key;
+    return (ka > kb) - (ka < kb);
+}
+
+esp_err_t kz_rgcache_load(void) {
+    // Whatever was loaded belonged to the last card, which may not be this one
+    free(s_recs);
+    s_recs = NULL;
+    s_rec_count = 0;
+    s_rec_size = 0;
+
+    FILE *fp = fopen(KZ_RGCACHE_PATH, "rb");
+    if (fp == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    char hdr[8];
+    if (fread(hdr, 1, sizeof(hdr), fp) != sizeof(hdr) ||
+        memcmp(hdr, KZ_RGCACHE_MAGIC, 4) != 0 || hdr[4] != KZ_RGCACHE_VERSION) {
+        ESP_LOGW(TAG, "Ignoring stale gain cache");
+        fclose(fp);
+        return ESP_ERR_INVALID_VERSION;
+    }
+
+    // Slurp the whole log and sort once rather than inserting one by one
+    fseek(fp, 0, SEEK_END);
+    size_t count = (ftell(fp) - sizeof(hdr)) / sizeof(kz_rgcache_rec_t);
+    fseek(fp, sizeof(hdr), SEEK_SET);
+    kz_rgcache_rec_t *recs = malloc(sizeof(*recs) * (count == 0 ? 1 : count));
+    if (recs == NULL) {
+        fclose(fp);
+        return ESP_ERR_NO_MEM;
+    }
+    count = fread(recs, sizeof(*recs), count, fp);
+    fclose(fp);
+    qsort(recs, count, sizeof(*recs), rec_cmp);
+
+    s_recs = recs;
+    s_rec_count = count;
+    s_rec_size = count == 0 ? 1 : count;
+    ESP_LOGI(TAG, "Loaded %u cached track gains", (unsigned)s_rec_count);
+
+    return ESP_OK;
+}
+
+bool kz_rgcache_lookup(uint32_t key, float *gain_db) {
+    bool found;
+    size_t pos = find_pos(key, &found);
+    if (found && gain_db != NULL) {
+        *gain_db = s_recs[pos].gain_cdb / 100.0f;
+    }
+    return found;
+}
+
+esp_err_t kz_rgcache_store(uint32_t key, float gain_db, kz_rgcache_src_e src) {
+    kz_rgcache_rec_t rec = {
+        .key = key,
+        .gain_cdb = (int16_t)(gain_db * 100.0f),
+        .src = src,
+    };
+    if (!insert_rec(&rec)) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    mkdir(KZ_RGCACHE_DIR, 0775);
+    FILE *fp = fopen(KZ_RGCACHE_PATH, "ab");
+    if (fp == NULL) {
+        return ESP_FAIL;
+    }
+    fseek(fp, 0, SEEK_END);
+    if (ftell(fp) == 0) {
+        char hdr[8] = {'K', 'Z', 'R', 'G', KZ_RGCACHE_VERSION, 0, 0, 0};
+        fwrite(hdr, 1, sizeof(hdr), fp);
+    }
+    size_t written = fwrite(&rec, sizeof(rec), 1, fp);
+    fclose(fp);
+
+    return written == 1 ? ESP_OK : ESP_FAIL;
+}
@@ -0,0 +1,18 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#define KZ_RGCACHE_DIR "/sdcard/.kitzune"
+#define KZ_RGCACHE_PATH KZ_RGCACHE_DIR "/rgcache.bin"
+
+typedef enum {
+    KZ_RGCACHE_SRC_TAG = 1,
+    KZ_RGCACHE_SRC_MEASURED,
+} kz_rgcache_src_e;
+
+// Replace the gains in RAM with those cached on the card. Call again
+// whenever a card is mounted.
+esp_err_t kz_rgcache_load(void);
+bool kz_rgcache_lookup(uint32_t key, float *gain_db);
+esp_err_t kz_rgcache_store(uint32_t key, float gain_db, kz_rgcache_src_e src);
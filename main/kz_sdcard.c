@@ -0,0 +1,110 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "audio_event_iface.h"
+#include "periph_sdcard.h"
+#include "sdcard.h"
+#include "board.h"
+
+#include "kz_sdcard.h"
+
+#define KZ_SDCARD_MOUNTED_BIT BIT0
+
+static const char *TAG = "KZ_SDCARD";
+
+static EventGroupHandle_t s_state = NULL;
+static audio_event_iface_handle_t s_evt = NULL;
+static kz_sdcard_cb_t s_listeners[KZ_SDCARD_MAX_LISTENERS];
+static volatile size_t s_listener_count = 0;
+// When the card was last seen going in, to time how long mounting takes
+static int64_t s_detect_us = 0;
+
+static void notify(bool mounted) {
+    for (size_t i = 0; i < s_listener_count; ++i) {
+        s_listeners[i](mounted);
+    }
+}
+
+static void kz_sdcard_task(void *arg) {
+    while (1) {
+        audio_event_iface_msg_t msg;
+        if (ESP_OK != audio_event_iface_listen(s_evt, &msg, portMAX_DELAY)) {
+            continue;
+        }
+        if (msg.source_type != PERIPH_ID_SDCARD) {
+            continue;
+        }
+        switch (msg.cmd) {
+            case SDCARD_STATUS_CARD_DETECT_CHANGE:
+                s_detect_us = esp_timer_get_time();
+                break;
+            case SDCARD_STATUS_MOUNTED:
+                ESP_LOGI(TAG, "Card mounted in %lld ms", (esp_timer_get_time() - s_detect_us) / 1000);
+                xEventGroupSetBits(s_state, KZ_SDCARD_MOUNTED_BIT);
+                notify(true);
+                break;
+            case SDCARD_STATUS_UNMOUNTED:
+                ESP_LOGI(TAG, "Card removed");
+                xEventGroupClearBits(s_state, KZ_SDCARD_MOUNTED_BIT);
+                notify(false);
+                break;
+            case SDCARD_STATUS_MOUNT_ERROR:
+                ESP_LOGE(TAG, "Card failed to mount");
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+esp_err_t kz_sdcard_init(esp_periph_set_handle_t set) {
+    s_state = xEventGroupCreate();
+    if (s_state == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    audio_event_iface_cfg_t evt_cfg = AUDIO_EVENT_IFACE_DEFAULT_CFG();
+    s_evt = audio_event_iface_init(&evt_cfg);
+    if (s_evt == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    // Listen before starting the peripheral so the first mount isn't missed
+    audio_event_iface_set_listener(esp_periph_set_get_event_iface(set), s_evt);
+    if (pdPASS != xTaskCreatePinnedToCore(kz_sdcard_task, "SDCARD", (3 * 1024), NULL,
+                                          5, NULL, PRO_CPU_NUM)) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    s_detect_us = esp_timer_get_time();
+    return audio_board_sdcard_init(set, SD_MODE_4_LINE);
+}
+
+// Listeners are never removed, and the slot is filled before the count is
+// bumped, so the card task can be walking the list while we append
+esp_err_t kz_sdcard_add_listener(kz_sdcard_cb_t cb) {
+    if (s_listener_count >= KZ_SDCARD_MAX_LISTENERS) {
+        return ESP_ERR_NO_MEM;
+    }
+    s_listeners[s_listener_count] = cb;
+    s_listener_count++;
+    return ESP_OK;
+}
+
+bool kz_sdcard_wait_mounted(TickType_t ticks_to_wait) {
+    if (s_state == NULL) {
+        return false;
+    }
+    return xEventGroupWaitBits(s_state, KZ_SDCARD_MOUNTED_BIT, pdFALSE, pdTRUE, ticks_to_wait) &
+           KZ_SDCARD_MOUNTED_BIT;
+}
+
+// The detect pin goes before the unmount event arrives, so check it too
+bool kz_sdcard_is_mounted(void) {
+    if (s_state == NULL) {
+        return false;
+    }
+    return (xEventGroupGetBits(s_state) & KZ_SDCARD_MOUNTED_BIT) && sdcard_is_exist();
+}
@@ -0,0 +1,19 @@
+#include <stdbool.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "esp_err.h"
+#include "esp_peripherals.h"
+
+#define KZ_SDCARD_MAX_LISTENERS 4
+
+// Called from the card task whenever the card is mounted or unmounted, so
+// listeners should hand off anything slow to their own task
+typedef void (*kz_sdcard_cb_t)(bool mounted);
+
+// Start the card peripheral. Mounting happens in the background, driven by
+// the card-detect pin, so use kz_sdcard_wait_mounted() if the card is needed.
+esp_err_t kz_sdcard_init(esp_periph_set_handle_t set);
+esp_err_t kz_sdcard_add_listener(kz_sdcard_cb_t cb);
+bool kz_sdcard_wait_mounted(TickType_t ticks_to_wait);
+bool kz_sdcard_is_mounted(void);
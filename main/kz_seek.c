@@ -0,0 +1,777 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "kz_util.h"
+#include "kz_seek.h"
+
+// Headers are replayed into the decoder ahead of the seek position, so they
+// have to fit in the reader's ring buffer alongside some audio
+#define KZ_SEEK_MAX_PREFIX (4 * 1024)
+#define KZ_SEEK_MAX_POINTS 256
+// Bisection stops once the bracketing points are this close together
+#define KZ_SEEK_BISECT_SPAN (16 * 1024)
+#define KZ_SEEK_MAX_PROBES 16
+// A probe reads this much at a time looking for a frame/page header, and
+// gives up once it has looked this far past where it started
+#define KZ_SEEK_PROBE_LEN (8 * 1024)
+#define KZ_SEEK_PROBE_MAX (64 * 1024)
+#define KZ_SEEK_HDR_MAX 32
+#define KZ_SEEK_OGG_TAIL (8 * 1024)
+#define KZ_SEEK_MAX_OGG_PAGES 16
+#define KZ_SEEK_CACHE_SIZE 4
+
+typedef struct {
+    uint32_t ms;
+    uint32_t off;
+} seek_point_t;
+
+typedef enum {
+    SEEK_PROBE_NONE,
+    SEEK_PROBE_OGG,
+    SEEK_PROBE_FLAC,
+} seek_probe_e;
+
+// Points are sorted by time. Formats that can be probed gain a point every
+// time a seek has to bisect, so later seeks nearby come straight from RAM.
+// A table is only good for the file it was built from, so it's keyed on
+// the size and modification time as well as the path - a file rewritten in
+// place, or another card with the same layout, builds a new one
+typedef struct {
+    uint32_t key;
+    long size;
+    time_t mtime;
+    uint32_t last_used;
+    seek_point_t *points;
+    size_t count;
+    bool interpolate;       // frame-synced streams can start between points
+    uint32_t align;         // interpolated offsets are rounded to this
+    seek_probe_e probe;
+    uint32_t audio_start;
+    uint32_t duration_ms;
+    uint32_t rate;
+    uint32_t pre_skip;
+    uint32_t serial;
+    uint32_t fixed_block;
+    uint8_t *prefix;
+    size_t prefix_len;
+} seek_table_t;
+
+// The file is only opened once something actually needs reading
+typedef struct {
+    const char *path;
+    FILE *fp;
+    long size;
+    time_t mtime;
+    uint32_t reads;
+} seek_reader_t;
+
+static seek_table_t *s_cache[KZ_SEEK_CACHE_SIZE];
+static uint32_t s_cache_clock = 0;
+// Bumped from the card task, the player task empties the cache when it next
+// looks and sees it moved
+static volatile uint32_t s_flushes = 0;
+static uint32_t s_flushes_seen = 0;
+
+static uint16_t be16(const uint8_t *p) {
+    return ((uint16_t)p[0] << 8) | p[1];
+}
+
+static uint32_t be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint32_t be24(const uint8_t *p) {
+    return ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+}
+
+static uint16_t le16(const uint8_t *p) {
+    return ((uint16_t)p[1] << 8) | p[0];
+}
+
+static uint32_t le32(const uint8_t *p) {
+    return ((uint32_t)p[3] << 24) | ((uint32_t)p[2] << 16) | ((uint32_t)p[1] << 8) | p[0];
+}
+
+static uint64_t le64(const uint8_t *p) {
+    return ((uint64_t)le32(&p[4]) << 32) | le32(p);
+}
+
+static uint32_t syncsafe32(const uint8_t *p) {
+    return ((uint32_t)(p[0] & 0x7F) << 21) | ((uint32_t)(p[1] & 0x7F) << 14) |
+           ((uint32_t)(p[2] & 0x7F) << 7) | (p[3] & 0x7F);
+}
+
+static bool sr_open(seek_reader_t *r) {
+    if (r->fp != NULL) {
+        return true;
+    }
+    r->fp = fopen(r->path, "rb");
+    return r->fp != NULL;
+}
+
+static size_t sr_read_at(seek_reader_t *r, uint32_t off, void *buf, size_t len) {
+    if (!sr_open(r) || fseek(r->fp, off, SEEK_SET) != 0) {
+        return 0;
+    }
+    r->reads++;
+    return fread(buf, 1, len, r->fp);
+}
+
+static void add_point(seek_table_t *t, uint32_t ms, uint32_t off) {
+    if (t->count == KZ_SEEK_MAX_POINTS) {
+        return;
+    }
+    size_t pos = t->count;
+    while (pos > 0 && t->points[pos - 1].ms > ms) {
+        pos--;
+    }
+    // Both time and offset have to keep increasing for the lookups to work
+    if ((pos > 0 && (t->points[pos - 1].ms == ms || t->points[pos - 1].off >= off)) ||
+        (pos < t->count && t->points[pos].off <= off)) {
+        return;
+    }
+    memmove(&t->points[pos + 1], &t->points[pos], sizeof(*t->points) * (t->count - pos));
+    t->points[pos] = (seek_point_t) {.ms = ms, .off = off};
+    t->count++;
+}
+
+// Index of the last point at or before ms
+static size_t find_lo(const seek_table_t *t, uint32_t ms) {
+    size_t lo = 0, hi = t->count;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (t->points[mid].ms <= ms) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// The Xing/Info TOC maps each percent of the track to a fraction of the
+// file, VBRI has a table of segment sizes. Without either assume CBR.
+static bool build_mp3(seek_table_t *t, seek_reader_t *r) {
+    static const uint16_t s_br_v1[16] = {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0};
+    static const uint16_t s_br_v2[16] = {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0};
+    static const uint32_t s_sr[3] = {44100, 48000, 32000};
+    uint8_t hdr[10];
+    uint32_t start = 0;
+    bool ok = false;
+
+    if (sr_read_at(r, 0, hdr, sizeof(hdr)) == sizeof(hdr) && memcmp(hdr, "ID3", 3) == 0) {
+        start = sizeof(hdr) + syncsafe32(&hdr[6]) + ((hdr[5] & 0x10) ? 10 : 0);
+    }
+    uint8_t *buf = malloc(2048);
+    if (buf == NULL) {
+        return false;
+    }
+    size_t n = sr_read_at(r, start, buf, 2048);
+
+    for (size_t i = 0; i + 4 <= n && !ok; ++i) {
+        if (buf[i] != 0xFF || (buf[i + 1] & 0xE0) != 0xE0) {
+            continue;
+        }
+        uint8_t ver = (buf[i + 1] >> 3) & 3;
+        uint8_t layer = (buf[i + 1] >> 1) & 3;
+        uint8_t br_idx = buf[i + 2] >> 4;
+        uint8_t sr_idx = (buf[i + 2] >> 2) & 3;
+        bool mono = (buf[i + 3] >> 6) == 3;
+        if (ver == 1 || layer != 1 || br_idx == 0 || br_idx == 15 || sr_idx == 3) {
+            continue;
+        }
+        bool is_v1 = (ver == 3);
+        uint32_t sr = s_sr[sr_idx] >> (is_v1 ? 0 : (ver == 2 ? 1 : 2));
+        uint32_t spf = is_v1 ? 1152 : 576;
+        uint32_t kbps = is_v1 ? s_br_v1[br_idx] : s_br_v2[br_idx];
+        size_t xing = i + 4 + (is_v1 ? (mono ? 17 : 32) : (mono ? 9 : 17));
+        size_t vbri = i + 4 + 32;
+
+        t->audio_start = start + i;
+        if (t->audio_start >= (uint32_t)r->size) {
+            break;
+        }
+        uint32_t audio_len = (uint32_t)r->size - t->audio_start;
+        t->duration_ms = (uint32_t)((uint64_t)audio_len * 8 / kbps);
+        t->points[t->count++] = (seek_point_t) {.ms = 0, .off = t->audio_start};
+
+        if (xing + 8 <= n && (memcmp(&buf[xing], "Xing", 4) == 0 || memcmp(&buf[xing], "Info", 4) == 0)) {
+            uint32_t flags = be32(&buf[xing + 4]);
+            size_t p = xing + 8;
+            if ((flags & 1) && p + 4 <= n) {
+                t->duration_ms = (uint32_t)((uint64_t)be32(&buf[p]) * spf * 1000 / sr);
+                p += 4;
+            }
+            if ((flags & 2) && p + 4 <= n) {
+                audio_len = be32(&buf[p]);
+                p += 4;
+            }
+            if ((flags & 4) && p + 100 <= n) {
+                for (int k = 1; k < 100; ++k) {
+                    add_point(t, (uint32_t)((uint64_t)t->duration_ms * k / 100),
+                              t->audio_start + (uint32_t)((uint64_t)buf[p + k] * audio_len / 256));
+                }
+            }
+        } else if (vbri + 26 <= n && memcmp(&buf[vbri], "VBRI", 4) == 0) {
+            uint32_t frames = be32(&buf[vbri + 14]);
+            uint16_t entries = be16(&buf[vbri + 18]);
+            uint16_t scale = be16(&buf[vbri + 20]);
+            uint16_t entry_size = be16(&buf[vbri + 22]);
+            uint16_t frames_per_entry = be16(&buf[vbri + 24]);
+            uint32_t off = t->audio_start;
+            t->duration_ms = (uint32_t)((uint64_t)frames * spf * 1000 / sr);
+            for (uint32_t k = 0; k < entries && entry_size <= 4; ++k) {
+                size_t p = vbri + 26 + k * entry_size;
+                if (p + entry_size > n) {
+                    break;
+                }
+                uint32_t val = 0;
+                for (uint16_t b = 0; b < entry_size; ++b) {
+                    val = (val << 8) | buf[p + b];
+                }
+                off += val * scale;
+                add_point(t, (uint32_t)((uint64_t)(k + 1) * frames_per_entry * spf * 1000 / sr), off);
+            }
+        }
+        add_point(t, t->duration_ms, (uint32_t)r->size);
+        t->interpolate = true;
+        t->align = 1;
+        ok = true;
+    }
+    free(buf);
+    return ok;
+}
+
+static bool build_wav(seek_table_t *t, seek_reader_t *r) {
+    uint8_t hdr[12];
+    uint32_t byte_rate = 0, block_align = 1;
+    uint32_t pos = sizeof(hdr);
+    if (sr_read_at(r, 0, hdr, sizeof(hdr)) != sizeof(hdr) ||
+        memcmp(hdr, "RIFF", 4) != 0 || memcmp(&hdr[8], "WAVE", 4) != 0) {
+        return false;
+    }
+    for (int i = 0; i < 16; ++i) {
+        uint8_t chunk[24];
+        if (sr_read_at(r, pos, chunk, sizeof(chunk)) < 8) {
+            return false;
+        }
+        uint32_t len = le32(&chunk[4]);
+        if (memcmp(chunk, "fmt ", 4) == 0 && len >= 16) {
+            byte_rate = le32(&chunk[16]);
+            block_align = le16(&chunk[20]);
+        } else if (memcmp(chunk, "data", 4) == 0) {
+            uint32_t data_start = pos + 8;
+            if (byte_rate == 0 || block_align == 0 || data_start > KZ_SEEK_MAX_PREFIX) {
+                return false;
+            }
+            uint32_t data_end = data_start + len;
+            if (data_end > (uint32_t)r->size) {
+                data_end = (uint32_t)r->size;
+            }
+            t->prefix = malloc(data_start);
+            if (t->prefix == NULL || sr_read_at(r, 0, t->prefix, data_start) != data_start) {
+                return false;
+            }
+            t->prefix_len = data_start;
+            t->audio_start = data_start;
+            t->duration_ms = (uint32_t)((uint64_t)(data_end - data_start) * 1000 / byte_rate);
+            t->points[t->count++] = (seek_point_t) {.ms = 0, .off = data_start};
+            add_point(t, t->duration_ms, data_end);
+            t->interpolate = true;
+            t->align = block_align;
+            return true;
+        }
+        pos += 8 + len + (len & 1);
+    }
+    return false;
+}
+
+// The decoder only needs fLaC and STREAMINFO, so that is all the prefix is
+static bool build_flac(seek_table_t *t, seek_reader_t *r) {
+    uint8_t hdr[4];
+    uint8_t si[34];
+    bool have_si = false;
+    bool last = false;
+    uint32_t pos = 4;
+    if (sr_read_at(r, 0, hdr, sizeof(hdr)) != sizeof(hdr) || memcmp(hdr, "fLaC", 4) != 0) {
+        return false;
+    }
+
+    while (!last) {
+        if (sr_read_at(r, pos, hdr, sizeof(hdr)) != sizeof(hdr)) {
+            return false;
+        }
+        last = (hdr[0] & 0x80) != 0;
+        uint8_t type = hdr[0] & 0x7F;
+        uint32_t len = be24(&hdr[1]);
+
+        if (type == 0 && len == sizeof(si)) {
+            if (sr_read_at(r, pos + 4, si, sizeof(si)) != sizeof(si)) {
+                return false;
+            }
+            uint16_t min_block = be16(si);
+            uint16_t max_block = be16(&si[2]);
+            t->rate = ((uint32_t)si[10] << 12) | ((uint32_t)si[11] << 4) | (si[12] >> 4);
+            uint64_t total = ((uint64_t)(si[13] & 0x0F) << 32) | be32(&si[14]);
+            if (t->rate == 0) {
+                return false;
+            }
+            t->duration_ms = (uint32_t)(total * 1000 / t->rate);
+            t->fixed_block = (min_block == max_block) ? min_block : 0;
+            have_si = true;
+        } else if (type == 3 && have_si) {
+            // Seek points are 18 bytes: sample, offset from the first frame
+            // and frame size. Only keep as many as we have room for.
+            uint32_t count = len / 18;
+            uint32_t stride = count / (KZ_SEEK_MAX_POINTS / 2) + 1;
+            uint8_t chunk[18 * 32];
+            size_t chunk_first = 0, chunk_count = 0;
+            for (uint32_t i = 0; i < count; i += stride) {
+                if (i >= chunk_first + chunk_count) {
+                    chunk_first = i;
+                    chunk_count = sr_read_at(r, pos + 4 + i * 18, chunk, sizeof(chunk)) / 18;
+                    if (chunk_count == 0) {
+                        break;
+                    }
+                }
+                const uint8_t *pt = &chunk[(i - chunk_first) * 18];
+                uint64_t sample = ((uint64_t)be32(pt) << 32) | be32(&pt[4]);
+                uint64_t off = ((uint64_t)be32(&pt[8]) << 32) | be32(&pt[12]);
+                if (sample == UINT64_MAX) {
+                    break;
+                }
+                // Offsets are relative to the first frame, fixed up below
+                add_point(t, (uint32_t)(sample * 1000 / t->rate), (uint32_t)off);
+            }
+        }
+        pos += 4 + len;
+    }
+    if (!have_si) {
+        return false;
+    }
+
+    t->audio_start = pos;
+    for (size_t i = 0; i < t->count; ++i) {
+        t->points[i].off += pos;
+    }
+    if (t->count == 0 || t->points[0].ms != 0) {
+        add_point(t, 0, pos);
+    }
+    add_point(t, t->duration_ms, (uint32_t)r->size);
+
+    t->prefix = malloc(4 + 4 + sizeof(si));
+    if (t->prefix == NULL) {
+        return false;
+    }
+    memcpy(t->prefix, "fLaC\x80\x00\x00\x22", 8);
+    memcpy(&t->prefix[8], si, sizeof(si));
+    t->prefix_len = 8 + sizeof(si);
+    t->probe = SEEK_PROBE_FLAC;
+    return true;
+}
+
+static uint32_t ogg_crc(const uint8_t *buf, size_t len) {
+    uint32_t crc = 0;
+    for (size_t i = 0; i < len; ++i) {
+        crc ^= (uint32_t)buf[i] << 24;
+        for (int b = 0; b < 8; ++b) {
+            crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+// Replay the header pages. If the comments make them too big, Opus can make
+// do with its ID page and an empty OpusTags page instead.
+static bool build_ogg(seek_table_t *t, seek_reader_t *r) {
+    uint8_t page[27 + 255];
+    uint8_t id[20] = {0};
+    uint32_t pos = 0, first_page_end = 0;
+    int packets = 0, needed = 0;
+    bool first_page_whole = false;
+
+    for (int i = 0; i < KZ_SEEK_MAX_OGG_PAGES && (needed == 0 || packets < needed); ++i) {
+        size_t n = sr_read_at(r, pos, page, sizeof(page));
+        if (n < 27 || memcmp(page, "OggS", 4) != 0 || n < 27u + page[26]) {
+            return false;
+        }
+        uint32_t body = 0;
+        int page_packets = 0;
+        for (int s = 0; s < page[26]; ++s) {
+            body += page[27 + s];
+            if (page[27 + s] < 255) {
+                page_packets++;
+            }
+        }
+        if (i == 0) {
+            t->serial = le32(&page[14]);
+            if (sr_read_at(r, pos + 27 + page[26], id, sizeof(id)) != sizeof(id)) {
+                return false;
+            }
+            if (memcmp(id, "OpusHead", 8) == 0) {
+                t->rate = 48000;
+                t->pre_skip = le16(&id[10]);
+                needed = 2;
+            } else if (memcmp(id, "\x01vorbis", 7) == 0) {
+                t->rate = le32(&id[12]);
+                needed = 3;
+            } else {
+                return false;
+            }
+            first_page_whole = (page_packets == 1 && page[27 + page[26] - 1] < 255);
+            first_page_end = 27 + page[26] + body;
+        }
+        packets += page_packets;
+        pos += 27 + page[26] + body;
+    }
+    if (packets < needed || t->rate == 0) {
+        return false;
+    }
+    t->audio_start = pos;
+
+    if (pos <= KZ_SEEK_MAX_PREFIX) {
+        t->prefix = malloc(pos);
+        if (t->prefix == NULL || sr_read_at(r, 0, t->prefix, pos) != pos) {
+            return false;
+        }
+        t->prefix_len = pos;
+    } else if (needed == 2 && first_page_whole && first_page_end + 44 <= KZ_SEEK_MAX_PREFIX) {
+        t->prefix = malloc(first_page_end + 44);
+        if (t->prefix == NULL || sr_read_at(r, 0, t->prefix, first_page_end) != first_page_end) {
+            return false;
+        }
+        uint8_t *tags = &t->prefix[first_page_end];
+        memset(tags, 0, 44);
+        memcpy(tags, "OggS", 4);
+        tags[14] = t->serial & 0xFF;
+        tags[15] = (t->serial >> 8) & 0xFF;
+        tags[16] = (t->serial >> 16) & 0xFF;
+        tags[17] = (t->serial >> 24) & 0xFF;
+        tags[18] = 1;               // page sequence number
+        tags[26] = 1;
+        tags[27] = 16;
+        memcpy(&tags[28], "OpusTags", 8);   // followed by empty vendor and no comments
+        uint32_t crc = ogg_crc(tags, 44);
+        tags[22] = crc & 0xFF;
+        tags[23] = (crc >> 8) & 0xFF;
+        tags[24] = (crc >> 16) & 0xFF;
+        tags[25] = (crc >> 24) & 0xFF;
+        t->prefix_len = first_page_end + 44;
+    } else {
+        return false;
+    }
+
+    // The last page's granule position is the stream length
+    uint8_t *tail = malloc(KZ_SEEK_OGG_TAIL);
+    if (tail == NULL) {
+        return false;
+    }
+    uint32_t tail_start = r->size > KZ_SEEK_OGG_TAIL ? (uint32_t)r->size - KZ_SEEK_OGG_TAIL : 0;
+    size_t n = sr_read_at(r, tail_start, tail, KZ_SEEK_OGG_TAIL);
+    for (long i = (long)n - 27; i >= 0; --i) {
+        if (memcmp(&tail[i], "OggS", 4) == 0 && le32(&tail[i + 14]) == t->serial) {
+            uint64_t granule = le64(&tail[i + 6]);
+            if (granule > t->pre_skip) {
+                t->duration_ms = (uint32_t)((granule - t->pre_skip) * 1000 / t->rate);
+            }
+            break;
+        }
+    }
+    free(tail);
+    if (t->duration_ms == 0) {
+        return false;
+    }
+
+    t->points[t->count++] = (seek_point_t) {.ms = 0, .off = t->audio_start};
+    add_point(t, t->duration_ms, (uint32_t)r->size);
+    t->probe = SEEK_PROBE_OGG;
+    return true;
+}
+
+static uint8_t flac_crc8(const uint8_t *buf, size_t len) {
+    uint8_t crc = 0;
+    for (size_t i = 0; i < len; ++i) {
+        crc ^= buf[i];
+        for (int b = 0; b < 8; ++b) {
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+// Check for a FLAC frame header at p and pull out its first sample. The
+// CRC-8 keeps us from locking onto sync codes in the middle of a frame.
+static bool flac_frame_sample(const seek_table_t *t, const uint8_t *p, size_t avail, uint64_t *sample) {
+    if (avail < 6 || p[0] != 0xFF || (p[1] & 0xFE) != 0xF8) {
+        return false;
+    }
+    uint8_t bs = p[2] >> 4;
+    uint8_t sr = p[2] & 0x0F;
+    if (bs == 0 || sr == 0x0F || (p[3] >> 4) >= 11 || ((p[3] >> 1) & 7) == 3 || (p[3] & 1)) {
+        return false;
+    }
+
+    // Frame/sample number, UTF-8 style
+    size_t pos = 4;
+    uint64_t num = p[pos++];
+    int extra;
+    if (!(num & 0x80)) {
+        extra = 0;
+    } else if ((num & 0xE0) == 0xC0) {
+        num &= 0x1F;
+        extra = 1;
+    } else if ((num & 0xF0) == 0xE0) {
+        num &= 0x0F;
+        extra = 2;
+    } else if ((num & 0xF8) == 0xF0) {
+        num &= 0x07;
+        extra = 3;
+    } else if ((num & 0xFC) == 0xF8) {
+        num &= 0x03;
+        extra = 4;
+    } else if ((num & 0xFE) == 0xFC) {
+        num &= 0x01;
+        extra = 5;
+    } else if (num == 0xFE) {
+        num = 0;
+        extra = 6;
+    } else {
+        return false;
+    }
+    if (pos + extra > avail) {
+        return false;
+    }
+    for (int i = 0; i < extra; ++i, ++pos) {
+        if ((p[pos] & 0xC0) != 0x80) {
+            return false;
+        }
+        num = (num << 6) | (p[pos] & 0x3F);
+    }
+    pos += (bs == 6) ? 1 : (bs == 7) ? 2 : 0;
+    pos += (sr == 12) ? 1 : (sr == 13 || sr == 14) ? 2 : 0;
+    if (pos >= avail || flac_crc8(p, pos) != p[pos]) {
+        return false;
+    }
+
+    if (p[1] & 1) {
+        *sample = num;
+    } else if (t->fixed_block != 0) {
+        *sample = num * t->fixed_block;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Find the first frame/page at or after off and the time it starts at. Ogg
+// granules are the end of the page, so a page is treated as starting there -
+// that only ever lands a little early.
+static bool probe(const seek_table_t *t, seek_reader_t *r, uint32_t off, seek_point_t *pt) {
+    uint8_t *buf = malloc(KZ_SEEK_PROBE_LEN);
+    bool found = false;
+    if (buf == NULL) {
+        return false;
+    }
+    for (uint32_t base = off; !found && base < off + KZ_SEEK_PROBE_MAX; base += KZ_SEEK_PROBE_LEN - KZ_SEEK_HDR_MAX) {
+        size_t n = sr_read_at(r, base, buf, KZ_SEEK_PROBE_LEN);
+        // Leave room for a whole header, unless this is the end of the file
+        size_t scan = n == KZ_SEEK_PROBE_LEN ? n - KZ_SEEK_HDR_MAX : n;
+        for (size_t i = 0; i < scan && !found; ++i) {
+            if (t->probe == SEEK_PROBE_OGG) {
+                if (i + 27 > n || memcmp(&buf[i], "OggS", 4) != 0 || buf[i + 4] != 0 ||
+                    (buf[i + 5] & ~7) != 0 || le32(&buf[i + 14]) != t->serial) {
+                    continue;
+                }
+                uint64_t granule = le64(&buf[i + 6]);
+                if (granule == UINT64_MAX) {
+                    continue;   // no packet finishes on this page
+                }
+                granule = granule > t->pre_skip ? granule - t->pre_skip : 0;
+                *pt = (seek_point_t) {.ms = (uint32_t)(granule * 1000 / t->rate), .off = base + i};
+                found = true;
+            } else {
+                uint64_t sample;
+                if (flac_frame_sample(t, &buf[i], n - i, &sample)) {
+                    *pt = (seek_point_t) {.ms = (uint32_t)(sample * 1000 / t->rate), .off = base + i};
+                    found = true;
+                }
+            }
+        }
+        if (n < KZ_SEEK_PROBE_LEN) {
+            break;
+        }
+    }
+    free(buf);
+    return found;
+}
+
+// Narrow the bracket around ms by probing the file, remembering every point
+// found along the way
+static void refine(seek_table_t *t, seek_reader_t *r, uint32_t ms) {
+    // Nothing starts between here and the upper point, so don't look there
+    uint32_t limit = UINT32_MAX;
+    for (int i = 0; i < KZ_SEEK_MAX_PROBES && t->count < KZ_SEEK_MAX_POINTS; ++i) {
+        size_t lo = find_lo(t, ms);
+        if (lo + 1 >= t->count) {
+            return;
+        }
+        seek_point_t a = t->points[lo], b = t->points[lo + 1];
+        uint32_t hi = b.off < limit ? b.off : limit;
+        if (hi <= a.off || hi - a.off <= KZ_SEEK_BISECT_SPAN) {
+            return;
+        }
+        // Guess by interpolating, but keep away from the ends so that a
+        // bad guess still shrinks the bracket
+        uint32_t span = hi - a.off;
+        uint32_t guess = a.off + (uint32_t)((uint64_t)(b.off - a.off) * (ms - a.ms) / (b.ms - a.ms));
+        uint32_t margin = span / 8;
+        if (guess < a.off + margin) {
+            guess = a.off + margin;
+        } else if (guess > hi - margin) {
+            guess = hi - margin;
+        }
+        seek_point_t p;
+        if (!probe(t, r, guess, &p) || p.off >= hi || p.ms >= b.ms) {
+            limit = guess;
+        } else if (p.ms <= a.ms) {
+            return;
+        } else {
+            add_point(t, p.ms, p.off);
+        }
+    }
+}
+
+static void free_table(seek_table_t *t) {
+    if (t == NULL) {
+        return;
+    }
+    free(t->points);
+    free(t->prefix);
+    free(t);
+}
+
+static seek_table_t *build_table(seek_reader_t *r) {
+    seek_table_t *t = calloc(1, sizeof(seek_table_t));
+    if (t == NULL) {
+        return NULL;
+    }
+    t->points = malloc(sizeof(seek_point_t) * KZ_SEEK_MAX_POINTS);
+    if (t->points == NULL || !sr_open(r)) {
+        free_table(t);
+        return NULL;
+    }
+
+    bool ok = false;
+    switch (kz_get_ext(r->path)) {
+        case AUD_EXT_MP3:
+            ok = build_mp3(t, r);
+            break;
+        case AUD_EXT_FLAC:
+            ok = build_flac(t, r);
+            break;
+        case AUD_EXT_OGG:
+        case AUD_EXT_OPUS:
+            ok = build_ogg(t, r);
+            break;
+        case AUD_EXT_WAV:
+            ok = build_wav(t, r);
+            break;
+        default:
+            break;
+    }
+    if (!ok || t->count < 2) {
+        free_table(t);
+        return NULL;
+    }
+    return t;
+}
+
+static seek_table_t *get_table(seek_reader_t *r) {
+    const uint32_t key = kz_path_hash(r->path);
+    size_t victim = 0;
+    struct stat st;
+
+    if (stat(r->path, &st) != 0) {
+        return NULL;
+    }
+    r->size = st.st_size;
+    r->mtime = st.st_mtime;
+
+    if (s_flushes != s_flushes_seen) {
+        s_flushes_seen = s_flushes;
+        for (size_t i = 0; i < KZ_SEEK_CACHE_SIZE; ++i) {
+            free_table(s_cache[i]);
+            s_cache[i] = NULL;
+        }
+    }
+    s_cache_clock++;
+    for (size_t i = 0; i < KZ_SEEK_CACHE_SIZE; ++i) {
+        if (s_cache[i] != NULL && s_cache[i]->key == key) {
+            if (s_cache[i]->size == r->size && s_cache[i]->mtime == r->mtime) {
+                s_cache[i]->last_used = s_cache_clock;
+                return s_cache[i];
+            }
+            // The file has changed since, so its old table goes first
+            free_table(s_cache[i]);
+            s_cache[i] = NULL;
+        }
+        if (s_cache[victim] != NULL &&
+            (s_cache[i] == NULL || s_cache[i]->last_used < s_cache[victim]->last_used)) {
+            victim = i;
+        }
+    }
+
+    seek_table_t *t = build_table(r);
+    if (t != NULL) {
+        free_table(s_cache[victim]);
+        t->key = key;
+        t->size = r->size;
+        t->mtime = r->mtime;
+        t->last_used = s_cache_clock;
+        s_cache[victim] = t;
+    }
+    return t;
+}
+
+void kz_seek_flush(void) {
+    s_flushes++;
+}
+
+esp_err_t kz_seek_find(const char *path, uint32_t ms, kz_seek_pos_t *pos) {
+    seek_reader_t r = {
+        .path = path,
+    };
+    esp_err_t ret = ESP_OK;
+    seek_table_t *t = get_table(&r);
+    if (t == NULL) {
+        ret = ESP_ERR_NOT_SUPPORTED;
+        goto kz_seek_find_cleanup;
+    }
+    if (t->probe != SEEK_PROBE_NONE) {
+        refine(t, &r, ms);
+    }
+
+    size_t lo = find_lo(t, ms);
+    const seek_point_t *a = &t->points[lo];
+    pos->ms = a->ms;
+    pos->byte_pos = a->off;
+    if (t->interpolate && lo + 1 < t->count) {
+        const seek_point_t *b = &t->points[lo + 1];
+        uint32_t off = a->off + (uint32_t)((uint64_t)(b->off - a->off) * (ms - a->ms) / (b->ms - a->ms));
+        pos->byte_pos = t->audio_start + (off - t->audio_start) / t->align * t->align;
+        pos->ms = ms;
+    }
+    pos->duration_ms = t->duration_ms;
+    pos->prefix = t->prefix;
+    pos->prefix_len = t->prefix_len;
+
+kz_seek_find_cleanup:
+    pos->reads = r.reads;
+    if (r.fp != NULL) {
+        fclose(r.fp);
+    }
+    return ret;
+}
@@ -0,0 +1,24 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+typedef struct {
+    uint32_t byte_pos;          // where the reader should carry on from
+    uint32_t ms;                // the time that position actually lands on
+    uint32_t duration_ms;
+    const uint8_t *prefix;      // headers the decoder needs to see first
+    size_t prefix_len;
+    uint32_t reads;             // SD reads the lookup needed, 0 when cached
+} kz_seek_pos_t;
+
+// Find where to restart the reader to play from ms. Seek tables are built
+// the first time a file is seeked in and then kept in a small cache, keyed
+// on the path, size and modification time so a changed file or another card
+// gets a new one. The prefix is only valid until the next call. Not thread
+// safe - only the player task uses it.
+esp_err_t kz_seek_find(const char *path, uint32_t ms, kz_seek_pos_t *pos);
+// Forget every table, e.g. because the card is going away. Safe from any
+// task, the cache is emptied on the next lookup.
+void kz_seek_flush(void);
@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_console.h"
+#include "esp_timer.h"
+
+#include "playlist.h"
+#include "player_be.h"
+#include "kz_prefetch.h"
+#include "kz_skipbench.h"
+
+#define KZ_SKIPBENCH_DEFAULT_PRESSES 20
+// About as fast as a thumb can click
+#define KZ_SKIPBENCH_DEFAULT_GAP_MS 80
+#define KZ_SKIPBENCH_TIMEOUT_MS 5000
+// Let each track play a little so bursts don't run into each other
+#define KZ_SKIPBENCH_SETTLE_MS 1500
+#define KZ_SKIPBENCH_POLL_MS 5
+
+// Wait for the player to time the skip which took in the press sent at
+// last_us
+static bool wait_for_skip(int64_t last_us, player_state_t *state) {
+    int64_t deadline = esp_timer_get_time() + KZ_SKIPBENCH_TIMEOUT_MS * 1000LL;
+    while (esp_timer_get_time() < deadline) {
+        vTaskDelay(pdMS_TO_TICKS(KZ_SKIPBENCH_POLL_MS));
+        if (player_get_state(state) && state->skip_press_us >= last_us) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Send n presses gap_ms apart, and print how long after the last one the
+// new track's audio started
+static void run_burst(int n, int gap_ms, bool prev) {
+    static player_state_t state;
+    int64_t last_us = 0;
+    for (int i = 0; i < n; ++i) {
+        if (i > 0) {
+            vTaskDelay(pdMS_TO_TICKS(gap_ms));
+        }
+        last_us = esp_timer_get_time();
+        if (prev) {
+            player_prev();
+        } else {
+            player_next();
+        }
+    }
+    if (wait_for_skip(last_us, &state)) {
+        printf("  %6u ms %-4s (%2u)", (unsigned)state.skip_ms, state.skip_head ? "head" : "",
+               (unsigned)state.skip_presses);
+    } else {
+        printf("  timed out        ");
+    }
+}
+
+static int skipbench_cmd(int argc, char **argv) {
+    int max = argc > 1 ? atoi(argv[1]) : KZ_SKIPBENCH_DEFAULT_PRESSES;
+    int gap_ms = argc > 2 ? atoi(argv[2]) : KZ_SKIPBENCH_DEFAULT_GAP_MS;
+    bool prev = argc > 3 && strcmp(argv[3], "prev") == 0;
+    if (max <= 0 || gap_ms < 0) {
+        return 1;
+    }
+    if (!player_is_playing()) {
+        printf("Start a track first\n");
+        return 1;
+    }
+
+    // Each burst size is timed with the next track's head decoded ahead
+    // and then without. "head" marks the skips that actually started from
+    // one; bursts landing anywhere but the predicted track won't.
+    bool prefetch = kz_prefetch_get_enabled();
+    printf("last press to audio (presses timed)\n");
+    printf("presses  prefetch on           prefetch off\n");
+    for (int n = 1; n <= max; ++n) {
+        printf("%7d", n);
+        kz_prefetch_set_enabled(true);
+        vTaskDelay(pdMS_TO_TICKS(KZ_SKIPBENCH_SETTLE_MS));
+        run_burst(n, gap_ms, prev);
+        kz_prefetch_set_enabled(false);
+        vTaskDelay(pdMS_TO_TICKS(KZ_SKIPBENCH_SETTLE_MS));
+        run_burst(n, gap_ms, prev);
+        printf("\n");
+    }
+    kz_prefetch_set_enabled(prefetch);
+    return 0;
+}
+
+esp_err_t kz_skipbench_init(void) {
+    const esp_console_cmd_t cmd = {
+        .command = "skipbench",
+        .help = "Send bursts of 1 to N next or previous presses a few ms apart and time each from its "
+                "last press to audio from the new track, with and without the next track prefetched. "
+                "Changes track, so play a throwaway playlist",
+        .hint = "[presses] [gap ms] [next|prev]",
+        .func = skipbench_cmd,
+    };
+    return esp_console_cmd_register(&cmd);
+}
@@ -0,0 +1,7 @@
+#include "esp_err.h"
+
+// Add the "skipbench" console command, which sends bursts of next presses
+// to the player and times each from its last press to the new track's
+// first audio, with and without the next track prefetched. Call after
+// kz_console_init().
+esp_err_t kz_skipbench_init(void);
@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_console.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "i2c_sched.h"
+#include "kz_prof.h"
+#include "kz_ssd1306.h"
+
+#define KZ_SSD1306_WIDTH 128
+#define KZ_SSD1306_PAGES 8
+// Bytes on the bus for each draw besides the pixels themselves: the column
+// and page range commands, plus the address and control bytes of both
+// transfers
+#define KZ_SSD1306_DRAW_OVERHEAD 10
+// Bus clock, and bits per byte on the wire once the ACK is counted
+#define KZ_SSD1306_I2C_HZ 400000
+#define KZ_SSD1306_BITS_PER_BYTE 9
+
+// Control byte ahead of a run of commands or of GDDRAM data
+#define SSD1306_CTRL_CMD 0x00
+#define SSD1306_CTRL_DATA 0x40
+#define SSD1306_CMD_SET_CONTRAST 0x81
+#define SSD1306_CMD_COLUMN_RANGE 0x21
+#define SSD1306_CMD_PAGE_RANGE 0x22
+
+static const char *TAG = "KZ_SSD1306";
+
+static uint8_t s_addr = 0;
+// What the panel is showing, in its own page format
+static uint8_t s_shadow[KZ_SSD1306_PAGES][KZ_SSD1306_WIDTH];
+
+// Only touched from the LVGL task
+static uint32_t s_bytes_sent = 0;
+static uint32_t s_bytes_full = 0;   // what flushing whole areas would have cost
+static uint32_t s_last_sent = 0;
+static uint32_t s_last_full = 0;
+static int64_t s_last_us = 0;
+
+// Queue the range commands and pixels for one area. The pixels are sent
+// from the shadow, which isn't touched again until the flush completes.
+static esp_err_t queue_draw(int x1, int x2, int page1, int page2, const uint8_t *pixels, size_t len) {
+    i2c_sched_xfer_t range = {
+        .addr = s_addr,
+        .prefix = {SSD1306_CTRL_CMD, SSD1306_CMD_COLUMN_RANGE, x1, x2, SSD1306_CMD_PAGE_RANGE, page1, page2},
+        .prefix_len = 7,
+    };
+    i2c_sched_xfer_t data = {
+        .addr = s_addr,
+        .prefix = {SSD1306_CTRL_DATA},
+        .prefix_len = 1,
+        .data = pixels,
+        .len = len,
+    };
+    esp_err_t ret = i2c_sched_submit(I2C_SCHED_DISPLAY, &range, portMAX_DELAY);
+    if (ret == ESP_OK) {
+        ret = i2c_sched_submit(I2C_SCHED_DISPLAY, &data, portMAX_DELAY);
+    }
+    return ret;
+}
+
+static void draw_span(int page, int x, const uint8_t *src, int len) {
+    memcpy(&s_shadow[page][x], src, len);
+    queue_draw(x, x + len - 1, page, page, &s_shadow[page][x], len);
+    s_bytes_sent += len + KZ_SSD1306_DRAW_OVERHEAD;
+}
+
+static void flush_done(esp_err_t ret, void *arg) {
+    lv_disp_flush_ready((lv_disp_drv_t *)arg);
+}
+
+// The port's rounder and pixel callbacks leave the area page aligned and
+// the buffer in page format, one row of bytes per page
+static void flush_cb(lv_disp_drv_t *drv, const lv_area_t *area, lv_color_t *color_map) {
+    const uint8_t *buf = (const uint8_t *)color_map;
+    int w = area->x2 - area->x1 + 1;
+    int first_page = area->y1 / 8;
+    int last_page = area->y2 / 8;
+    s_bytes_full += w * (last_page - first_page + 1) + KZ_SSD1306_DRAW_OVERHEAD;
+
+    for (int page = first_page; page <= last_page && page < KZ_SSD1306_PAGES; ++page) {
+        const uint8_t *src = buf + (page - first_page) * w;
+        const uint8_t *shadow = &s_shadow[page][area->x1];
+        int start = -1;
+        int same = 0;
+        for (int x = 0; x < w; ++x) {
+            if (src[x] != shadow[x]) {
+                start = start < 0 ? x : start;
+                same = 0;
+            } else if (start >= 0 && ++same > KZ_SSD1306_DRAW_OVERHEAD) {
+                // A gap this long costs more to resend than to skip
+                draw_span(page, area->x1 + start, src + start, x - same + 1 - start);
+                start = -1;
+                same = 0;
+            }
+        }
+        if (start >= 0) {
+            draw_span(page, area->x1 + start, src + start, w - same - start);
+        }
+    }
+    // LVGL carries on drawing into the other buffer while this goes out,
+    // and is told the flush is done once the bus gets to this marker
+    i2c_sched_xfer_t marker = {
+        .cb = flush_done,
+        .arg = drv,
+    };
+    if (i2c_sched_submit(I2C_SCHED_DISPLAY, &marker, portMAX_DELAY) != ESP_OK) {
+        lv_disp_flush_ready(drv);
+    }
+}
+
+esp_err_t kz_ssd1306_attach(lv_disp_t *disp, uint8_t addr) {
+    if (disp == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    s_addr = addr;
+    // The panel RAM is garbage after reset, so start from a known blank
+    memset(s_shadow, 0, sizeof(s_shadow));
+    i2c_sched_xfer_t range = {
+        .addr = s_addr,
+        .prefix = {SSD1306_CTRL_CMD, SSD1306_CMD_COLUMN_RANGE, 0, KZ_SSD1306_WIDTH - 1,
+                   SSD1306_CMD_PAGE_RANGE, 0, KZ_SSD1306_PAGES - 1},
+        .prefix_len = 7,
+    };
+    i2c_sched_xfer_t data = {
+        .addr = s_addr,
+        .prefix = {SSD1306_CTRL_DATA},
+        .prefix_len = 1,
+        .data = &s_shadow[0][0],
+        .len = sizeof(s_shadow),
+    };
+    esp_err_t ret = i2c_sched_xfer(I2C_SCHED_DISPLAY, &range);
+    if (ret == ESP_OK) {
+        ret = i2c_sched_xfer(I2C_SCHED_DISPLAY, &data);
+    }
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Unable to clear the panel: %s", esp_err_to_name(ret));
+        return ret;
+    }
+    s_last_us = esp_timer_get_time();
+    disp->driver->flush_cb = flush_cb;
+    return ESP_OK;
+}
+
+void kz_ssd1306_set_contrast(uint8_t contrast) {
+    i2c_sched_xfer_t cmd = {
+        .addr = s_addr,
+        .prefix = {SSD1306_CTRL_CMD, SSD1306_CMD_SET_CONTRAST, contrast},
+        .prefix_len = 3,
+    };
+    i2c_sched_submit(I2C_SCHED_DISPLAY, &cmd, portMAX_DELAY);
+}
+
+static void print_bus_stats(const char *name, i2c_sched_class_t cls) {
+    i2c_sched_stats_t st;
+    i2c_sched_get_stats(cls, &st);
+    printf("%-8s %7u transfers %7u chunks %9u bytes %4u errors, worst wait %u us, worst latency %u us\n",
+           name, (unsigned)st.xfers, (unsigned)st.chunks, (unsigned)st.bytes, (unsigned)st.errors,
+           (unsigned)st.max_wait_us, (unsigned)st.max_latency_us);
+}
+
+static int disp_cmd(int argc, char **argv) {
+    int64_t now = esp_timer_get_time();
+    uint32_t sent = s_bytes_sent;
+    uint32_t full = s_bytes_full;
+    uint32_t elapsed_ms = (uint32_t)((now - s_last_us) / 1000);
+    if (elapsed_ms == 0) {
+        return 0;
+    }
+    uint32_t sent_bps = (uint32_t)((uint64_t)(sent - s_last_sent) * 1000 / elapsed_ms);
+    uint32_t full_bps = (uint32_t)((uint64_t)(full - s_last_full) * 1000 / elapsed_ms);
+    // Hundredths of a percent of the bus
+    uint32_t busy = (uint32_t)((uint64_t)sent_bps * KZ_SSD1306_BITS_PER_BYTE * 10000 / KZ_SSD1306_I2C_HZ);
+    printf("I2C to the panel over the last %u ms: %u B/s sent (%u.%02u%% of the bus), %u B/s without diffing\n",
+           (unsigned)elapsed_ms, (unsigned)sent_bps, (unsigned)(busy / 100), (unsigned)(busy % 100),
+           (unsigned)full_bps);
+    uint16_t lvgl_load;
+    if (kz_prof_get_task_load("taskLVGL", &lvgl_load)) {
+        printf("LVGL task %u.%02u%% of a core\n", lvgl_load / 100, lvgl_load % 100);
+    }
+    // Since boot. The codec's worst latency is what a volume change or
+    // mute waits behind panel updates.
+    print_bus_stats("codec", I2C_SCHED_CODEC);
+    print_bus_stats("display", I2C_SCHED_DISPLAY);
+    s_last_sent = sent;
+    s_last_full = full;
+    s_last_us = now;
+    return 0;
+}
+
+esp_err_t kz_ssd1306_console_init(void) {
+    const esp_console_cmd_t cmd = {
+        .command = "disp",
+        .help = "Show display bytes per second and bus use since the last 'disp', against what full area "
+                "flushes would cost, the LVGL task's CPU load, and I2C transfer latency for the codec and panel",
+        .hint = NULL,
+        .func = disp_cmd,
+    };
+    return esp_console_cmd_register(&cmd);
+}
@@ -0,0 +1,14 @@
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "lvgl.h"
+
+// Take over LVGL's flush for the SSD1306 at this 7-bit address so that only
+// the columns which changed in each 8-row page go over I2C, queued behind
+// codec traffic on the bus scheduler. Call with the LVGL lock held, after
+// lvgl_port_add_disp() and i2c_sched_init().
+esp_err_t kz_ssd1306_attach(lv_disp_t *disp, uint8_t addr);
+// Queue a contrast change, 0x00 to 0xff
+void kz_ssd1306_set_contrast(uint8_t contrast);
+// Add the "disp" console command. Call after kz_console_init().
+esp_err_t kz_ssd1306_console_init(void);
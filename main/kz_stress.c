@@ -0,0 +1,215 @@
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_console.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_lvgl_port.h"
+#include "lvgl.h"
+
+#include "dynstr.h"
+#include "strstack.h"
+#include "playlist.h"
+#include "player_be.h"
+#include "kz_prof.h"
+#include "kz_telem.h"
+#include "kz_vis.h"
+#include "kz_stress.h"
+
+#define KZ_STRESS_ROOT "/sdcard"
+#define KZ_STRESS_DEFAULT_S 30
+#define KZ_STRESS_SAMPLE_MS 2
+#define KZ_STRESS_REPAINT_MS 20
+
+static const char *TAG = "KZ_STRESS";
+
+static volatile bool s_running = false;
+static volatile bool s_walk_done = true;
+static volatile bool s_repaint_done = true;
+
+// Written by the sample timer only
+static uint32_t s_starved = 0;
+static uint32_t s_underruns = 0;
+static bool s_was_starved = false;
+static uint8_t s_low_fill[KZ_TELEM_RB_COUNT];
+
+static uint32_t s_entries = 0;
+static uint32_t s_passes = 0;
+static uint32_t s_repaints = 0;
+
+static void sample_cb(void *arg) {
+    bool starved = player_output_starved();
+    if (starved) {
+        s_starved++;
+        if (!s_was_starved) {
+            s_underruns++;
+        }
+    }
+    s_was_starved = starved;
+
+    uint8_t fill[KZ_TELEM_RB_COUNT];
+    size_t n = player_get_buffer_fill(fill, KZ_TELEM_RB_COUNT);
+    for (size_t i = 0; i < n; ++i) {
+        s_low_fill[i] = fill[i] < s_low_fill[i] ? fill[i] : s_low_fill[i];
+    }
+}
+
+// Stat everything on the card, over and over, like a library scan would
+static void walk_task(void *arg) {
+    DIR *dp = NULL;
+    struct dirent *ep;
+    dynstr_handle_t curpath = dynstr_new();
+    strstack_handle_t dirs = strstack_new();
+    if (curpath == NULL || dirs == NULL) {
+        goto walk_task_cleanup;
+    }
+
+    while (s_running) {
+        if (strstack_depth(dirs) == 0) {
+            if (!strstack_push(dirs, KZ_STRESS_ROOT)) {
+                goto walk_task_cleanup;
+            }
+            s_passes++;
+        }
+        dynstr_assign(curpath, strstack_peek_top(dirs));
+        strstack_pop(dirs);
+
+        dp = opendir(dynstr_as_c_str(curpath));
+        if (dp == NULL) {
+            continue;
+        }
+        if (!dynstr_append_c_str(curpath, "/")) {
+            goto walk_task_cleanup;
+        }
+        size_t curpath_initial_len = dynstr_len(curpath);
+        while (s_running && (ep = readdir(dp)) != NULL) {
+            dynstr_truncate(curpath, curpath_initial_len);
+            if (!dynstr_append_c_str(curpath, ep->d_name)) {
+                goto walk_task_cleanup;
+            }
+            s_entries++;
+            if (ep->d_type == DT_DIR) {
+                if (ep->d_name[0] != '.' && !strstack_push(dirs, dynstr_as_c_str(curpath))) {
+                    goto walk_task_cleanup;
+                }
+                continue;
+            }
+            struct stat st;
+            stat(dynstr_as_c_str(curpath), &st);
+        }
+        closedir(dp);
+        dp = NULL;
+    }
+
+walk_task_cleanup:
+    if (dp != NULL) {
+        closedir(dp);
+    }
+    strstack_destroy(dirs);
+    dynstr_destroy(curpath);
+    s_walk_done = true;
+    vTaskDelete(NULL);
+}
+
+// Have LVGL redraw the whole screen every few frames
+static void repaint_task(void *arg) {
+    TickType_t last_wake = xTaskGetTickCount();
+    while (s_running) {
+        lvgl_port_lock(0);
+        lv_obj_invalidate(lv_scr_act());
+        lvgl_port_unlock();
+        s_repaints++;
+        vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(KZ_STRESS_REPAINT_MS));
+    }
+    s_repaint_done = true;
+    vTaskDelete(NULL);
+}
+
+static int stress_cmd(int argc, char **argv) {
+    int seconds = argc > 1 ? atoi(argv[1]) : KZ_STRESS_DEFAULT_S;
+    const char *fmt = player_get_format();
+    if (seconds <= 0 || s_running) {
+        return 1;
+    }
+    if (fmt == NULL) {
+        printf("Start a track first\n");
+        return 1;
+    }
+
+    s_starved = s_underruns = 0;
+    s_was_starved = false;
+    memset(s_low_fill, 100, sizeof(s_low_fill));
+    s_entries = s_passes = s_repaints = 0;
+    player_take_max_busy_us();
+    uint32_t vis_frames, vis_max_us;
+    kz_vis_take_stats(&vis_frames, &vis_max_us);
+
+    esp_timer_handle_t timer = NULL;
+    const esp_timer_create_args_t timer_args = {
+        .callback = sample_cb,
+        .name = "stress",
+    };
+    if (ESP_OK != esp_timer_create(&timer_args, &timer)) {
+        return 1;
+    }
+
+    // The load runs where the real scanner and LVGL work would
+    s_running = true;
+    s_walk_done = (pdPASS != xTaskCreatePinnedToCore(walk_task, "STRESS_FS", (4 * 1024), NULL,
+                                                     tskIDLE_PRIORITY + 1, NULL, PRO_CPU_NUM));
+    s_repaint_done = (pdPASS != xTaskCreatePinnedToCore(repaint_task, "STRESS_UI", (3 * 1024), NULL,
+                                                        CONFIG_KZ_SCHED_LVGL_PRIO, NULL,
+                                                        CONFIG_KZ_SCHED_UI_CORE));
+    ESP_LOGI(TAG, "Stressing for %d s while playing %s", seconds, fmt);
+    esp_timer_start_periodic(timer, KZ_STRESS_SAMPLE_MS * 1000);
+    vTaskDelay(pdMS_TO_TICKS(seconds * 1000));
+    esp_timer_stop(timer);
+    esp_timer_delete(timer);
+
+    kz_prof_summary_t prof;
+    bool have_prof = kz_prof_get_summary(&prof);
+    uint32_t busy_us = player_take_max_busy_us();
+    kz_vis_take_stats(&vis_frames, &vis_max_us);
+    s_running = false;
+    while (!s_walk_done || !s_repaint_done) {
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+
+    printf("%s for %d s: %u underruns, starved for %u ms\n", fmt, seconds, (unsigned)s_underruns,
+           (unsigned)(s_starved * KZ_STRESS_SAMPLE_MS));
+    printf("walked %u entries (%u passes), %u repaints\n", (unsigned)s_entries, (unsigned)s_passes,
+           (unsigned)s_repaints);
+    printf("lowest buffer fill");
+    for (size_t i = 0; i < KZ_TELEM_RB_COUNT; ++i) {
+        printf("  %s %u%%", kz_telem_rb_name(i), s_low_fill[i]);
+    }
+    printf("\n");
+    // Skip tracks during the run to include track changes
+    printf("player loop worst %u us on one command or event\n", (unsigned)busy_us);
+    // Only drawn on Now Playing, so leave the screen there to include it
+    if (vis_frames > 0) {
+        printf("visualizer %u frames, worst %u us\n", (unsigned)vis_frames, (unsigned)vis_max_us);
+    }
+    if (have_prof) {
+        printf("core0 %u.%02u%%  core1 %u.%02u%%\n", prof.core_load[0] / 100, prof.core_load[0] % 100,
+               prof.core_load[1] / 100, prof.core_load[1] % 100);
+    }
+    return 0;
+}
+
+esp_err_t kz_stress_init(void) {
+    const esp_console_cmd_t cmd = {
+        .command = "stress",
+        .help = "Walk the card and repaint the screen while a track plays, then report underruns. "
+                "Start a FLAC track first for the worst case",
+        .hint = "[seconds]",
+        .func = stress_cmd,
+    };
+    return esp_console_cmd_register(&cmd);
+}
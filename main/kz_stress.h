@@ -0,0 +1,6 @@
+#include "esp_err.h"
+
+// Add the "stress" console command, which loads the card and the display
+// while a track plays and reports any audio underruns. Call after
+// kz_console_init().
+esp_err_t kz_stress_init(void);
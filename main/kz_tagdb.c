@@ -0,0 +1,756 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "dynstr.h"
+#include "strstack.h"
+#include "kz_util.h"
+#include "kz_tags.h"
+#include "kz_rgcache.h"
+#include "kz_tagdb.h"
+
+#define KZ_TAGDB_MAGIC "KZDB"
+#define KZ_TAGDB_VERSION 2
+#define KZ_TAGDB_TMP_PATH KZ_RGCACHE_DIR "/tagdb.tmp"
+#define KZ_TAGDB_ROOT "/sdcard"
+#define KZ_TAGDB_UNKNOWN_ARTIST "Unknown Artist"
+#define KZ_TAGDB_UNKNOWN_ALBUM "Unknown Album"
+
+static const char *TAG = "KZ_TAGDB";
+
+// On-card layout: header, then artist, album and track tables, then a pool
+// of NUL-terminated strings referenced by offset. Artists are sorted by
+// name, albums by artist then name, tracks by album then path. The pool is
+// in the same order - artist names, album names, then each track's title
+// and path - so a page of any table reads its strings from one stretch of
+// the file, and every artist and album name is there once.
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t artist_count, album_count, track_count;
+    uint32_t artist_off, album_off, track_off, pool_off;
+} kz_tagdb_hdr_t;
+
+typedef struct {
+    uint32_t name_off;
+    uint32_t first_album;
+    uint32_t album_count;
+} kz_tagdb_artist_t;
+
+typedef struct {
+    uint32_t name_off;
+    uint32_t artist_id;
+    uint32_t first_track;
+    uint32_t track_count;
+} kz_tagdb_album_t;
+
+typedef struct {
+    uint32_t title_off;
+    uint32_t path_off;
+    uint32_t album_id;
+    uint32_t duration_ms;
+    uint32_t size;      // size and mtime let a rebuild skip unchanged files
+    uint32_t mtime;
+    uint32_t path_hash;
+} kz_tagdb_track_t;
+
+// One row per file while building; strings live in the build pool
+typedef struct {
+    uint32_t path_off, artist_off, album_off, title_off;
+    uint32_t duration_ms, size, mtime;
+} tagdb_rec_t;
+
+typedef struct {
+    char *pool;
+    size_t pool_len, pool_size;
+    uint32_t *names;    // open addressed set of the artist and album names in the pool
+    size_t name_count, names_size;
+    tagdb_rec_t *recs;
+    size_t rec_count, rec_size;
+} tagdb_build_t;
+
+typedef struct {
+    uint32_t hash, size, mtime, id;
+} tagdb_prev_ent_t;
+
+// The previous database, used to avoid re-reading tags of unchanged files
+typedef struct {
+    FILE *fp;
+    kz_tagdb_hdr_t hdr;
+    tagdb_prev_ent_t *ents;     // sorted by path hash
+} tagdb_prev_t;
+
+// Called for each audio file on the card, false stops the walk
+typedef bool (*tagdb_visit_t)(void *ctx, const char *path, const struct stat *st);
+
+static SemaphoreHandle_t s_lock = NULL;
+static FILE *s_fp = NULL;
+static kz_tagdb_hdr_t s_hdr;
+static volatile bool s_building = false;
+static volatile bool s_rescan = false;
+static const char *s_sort_pool = NULL;
+
+static bool read_at(FILE *fp, uint32_t off, void *buf, size_t len) {
+    return fseek(fp, off, SEEK_SET) == 0 && fread(buf, 1, len, fp) == len;
+}
+
+static void read_str(FILE *fp, const kz_tagdb_hdr_t *hdr, uint32_t off, char *buf, size_t len) {
+    buf[0] = '\0';
+    if (fseek(fp, hdr->pool_off + off, SEEK_SET) == 0) {
+        size_t n = fread(buf, 1, len - 1, fp);
+        buf[n] = '\0';
+    }
+}
+
+static bool read_hdr(FILE *fp, kz_tagdb_hdr_t *hdr) {
+    return read_at(fp, 0, hdr, sizeof(*hdr)) && memcmp(hdr->magic, KZ_TAGDB_MAGIC, 4) == 0 &&
+           hdr->version == KZ_TAGDB_VERSION;
+}
+
+static uint32_t pool_add(tagdb_build_t *b, const char *str) {
+    size_t len = strlen(str) + 1;
+    if (b->pool_len + len > b->pool_size) {
+        size_t new_size = b->pool_size == 0 ? 4096 : b->pool_size;
+        while (new_size < b->pool_len + len) {
+            new_size *= 2;
+        }
+        char *new_pool = realloc(b->pool, new_size);
+        if (new_pool == NULL) {
+            return UINT32_MAX;
+        }
+        b->pool = new_pool;
+        b->pool_size = new_size;
+    }
+    uint32_t off = b->pool_len;
+    memcpy(&b->pool[off], str, len);
+    b->pool_len += len;
+    return off;
+}
+
+static size_t name_slot(const tagdb_build_t *b, const uint32_t *names, size_t size, const char *str) {
+    size_t i = kz_path_hash(str) & (size - 1);
+    while (names[i] != UINT32_MAX && strcmp(&b->pool[names[i]], str) != 0) {
+        i = (i + 1) & (size - 1);
+    }
+    return i;
+}
+
+// Artist and album names repeat for every track, so each is only added once
+static uint32_t pool_intern(tagdb_build_t *b, const char *str) {
+    if (2 * (b->name_count + 1) > b->names_size) {
+        size_t new_size = b->names_size == 0 ? 256 : b->names_size * 2;
+        uint32_t *names = malloc(sizeof(*names) * new_size);
+        if (names == NULL) {
+            return UINT32_MAX;
+        }
+        memset(names, 0xFF, sizeof(*names) * new_size);
+        for (size_t i = 0; i < b->names_size; ++i) {
+            if (b->names[i] != UINT32_MAX) {
+                names[name_slot(b, names, new_size, &b->pool[b->names[i]])] = b->names[i];
+            }
+        }
+        free(b->names);
+        b->names = names;
+        b->names_size = new_size;
+    }
+    size_t slot = name_slot(b, b->names, b->names_size, str);
+    if (b->names[slot] == UINT32_MAX) {
+        uint32_t off = pool_add(b, str);
+        if (off == UINT32_MAX) {
+            return UINT32_MAX;
+        }
+        b->names[slot] = off;
+        b->name_count++;
+    }
+    return b->names[slot];
+}
+
+static bool add_rec(tagdb_build_t *b, const char *path, const char *artist, const char *album,
+                    const char *title, uint32_t duration_ms, const struct stat *st) {
+    if (b->rec_count == b->rec_size) {
+        size_t new_size = b->rec_size == 0 ? 256 : b->rec_size * 2;
+        tagdb_rec_t *new_recs = realloc(b->recs, sizeof(*b->recs) * new_size);
+        if (new_recs == NULL) {
+            return false;
+        }
+        b->recs = new_recs;
+        b->rec_size = new_size;
+    }
+    tagdb_rec_t *rec = &b->recs[b->rec_count];
+    rec->path_off = pool_add(b, path);
+    rec->artist_off = pool_intern(b, artist[0] != '\0' ? artist : KZ_TAGDB_UNKNOWN_ARTIST);
+    rec->album_off = pool_intern(b, album[0] != '\0' ? album : KZ_TAGDB_UNKNOWN_ALBUM);
+    rec->title_off = pool_add(b, title);
+    if (rec->path_off == UINT32_MAX || rec->artist_off == UINT32_MAX ||
+        rec->album_off == UINT32_MAX || rec->title_off == UINT32_MAX) {
+        return false;
+    }
+    rec->duration_ms = duration_ms;
+    rec->size = (uint32_t)st->st_size;
+    rec->mtime = (uint32_t)st->st_mtime;
+    b->rec_count++;
+    return true;
+}
+
+static int prev_cmp(const void *a, const void *b) {
+    uint32_t ha = ((const tagdb_prev_ent_t *)a)->hash;
+    uint32_t hb = ((const tagdb_prev_ent_t *)b)->hash;
+    return (ha > hb) - (ha < hb);
+}
+
+// Only the track table is read, in one pass, so this costs the same however
+// the strings are laid out
+static void prev_open(tagdb_prev_t *prev, const char *path) {
+    memset(prev, 0, sizeof(*prev));
+    prev->fp = fopen(path, "rb");
+    if (prev->fp == NULL) {
+        return;
+    }
+    if (!read_hdr(prev->fp, &prev->hdr) || prev->hdr.track_count == 0 ||
+        fseek(prev->fp, prev->hdr.track_off, SEEK_SET) != 0) {
+        goto prev_open_cleanup;
+    }
+    prev->ents = malloc(sizeof(*prev->ents) * prev->hdr.track_count);
+    if (prev->ents == NULL) {
+        goto prev_open_cleanup;
+    }
+    for (uint32_t i = 0; i < prev->hdr.track_count; ++i) {
+        kz_tagdb_track_t t;
+        if (fread(&t, sizeof(t), 1, prev->fp) != 1) {
+            goto prev_open_cleanup;
+        }
+        prev->ents[i] = (tagdb_prev_ent_t) {t.path_hash, t.size, t.mtime, i};
+    }
+    qsort(prev->ents, prev->hdr.track_count, sizeof(*prev->ents), prev_cmp);
+    return;
+
+prev_open_cleanup:
+    free(prev->ents);
+    prev->ents = NULL;
+    fclose(prev->fp);
+    prev->fp = NULL;
+}
+
+static void prev_close(tagdb_prev_t *prev) {
+    free(prev->ents);
+    if (prev->fp != NULL) {
+        fclose(prev->fp);
+    }
+    memset(prev, 0, sizeof(*prev));
+}
+
+// The previous row for path if the file hasn't changed since
+static const tagdb_prev_ent_t *prev_find(const tagdb_prev_t *prev, const char *path, const struct stat *st) {
+    if (prev->ents == NULL) {
+        return NULL;
+    }
+    tagdb_prev_ent_t key = {.hash = kz_path_hash(path)};
+    const tagdb_prev_ent_t *hit = bsearch(&key, prev->ents, prev->hdr.track_count, sizeof(key), prev_cmp);
+    if (hit == NULL || hit->size != (uint32_t)st->st_size || hit->mtime != (uint32_t)st->st_mtime) {
+        return NULL;
+    }
+    return hit;
+}
+
+// Copy a file's row from the previous database if it hasn't changed since
+static bool prev_reuse(tagdb_prev_t *prev, tagdb_build_t *b, const char *path, const struct stat *st) {
+    const tagdb_prev_ent_t *hit = prev_find(prev, path, st);
+    if (hit == NULL) {
+        return false;
+    }
+
+    const kz_tagdb_hdr_t *hdr = &prev->hdr;
+    kz_tagdb_track_t t;
+    kz_tagdb_album_t al;
+    kz_tagdb_artist_t ar;
+    if (!read_at(prev->fp, hdr->track_off + hit->id * sizeof(t), &t, sizeof(t)) ||
+        !read_at(prev->fp, hdr->album_off + t.album_id * sizeof(al), &al, sizeof(al)) ||
+        !read_at(prev->fp, hdr->artist_off + al.artist_id * sizeof(ar), &ar, sizeof(ar))) {
+        return false;
+    }
+    char title[KZ_TAGS_TITLE_LEN], album[KZ_TAGS_NAME_LEN], artist[KZ_TAGS_NAME_LEN];
+    read_str(prev->fp, hdr, t.title_off, title, sizeof(title));
+    read_str(prev->fp, hdr, al.name_off, album, sizeof(album));
+    read_str(prev->fp, hdr, ar.name_off, artist, sizeof(artist));
+
+    return add_rec(b, path, artist, album, title, t.duration_ms, st);
+}
+
+// Walk the whole card the same way the "Play All" playlist does
+static bool walk_card(const char *root, tagdb_visit_t visit, void *ctx) {
+    bool ok = false;
+    DIR *dp = NULL;
+    struct dirent *ep;
+    dynstr_handle_t curpath = dynstr_new();
+    strstack_handle_t dirs = strstack_new();
+    if (curpath == NULL || dirs == NULL || !strstack_push(dirs, root)) {
+        goto walk_card_cleanup;
+    }
+
+    while (strstack_depth(dirs) > 0) {
+        dynstr_assign(curpath, strstack_peek_top(dirs));
+        strstack_pop(dirs);
+
+        dp = opendir(dynstr_as_c_str(curpath));
+        if (dp == NULL) {
+            continue;
+        }
+        if (!dynstr_append_c_str(curpath, "/")) {
+            goto walk_card_cleanup;
+        }
+        size_t curpath_initial_len = dynstr_len(curpath);
+        while ((ep = readdir(dp)) != NULL) {
+            // Skip our own state directory and other hidden files
+            if (ep->d_name[0] == '.') {
+                continue;
+            }
+            dynstr_truncate(curpath, curpath_initial_len);
+            if (!dynstr_append_c_str(curpath, ep->d_name)) {
+                goto walk_card_cleanup;
+            }
+            const char *path = dynstr_as_c_str(curpath);
+
+            if (ep->d_type == DT_DIR) {
+                if (!strstack_push(dirs, path)) {
+                    goto walk_card_cleanup;
+                }
+                continue;
+            }
+            struct stat st;
+            if (AUD_EXT_UNKNOWN == kz_get_ext(path) || stat(path, &st) != 0) {
+                continue;
+            }
+            if (!visit(ctx, path, &st)) {
+                goto walk_card_cleanup;
+            }
+        }
+        closedir(dp);
+        dp = NULL;
+    }
+    ok = true;
+
+walk_card_cleanup:
+    if (dp != NULL) {
+        closedir(dp);
+    }
+    strstack_destroy(dirs);
+    dynstr_destroy(curpath);
+    return ok;
+}
+
+typedef struct {
+    tagdb_build_t *b;
+    tagdb_prev_t *prev;
+    kz_tags_t tags;
+    uint32_t reused;
+} tagdb_scan_t;
+
+static bool scan_visit(void *ctx, const char *path, const struct stat *st) {
+    tagdb_scan_t *scan = ctx;
+    if (prev_reuse(scan->prev, scan->b, path, st)) {
+        scan->reused++;
+        return true;
+    }
+    if (ESP_OK != kz_tags_read(path, &scan->tags)) {
+        return true;
+    }
+    kz_tags_default_title(path, &scan->tags);
+    return add_rec(scan->b, path, scan->tags.artist, scan->tags.album, scan->tags.title,
+                   scan->tags.duration_ms, st);
+}
+
+static bool scan_card(const char *root, tagdb_build_t *b, tagdb_prev_t *prev, uint32_t *reused) {
+    tagdb_scan_t *scan = calloc(1, sizeof(tagdb_scan_t));
+    if (scan == NULL) {
+        return false;
+    }
+    scan->b = b;
+    scan->prev = prev;
+    bool ok = walk_card(root, scan_visit, scan);
+    *reused = scan->reused;
+    free(scan);
+    return ok;
+}
+
+typedef struct {
+    const tagdb_prev_t *prev;
+    uint32_t count;
+} tagdb_check_t;
+
+static bool check_visit(void *ctx, const char *path, const struct stat *st) {
+    tagdb_check_t *check = ctx;
+    check->count++;
+    return prev_find(check->prev, path, st) != NULL;
+}
+
+// True if every audio file on the card is in the previous database as it
+// is now, and nothing else is. That's a walk of the directories and a stat
+// of each file: no tags are read and nothing is written.
+static bool card_unchanged(const char *root, const tagdb_prev_t *prev) {
+    tagdb_check_t check = {.prev = prev};
+    return prev->ents != NULL && walk_card(root, check_visit, &check) &&
+           check.count == prev->hdr.track_count;
+}
+
+static int rec_cmp(const void *a, const void *b) {
+    const tagdb_rec_t *ra = a, *rb = b;
+    int r = strcasecmp(&s_sort_pool[ra->artist_off], &s_sort_pool[rb->artist_off]);
+    if (r == 0) {
+        r = strcasecmp(&s_sort_pool[ra->album_off], &s_sort_pool[rb->album_off]);
+    }
+    if (r == 0) {
+        r = strcmp(&s_sort_pool[ra->path_off], &s_sort_pool[rb->path_off]);
+    }
+    return r;
+}
+
+static bool write_str(FILE *fp, const char *str) {
+    return fwrite(str, 1, strlen(str) + 1, fp) == strlen(str) + 1;
+}
+
+// Sort the rows and emit the three tables, then the strings they refer to
+// in the same order
+static bool write_db(tagdb_build_t *b, const char *path) {
+    bool ok = false;
+    kz_tagdb_hdr_t hdr = {
+        .magic = KZ_TAGDB_MAGIC,
+        .version = KZ_TAGDB_VERSION,
+    };
+    kz_tagdb_artist_t *artists = NULL;
+    kz_tagdb_album_t *albums = NULL;
+    FILE *fp = NULL;
+
+    s_sort_pool = b->pool;
+    qsort(b->recs, b->rec_count, sizeof(*b->recs), rec_cmp);
+
+    artists = malloc(sizeof(*artists) * (b->rec_count + 1));
+    albums = malloc(sizeof(*albums) * (b->rec_count + 1));
+    if (artists == NULL || albums == NULL) {
+        goto write_db_cleanup;
+    }
+    for (size_t i = 0; i < b->rec_count; ++i) {
+        const tagdb_rec_t *rec = &b->recs[i];
+        bool new_artist = (i == 0) ||
+            strcasecmp(&b->pool[rec->artist_off], &b->pool[b->recs[i - 1].artist_off]) != 0;
+        bool new_album = new_artist ||
+            strcasecmp(&b->pool[rec->album_off], &b->pool[b->recs[i - 1].album_off]) != 0;
+        if (new_artist) {
+            artists[hdr.artist_count++] = (kz_tagdb_artist_t) {
+                .first_album = hdr.album_count,
+            };
+        }
+        if (new_album) {
+            albums[hdr.album_count++] = (kz_tagdb_album_t) {
+                .artist_id = hdr.artist_count - 1,
+                .first_track = i,
+            };
+            artists[hdr.artist_count - 1].album_count++;
+        }
+        albums[hdr.album_count - 1].track_count++;
+    }
+    hdr.track_count = b->rec_count;
+    hdr.artist_off = sizeof(hdr);
+    hdr.album_off = hdr.artist_off + hdr.artist_count * sizeof(kz_tagdb_artist_t);
+    hdr.track_off = hdr.album_off + hdr.album_count * sizeof(kz_tagdb_album_t);
+    hdr.pool_off = hdr.track_off + hdr.track_count * sizeof(kz_tagdb_track_t);
+
+    // Names are those of each one's first track, so the build pool can be
+    // reached from the rows when it comes to writing them out
+    uint32_t pool_len = 0;
+    for (uint32_t i = 0; i < hdr.artist_count; ++i) {
+        artists[i].name_off = pool_len;
+        pool_len += strlen(&b->pool[b->recs[albums[artists[i].first_album].first_track].artist_off]) + 1;
+    }
+    for (uint32_t i = 0; i < hdr.album_count; ++i) {
+        albums[i].name_off = pool_len;
+        pool_len += strlen(&b->pool[b->recs[albums[i].first_track].album_off]) + 1;
+    }
+
+    mkdir(KZ_RGCACHE_DIR, 0775);
+    fp = fopen(path, "wb");
+    if (fp == NULL ||
+        fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        fwrite(artists, sizeof(*artists), hdr.artist_count, fp) != hdr.artist_count ||
+        fwrite(albums, sizeof(*albums), hdr.album_count, fp) != hdr.album_count) {
+        goto write_db_cleanup;
+    }
+    uint32_t album_id = 0;
+    for (size_t i = 0; i < b->rec_count; ++i) {
+        const tagdb_rec_t *rec = &b->recs[i];
+        while (i >= albums[album_id].first_track + albums[album_id].track_count) {
+            album_id++;
+        }
+        const char *track_path = &b->pool[rec->path_off];
+        kz_tagdb_track_t t = {
+            .title_off = pool_len,
+            .path_off = pool_len + strlen(&b->pool[rec->title_off]) + 1,
+            .album_id = album_id,
+            .duration_ms = rec->duration_ms,
+            .size = rec->size,
+            .mtime = rec->mtime,
+            .path_hash = kz_path_hash(track_path),
+        };
+        pool_len = t.path_off + strlen(track_path) + 1;
+        if (fwrite(&t, sizeof(t), 1, fp) != 1) {
+            goto write_db_cleanup;
+        }
+    }
+    for (uint32_t i = 0; i < hdr.artist_count; ++i) {
+        if (!write_str(fp, &b->pool[b->recs[albums[artists[i].first_album].first_track].artist_off])) {
+            goto write_db_cleanup;
+        }
+    }
+    for (uint32_t i = 0; i < hdr.album_count; ++i) {
+        if (!write_str(fp, &b->pool[b->recs[albums[i].first_track].album_off])) {
+            goto write_db_cleanup;
+        }
+    }
+    for (size_t i = 0; i < b->rec_count; ++i) {
+        if (!write_str(fp, &b->pool[b->recs[i].title_off]) || !write_str(fp, &b->pool[b->recs[i].path_off])) {
+            goto write_db_cleanup;
+        }
+    }
+    ok = true;
+
+write_db_cleanup:
+    if (fp != NULL && fclose(fp) != 0) {
+        ok = false;
+    }
+    free(albums);
+    free(artists);
+    return ok;
+}
+
+static void build_db(void) {
+    tagdb_build_t b = {0};
+    tagdb_prev_t prev;
+    uint32_t reused = 0;
+    int64_t start = esp_timer_get_time();
+
+    // Most mounts are of the same card as last time with nothing changed,
+    // which is found out without reading a tag or writing anything
+    prev_open(&prev, KZ_TAGDB_PATH);
+    if (card_unchanged(KZ_TAGDB_ROOT, &prev)) {
+        ESP_LOGI(TAG, "%u tracks unchanged, checked in %lld ms", (unsigned)prev.hdr.track_count,
+                 (esp_timer_get_time() - start) / 1000);
+        prev_close(&prev);
+        return;
+    }
+    bool ok = scan_card(KZ_TAGDB_ROOT, &b, &prev, &reused);
+    prev_close(&prev);
+    ok = ok && write_db(&b, KZ_TAGDB_TMP_PATH);
+
+    if (ok) {
+        // Swap the new database in under the lock so readers never see a
+        // half-written file
+        xSemaphoreTake(s_lock, portMAX_DELAY);
+        if (s_fp != NULL) {
+            fclose(s_fp);
+            s_fp = NULL;
+        }
+        remove(KZ_TAGDB_PATH);
+        rename(KZ_TAGDB_TMP_PATH, KZ_TAGDB_PATH);
+        xSemaphoreGive(s_lock);
+        ESP_LOGI(TAG, "Indexed %u tracks (%u unchanged) in %lld ms", (unsigned)b.rec_count,
+                 (unsigned)reused, (esp_timer_get_time() - start) / 1000);
+    } else {
+        ESP_LOGE(TAG, "Failed to build the tag database");
+    }
+
+    free(b.recs);
+    free(b.names);
+    free(b.pool);
+}
+
+static void kz_tagdb_task(void *arg) {
+    // A card swapped mid-scan asks for another pass rather than a new task
+    bool again = true;
+    while (again) {
+        build_db();
+        xSemaphoreTake(s_lock, portMAX_DELAY);
+        again = s_rescan;
+        s_rescan = false;
+        s_building = again;
+        xSemaphoreGive(s_lock);
+    }
+    vTaskDelete(NULL);
+}
+
+esp_err_t kz_tagdb_init(void) {
+    if (s_lock == NULL) {
+        s_lock = xSemaphoreCreateMutex();
+        if (s_lock == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    bool building = s_building;
+    s_rescan = building;
+    s_building = true;
+    xSemaphoreGive(s_lock);
+    if (building) {
+        return ESP_OK;
+    }
+    // Just above idle so the scan only ever uses spare cycles
+    if (pdPASS != xTaskCreatePinnedToCore(kz_tagdb_task, "TAGDB", (6 * 1024), NULL,
+                                          tskIDLE_PRIORITY + 1, NULL, PRO_CPU_NUM)) {
+        s_building = false;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+bool kz_tagdb_is_building(void) {
+    return s_building;
+}
+
+void kz_tagdb_release(void) {
+    if (s_lock == NULL) {
+        return;
+    }
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (s_fp != NULL) {
+        fclose(s_fp);
+        s_fp = NULL;
+    }
+    xSemaphoreGive(s_lock);
+}
+
+// Must be called with s_lock held
+static bool ensure_open(void) {
+    if (s_fp != NULL) {
+        return true;
+    }
+    s_fp = fopen(KZ_TAGDB_PATH, "rb");
+    if (s_fp == NULL) {
+        return false;
+    }
+    if (!read_hdr(s_fp, &s_hdr)) {
+        fclose(s_fp);
+        s_fp = NULL;
+        return false;
+    }
+    return true;
+}
+
+uint32_t kz_tagdb_count(kz_tagdb_level_e level, uint32_t parent) {
+    uint32_t count = 0;
+    if (s_lock == NULL) {
+        return 0;
+    }
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (ensure_open()) {
+        kz_tagdb_artist_t ar;
+        kz_tagdb_album_t al;
+        switch (level) {
+            case KZ_TAGDB_ARTISTS:
+                count = s_hdr.artist_count;
+                break;
+            case KZ_TAGDB_ALBUMS:
+                if (parent < s_hdr.artist_count &&
+                    read_at(s_fp, s_hdr.artist_off + parent * sizeof(ar), &ar, sizeof(ar))) {
+                    count = ar.album_count;
+                }
+                break;
+            case KZ_TAGDB_TRACKS:
+                if (parent < s_hdr.album_count &&
+                    read_at(s_fp, s_hdr.album_off + parent * sizeof(al), &al, sizeof(al))) {
+                    count = al.track_count;
+                }
+                break;
+        }
+    }
+    xSemaphoreGive(s_lock);
+    return count;
+}
+
+size_t kz_tagdb_fetch(kz_tagdb_level_e level, uint32_t parent, uint32_t first, size_t count, kz_tagdb_item_t *items) {
+    size_t fetched = 0;
+    if (s_lock == NULL) {
+        return 0;
+    }
+    int64_t start = esp_timer_get_time();
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (!ensure_open()) {
+        goto kz_tagdb_fetch_cleanup;
+    }
+
+    // Find where the parent's children start in the table we're paging
+    uint32_t base = 0, total = 0, table_off = 0;
+    size_t rec_len = 0;
+    if (level == KZ_TAGDB_ARTISTS) {
+        total = s_hdr.artist_count;
+        table_off = s_hdr.artist_off;
+        rec_len = sizeof(kz_tagdb_artist_t);
+    } else if (level == KZ_TAGDB_ALBUMS) {
+        kz_tagdb_artist_t ar;
+        if (parent >= s_hdr.artist_count ||
+            !read_at(s_fp, s_hdr.artist_off + parent * sizeof(ar), &ar, sizeof(ar))) {
+            goto kz_tagdb_fetch_cleanup;
+        }
+        base = ar.first_album;
+        total = ar.album_count;
+        table_off = s_hdr.album_off;
+        rec_len = sizeof(kz_tagdb_album_t);
+    } else {
+        kz_tagdb_album_t al;
+        if (parent >= s_hdr.album_count ||
+            !read_at(s_fp, s_hdr.album_off + parent * sizeof(al), &al, sizeof(al))) {
+            goto kz_tagdb_fetch_cleanup;
+        }
+        base = al.first_track;
+        total = al.track_count;
+        table_off = s_hdr.track_off;
+        rec_len = sizeof(kz_tagdb_track_t);
+    }
+    if (first >= total) {
+        goto kz_tagdb_fetch_cleanup;
+    }
+    if (count > total - first) {
+        count = total - first;
+    }
+
+    // Every record type starts with its name offset
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t id = base + first + i;
+        uint32_t name_off;
+        if (!read_at(s_fp, table_off + id * rec_len, &name_off, sizeof(name_off))) {
+            break;
+        }
+        items[i].id = id;
+        read_str(s_fp, &s_hdr, name_off, items[i].name, sizeof(items[i].name));
+        fetched++;
+    }
+
+kz_tagdb_fetch_cleanup:
+    xSemaphoreGive(s_lock);
+    ESP_LOGD(TAG, "Fetched %u items in %lld us", (unsigned)fetched, esp_timer_get_time() - start);
+    return fetched;
+}
+
+esp_err_t kz_tagdb_track_path(uint32_t track_id, char *path, size_t len) {
+    esp_err_t ret = ESP_ERR_NOT_FOUND;
+    if (s_lock == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    kz_tagdb_track_t t;
+    if (ensure_open() && track_id < s_hdr.track_count &&
+        read_at(s_fp, s_hdr.track_off + track_id * sizeof(t), &t, sizeof(t))) {
+        read_str(s_fp, &s_hdr, t.path_off, path, len);
+        ret = ESP_OK;
+    }
+    xSemaphoreGive(s_lock);
+    return ret;
+}
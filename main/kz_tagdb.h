@@ -0,0 +1,34 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#define KZ_TAGDB_PATH "/sdcard/.kitzune/tagdb.bin"
+#define KZ_TAGDB_NAME_LEN 64
+
+typedef enum {
+    KZ_TAGDB_ARTISTS,
+    KZ_TAGDB_ALBUMS,    // albums of an artist
+    KZ_TAGDB_TRACKS,    // tracks of an album
+} kz_tagdb_level_e;
+
+typedef struct {
+    uint32_t id;
+    char name[KZ_TAGDB_NAME_LEN];
+} kz_tagdb_item_t;
+
+// Start the background task which (re)builds the database from the card.
+// If no audio file was added, removed or changed since the last build it
+// stops after checking. Calling it again mid-build queues one more pass
+// once the current one ends.
+esp_err_t kz_tagdb_init(void);
+bool kz_tagdb_is_building(void);
+// Close the open database, e.g. because the card is going away
+void kz_tagdb_release(void);
+
+// Every table is fixed-size records laid out so the children of any entry
+// are contiguous, so a page costs the same regardless of library size
+uint32_t kz_tagdb_count(kz_tagdb_level_e level, uint32_t parent);
+size_t kz_tagdb_fetch(kz_tagdb_level_e level, uint32_t parent, uint32_t first, size_t count, kz_tagdb_item_t *items);
+esp_err_t kz_tagdb_track_path(uint32_t track_id, char *path, size_t len);
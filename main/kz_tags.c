@@ -0,0 +1,804 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "kz_util.h"
+#include "kz_tags.h"
+
+// Tag frames/comments bigger than this are cover art or lyrics - skip them
+#define KZ_TAGS_MAX_FIELD 512
+// Upper bound on how much of a comment block/packet we are willing to read
+#define KZ_TAGS_MAX_BLOCK (16 * 1024)
+#define KZ_TAGS_MAX_OGG_PAGES 16
+// How far back from the end of an Ogg file we look for the last granule
+#define KZ_TAGS_OGG_TAIL (8 * 1024)
+#define KZ_TAGS_MAX_MP4_ATOMS 256
+#define KZ_TAGS_CACHE_SIZE 16
+
+typedef struct {
+    FILE *fp;
+    kz_tags_t *tags;
+    // ID3v2.2/2.3 tag unsynchronisation, and whether the last byte was
+    // 0xFF. Only id3_read looks at these.
+    bool unsync;
+    bool after_ff;
+} tag_reader_t;
+
+typedef struct {
+    uint32_t key;
+    uint32_t last_used;
+    kz_tags_t tags;
+} kz_tags_cache_ent_t;
+
+static kz_tags_cache_ent_t s_cache[KZ_TAGS_CACHE_SIZE];
+static uint32_t s_cache_clock = 0;
+
+static bool tr_read(tag_reader_t *r, void *buf, size_t len) {
+    size_t n = fread(buf, 1, len, r->fp);
+    r->tags->bytes_read += n;
+    return n == len;
+}
+
+static bool tr_skip(tag_reader_t *r, long len) {
+    return fseek(r->fp, len, SEEK_CUR) == 0;
+}
+
+static long tr_size(tag_reader_t *r) {
+    long pos = ftell(r->fp);
+    fseek(r->fp, 0, SEEK_END);
+    long size = ftell(r->fp);
+    fseek(r->fp, pos, SEEK_SET);
+    return size;
+}
+
+static uint32_t be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint32_t be24(const uint8_t *p) {
+    return ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+}
+
+static uint32_t le32(const uint8_t *p) {
+    return ((uint32_t)p[3] << 24) | ((uint32_t)p[2] << 16) | ((uint32_t)p[1] << 8) | p[0];
+}
+
+static uint64_t le64(const uint8_t *p) {
+    return ((uint64_t)le32(&p[4]) << 32) | le32(p);
+}
+
+static uint32_t syncsafe32(const uint8_t *p) {
+    return ((uint32_t)(p[0] & 0x7F) << 21) | ((uint32_t)(p[1] & 0x7F) << 14) |
+           ((uint32_t)(p[2] & 0x7F) << 7) | (p[3] & 0x7F);
+}
+
+static void set_str(char *dst, size_t dst_len, const char *src) {
+    strncpy(dst, src, dst_len - 1);
+    dst[dst_len - 1] = '\0';
+}
+
+// Every format funnels its key/value pairs through here
+static void tags_on_field(kz_tags_t *tags, const char *key, const char *val) {
+    if (strcasecmp(key, "TITLE") == 0) {
+        set_str(tags->title, sizeof(tags->title), val);
+    } else if (strcasecmp(key, "ARTIST") == 0) {
+        set_str(tags->artist, sizeof(tags->artist), val);
+    } else if (strcasecmp(key, "ALBUM") == 0) {
+        set_str(tags->album, sizeof(tags->album), val);
+    } else if (strcasecmp(key, "REPLAYGAIN_TRACK_GAIN") == 0) {
+        tags->track_gain_db = strtof(val, NULL);
+        tags->has_track_gain = true;
+    } else if (strcasecmp(key, "REPLAYGAIN_TRACK_PEAK") == 0) {
+        tags->track_peak = strtof(val, NULL);
+        tags->has_track_peak = tags->track_peak > 0.0f;
+    } else if (strcasecmp(key, "R128_TRACK_GAIN") == 0 && !tags->has_track_gain) {
+        // Opus stores Q7.8 dB relative to -23 LUFS
+        tags->track_gain_db = strtol(val, NULL, 10) / 256.0f + (KZ_TAGS_RG_REFERENCE_LUFS + 23.0f);
+        tags->has_track_gain = true;
+    }
+}
+
+static size_t utf8_put(char *out, size_t pos, size_t out_len, uint32_t cp) {
+    char enc[3];
+    size_t n;
+    if (cp < 0x80) {
+        enc[0] = (char)cp;
+        n = 1;
+    } else if (cp < 0x800) {
+        enc[0] = (char)(0xC0 | (cp >> 6));
+        enc[1] = (char)(0x80 | (cp & 0x3F));
+        n = 2;
+    } else {
+        enc[0] = (char)(0xE0 | (cp >> 12));
+        enc[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        enc[2] = (char)(0x80 | (cp & 0x3F));
+        n = 3;
+    }
+    if (pos + n >= out_len) {
+        return pos;
+    }
+    memcpy(&out[pos], enc, n);
+    return pos + n;
+}
+
+// Decode one NUL-terminated ID3 string into UTF-8, returning the number of
+// input bytes consumed (including the terminator)
+static size_t id3_decode_str(uint8_t enc, const uint8_t *in, size_t in_len, char *out, size_t out_len) {
+    size_t i = 0, o = 0;
+    if (enc == 1 || enc == 2) {
+        bool big_endian = (enc == 2);
+        if (in_len >= 2 && in[0] == 0xFF && in[1] == 0xFE) {
+            big_endian = false;
+            i = 2;
+        } else if (in_len >= 2 && in[0] == 0xFE && in[1] == 0xFF) {
+            big_endian = true;
+            i = 2;
+        }
+        for (; i + 1 < in_len; i += 2) {
+            uint32_t cp = big_endian ? ((in[i] << 8) | in[i + 1]) : ((in[i + 1] << 8) | in[i]);
+            if (cp == 0) {
+                i += 2;
+                break;
+            }
+            // Anything outside the BMP is replaced, it isn't worth the code
+            o = utf8_put(out, o, out_len, (cp >= 0xD800 && cp < 0xE000) ? '?' : cp);
+        }
+    } else {
+        for (; i < in_len; ++i) {
+            if (in[i] == 0) {
+                i++;
+                break;
+            }
+            if (enc == 3) {
+                if (o + 1 < out_len) {
+                    out[o++] = (char)in[i];
+                }
+            } else {
+                o = utf8_put(out, o, out_len, in[i]);
+            }
+        }
+    }
+    out[o] = '\0';
+    return i;
+}
+
+static void id3_on_frame(tag_reader_t *r, const char *id, const uint8_t *data, size_t len) {
+    char key[64], val[KZ_TAGS_MAX_FIELD];
+    if (len < 2) {
+        return;
+    }
+    if (strcmp(id, "TXXX") == 0 || strcmp(id, "TXX") == 0) {
+        size_t used = id3_decode_str(data[0], &data[1], len - 1, key, sizeof(key));
+        id3_decode_str(data[0], &data[1 + used], len - 1 - used, val, sizeof(val));
+        tags_on_field(r->tags, key, val);
+        return;
+    }
+
+    const char *field = NULL;
+    if (strcmp(id, "TIT2") == 0 || strcmp(id, "TT2") == 0) {
+        field = "TITLE";
+    } else if (strcmp(id, "TPE1") == 0 || strcmp(id, "TP1") == 0) {
+        field = "ARTIST";
+    } else if (strcmp(id, "TALB") == 0 || strcmp(id, "TAL") == 0) {
+        field = "ALBUM";
+    } else if (strcmp(id, "TLEN") == 0 || strcmp(id, "TLE") == 0) {
+        id3_decode_str(data[0], &data[1], len - 1, val, sizeof(val));
+        r->tags->duration_ms = strtoul(val, NULL, 10);
+        return;
+    }
+    if (field != NULL) {
+        id3_decode_str(data[0], &data[1], len - 1, val, sizeof(val));
+        tags_on_field(r->tags, field, val);
+    }
+}
+
+// Unsynchronisation stuffs a 0x00 after every 0xFF so nothing in the tag
+// looks like an MPEG sync word. In v2.2/2.3 it covers the whole tag and is
+// undone on the way in, so these read and skip the tag as it was before.
+static bool id3_read(tag_reader_t *r, uint8_t *buf, size_t len) {
+    if (!r->unsync) {
+        return tr_read(r, buf, len);
+    }
+    for (size_t i = 0; i < len; ++i) {
+        int c = getc(r->fp);
+        if (c == 0 && r->after_ff) {
+            r->tags->bytes_read++;
+            c = getc(r->fp);
+        }
+        if (c == EOF) {
+            return false;
+        }
+        r->tags->bytes_read++;
+        r->after_ff = (c == 0xFF);
+        buf[i] = (uint8_t)c;
+    }
+    return true;
+}
+
+static bool id3_skip(tag_reader_t *r, uint32_t len) {
+    if (!r->unsync) {
+        return tr_skip(r, len);
+    }
+    uint8_t buf[64];
+    while (len > 0) {
+        uint32_t n = len < sizeof(buf) ? len : sizeof(buf);
+        if (!id3_read(r, buf, n)) {
+            return false;
+        }
+        len -= n;
+    }
+    return true;
+}
+
+// In v2.4 it's per frame instead, and frame sizes count the stuffed bytes
+static size_t id3_unsync_frame(uint8_t *data, size_t len) {
+    size_t o = 0;
+    for (size_t i = 0; i < len; ++i) {
+        data[o++] = data[i];
+        if (data[i] == 0xFF && i + 1 < len && data[i + 1] == 0) {
+            i++;
+        }
+    }
+    return o;
+}
+
+// How much of the tag is left to read, in stored bytes
+static uint32_t id3_left(tag_reader_t *r, long tag_end) {
+    long left = tag_end - ftell(r->fp);
+    return left > 0 ? (uint32_t)left : 0;
+}
+
+// Returns the offset of the first byte after the tag (0 if there is none)
+static long read_id3v2(tag_reader_t *r) {
+    uint8_t hdr[10];
+    if (!tr_read(r, hdr, sizeof(hdr)) || memcmp(hdr, "ID3", 3) != 0) {
+        return 0;
+    }
+    const uint8_t ver = hdr[3];
+    const uint32_t tag_size = syncsafe32(&hdr[6]);
+    const size_t fhdr_len = (ver == 2) ? 6 : 10;
+    const long tag_end = sizeof(hdr) + tag_size;
+    const long audio_start = tag_end + ((hdr[5] & 0x10) ? 10 : 0);
+
+    if (ver < 2 || ver > 4) {
+        return audio_start;
+    }
+    r->unsync = (ver < 4) && (hdr[5] & 0x80);
+    r->after_ff = false;
+    if (hdr[5] & 0x40) {
+        uint8_t ext[4];
+        if (!id3_read(r, ext, sizeof(ext))) {
+            return audio_start;
+        }
+        // v2.3 excludes the size field itself, v2.4 includes it
+        uint32_t ext_len = (ver == 4) ? syncsafe32(ext) : be32(ext);
+        if (ver == 4) {
+            if (ext_len < sizeof(ext)) {
+                return audio_start;
+            }
+            ext_len -= sizeof(ext);
+        }
+        if (ext_len > id3_left(r, tag_end) || !id3_skip(r, ext_len)) {
+            return audio_start;
+        }
+    }
+
+    uint8_t *data = malloc(KZ_TAGS_MAX_FIELD);
+    if (data == NULL) {
+        return audio_start;
+    }
+    while (id3_left(r, tag_end) >= fhdr_len) {
+        uint8_t fhdr[10];
+        char id[5] = {0};
+        uint32_t size;
+        uint8_t flags = 0;
+        if (!id3_read(r, fhdr, fhdr_len) || fhdr[0] == 0) {
+            break;
+        }
+        if (ver == 2) {
+            memcpy(id, fhdr, 3);
+            size = be24(&fhdr[3]);
+        } else {
+            memcpy(id, fhdr, 4);
+            size = (ver == 4) ? syncsafe32(&fhdr[4]) : be32(&fhdr[4]);
+            flags = fhdr[9];
+        }
+        // A frame can't hold more than is left of the tag
+        if (size > id3_left(r, tag_end)) {
+            break;
+        }
+        // Compressed and encrypted frames aren't worth the code
+        bool usable = (ver == 4) ? !(flags & 0x0C) : !(flags & 0xC0);
+        if (id[0] == 'T' && usable && size <= KZ_TAGS_MAX_FIELD) {
+            if (!id3_read(r, data, size)) {
+                break;
+            }
+            size_t len = size;
+            if (ver == 4 && ((hdr[5] & 0x80) || (flags & 0x02))) {
+                len = id3_unsync_frame(data, len);
+            }
+            // Skip a group byte and a v2.4 data length in front of the data
+            size_t skip = ((ver == 4 ? flags & 0x40 : flags & 0x20) ? 1 : 0) +
+                          ((ver == 4 && (flags & 0x01)) ? 4 : 0);
+            if (len > skip) {
+                id3_on_frame(r, id, &data[skip], len - skip);
+            }
+        } else if (!id3_skip(r, size)) {
+            break;
+        }
+    }
+    free(data);
+
+    return audio_start;
+}
+
+// ID3v1 lives in the last 128 bytes, only consulted if v2 had no title
+static void read_id3v1(tag_reader_t *r) {
+    uint8_t tag[128];
+    char val[31];
+    if (fseek(r->fp, -128, SEEK_END) != 0 || !tr_read(r, tag, sizeof(tag)) ||
+        memcmp(tag, "TAG", 3) != 0) {
+        return;
+    }
+    static const struct {
+        size_t offset;
+        const char *field;
+    } fields[] = {{3, "TITLE"}, {33, "ARTIST"}, {63, "ALBUM"}};
+    for (size_t i = 0; i < sizeof(fields) / sizeof(*fields); ++i) {
+        memcpy(val, &tag[fields[i].offset], 30);
+        val[30] = '\0';
+        // Fields are space padded
+        for (int j = 29; j >= 0 && (val[j] == ' ' || val[j] == '\0'); --j) {
+            val[j] = '\0';
+        }
+        char utf8[64];
+        id3_decode_str(0, (const uint8_t *)val, strlen(val) + 1, utf8, sizeof(utf8));
+        tags_on_field(r->tags, fields[i].field, utf8);
+    }
+}
+
+// Work out the duration from the first frame: the Xing/Info or VBRI header
+// if there is one, otherwise assume CBR and use the file size
+static void read_mp3_duration(tag_reader_t *r, long audio_start) {
+    static const uint16_t s_br_v1[16] = {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0};
+    static const uint16_t s_br_v2[16] = {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0};
+    static const uint32_t s_sr[3] = {44100, 48000, 32000};
+    uint8_t buf[512];
+
+    if (fseek(r->fp, audio_start, SEEK_SET) != 0) {
+        return;
+    }
+    size_t n = fread(buf, 1, sizeof(buf), r->fp);
+    r->tags->bytes_read += n;
+
+    for (size_t i = 0; i + 4 <= n; ++i) {
+        if (buf[i] != 0xFF || (buf[i + 1] & 0xE0) != 0xE0) {
+            continue;
+        }
+        uint8_t ver = (buf[i + 1] >> 3) & 3;
+        uint8_t layer = (buf[i + 1] >> 1) & 3;
+        uint8_t br_idx = buf[i + 2] >> 4;
+        uint8_t sr_idx = (buf[i + 2] >> 2) & 3;
+        bool mono = (buf[i + 3] >> 6) == 3;
+        if (ver == 1 || layer != 1 || br_idx == 0 || br_idx == 15 || sr_idx == 3) {
+            continue;
+        }
+        bool is_v1 = (ver == 3);
+        uint32_t sr = s_sr[sr_idx] >> (is_v1 ? 0 : (ver == 2 ? 1 : 2));
+        uint32_t spf = is_v1 ? 1152 : 576;
+        uint32_t kbps = is_v1 ? s_br_v1[br_idx] : s_br_v2[br_idx];
+
+        size_t xing = i + 4 + (is_v1 ? (mono ? 17 : 32) : (mono ? 9 : 17));
+        size_t vbri = i + 4 + 32;
+        uint32_t frames = 0;
+        if (xing + 12 <= n && (memcmp(&buf[xing], "Xing", 4) == 0 || memcmp(&buf[xing], "Info", 4) == 0)) {
+            if (be32(&buf[xing + 4]) & 1) {
+                frames = be32(&buf[xing + 8]);
+            }
+        } else if (vbri + 18 <= n && memcmp(&buf[vbri], "VBRI", 4) == 0) {
+            frames = be32(&buf[vbri + 14]);
+        }
+
+        if (frames != 0) {
+            r->tags->duration_ms = (uint32_t)((uint64_t)frames * spf * 1000 / sr);
+        } else {
+            // A bogus ID3 size can put the audio past the end of the file
+            long audio_len = tr_size(r) - audio_start - (long)i;
+            if (audio_len <= 0) {
+                return;
+            }
+            r->tags->duration_ms = (uint32_t)((uint64_t)audio_len * 8 / kbps);
+        }
+        return;
+    }
+}
+
+static void read_mp3(tag_reader_t *r) {
+    long audio_start = read_id3v2(r);
+    if (r->tags->title[0] == '\0') {
+        read_id3v1(r);
+    }
+    if (r->tags->duration_ms == 0) {
+        read_mp3_duration(r, audio_start);
+    }
+}
+
+static void parse_vorbis_comments(tag_reader_t *r, const uint8_t *buf, size_t len) {
+    char field[KZ_TAGS_MAX_FIELD];
+    // Vendor string, then the count. Lengths are checked against what's
+    // left rather than added up, so a bogus one can't wrap around.
+    if (len < 4 || le32(buf) > len - 4 || len - 4 - le32(buf) < 4) {
+        return;
+    }
+    size_t pos = 4 + le32(buf);
+    uint32_t count = le32(&buf[pos]);
+    pos += 4;
+    for (uint32_t i = 0; i < count && pos + 4 <= len; ++i) {
+        uint32_t flen = le32(&buf[pos]);
+        pos += 4;
+        if (flen > len - pos) {
+            // The block was truncated by KZ_TAGS_MAX_BLOCK
+            break;
+        }
+        if (flen < sizeof(field)) {
+            memcpy(field, &buf[pos], flen);
+            field[flen] = '\0';
+            char *eq = strchr(field, '=');
+            if (eq != NULL) {
+                *eq = '\0';
+                tags_on_field(r->tags, field, eq + 1);
+            }
+        }
+        pos += flen;
+    }
+}
+
+static void read_flac(tag_reader_t *r) {
+    uint8_t hdr[4];
+    if (!tr_read(r, hdr, sizeof(hdr)) || memcmp(hdr, "fLaC", 4) != 0) {
+        return;
+    }
+    bool last = false;
+    while (!last) {
+        if (!tr_read(r, hdr, sizeof(hdr))) {
+            return;
+        }
+        last = (hdr[0] & 0x80) != 0;
+        uint8_t type = hdr[0] & 0x7F;
+        uint32_t len = be24(&hdr[1]);
+
+        if (type == 0 && len == 34) {
+            // STREAMINFO: 20 bit sample rate and 36 bit total sample count
+            uint8_t si[34];
+            if (!tr_read(r, si, sizeof(si))) {
+                return;
+            }
+            uint32_t sr = ((uint32_t)si[10] << 12) | ((uint32_t)si[11] << 4) | (si[12] >> 4);
+            uint64_t total = ((uint64_t)(si[13] & 0x0F) << 32) | be32(&si[14]);
+            if (sr != 0) {
+                r->tags->duration_ms = (uint32_t)(total * 1000 / sr);
+            }
+        } else if (type == 4) {
+            size_t rd_len = len < KZ_TAGS_MAX_BLOCK ? len : KZ_TAGS_MAX_BLOCK;
+            uint8_t *buf = malloc(rd_len);
+            if (buf == NULL) {
+                return;
+            }
+            if (tr_read(r, buf, rd_len)) {
+                parse_vorbis_comments(r, buf, rd_len);
+            }
+            free(buf);
+            // STREAMINFO always comes first, so there's nothing left we need
+            return;
+        } else if (!tr_skip(r, len)) {
+            return;
+        }
+    }
+}
+
+// The last page's granule position is the stream length in samples
+static void read_ogg_duration(tag_reader_t *r, uint32_t rate, uint32_t pre_skip) {
+    long size = tr_size(r);
+    long start = size > KZ_TAGS_OGG_TAIL ? size - KZ_TAGS_OGG_TAIL : 0;
+    uint8_t *tail = malloc(KZ_TAGS_OGG_TAIL);
+    if (tail == NULL || rate == 0 || fseek(r->fp, start, SEEK_SET) != 0) {
+        free(tail);
+        return;
+    }
+    size_t n = fread(tail, 1, KZ_TAGS_OGG_TAIL, r->fp);
+    r->tags->bytes_read += n;
+    for (long i = (long)n - 27; i >= 0; --i) {
+        if (memcmp(&tail[i], "OggS", 4) == 0) {
+            uint64_t granule = le64(&tail[i + 6]);
+            if (granule > pre_skip) {
+                r->tags->duration_ms = (uint32_t)((granule - pre_skip) * 1000 / rate);
+            }
+            break;
+        }
+    }
+    free(tail);
+}
+
+// Collect the first two packets of the first logical stream: the ID header
+// (for the sample rate) and the comment header, which is laid out the same
+// for both Vorbis and Opus
+static void read_ogg(tag_reader_t *r) {
+    uint8_t *pkt = malloc(KZ_TAGS_MAX_BLOCK);
+    if (pkt == NULL) {
+        return;
+    }
+    uint8_t id_hdr[20] = {0};
+    size_t id_len = 0;
+    size_t pkt_len = 0;
+    int packet = 0;
+    bool done = false;
+
+    for (int page = 0; page < KZ_TAGS_MAX_OGG_PAGES && !done; ++page) {
+        uint8_t hdr[27], segs[255];
+        if (!tr_read(r, hdr, sizeof(hdr)) || memcmp(hdr, "OggS", 4) != 0) {
+            break;
+        }
+        if (!tr_read(r, segs, hdr[26])) {
+            break;
+        }
+        for (int s = 0; s < hdr[26] && !done; ++s) {
+            if (packet == 0) {
+                size_t n = segs[s] < sizeof(id_hdr) - id_len ? segs[s] : sizeof(id_hdr) - id_len;
+                if (!tr_read(r, &id_hdr[id_len], n) || !tr_skip(r, segs[s] - n)) {
+                    done = true;
+                }
+                id_len += n;
+            } else if (packet == 1) {
+                size_t n = segs[s];
+                if (pkt_len + n > KZ_TAGS_MAX_BLOCK) {
+                    // Parse what we have, the rest is most likely cover art
+                    n = KZ_TAGS_MAX_BLOCK - pkt_len;
+                    done = true;
+                }
+                if (!tr_read(r, &pkt[pkt_len], n)) {
+                    done = true;
+                }
+                pkt_len += n;
+            }
+            if (segs[s] < 255) {
+                if (packet == 1) {
+                    done = true;
+                }
+                packet++;
+            }
+        }
+    }
+
+    if (pkt_len > 7 && memcmp(pkt, "\x03vorbis", 7) == 0) {
+        parse_vorbis_comments(r, &pkt[7], pkt_len - 7);
+    } else if (pkt_len > 8 && memcmp(pkt, "OpusTags", 8) == 0) {
+        parse_vorbis_comments(r, &pkt[8], pkt_len - 8);
+    }
+    free(pkt);
+
+    if (id_len >= 16 && memcmp(id_hdr, "\x01vorbis", 7) == 0) {
+        read_ogg_duration(r, le32(&id_hdr[12]), 0);
+    } else if (id_len >= 12 && memcmp(id_hdr, "OpusHead", 8) == 0) {
+        // Opus granules always count 48kHz samples
+        read_ogg_duration(r, 48000, id_hdr[10] | (id_hdr[11] << 8));
+    }
+}
+
+static void mp4_on_ilst_item(tag_reader_t *r, const uint8_t *type, const uint8_t *data, size_t len) {
+    char val[KZ_TAGS_MAX_FIELD];
+    char name[64] = {0};
+    const char *field = NULL;
+    size_t pos = 0;
+
+    if (memcmp(type, "\xA9nam", 4) == 0) {
+        field = "TITLE";
+    } else if (memcmp(type, "\xA9" "ART", 4) == 0) {
+        field = "ARTIST";
+    } else if (memcmp(type, "\xA9" "alb", 4) == 0) {
+        field = "ALBUM";
+    } else if (memcmp(type, "----", 4) != 0) {
+        return;
+    }
+
+    // Items hold child atoms: 'mean' and 'name' for freeform, then 'data'
+    while (pos + 8 <= len) {
+        uint32_t size = be32(&data[pos]);
+        if (size < 8 || size > len - pos) {
+            return;
+        }
+        const uint8_t *body = &data[pos + 8];
+        size_t body_len = size - 8;
+        if (memcmp(&data[pos + 4], "name", 4) == 0 && body_len > 4) {
+            size_t n = body_len - 4 < sizeof(name) - 1 ? body_len - 4 : sizeof(name) - 1;
+            memcpy(name, &body[4], n);
+            field = name;
+        } else if (memcmp(&data[pos + 4], "data", 4) == 0 && body_len > 8 && field != NULL) {
+            size_t n = body_len - 8 < sizeof(val) - 1 ? body_len - 8 : sizeof(val) - 1;
+            memcpy(val, &body[8], n);
+            val[n] = '\0';
+            tags_on_field(r->tags, field, val);
+        }
+        pos += size;
+    }
+}
+
+// Walk the atoms between the current position and end, descending only into
+// the containers that lead to mvhd and ilst. Everything else (mdat, trak,
+// covr...) is skipped with a seek.
+static void read_mp4_atoms(tag_reader_t *r, long end, int depth, int *budget) {
+    uint8_t *data = NULL;
+    while (ftell(r->fp) + 8 <= end && (*budget)-- > 0) {
+        uint8_t hdr[16];
+        if (!tr_read(r, hdr, 8)) {
+            break;
+        }
+        uint64_t size = be32(hdr);
+        size_t hdr_len = 8;
+        if (size == 1) {
+            if (!tr_read(r, &hdr[8], 8)) {
+                break;
+            }
+            size = ((uint64_t)be32(&hdr[8]) << 32) | be32(&hdr[12]);
+            hdr_len = 16;
+        } else if (size == 0) {
+            size = end - ftell(r->fp) + 8;
+        }
+        if (size < hdr_len) {
+            break;
+        }
+        const long body_start = ftell(r->fp);
+        const long body_end = body_start + (long)(size - hdr_len);
+        const uint8_t *type = &hdr[4];
+
+        if (depth < 4 && (memcmp(type, "moov", 4) == 0 || memcmp(type, "udta", 4) == 0 ||
+                          memcmp(type, "ilst", 4) == 0)) {
+            read_mp4_atoms(r, body_end, depth + 1, budget);
+        } else if (depth < 4 && memcmp(type, "meta", 4) == 0) {
+            // meta is a full box, skip the version and flags
+            if (tr_skip(r, 4)) {
+                read_mp4_atoms(r, body_end, depth + 1, budget);
+            }
+        } else if (memcmp(type, "mvhd", 4) == 0 && size - hdr_len >= 32) {
+            uint8_t mvhd[32];
+            if (tr_read(r, mvhd, sizeof(mvhd))) {
+                uint32_t timescale;
+                uint64_t duration;
+                if (mvhd[0] == 1) {
+                    timescale = be32(&mvhd[20]);
+                    duration = ((uint64_t)be32(&mvhd[24]) << 32) | be32(&mvhd[28]);
+                } else {
+                    timescale = be32(&mvhd[12]);
+                    duration = be32(&mvhd[16]);
+                }
+                if (timescale != 0) {
+                    r->tags->duration_ms = (uint32_t)(duration * 1000 / timescale);
+                }
+            }
+        } else if (depth > 0 && size - hdr_len <= KZ_TAGS_MAX_FIELD) {
+            // Everything small inside ilst is a candidate tag item
+            if (data == NULL && (data = malloc(KZ_TAGS_MAX_FIELD)) == NULL) {
+                break;
+            }
+            if (tr_read(r, data, size - hdr_len)) {
+                mp4_on_ilst_item(r, type, data, size - hdr_len);
+            }
+        }
+        if (fseek(r->fp, body_end, SEEK_SET) != 0) {
+            break;
+        }
+    }
+    free(data);
+}
+
+static void read_mp4(tag_reader_t *r) {
+    int budget = KZ_TAGS_MAX_MP4_ATOMS;
+    read_mp4_atoms(r, tr_size(r), 0, &budget);
+}
+
+static void read_wav(tag_reader_t *r) {
+    uint8_t hdr[12];
+    uint32_t byte_rate = 0;
+    if (!tr_read(r, hdr, sizeof(hdr)) || memcmp(hdr, "RIFF", 4) != 0 || memcmp(&hdr[8], "WAVE", 4) != 0) {
+        return;
+    }
+    for (int i = 0; i < 16; ++i) {
+        uint8_t chunk[8];
+        if (!tr_read(r, chunk, sizeof(chunk))) {
+            return;
+        }
+        uint32_t len = le32(&chunk[4]);
+        if (memcmp(chunk, "fmt ", 4) == 0 && len >= 16) {
+            uint8_t fmt[16];
+            if (!tr_read(r, fmt, sizeof(fmt))) {
+                return;
+            }
+            byte_rate = le32(&fmt[8]);
+            len -= sizeof(fmt);
+        } else if (memcmp(chunk, "data", 4) == 0) {
+            if (byte_rate != 0) {
+                r->tags->duration_ms = (uint32_t)((uint64_t)len * 1000 / byte_rate);
+            }
+            return;
+        }
+        if (!tr_skip(r, len + (len & 1))) {
+            return;
+        }
+    }
+}
+
+esp_err_t kz_tags_read(const char *path, kz_tags_t *tags) {
+    memset(tags, 0, sizeof(*tags));
+    tag_reader_t r = {
+        .fp = fopen(path, "rb"),
+        .tags = tags,
+    };
+    if (r.fp == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    switch (kz_get_ext(path)) {
+        case AUD_EXT_MP3:
+            read_mp3(&r);
+            break;
+        case AUD_EXT_FLAC:
+            read_flac(&r);
+            break;
+        case AUD_EXT_OGG:
+        case AUD_EXT_OPUS:
+            read_ogg(&r);
+            break;
+        case AUD_EXT_MP4:
+        case AUD_EXT_M4A:
+            read_mp4(&r);
+            break;
+        case AUD_EXT_WAV:
+            read_wav(&r);
+            break;
+        default:
+            break;
+    }
+    fclose(r.fp);
+
+    return ESP_OK;
+}
+
+void kz_tags_default_title(const char *path, kz_tags_t *tags) {
+    if (tags->title[0] != '\0') {
+        return;
+    }
+    const char *name = strrchr(path, '/');
+    name = (name == NULL) ? path : name + 1;
+    set_str(tags->title, sizeof(tags->title), name);
+    char *dot = strrchr(tags->title, '.');
+    if (dot != NULL && dot != tags->title) {
+        *dot = '\0';
+    }
+}
+
+esp_err_t kz_tags_get(const char *path, kz_tags_t *tags) {
+    const uint32_t key = kz_path_hash(path);
+    kz_tags_cache_ent_t *victim = &s_cache[0];
+
+    s_cache_clock++;
+    for (size_t i = 0; i < KZ_TAGS_CACHE_SIZE; ++i) {
+        if (s_cache[i].last_used != 0 && s_cache[i].key == key) {
+            s_cache[i].last_used = s_cache_clock;
+            *tags = s_cache[i].tags;
+            tags->bytes_read = 0;
+            return ESP_OK;
+        }
+        if (s_cache[i].last_used < victim->last_used) {
+            victim = &s_cache[i];
+        }
+    }
+
+    esp_err_t ret = kz_tags_read(path, tags);
+    if (ret == ESP_OK) {
+        victim->key = key;
+        victim->last_used = s_cache_clock;
+        victim->tags = *tags;
+    }
+    return ret;
+}
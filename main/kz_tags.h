@@ -0,0 +1,33 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+// ReplayGain 2.0 gains are relative to this reference loudness
+#define KZ_TAGS_RG_REFERENCE_LUFS (-18.0f)
+
+#define KZ_TAGS_TITLE_LEN 96
+#define KZ_TAGS_NAME_LEN 64
+
+// All strings are UTF-8 and empty when the tag is missing
+typedef struct {
+    char title[KZ_TAGS_TITLE_LEN];
+    char artist[KZ_TAGS_NAME_LEN];
+    char album[KZ_TAGS_NAME_LEN];
+    uint32_t duration_ms;
+    bool has_track_gain;
+    float track_gain_db;
+    bool has_track_peak;
+    float track_peak;
+    size_t bytes_read;
+} kz_tags_t;
+
+esp_err_t kz_tags_read(const char *path, kz_tags_t *tags);
+
+// Same as kz_tags_read, but answered from a small cache of recently read
+// files when possible. Not thread safe - only the player task uses it.
+esp_err_t kz_tags_get(const char *path, kz_tags_t *tags);
+
+// Fill in the title from the file name if the tags didn't have one
+void kz_tags_default_title(const char *path, kz_tags_t *tags);
@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "esp_console.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "playlist.h"
+#include "player_be.h"
+#include "kz_telem.h"
+
+#define KZ_TELEM_PERIOD_MS 1000
+// Ten minutes of history, kept in PSRAM where there's room for it
+#define KZ_TELEM_RING_LEN 600
+// Room for tasks started between counting them and taking the snapshot
+#define KZ_TELEM_STATUS_HEADROOM 4
+
+static const char *TAG = "KZ_TELEM";
+
+static const char *s_rb_names[KZ_TELEM_RB_COUNT] = {"fs>dec", "dec>rsp", "rsp>mix", "mix>eq", "eq>hp"};
+
+// Tasks are looked up by name each sample, so ones which come and go (the
+// decoders, BT, the crossfade pipeline) are picked up whenever they're
+// running
+static kz_telem_task_t s_tasks[] = {
+    {"PLAYER"}, {"TAGDB"}, {"SDCARD"}, {"BT_IDLE"}, {"TELEM"}, {"PROF"},
+    {"taskLVGL"}, {"esp_periph"}, {"fs"}, {"mp3"}, {"flac"}, {"opus"},
+    {"ogg"}, {"wav"}, {"aac"}, {"rsp"}, {"hp"}, {"I2C"},
+    {"PREFETCH"}, {"mix"}, {"xf_fs"}, {"xf_dec"}, {"xf_rsp"},
+    {"eq"}, {"VIS"},
+};
+_Static_assert(sizeof(s_tasks) / sizeof(*s_tasks) == KZ_TELEM_TASK_COUNT, "KZ_TELEM_TASK_COUNT is out of date");
+
+static SemaphoreHandle_t s_lock = NULL;
+static kz_telem_sample_t *s_ring = NULL;
+static size_t s_head = 0;   // next slot to write
+static size_t s_count = 0;
+static TaskStatus_t *s_status = NULL;
+static size_t s_status_cap = 0;
+
+static void take_sample(kz_telem_sample_t *s) {
+    s->t_ms = (uint32_t)(esp_timer_get_time() / 1000);
+    s->int_free = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    s->int_min = heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL);
+    s->int_largest = heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL);
+    s->psram_free = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+    s->psram_min = heap_caps_get_minimum_free_size(MALLOC_CAP_SPIRAM);
+    s->psram_largest = heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM);
+    memset(s->rb_fill, 0, sizeof(s->rb_fill));
+    player_get_buffer_fill(s->rb_fill, KZ_TELEM_RB_COUNT);
+}
+
+// Stack space left for each watched task, 0 for ones not running. The
+// snapshot is taken with the kernel locked on both cores, so unlike looking
+// each handle up and then reading it, no task can be deleted in between.
+static bool sample_tasks(uint32_t *stack_free) {
+    size_t want = uxTaskGetNumberOfTasks() + KZ_TELEM_STATUS_HEADROOM;
+    if (want > s_status_cap) {
+        TaskStatus_t *grown = realloc(s_status, want * sizeof(*s_status));
+        if (grown == NULL) {
+            return false;
+        }
+        s_status = grown;
+        s_status_cap = want;
+    }
+    size_t n = uxTaskGetSystemState(s_status, s_status_cap, NULL);
+    if (n == 0) {
+        // More tasks started than the headroom allows, the next sample
+        // makes room for them
+        return false;
+    }
+    for (size_t i = 0; i < KZ_TELEM_TASK_COUNT; ++i) {
+        stack_free[i] = 0;
+        for (size_t j = 0; j < n; ++j) {
+            if (strcmp(s_status[j].pcTaskName, s_tasks[i].name) == 0) {
+                stack_free[i] = s_status[j].usStackHighWaterMark;
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+static void kz_telem_task(void *arg) {
+    TickType_t last_wake = xTaskGetTickCount();
+    while (1) {
+        vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(KZ_TELEM_PERIOD_MS));
+        kz_telem_sample_t sample;
+        uint32_t stack_free[KZ_TELEM_TASK_COUNT];
+        take_sample(&sample);
+        bool have_tasks = sample_tasks(stack_free);
+
+        xSemaphoreTake(s_lock, portMAX_DELAY);
+        s_ring[s_head] = sample;
+        s_head = (s_head + 1) % KZ_TELEM_RING_LEN;
+        if (s_count < KZ_TELEM_RING_LEN) {
+            s_count++;
+        }
+        for (size_t i = 0; i < KZ_TELEM_TASK_COUNT && have_tasks; ++i) {
+            s_tasks[i].stack_free = stack_free[i];
+            if (stack_free[i] != 0 && (s_tasks[i].stack_min == 0 || stack_free[i] < s_tasks[i].stack_min)) {
+                s_tasks[i].stack_min = stack_free[i];
+            }
+        }
+        xSemaphoreGive(s_lock);
+    }
+}
+
+bool kz_telem_latest(kz_telem_sample_t *sample) {
+    if (s_lock == NULL) {
+        return false;
+    }
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    bool ok = s_count > 0;
+    if (ok) {
+        *sample = s_ring[(s_head + KZ_TELEM_RING_LEN - 1) % KZ_TELEM_RING_LEN];
+    }
+    xSemaphoreGive(s_lock);
+    return ok;
+}
+
+size_t kz_telem_tasks(kz_telem_task_t *tasks, size_t max) {
+    if (s_lock == NULL) {
+        return 0;
+    }
+    size_t n = max < KZ_TELEM_TASK_COUNT ? max : KZ_TELEM_TASK_COUNT;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    memcpy(tasks, s_tasks, n * sizeof(*tasks));
+    xSemaphoreGive(s_lock);
+    return n;
+}
+
+const char *kz_telem_rb_name(size_t i) {
+    return i < KZ_TELEM_RB_COUNT ? s_rb_names[i] : "?";
+}
+
+static void print_summary(void) {
+    kz_telem_sample_t last;
+    kz_telem_sample_t low;
+    memset(&low, 0xff, sizeof(low));
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    for (size_t i = 0; i < s_count; ++i) {
+        const kz_telem_sample_t *s = &s_ring[i];
+        low.int_free = s->int_free < low.int_free ? s->int_free : low.int_free;
+        low.int_largest = s->int_largest < low.int_largest ? s->int_largest : low.int_largest;
+        low.psram_free = s->psram_free < low.psram_free ? s->psram_free : low.psram_free;
+        low.psram_largest = s->psram_largest < low.psram_largest ? s->psram_largest : low.psram_largest;
+        for (size_t r = 0; r < KZ_TELEM_RB_COUNT; ++r) {
+            low.rb_fill[r] = s->rb_fill[r] < low.rb_fill[r] ? s->rb_fill[r] : low.rb_fill[r];
+        }
+    }
+    last = s_ring[(s_head + KZ_TELEM_RING_LEN - 1) % KZ_TELEM_RING_LEN];
+    size_t count = s_count;
+    xSemaphoreGive(s_lock);
+
+    if (count == 0) {
+        printf("No samples yet\n");
+        return;
+    }
+    printf("              free     min  largest  (lowest free / largest over %us)\n",
+           (unsigned)(count * KZ_TELEM_PERIOD_MS / 1000));
+    printf("internal  %8u %7u %8u  (%u / %u)\n", (unsigned)last.int_free, (unsigned)last.int_min,
+           (unsigned)last.int_largest, (unsigned)low.int_free, (unsigned)low.int_largest);
+    printf("psram     %8u %7u %8u  (%u / %u)\n", (unsigned)last.psram_free, (unsigned)last.psram_min,
+           (unsigned)last.psram_largest, (unsigned)low.psram_free, (unsigned)low.psram_largest);
+    for (size_t r = 0; r < KZ_TELEM_RB_COUNT; ++r) {
+        printf("rb %-7s %3u%% full (lowest %u%%)\n", s_rb_names[r], last.rb_fill[r], low.rb_fill[r]);
+    }
+
+    kz_telem_task_t tasks[KZ_TELEM_TASK_COUNT];
+    size_t n = kz_telem_tasks(tasks, KZ_TELEM_TASK_COUNT);
+    printf("task         stack free   lowest\n");
+    for (size_t i = 0; i < n; ++i) {
+        if (tasks[i].stack_min != 0) {
+            printf("%-12s %10u %8u\n", tasks[i].name, (unsigned)tasks[i].stack_free, (unsigned)tasks[i].stack_min);
+        }
+    }
+}
+
+// Oldest first, as CSV for plotting. The ring is copied out first so that
+// a slow console doesn't hold up sampling or the stats screen.
+static void print_dump(void) {
+    kz_telem_sample_t *copy = heap_caps_malloc(sizeof(*copy) * KZ_TELEM_RING_LEN, MALLOC_CAP_SPIRAM);
+    if (copy == NULL) {
+        printf("No room to copy the samples\n");
+        return;
+    }
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    size_t first = (s_head + KZ_TELEM_RING_LEN - s_count) % KZ_TELEM_RING_LEN;
+    size_t count = s_count;
+    for (size_t i = 0; i < count; ++i) {
+        copy[i] = s_ring[(first + i) % KZ_TELEM_RING_LEN];
+    }
+    xSemaphoreGive(s_lock);
+
+    printf("t_ms,int_free,int_min,int_largest,psram_free,psram_min,psram_largest");
+    for (size_t r = 0; r < KZ_TELEM_RB_COUNT; ++r) {
+        printf(",%s", s_rb_names[r]);
+    }
+    printf("\n");
+    for (size_t i = 0; i < count; ++i) {
+        const kz_telem_sample_t *s = &copy[i];
+        printf("%u,%u,%u,%u,%u,%u,%u", (unsigned)s->t_ms, (unsigned)s->int_free,
+               (unsigned)s->int_min, (unsigned)s->int_largest, (unsigned)s->psram_free,
+               (unsigned)s->psram_min, (unsigned)s->psram_largest);
+        for (size_t r = 0; r < KZ_TELEM_RB_COUNT; ++r) {
+            printf(",%u", s->rb_fill[r]);
+        }
+        printf("\n");
+    }
+    free(copy);
+}
+
+static int mem_cmd(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "dump") == 0) {
+        print_dump();
+    } else {
+        print_summary();
+    }
+    return 0;
+}
+
+esp_err_t kz_telem_init(void) {
+    s_lock = xSemaphoreCreateMutex();
+    if (s_lock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    s_ring = heap_caps_malloc(sizeof(*s_ring) * KZ_TELEM_RING_LEN, MALLOC_CAP_SPIRAM);
+    if (s_ring == NULL) {
+        ESP_LOGE(TAG, "Unable to allocate the sample ring!");
+        return ESP_ERR_NO_MEM;
+    }
+
+    const esp_console_cmd_t cmd = {
+        .command = "mem",
+        .help = "Show heap, ring buffer and stack use. 'mem dump' prints every sample as CSV",
+        .hint = "[dump]",
+        .func = mem_cmd,
+    };
+    esp_console_cmd_register(&cmd);
+
+    if (pdPASS != xTaskCreatePinnedToCore(kz_telem_task, "TELEM", (3 * 1024), NULL,
+                                          tskIDLE_PRIORITY + 1, NULL, PRO_CPU_NUM)) {
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
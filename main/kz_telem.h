@@ -0,0 +1,36 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+// Buffers between the reader, decoder, resampler, mixer, EQ and I2S writer
+#define KZ_TELEM_RB_COUNT 5
+
+typedef struct {
+    uint32_t t_ms;
+    uint32_t int_free;
+    uint32_t int_min;
+    uint32_t int_largest;
+    uint32_t psram_free;
+    uint32_t psram_min;
+    uint32_t psram_largest;
+    uint8_t rb_fill[KZ_TELEM_RB_COUNT];     // percent full
+} kz_telem_sample_t;
+
+// Tasks whose stacks are watched, the most kz_telem_tasks() returns
+#define KZ_TELEM_TASK_COUNT 25
+
+typedef struct {
+    const char *name;
+    uint32_t stack_free;    // bytes left at the last sample, 0 when not running
+    uint32_t stack_min;     // lowest ever seen, 0 when never seen
+} kz_telem_task_t;
+
+// Start sampling memory use once a second into a fixed ring, and add the
+// "mem" console command. Call after kz_console_init().
+esp_err_t kz_telem_init(void);
+bool kz_telem_latest(kz_telem_sample_t *sample);
+size_t kz_telem_tasks(kz_telem_task_t *tasks, size_t max);
+// Short name of buffer i, as "fs>dec"
+const char *kz_telem_rb_name(size_t i);
@@ -0,0 +1,306 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_console.h"
+#include "esp_cpu.h"
+#include "esp_log.h"
+#include "nvs.h"
+
+#include "playlist.h"
+#include "player_be.h"
+#include "kz_eq.h"
+#include "kz_tone.h"
+
+#define KZ_TONE_NVS_NAMESPACE "kz_tone"
+#define KZ_TONE_NVS_PRESET_KEY "preset"
+#define KZ_TONE_NVS_CUSTOM_KEY "custom"
+#define KZ_TONE_PRESET_BANDS 5
+#define KZ_TONE_BENCH_RATE 48000
+#define KZ_TONE_BENCH_FRAMES 512
+// About a second of audio at the bench rate
+#define KZ_TONE_BENCH_BLOCKS 94
+// ... of which this many are also run in double precision to compare
+#define KZ_TONE_BENCH_REF_BLOCKS 10
+
+static const char *TAG = "KZ_TONE";
+
+typedef struct {
+    const char *name;
+    float gain_db[KZ_TONE_PRESET_BANDS];
+} tone_preset_t;
+
+// The fixed presets share these bands
+static const kz_eq_band_t s_preset_bands[KZ_TONE_PRESET_BANDS] = {
+    {KZ_EQ_LOW_SHELF, 80.0f, 0.0f, 0.707f},
+    {KZ_EQ_PEAK, 250.0f, 0.0f, 1.0f},
+    {KZ_EQ_PEAK, 1000.0f, 0.0f, 1.0f},
+    {KZ_EQ_PEAK, 4000.0f, 0.0f, 1.0f},
+    {KZ_EQ_HIGH_SHELF, 10000.0f, 0.0f, 0.707f},
+};
+
+static const tone_preset_t s_presets[] = {
+    {"flat", {0.0f, 0.0f, 0.0f, 0.0f, 0.0f}},
+    {"bass", {6.0f, 2.0f, 0.0f, 0.0f, 0.0f}},
+    {"treble", {0.0f, 0.0f, 0.0f, 2.0f, 6.0f}},
+    {"loudness", {6.0f, 1.0f, -1.0f, 1.0f, 5.0f}},
+    {"vocal", {-2.0f, -1.0f, 3.0f, 2.0f, -1.0f}},
+};
+#define KZ_TONE_PRESET_COUNT (sizeof(s_presets) / sizeof(*s_presets))
+// One past the fixed ones
+#define KZ_TONE_CUSTOM KZ_TONE_PRESET_COUNT
+
+static const float s_octaves[KZ_EQ_MAX_BANDS] = {31, 62, 125, 250, 500, 1000, 2000, 4000, 8000, 16000};
+
+// Written by the console task, read by the player task
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint8_t s_preset = 0;
+static kz_eq_band_t s_custom[KZ_EQ_MAX_BANDS];
+
+static int16_t s_src[KZ_TONE_BENCH_FRAMES * 2];
+static int16_t s_fast[KZ_TONE_BENCH_FRAMES * 2];
+static int16_t s_ref[KZ_TONE_BENCH_FRAMES * 2];
+
+int kz_tone_get_bands(kz_eq_band_t *bands) {
+    int count = 0;
+    portENTER_CRITICAL(&s_lock);
+    if (s_preset == KZ_TONE_CUSTOM) {
+        memcpy(bands, s_custom, sizeof(s_custom));
+        count = KZ_EQ_MAX_BANDS;
+    } else if (s_preset != 0) {
+        memcpy(bands, s_preset_bands, sizeof(s_preset_bands));
+        for (int i = 0; i < KZ_TONE_PRESET_BANDS; ++i) {
+            bands[i].gain_db = s_presets[s_preset].gain_db[i];
+        }
+        count = KZ_TONE_PRESET_BANDS;
+    }
+    portEXIT_CRITICAL(&s_lock);
+    return count;
+}
+
+static const char *preset_name(uint8_t preset) {
+    return preset == KZ_TONE_CUSTOM ? "custom" : s_presets[preset].name;
+}
+
+static esp_err_t save_tone(void) {
+    nvs_handle_t nvs;
+    esp_err_t ret = nvs_open(KZ_TONE_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    ret = nvs_set_u8(nvs, KZ_TONE_NVS_PRESET_KEY, s_preset);
+    if (ret == ESP_OK) {
+        ret = nvs_set_blob(nvs, KZ_TONE_NVS_CUSTOM_KEY, s_custom, sizeof(s_custom));
+    }
+    if (ret == ESP_OK) {
+        ret = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    return ret;
+}
+
+static void load_tone(void) {
+    uint8_t preset = 0;
+    kz_eq_band_t custom[KZ_EQ_MAX_BANDS];
+    for (int i = 0; i < KZ_EQ_MAX_BANDS; ++i) {
+        custom[i] = (kz_eq_band_t) {KZ_EQ_PEAK, s_octaves[i], 0.0f, 1.41f};
+    }
+    nvs_handle_t nvs;
+    if (ESP_OK == nvs_open(KZ_TONE_NVS_NAMESPACE, NVS_READONLY, &nvs)) {
+        if (ESP_OK != nvs_get_u8(nvs, KZ_TONE_NVS_PRESET_KEY, &preset) || preset > KZ_TONE_CUSTOM) {
+            preset = 0;
+        }
+        kz_eq_band_t saved[KZ_EQ_MAX_BANDS];
+        size_t len = sizeof(saved);
+        if (ESP_OK == nvs_get_blob(nvs, KZ_TONE_NVS_CUSTOM_KEY, saved, &len) && len == sizeof(saved)) {
+            memcpy(custom, saved, sizeof(saved));
+        }
+        nvs_close(nvs);
+    }
+    portENTER_CRITICAL(&s_lock);
+    s_preset = preset;
+    memcpy(s_custom, custom, sizeof(custom));
+    portEXIT_CRITICAL(&s_lock);
+}
+
+static void print_tone(void) {
+    kz_eq_band_t bands[KZ_EQ_MAX_BANDS];
+    int count = kz_tone_get_bands(bands);
+    printf("eq %s\n", preset_name(s_preset));
+    static const char *types[] = {"peak", "low shelf", "high shelf"};
+    for (int i = 0; i < count; ++i) {
+        printf("%2d %-10s %7.0f Hz %+5.1f dB  Q %.2f\n", i + 1, types[bands[i].type], bands[i].freq_hz,
+               bands[i].gain_db, bands[i].q);
+    }
+}
+
+// Something like music: a bass line, a tone and a high one over noise
+static void bench_signal(int16_t *pcm, size_t frames, uint32_t start) {
+    static uint32_t seed = 1;
+    for (size_t i = 0; i < frames; ++i) {
+        float t = (float)(start + i) / KZ_TONE_BENCH_RATE;
+        seed = seed * 1664525u + 1013904223u;
+        float noise = (float)(int32_t)seed / 2147483648.0f;
+        float v = 0.2f * sinf(2.0f * (float)M_PI * 40.0f * t) + 0.15f * sinf(2.0f * (float)M_PI * 440.0f * t) +
+                  0.1f * sinf(2.0f * (float)M_PI * 3000.0f * t) + 0.05f * noise;
+        pcm[2 * i] = (int16_t)(v * 29000.0f);
+        pcm[2 * i + 1] = (int16_t)(v * 26000.0f);
+    }
+}
+
+// The same cascade in double precision, from the same coefficients, so the
+// difference is down to the fixed point arithmetic alone
+static void bench_double(const kz_eq_coefs_t *coefs, double (*st)[2][4], const int16_t *pcm, size_t frames,
+                         const int16_t *out, double *max_err, double *err_sq, double *sig_sq) {
+    const double scale = 1.0 / (1 << KZ_EQ_COEF_SHIFT);
+    for (size_t i = 0; i < frames; ++i) {
+        for (int ch = 0; ch < 2; ++ch) {
+            double v = pcm[2 * i + ch];
+            for (int b = 0; b < coefs->bands; ++b) {
+                const int32_t *c = coefs->c[b];
+                double *s = st[b][ch];
+                double y = (c[0] * v + c[1] * s[0] + c[2] * s[1] - c[3] * s[2] - c[4] * s[3]) * scale;
+                s[1] = s[0];
+                s[0] = v;
+                s[3] = s[2];
+                s[2] = y;
+                v = y;
+            }
+            double e = fabs(out[2 * i + ch] - v);
+            *max_err = e > *max_err ? e : *max_err;
+            *err_sq += e * e;
+            *sig_sq += v * v;
+        }
+    }
+}
+
+static void run_bench(int count) {
+    kz_eq_band_t bands[KZ_EQ_MAX_BANDS];
+    for (int i = 0; i < count; ++i) {
+        // Alternate boosts and cuts so none of them is left out as flat
+        bands[i] = (kz_eq_band_t) {KZ_EQ_PEAK, s_octaves[i], (i % 2) ? -6.0f : 6.0f, 1.41f};
+    }
+    static kz_eq_coefs_t coefs;
+    static kz_eq_state_t st_fast, st_ref;
+    static double st_double[KZ_EQ_MAX_BANDS][2][4];
+    kz_eq_design(bands, count, KZ_TONE_BENCH_RATE, &coefs);
+    kz_eq_reset(&st_fast);
+    kz_eq_reset(&st_ref);
+    memset(st_double, 0, sizeof(st_double));
+
+    uint32_t fast_min = UINT32_MAX, ref_min = UINT32_MAX;
+    uint64_t fast_total = 0, ref_total = 0;
+    bool exact = true;
+    double max_err = 0.0, err_sq = 0.0, sig_sq = 0.0;
+    for (int blk = 0; blk < KZ_TONE_BENCH_BLOCKS; ++blk) {
+        bench_signal(s_src, KZ_TONE_BENCH_FRAMES, blk * KZ_TONE_BENCH_FRAMES);
+        memcpy(s_fast, s_src, sizeof(s_src));
+        memcpy(s_ref, s_src, sizeof(s_src));
+        uint32_t t0 = esp_cpu_get_cycle_count();
+        kz_eq_process(&coefs, &st_fast, s_fast, KZ_TONE_BENCH_FRAMES, 2);
+        uint32_t t1 = esp_cpu_get_cycle_count();
+        kz_eq_process_ref(&coefs, &st_ref, s_ref, KZ_TONE_BENCH_FRAMES, 2);
+        uint32_t t2 = esp_cpu_get_cycle_count();
+        // The quickest block is the one nothing else interrupted
+        fast_min = t1 - t0 < fast_min ? t1 - t0 : fast_min;
+        ref_min = t2 - t1 < ref_min ? t2 - t1 : ref_min;
+        fast_total += t1 - t0;
+        ref_total += t2 - t1;
+        exact = exact && memcmp(s_fast, s_ref, sizeof(s_fast)) == 0;
+        if (blk < KZ_TONE_BENCH_REF_BLOCKS) {
+            bench_double(&coefs, st_double, s_src, KZ_TONE_BENCH_FRAMES, s_fast, &max_err, &err_sq, &sig_sq);
+        }
+        // Let the lower priority tasks run
+        vTaskDelay(1);
+    }
+    const unsigned samples = KZ_TONE_BENCH_FRAMES * 2;
+    float fast_cps = (float)fast_min / samples;
+    float ref_cps = (float)ref_min / samples;
+    // Of one core, for 48 kHz stereo
+    float load = fast_cps * KZ_TONE_BENCH_RATE * 2 / (CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ * 1e4f);
+    printf("%2d bands  fast %6.1f cycles/sample (mean %6.1f)  reference %6.1f (mean %6.1f)  %.1f%% of a core\n",
+           count, fast_cps, (float)fast_total / ((uint64_t)samples * KZ_TONE_BENCH_BLOCKS), ref_cps,
+           (float)ref_total / ((uint64_t)samples * KZ_TONE_BENCH_BLOCKS), load);
+    printf("          %s  max error %.2f LSB, %.1f dB below the signal against double precision\n",
+           exact ? "fast and reference match" : "FAST AND REFERENCE DIFFER", max_err,
+           err_sq > 0.0 ? 10.0 * log10(sig_sq / err_sq) : INFINITY);
+    ESP_LOGI(TAG, "%d bands: %.1f cycles/sample", count, fast_cps);
+}
+
+static int eq_cmd(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        int count = argc > 2 ? atoi(argv[2]) : 0;
+        if (count < 0 || count > KZ_EQ_MAX_BANDS) {
+            return 1;
+        }
+        if (player_is_playing()) {
+            printf("Pause playback first\n");
+            return 1;
+        }
+        if (count != 0) {
+            run_bench(count);
+        } else {
+            run_bench(KZ_TONE_PRESET_BANDS);
+            run_bench(KZ_EQ_MAX_BANDS);
+        }
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "band") == 0) {
+        int band = argc > 3 ? atoi(argv[2]) : 0;
+        if (band < 1 || band > KZ_EQ_MAX_BANDS) {
+            printf("Usage: eq band <1-%d> <dB> [Hz [Q]]\n", KZ_EQ_MAX_BANDS);
+            return 1;
+        }
+        kz_eq_band_t b = s_custom[band - 1];
+        b.gain_db = strtof(argv[3], NULL);
+        b.freq_hz = argc > 4 ? strtof(argv[4], NULL) : b.freq_hz;
+        b.q = argc > 5 ? strtof(argv[5], NULL) : b.q;
+        if (fabsf(b.gain_db) > KZ_EQ_MAX_GAIN_DB || b.freq_hz < 20.0f || b.freq_hz > 20000.0f || b.q < 0.1f ||
+            b.q > 10.0f) {
+            printf("Gain within +/-%.0f dB, 20 Hz to 20 kHz, Q 0.1 to 10\n", KZ_EQ_MAX_GAIN_DB);
+            return 1;
+        }
+        portENTER_CRITICAL(&s_lock);
+        s_custom[band - 1] = b;
+        s_preset = KZ_TONE_CUSTOM;
+        portEXIT_CRITICAL(&s_lock);
+    } else if (argc > 1) {
+        uint8_t preset = 0;
+        while (preset <= KZ_TONE_CUSTOM && strcmp(argv[1], preset_name(preset)) != 0) {
+            preset++;
+        }
+        if (preset > KZ_TONE_CUSTOM) {
+            printf("Usage: eq [flat|bass|treble|loudness|vocal|custom|band <n> <dB> [Hz [Q]]|bench [bands]]\n");
+            return 1;
+        }
+        portENTER_CRITICAL(&s_lock);
+        s_preset = preset;
+        portEXIT_CRITICAL(&s_lock);
+    }
+    if (argc > 1) {
+        player_update_eq();
+        if (ESP_OK != save_tone()) {
+            printf("Unable to save the setting\n");
+        }
+    }
+    print_tone();
+    return 0;
+}
+
+esp_err_t kz_tone_init(void) {
+    load_tone();
+    player_update_eq();
+
+    const esp_console_cmd_t cmd = {
+        .command = "eq",
+        .help = "Show or pick the EQ preset, or set a band of the custom one. 'bench' times the filter for "
+                "5 and 10 bands, or the number given, and checks it against double precision",
+        .hint = "[preset|band <n> <dB> [Hz [Q]]|bench [bands]]",
+        .func = eq_cmd,
+    };
+    return esp_console_cmd_register(&cmd);
+}
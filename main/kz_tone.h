@@ -0,0 +1,8 @@
+#include "esp_err.h"
+
+// Load the EQ preset kept in NVS and add the "eq" console command, which
+// picks a preset, adjusts the custom bands and benchmarks the filter. Call
+// after kz_console_init().
+esp_err_t kz_tone_init(void);
+// Copy the bands of the preset in use, returning how many. 0 is flat.
+int kz_tone_get_bands(kz_eq_band_t *bands);
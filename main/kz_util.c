@@ -36,3 +36,13 @@ audio_extension_e kz_get_ext(const char *url) {
 
     return AUD_EXT_UNKNOWN;
 }
+
+// FNV-1a, used to key the per-file caches without storing whole paths
+uint32_t kz_path_hash(const char *path) {
+    uint32_t hash = 2166136261u;
+    while (*path != '\0') {
+        hash ^= (uint8_t)*path++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
@@ -1,3 +1,8 @@
+#include <stdint.h>
+
+// Length of the "file:/" in front of a path on the card
+#define FILE_PREFIX_LEN 6
+
 typedef enum {
     AUD_EXT_UNKNOWN = 0,
     AUD_EXT_MP3,
@@ -12,3 +17,4 @@ typedef enum {
 } audio_extension_e;
 
 audio_extension_e kz_get_ext(const char *url);
+uint32_t kz_path_hash(const char *path);
@@ -0,0 +1,438 @@
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "kz_vis.h"
+
+#ifdef ESP_PLATFORM
+#include "esp_attr.h"
+#define KZ_VIS_HOT IRAM_ATTR
+#else
+#define KZ_VIS_HOT
+#endif
+
+#define KZ_VIS_SHIFT 15
+
+// Quarter of a cosine is all the twiddles need, but a half keeps the
+// butterfly loop free of index juggling
+static int16_t s_cos[KZ_VIS_FFT_LEN / 2];
+static int16_t s_sin[KZ_VIS_FFT_LEN / 2];
+static int16_t s_hann[KZ_VIS_FFT_LEN];
+static bool s_tables_built = false;
+
+static void build_tables(void) {
+    if (s_tables_built) {
+        return;
+    }
+    for (int i = 0; i < KZ_VIS_FFT_LEN / 2; ++i) {
+        s_cos[i] = (int16_t)lrint(cos(2.0 * M_PI * i / KZ_VIS_FFT_LEN) * INT16_MAX);
+        s_sin[i] = (int16_t)lrint(sin(2.0 * M_PI * i / KZ_VIS_FFT_LEN) * INT16_MAX);
+    }
+    for (int i = 0; i < KZ_VIS_FFT_LEN; ++i) {
+        s_hann[i] = (int16_t)lrint((0.5 - 0.5 * cos(2.0 * M_PI * i / KZ_VIS_FFT_LEN)) * INT16_MAX);
+    }
+    s_tables_built = true;
+}
+
+void kz_vis_window(int16_t *pcm) {
+    build_tables();
+    for (int i = 0; i < KZ_VIS_FFT_LEN; ++i) {
+        pcm[i] = (int16_t)((pcm[i] * s_hann[i]) >> KZ_VIS_SHIFT);
+    }
+}
+
+// Decimation in time. The halving in each butterfly keeps every value's
+// magnitude within that of the largest input, so a real input clipped to
+// +/-32767 never overflows.
+void KZ_VIS_HOT kz_vis_fft(int16_t *re, int16_t *im, int bits) {
+    const int n = 1 << bits;
+    build_tables();
+
+    for (int i = 1, j = 0; i < n; ++i) {
+        int bit = n >> 1;
+        for (; j & bit; bit >>= 1) {
+            j ^= bit;
+        }
+        j ^= bit;
+        if (i < j) {
+            int16_t t = re[i];
+            re[i] = re[j];
+            re[j] = t;
+            t = im[i];
+            im[i] = im[j];
+            im[j] = t;
+        }
+    }
+
+    for (int len = 2, step = KZ_VIS_FFT_LEN / 2; len <= n; len <<= 1, step >>= 1) {
+        const int half = len / 2;
+        for (int j = 0; j < half; ++j) {
+            const int32_t wr = s_cos[j * step];
+            const int32_t wi = -s_sin[j * step];
+            for (int a = j; a < n; a += len) {
+                const int b = a + half;
+                int32_t tr = (wr * re[b] - wi * im[b]) >> KZ_VIS_SHIFT;
+                int32_t ti = (wr * im[b] + wi * re[b]) >> KZ_VIS_SHIFT;
+                int32_t ar = re[a];
+                int32_t ai = im[a];
+                re[b] = (int16_t)((ar - tr) >> 1);
+                im[b] = (int16_t)((ai - ti) >> 1);
+                re[a] = (int16_t)((ar + tr) >> 1);
+                im[a] = (int16_t)((ai + ti) >> 1);
+            }
+        }
+    }
+}
+
+#ifdef ESP_PLATFORM
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_console.h"
+#include "esp_cpu.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "nvs.h"
+
+#define KZ_VIS_NVS_NAMESPACE "kz_vis"
+#define KZ_VIS_NVS_KEY "mode"
+#define KZ_VIS_TASK_STACK (3 * 1024)
+// The bars span this, or up to the top of what's tapped if that's lower
+#define KZ_VIS_LOW_HZ 50
+#define KZ_VIS_HIGH_HZ 16000
+#define KZ_VIS_RANGE_DB 60.0f
+#define KZ_VIS_VU_RANGE_DB 48.0f
+// A full scale sine through the window and the 1/n scaling comes out at a
+// quarter of full scale in its bin, so this much power
+#define KZ_VIS_FULL_POWER (8192.0f * 8192.0f)
+// Levels drop this much per frame at most, so the bars fall smoothly
+#define KZ_VIS_FALL 16
+// Frames a VU peak is held for before it falls too
+#define KZ_VIS_PEAK_HOLD 15
+#define KZ_VIS_BENCH_RUNS 50
+#define KZ_VIS_BENCH_FRAMES 512
+#define KZ_VIS_BENCH_FPS 20
+
+static const char *TAG = "KZ_VIS";
+
+static volatile kz_vis_mode_e s_mode = KZ_VIS_OFF;
+static TaskHandle_t s_task = NULL;
+
+// Written by the tap on the audio path only. The visualizer may copy it
+// while it's being written, which at worst shows a frame slightly torn.
+static int16_t s_ring[KZ_VIS_FFT_LEN * 2];
+static volatile uint32_t s_written = 0;     // frames
+static volatile int s_tap_rate = 0;
+
+// Published by the visualizer task with a sequence count, odd while
+// writing, as the player publishes its state
+static kz_vis_frame_t s_frame;
+static volatile uint32_t s_frame_seq = 0;
+static bool s_have_frame = false;
+
+static portMUX_TYPE s_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t s_stat_frames = 0;
+static uint32_t s_stat_max_us = 0;
+
+// Scratch for working out a spectrum. The bench has one of its own, so it
+// can run while the visualizer is in use.
+typedef struct {
+    int16_t re[KZ_VIS_FFT_LEN];
+    int16_t im[KZ_VIS_FFT_LEN];
+    uint8_t edges[KZ_VIS_BAR_COUNT + 1];    // first bin of each bar, and one past the last
+    int edges_rate;
+} vis_spectrum_t;
+
+// Only touched by the visualizer task
+static vis_spectrum_t s_spectrum;
+static int16_t s_left[KZ_VIS_FFT_LEN];
+static int16_t s_right[KZ_VIS_FFT_LEN];
+static uint32_t s_last_written = 0;
+static kz_vis_frame_t s_levels;
+static uint8_t s_peak_hold[2];
+
+// Returns the new count of frames written to ring
+static uint32_t KZ_VIS_HOT tap_block(int16_t *ring, uint32_t w, const int16_t *pcm, size_t frames,
+                                     int channels) {
+    const int r = channels - 1;
+    for (size_t i = 0; i + 1 < frames; i += 2) {
+        const int16_t *f = pcm + i * channels;
+        size_t k = (w & (KZ_VIS_FFT_LEN - 1)) * 2;
+        ring[k] = (int16_t)((f[0] + f[channels]) >> 1);
+        ring[k + 1] = (int16_t)((f[r] + f[channels + r]) >> 1);
+        w++;
+    }
+    return w;
+}
+
+void KZ_VIS_HOT kz_vis_tap(const int16_t *pcm, size_t frames, int channels, int rate) {
+    if (s_mode == KZ_VIS_OFF || channels < 1 || channels > 2) {
+        return;
+    }
+    s_written = tap_block(s_ring, s_written, pcm, frames, channels);
+    s_tap_rate = rate / 2;
+}
+
+// Bars are spaced evenly in log frequency, each at least a bin wide
+static void set_edges(vis_spectrum_t *sp, int rate) {
+    float high = KZ_VIS_HIGH_HZ < rate / 2 ? KZ_VIS_HIGH_HZ : rate / 2;
+    int prev = 0;
+    for (int i = 0; i <= KZ_VIS_BAR_COUNT; ++i) {
+        float f = KZ_VIS_LOW_HZ * powf(high / KZ_VIS_LOW_HZ, (float)i / KZ_VIS_BAR_COUNT);
+        int bin = (int)lrintf(f * KZ_VIS_FFT_LEN / rate);
+        bin = bin <= prev ? prev + 1 : bin;
+        bin = bin > KZ_VIS_FFT_LEN / 2 ? KZ_VIS_FFT_LEN / 2 : bin;
+        sp->edges[i] = (uint8_t)bin;
+        prev = bin;
+    }
+    sp->edges_rate = rate;
+}
+
+static uint8_t to_level(float db, float range) {
+    float level = (db + range) * KZ_VIS_LEVEL_MAX / range;
+    return level <= 0.0f ? 0 : (level >= KZ_VIS_LEVEL_MAX ? KZ_VIS_LEVEL_MAX : (uint8_t)level);
+}
+
+// Window the mono mix, transform it and take the loudest bin under each bar
+static void spectrum(vis_spectrum_t *sp, const int16_t *left, const int16_t *right, int rate,
+                     uint8_t *bars) {
+    if (rate != sp->edges_rate) {
+        set_edges(sp, rate);
+    }
+    for (int i = 0; i < KZ_VIS_FFT_LEN; ++i) {
+        int32_t m = (left[i] + right[i]) >> 1;
+        sp->re[i] = (int16_t)(m < -INT16_MAX ? -INT16_MAX : m);
+        sp->im[i] = 0;
+    }
+    kz_vis_window(sp->re);
+    kz_vis_fft(sp->re, sp->im, KZ_VIS_FFT_BITS);
+    for (int b = 0; b < KZ_VIS_BAR_COUNT; ++b) {
+        uint32_t peak = 0;
+        for (int k = sp->edges[b]; k < sp->edges[b + 1]; ++k) {
+            uint32_t p = (uint32_t)(sp->re[k] * sp->re[k]) + (uint32_t)(sp->im[k] * sp->im[k]);
+            peak = p > peak ? p : peak;
+        }
+        bars[b] = to_level(10.0f * log10f((peak + 1) / KZ_VIS_FULL_POWER), KZ_VIS_RANGE_DB);
+    }
+}
+
+static void meter(const int16_t *pcm, uint8_t *rms_level, uint8_t *peak_level) {
+    int64_t sum = 0;
+    int32_t peak = 0;
+    for (int i = 0; i < KZ_VIS_FFT_LEN; ++i) {
+        int32_t v = pcm[i];
+        sum += v * v;
+        v = v < 0 ? -v : v;
+        peak = v > peak ? v : peak;
+    }
+    float rms = sqrtf((float)sum / KZ_VIS_FFT_LEN);
+    *rms_level = to_level(20.0f * log10f((rms + 1.0f) / INT16_MAX), KZ_VIS_VU_RANGE_DB);
+    *peak_level = to_level(20.0f * log10f((peak + 1.0f) / INT16_MAX), KZ_VIS_VU_RANGE_DB);
+}
+
+// Rise at once, fall gradually
+static uint8_t fall(uint8_t level, uint8_t prev) {
+    return level >= prev ? level : (prev - level > KZ_VIS_FALL ? prev - KZ_VIS_FALL : level);
+}
+
+static void work_frame(void) {
+    kz_vis_frame_t next = {0};
+    uint32_t w = s_written;
+    int rate = s_tap_rate;
+    // With nothing new since the last frame, playback has stopped, so let
+    // everything fall away
+    if (w != s_last_written && rate > 0) {
+        for (int i = 0; i < KZ_VIS_FFT_LEN; ++i) {
+            size_t k = ((w + i) & (KZ_VIS_FFT_LEN - 1)) * 2;
+            s_left[i] = s_ring[k];
+            s_right[i] = s_ring[k + 1];
+        }
+        if (s_mode == KZ_VIS_SPECTRUM) {
+            spectrum(&s_spectrum, s_left, s_right, rate, next.bars);
+        } else {
+            meter(s_left, &next.vu[0], &next.vu_peak[0]);
+            meter(s_right, &next.vu[1], &next.vu_peak[1]);
+        }
+    }
+    s_last_written = w;
+
+    for (int b = 0; b < KZ_VIS_BAR_COUNT; ++b) {
+        s_levels.bars[b] = fall(next.bars[b], s_levels.bars[b]);
+    }
+    for (int ch = 0; ch < 2; ++ch) {
+        s_levels.vu[ch] = fall(next.vu[ch], s_levels.vu[ch]);
+        if (next.vu_peak[ch] >= s_levels.vu_peak[ch]) {
+            s_levels.vu_peak[ch] = next.vu_peak[ch];
+            s_peak_hold[ch] = KZ_VIS_PEAK_HOLD;
+        } else if (s_peak_hold[ch] > 0) {
+            s_peak_hold[ch]--;
+        } else {
+            s_levels.vu_peak[ch] = fall(next.vu_peak[ch], s_levels.vu_peak[ch]);
+        }
+    }
+
+    s_frame_seq++;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    s_frame = s_levels;
+    s_have_frame = true;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    s_frame_seq++;
+}
+
+static void vis_task(void *arg) {
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if (s_mode == KZ_VIS_OFF) {
+            continue;
+        }
+        int64_t start = esp_timer_get_time();
+        work_frame();
+        uint32_t us = (uint32_t)(esp_timer_get_time() - start);
+        portENTER_CRITICAL(&s_stats_lock);
+        s_stat_frames++;
+        s_stat_max_us = us > s_stat_max_us ? us : s_stat_max_us;
+        portEXIT_CRITICAL(&s_stats_lock);
+    }
+}
+
+kz_vis_mode_e kz_vis_get_mode(void) {
+    return s_mode;
+}
+
+void kz_vis_request(void) {
+    if (s_task != NULL) {
+        xTaskNotifyGive(s_task);
+    }
+}
+
+bool kz_vis_get_frame(kz_vis_frame_t *frame) {
+    uint32_t seq = s_frame_seq;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if ((seq & 1) != 0 || !s_have_frame) {
+        return false;
+    }
+    *frame = s_frame;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return seq == s_frame_seq;
+}
+
+void kz_vis_take_stats(uint32_t *frames, uint32_t *max_us) {
+    portENTER_CRITICAL(&s_stats_lock);
+    *frames = s_stat_frames;
+    *max_us = s_stat_max_us;
+    s_stat_frames = 0;
+    s_stat_max_us = 0;
+    portEXIT_CRITICAL(&s_stats_lock);
+}
+
+// Everything it works on is its own, so it can't disturb the tap or the
+// visualizer task if the music is playing
+static void run_bench(void) {
+    static int16_t pcm[KZ_VIS_BENCH_FRAMES * 2];
+    static int16_t ring[KZ_VIS_FFT_LEN * 2];
+    static vis_spectrum_t sp;
+    static int16_t re[KZ_VIS_FFT_LEN], im[KZ_VIS_FFT_LEN];
+    static int16_t left[KZ_VIS_FFT_LEN], right[KZ_VIS_FFT_LEN];
+    uint8_t bars[KZ_VIS_BAR_COUNT];
+    for (int i = 0; i < KZ_VIS_BENCH_FRAMES; ++i) {
+        pcm[2 * i] = (int16_t)(12000.0f * sinf(2.0f * (float)M_PI * 1000.0f * i / 48000.0f));
+        pcm[2 * i + 1] = (int16_t)(8000.0f * sinf(2.0f * (float)M_PI * 150.0f * i / 48000.0f));
+    }
+    for (int i = 0; i < KZ_VIS_FFT_LEN; ++i) {
+        left[i] = pcm[2 * i];
+        right[i] = pcm[2 * i + 1];
+    }
+
+    // The quickest of several runs is the one nothing else interrupted
+    uint32_t fft_min = UINT32_MAX, frame_min = UINT32_MAX, tap_min = UINT32_MAX;
+    for (int run = 0; run < KZ_VIS_BENCH_RUNS; ++run) {
+        memcpy(re, left, sizeof(re));
+        memset(im, 0, sizeof(im));
+        uint32_t t0 = esp_cpu_get_cycle_count();
+        kz_vis_fft(re, im, KZ_VIS_FFT_BITS);
+        uint32_t t1 = esp_cpu_get_cycle_count();
+        spectrum(&sp, left, right, 24000, bars);
+        uint32_t t2 = esp_cpu_get_cycle_count();
+        tap_block(ring, 0, pcm, KZ_VIS_BENCH_FRAMES, 2);
+        uint32_t t3 = esp_cpu_get_cycle_count();
+        fft_min = t1 - t0 < fft_min ? t1 - t0 : fft_min;
+        frame_min = t2 - t1 < frame_min ? t2 - t1 : frame_min;
+        tap_min = t3 - t2 < tap_min ? t3 - t2 : tap_min;
+    }
+    const float mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ;
+    printf("fft %d points  %6u cycles  %6.1f us\n", KZ_VIS_FFT_LEN, (unsigned)fft_min, fft_min / mhz);
+    printf("spectrum frame %6u cycles  %6.1f us, %.2f%% of the UI core at %d fps\n", (unsigned)frame_min,
+           frame_min / mhz, frame_min * KZ_VIS_BENCH_FPS / (mhz * 1e4f), KZ_VIS_BENCH_FPS);
+    printf("tap            %6u cycles per %d frames, %.3f%% of the audio core at 48 kHz\n", (unsigned)tap_min,
+           KZ_VIS_BENCH_FRAMES, tap_min * (48000.0f / KZ_VIS_BENCH_FRAMES) / (mhz * 1e4f));
+    uint32_t frames, max_us;
+    kz_vis_take_stats(&frames, &max_us);
+    printf("%u frames drawn since the last look, slowest %u us\n", (unsigned)frames, (unsigned)max_us);
+}
+
+static void set_mode(kz_vis_mode_e mode) {
+    s_mode = mode;
+    nvs_handle_t nvs;
+    if (ESP_OK == nvs_open(KZ_VIS_NVS_NAMESPACE, NVS_READWRITE, &nvs)) {
+        if (ESP_OK != nvs_set_u8(nvs, KZ_VIS_NVS_KEY, (uint8_t)mode) || ESP_OK != nvs_commit(nvs)) {
+            printf("Unable to save the setting\n");
+        }
+        nvs_close(nvs);
+    }
+}
+
+static int vis_cmd(int argc, char **argv) {
+    static const char *names[] = {
+        [KZ_VIS_OFF] = "off",
+        [KZ_VIS_SPECTRUM] = "spectrum",
+        [KZ_VIS_VU] = "vu",
+    };
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        run_bench();
+        return 0;
+    }
+    if (argc > 1) {
+        int mode = 0;
+        while (mode <= KZ_VIS_VU && strcmp(argv[1], names[mode]) != 0) {
+            mode++;
+        }
+        if (mode > KZ_VIS_VU) {
+            printf("Usage: vis [off|spectrum|vu|bench]\n");
+            return 1;
+        }
+        set_mode((kz_vis_mode_e)mode);
+    }
+    printf("vis %s\n", names[s_mode]);
+    return 0;
+}
+
+esp_err_t kz_vis_init(void) {
+    nvs_handle_t nvs;
+    uint8_t mode = KZ_VIS_OFF;
+    if (ESP_OK == nvs_open(KZ_VIS_NVS_NAMESPACE, NVS_READONLY, &nvs)) {
+        nvs_get_u8(nvs, KZ_VIS_NVS_KEY, &mode);
+        nvs_close(nvs);
+    }
+    s_mode = mode <= KZ_VIS_VU ? (kz_vis_mode_e)mode : KZ_VIS_OFF;
+    build_tables();
+
+    // Below LVGL, so drawing always comes first
+    if (pdPASS != xTaskCreatePinnedToCore(vis_task, "VIS", KZ_VIS_TASK_STACK, NULL, tskIDLE_PRIORITY + 1,
+                                          &s_task, CONFIG_KZ_SCHED_UI_CORE)) {
+        ESP_LOGE(TAG, "Unable to start the visualizer task");
+        return ESP_ERR_NO_MEM;
+    }
+
+    const esp_console_cmd_t cmd = {
+        .command = "vis",
+        .help = "Show or set the Now Playing visualizer. 'bench' times the FFT, a spectrum frame and the tap "
+                "on the audio path",
+        .hint = "[off|spectrum|vu|bench]",
+        .func = vis_cmd,
+    };
+    return esp_console_cmd_register(&cmd);
+}
+#endif
@@ -0,0 +1,49 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define KZ_VIS_FFT_BITS (8)
+#define KZ_VIS_FFT_LEN (1 << KZ_VIS_FFT_BITS)
+#define KZ_VIS_BAR_COUNT (16)
+// Bar and meter levels run from 0, silence, to this at full scale
+#define KZ_VIS_LEVEL_MAX (255)
+
+// Portable fixed point FFT, radix 2 and in place on Q15 halves, up to
+// KZ_VIS_FFT_LEN points. Each stage halves its output so nothing can
+// overflow, leaving the result scaled by 1/n. See host_test/test_vis.c for
+// its accuracy and cost.
+void kz_vis_fft(int16_t *re, int16_t *im, int bits);
+// Apply a Hann window of KZ_VIS_FFT_LEN points to pcm
+void kz_vis_window(int16_t *pcm);
+
+#ifdef ESP_PLATFORM
+#include "esp_err.h"
+
+typedef enum {
+    KZ_VIS_OFF = 0,
+    KZ_VIS_SPECTRUM,
+    KZ_VIS_VU,
+} kz_vis_mode_e;
+
+typedef struct {
+    uint8_t bars[KZ_VIS_BAR_COUNT];     // low to high frequency
+    uint8_t vu[2];                      // left and right
+    uint8_t vu_peak[2];
+} kz_vis_frame_t;
+
+// Copy the end of the audio on its way to the I2S writer, decimated by 2,
+// for the visualizer. Cheap enough for the audio path, and does nothing
+// while the visualizer is off.
+void kz_vis_tap(const int16_t *pcm, size_t frames, int channels, int rate);
+kz_vis_mode_e kz_vis_get_mode(void);
+// Have the visualizer task work out a frame from the latest audio. It runs
+// at low priority on the UI core, so only ask while it's being shown.
+void kz_vis_request(void);
+// The last frame worked out. False if none has been yet.
+bool kz_vis_get_frame(kz_vis_frame_t *frame);
+// Frames worked out and the slowest one, since the last call
+void kz_vis_take_stats(uint32_t *frames, uint32_t *max_us);
+// Load the mode kept in NVS, start the visualizer task and add the "vis"
+// console command. Call after kz_console_init().
+esp_err_t kz_vis_init(void);
+#endif
@@ -0,0 +1,327 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_console.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "nvs.h"
+
+#include "audio_element.h"
+#include "audio_pipeline.h"
+#include "raw_stream.h"
+
+#include "playlist.h"
+#include "player_be.h"
+#include "kz_util.h"
+#include "kz_decoder.h"
+#include "kz_resample.h"
+#include "kz_mix.h"
+#include "kz_xfade.h"
+
+#define KZ_XFADE_NVS_NAMESPACE "kz_xfade"
+#define KZ_XFADE_NVS_KEY "ms"
+#define KZ_XFADE_BENCH_DEFAULT_S 10
+#define KZ_XFADE_TIMEOUT_MS 2000
+#define KZ_XFADE_BLOCK (2048)
+
+static const char *TAG = "KZ_XFADE";
+
+typedef struct {
+    const char *name;
+    const char *file;
+} bench_clip_t;
+
+// One clip per decoder
+static const bench_clip_t s_clips[] = {
+    {"MP3", "mp3_cbr.mp3"},
+    {"FLAC", "flac_16.flac"},
+    {"Opus", "opus.opus"},
+    {"Vorbis", "vorbis.ogg"},
+    {"AAC", "aac_lc.m4a"},
+    {"WAV", "wav.wav"},
+};
+#define KZ_XFADE_CLIP_COUNT (sizeof(s_clips) / sizeof(*s_clips))
+
+// Reader, decoder and resampler, as the player's side pipeline has them
+typedef struct {
+    audio_pipeline_handle_t pipeline;
+    audio_element_handle_t decoder;
+    audio_element_handle_t rsp;
+    audio_element_handle_t sink;
+    audio_element_info_t info;      // what comes out of the resampler
+    uint64_t bytes;
+    bool done;
+} bench_chain_t;
+
+typedef struct {
+    uint32_t audio_ms;              // of the shorter of the two
+    uint32_t wall_ms;
+    int32_t int_cost;
+    int32_t psram_cost;
+    int32_t int_peak;
+    int32_t psram_peak;
+    bool mixed;                     // in the same format, so the player would fade between them
+} bench_result_t;
+
+static int16_t s_buf[2][KZ_XFADE_BLOCK / sizeof(int16_t)];
+
+static esp_err_t chain_open(bench_chain_t *c, int n, const char *url) {
+    // Registered under names of their own, so the two sets of tasks can
+    // be told apart
+    static char tags[2][4][8];
+    const char *names[] = {"xb_fs", "xb_dec", "xb_rsp", "xb_raw"};
+    for (int i = 0; i < 4; ++i) {
+        snprintf(tags[n][i], sizeof(tags[n][i]), "%s%d", names[i], n);
+    }
+    memset(c, 0, sizeof(*c));
+
+    kz_resample_cfg_t rsp_cfg = DEFAULT_KZ_RESAMPLE_CONFIG();
+    rsp_cfg.quality = KZ_RESAMPLE_MEDIUM;
+    rsp_cfg.task_core = CONFIG_KZ_SCHED_AUDIO_CORE;
+    rsp_cfg.task_prio = CONFIG_KZ_SCHED_RSP_PRIO;
+    rsp_cfg.stack_in_ext = n != 0;
+    c->rsp = kz_resample_init(&rsp_cfg);
+
+    raw_stream_cfg_t raw_cfg = RAW_STREAM_CFG_DEFAULT();
+    raw_cfg.type = AUDIO_STREAM_READER;
+    c->sink = raw_stream_init(&raw_cfg);
+
+    // The first as the player's own decoder, the second as its side one
+    kz_decoder_t dec = kz_decoder_for_ext(kz_get_ext(url));
+    kz_decoder_stack_t stack = n == 0 ? kz_decoder_get_stack(dec) : KZ_DECODER_STACK_PSRAM;
+    c->pipeline = kz_decoder_pipeline_create(url, stack, CONFIG_KZ_SCHED_FS_PRIO,
+                                             (audio_element_handle_t[]) {c->rsp, c->sink}, 2,
+                                             (const char *[]) {tags[n][0], tags[n][1], tags[n][2], tags[n][3]},
+                                             &c->decoder);
+    if (c->pipeline == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    audio_element_set_input_timeout(c->sink, pdMS_TO_TICKS(KZ_XFADE_TIMEOUT_MS));
+    audio_pipeline_run(c->pipeline);
+    return ESP_OK;
+}
+
+// The player hands the decoder's format to the resampler; do the same
+static bool chain_wait_format(bench_chain_t *c) {
+    int64_t deadline = esp_timer_get_time() + KZ_XFADE_TIMEOUT_MS * 1000LL;
+    audio_element_info_t info = {0};
+    while (esp_timer_get_time() < deadline) {
+        audio_element_getinfo(c->decoder, &info);
+        if (info.sample_rates != 0 && info.channels != 0) {
+            kz_resample_set_src_info(c->rsp, info.sample_rates, info.bits, info.channels);
+            c->info = info;
+            c->info.sample_rates = kz_resample_out_rate(c->rsp, info.sample_rates, info.bits, info.channels);
+            return true;
+        }
+        vTaskDelay(1);
+    }
+    return false;
+}
+
+static int chain_read(bench_chain_t *c, int16_t *buf) {
+    if (c->done) {
+        return 0;
+    }
+    int len = raw_stream_read(c->sink, (char *)buf, KZ_XFADE_BLOCK);
+    if (len <= 0) {
+        c->done = true;
+        return 0;
+    }
+    c->bytes += len;
+    return len;
+}
+
+static void chain_close(bench_chain_t *c) {
+    if (c->pipeline == NULL) {
+        return;
+    }
+    kz_decoder_pipeline_destroy(c->pipeline);
+    c->pipeline = NULL;
+}
+
+static uint32_t chain_ms(const bench_chain_t *c) {
+    uint32_t byte_rate = c->info.sample_rates * c->info.channels * c->info.bits / 8;
+    return byte_rate != 0 ? (uint32_t)(c->bytes * 1000 / byte_rate) : 0;
+}
+
+// Decode two clips at once as fast as they'll go, mixing them as a
+// crossfade would when they're in the same format
+static esp_err_t bench_pair(const char *url_a, const char *url_b, uint32_t max_ms, bench_result_t *res) {
+    static bench_chain_t chains[2];
+    size_t int_before = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    size_t psram_before = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+    size_t int_min = int_before;
+    size_t psram_min = psram_before;
+    memset(res, 0, sizeof(*res));
+
+    int64_t start = esp_timer_get_time();
+    esp_err_t ret = chain_open(&chains[0], 0, url_a);
+    if (ret == ESP_OK) {
+        ret = chain_open(&chains[1], 1, url_b);
+    }
+    if (ret == ESP_OK && (!chain_wait_format(&chains[0]) || !chain_wait_format(&chains[1]))) {
+        ret = ESP_FAIL;
+    }
+    const audio_element_info_t *a = &chains[0].info;
+    const audio_element_info_t *b = &chains[1].info;
+    res->mixed = a->bits == 16 && b->bits == 16 && a->sample_rates == b->sample_rates && a->channels == b->channels;
+    uint32_t fade = (uint32_t)((uint64_t)max_ms * a->sample_rates / 1000);
+    uint32_t pos = 0;
+
+    bool allocated = false;
+    while (ret == ESP_OK && !(chains[0].done && chains[1].done)) {
+        int len_a = chain_read(&chains[0], s_buf[0]);
+        int len_b = chain_read(&chains[1], s_buf[1]);
+        if (!allocated && len_a > 0 && len_b > 0) {
+            // Everything has been allocated once audio is coming out of both
+            res->int_cost = (int32_t)(int_before - heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+            res->psram_cost = (int32_t)(psram_before - heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
+            allocated = true;
+        }
+        if (res->mixed && len_a == KZ_XFADE_BLOCK && len_b == KZ_XFADE_BLOCK) {
+            size_t frames = KZ_XFADE_BLOCK / (sizeof(int16_t) * a->channels);
+            kz_mix_fade(s_buf[0], s_buf[1], s_buf[0], frames, a->channels, pos, fade);
+            pos += frames;
+        }
+        size_t int_free = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+        size_t psram_free = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+        int_min = int_free < int_min ? int_free : int_min;
+        psram_min = psram_free < psram_min ? psram_free : psram_min;
+        if (chain_ms(&chains[0]) >= max_ms && chain_ms(&chains[1]) >= max_ms) {
+            break;
+        }
+    }
+    res->wall_ms = (uint32_t)((esp_timer_get_time() - start) / 1000);
+    uint32_t ms_a = chain_ms(&chains[0]);
+    uint32_t ms_b = chain_ms(&chains[1]);
+    res->audio_ms = ms_a < ms_b ? ms_a : ms_b;
+    res->int_peak = (int32_t)(int_before - int_min);
+    res->psram_peak = (int32_t)(psram_before - psram_min);
+
+    chain_close(&chains[0]);
+    chain_close(&chains[1]);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    return res->audio_ms > 0 ? ESP_OK : ESP_FAIL;
+}
+
+// Time the mixing kernel on its own over a second of a 48 kHz stereo fade
+static void bench_kernel(void) {
+    const size_t frames = KZ_XFADE_BLOCK / (2 * sizeof(int16_t));
+    for (size_t i = 0; i < frames * 2; ++i) {
+        s_buf[0][i] = (int16_t)(i * 37);
+        s_buf[1][i] = (int16_t)(i * -53);
+    }
+    uint32_t len = 48000;
+    int64_t start = esp_timer_get_time();
+    for (uint32_t pos = 0; pos < len; pos += frames) {
+        kz_mix_fade(s_buf[0], s_buf[1], s_buf[0], frames, 2, pos, len);
+    }
+    int64_t us = esp_timer_get_time() - start;
+    printf("mix kernel: 1 s of stereo in %lld us, %llu samples/s\n", (long long)us,
+           us > 0 ? (unsigned long long)(2 * len) * 1000000ULL / us : 0ULL);
+}
+
+static void run_bench(uint32_t seconds) {
+    char url_a[64], url_b[64];
+    bench_kernel();
+    printf("pair            audio    wall    rtf   internal (peak)     psram (peak)  fade\n");
+    for (int i = 0; i < KZ_XFADE_CLIP_COUNT; ++i) {
+        for (int j = i; j < KZ_XFADE_CLIP_COUNT; ++j) {
+            struct stat st;
+            snprintf(url_a, sizeof(url_a), "file:/" KZ_DECODER_BENCH_DIR "/%s", s_clips[i].file);
+            snprintf(url_b, sizeof(url_b), "file:/" KZ_DECODER_BENCH_DIR "/%s", s_clips[j].file);
+            if (stat(url_a + FILE_PREFIX_LEN, &st) != 0 || stat(url_b + FILE_PREFIX_LEN, &st) != 0) {
+                printf("%-6s+ %-6s  missing clip\n", s_clips[i].name, s_clips[j].name);
+                continue;
+            }
+            bench_result_t res;
+            if (ESP_OK != bench_pair(url_a, url_b, seconds * 1000, &res)) {
+                printf("%-6s+ %-6s  failed\n", s_clips[i].name, s_clips[j].name);
+                continue;
+            }
+            // Fraction of real time spent decoding both, lower is better
+            unsigned rtf = (unsigned)((uint64_t)res.wall_ms * 1000 / res.audio_ms);
+            printf("%-6s+ %-6s %6u ms %5u ms  %u.%03u  %7d (%7d)  %7d (%7d)  %s\n", s_clips[i].name,
+                   s_clips[j].name, (unsigned)res.audio_ms, (unsigned)res.wall_ms, rtf / 1000, rtf % 1000,
+                   (int)res.int_cost, (int)res.int_peak, (int)res.psram_cost, (int)res.psram_peak,
+                   res.mixed ? "yes" : "cut");
+            ESP_LOGI(TAG, "%s+%s rtf %u/1000", s_clips[i].name, s_clips[j].name, rtf);
+        }
+    }
+}
+
+static esp_err_t save_crossfade(uint32_t ms) {
+    nvs_handle_t nvs;
+    esp_err_t ret = nvs_open(KZ_XFADE_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    ret = nvs_set_u32(nvs, KZ_XFADE_NVS_KEY, ms);
+    if (ret == ESP_OK) {
+        ret = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    return ret;
+}
+
+static int crossfade_cmd(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        int seconds = argc > 2 ? atoi(argv[2]) : KZ_XFADE_BENCH_DEFAULT_S;
+        if (seconds <= 0) {
+            return 1;
+        }
+        // Anything else decoding at the same time would skew the numbers
+        if (player_is_playing()) {
+            printf("Pause playback first\n");
+            return 1;
+        }
+        run_bench(seconds);
+        return 0;
+    }
+    if (argc > 1) {
+        char *end;
+        float seconds = strtof(argv[1], &end);
+        if (end == argv[1] || *end != '\0' || seconds < 0.0f || seconds * 1000 > PLAYER_XFADE_MAX_MS) {
+            printf("Usage: crossfade [0-%d seconds|bench [seconds]]\n", PLAYER_XFADE_MAX_MS / 1000);
+            return 1;
+        }
+        player_set_crossfade((uint32_t)(seconds * 1000));
+        if (ESP_OK != save_crossfade(player_get_crossfade())) {
+            printf("Unable to save the setting\n");
+        }
+    }
+    uint32_t ms = player_get_crossfade();
+    if (ms == 0) {
+        printf("crossfade off\n");
+    } else {
+        printf("crossfade %u.%03u s\n", (unsigned)(ms / 1000), (unsigned)(ms % 1000));
+    }
+    return 0;
+}
+
+esp_err_t kz_xfade_init(void) {
+    nvs_handle_t nvs;
+    uint32_t ms = 0;
+    if (ESP_OK == nvs_open(KZ_XFADE_NVS_NAMESPACE, NVS_READONLY, &nvs)) {
+        nvs_get_u32(nvs, KZ_XFADE_NVS_KEY, &ms);
+        nvs_close(nvs);
+    }
+    player_set_crossfade(ms);
+
+    const esp_console_cmd_t cmd = {
+        .command = "crossfade",
+        .help = "Show or set how long each track fades into the next, 0 to cut. 'bench' decodes each pair of "
+                "reference clips in " KZ_DECODER_BENCH_DIR " at once, as a crossfade does",
+        .hint = "[seconds|bench [seconds]]",
+        .func = crossfade_cmd,
+    };
+    return esp_console_cmd_register(&cmd);
+}
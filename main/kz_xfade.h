@@ -0,0 +1,6 @@
+#include "esp_err.h"
+
+// Apply the crossfade length kept in NVS and add the "crossfade" console
+// command, which changes it and benchmarks decoding two tracks at once as
+// a crossfade does, for each pair of formats. Call after kz_console_init().
+esp_err_t kz_xfade_init(void);
@@ -25,6 +25,7 @@
 #include "playlist.h"
 
 #include "driver/i2c.h"
+#include "i2c_sched.h"
 
 #include "esp_lcd_panel_io.h"
 #include "esp_lcd_panel_ops.h"
@@ -40,19 +41,39 @@
 #include "ui_np.h"
 #include "ui_bt.h"
 #include "ui_fe.h"
+#include "ui_lib.h"
+#include "ui_stats.h"
+#include "ui_gov.h"
+#include "kz_tagdb.h"
+#include "kz_seek.h"
+#include "kz_boot.h"
+#include "kz_sdcard.h"
+#include "kz_console.h"
+#include "kz_telem.h"
+#include "kz_prof.h"
+#include "kz_stress.h"
+#include "kz_decbench.h"
+#include "kz_ssd1306.h"
+#include "kz_skipbench.h"
+#include "kz_prefetch.h"
+#include "kz_xfade.h"
+#include "kz_eq.h"
+#include "kz_tone.h"
+#include "kz_vis.h"
 
 static const char *TAG = "MAIN";
 
 #define SSD1306_H_RES 128
 #define SSD1306_V_RES 64
+#define SSD1306_I2C_ADDR 0x3D
 
-#if configUSE_TRACE_FACILITY != 0
-static esp_err_t print_real_time_stats(TickType_t xTicksToWait);
-#endif
+#define BOOT_SDCARD_WAIT_MS (3 * 1000)
 
 static disp_state_t s_cur_disp_state = DS_MAIN_MENU;
 static disp_state_t s_prev_disp_state = DS_MAIN_MENU;
 
+static esp_periph_set_handle_t s_periph_set = NULL;
+static audio_board_handle_t s_board_handle = NULL;
 static esp_err_t input_key_service_cb(periph_service_handle_t handle, periph_service_event_t *evt, void *ctx)
 {
     /* Handle touch pad events
@@ -61,6 +82,7 @@ static esp_err_t input_key_service_cb(periph_service_handle_t handle, periph_ser
     audio_board_handle_t board_handle = (audio_board_handle_t) ctx;
 
     disp_state_t next_state = DS_NO_CHANGE;
+    ui_gov_poke();
     if (evt->type == INPUT_KEY_SERVICE_ACTION_PRESS) {
         switch ((int)evt->data) {
             case INPUT_KEY_USER_ID_CENTER:
@@ -89,6 +111,12 @@ static esp_err_t input_key_service_cb(periph_service_handle_t handle, periph_ser
             case DS_FILE_EXP:
                 next_state = ui_fe_handle_input(handle, evt, board_handle);
                 break;
+            case DS_LIBRARY:
+                next_state = ui_lib_handle_input(handle, evt, board_handle);
+                break;
+            case DS_STATS:
+                next_state = ui_stats_handle_input(handle, evt, board_handle);
+                break;
             default:
                 return ESP_FAIL;
         }
@@ -98,6 +126,13 @@ static esp_err_t input_key_service_cb(periph_service_handle_t handle, periph_ser
         s_prev_disp_state = s_cur_disp_state;
         s_cur_disp_state = next_state;
 
+        // Keep the BT stack up for as long as its screen is showing
+        if (s_cur_disp_state == DS_BLUETOOTH) {
+            bt_be_acquire();
+        } else if (s_prev_disp_state == DS_BLUETOOTH) {
+            bt_be_release();
+        }
+
         lvgl_port_lock(0);
         switch(s_cur_disp_state) {
             case DS_NOW_PLAYING:
@@ -109,76 +144,93 @@ static esp_err_t input_key_service_cb(periph_service_handle_t handle, periph_ser
             case DS_FILE_EXP:
                 lv_scr_load_anim(ui_fe_get_screen(), LV_SCR_LOAD_ANIM_MOVE_TOP, 500, 0, false);
                 break;
+            case DS_LIBRARY:
+                lv_scr_load_anim(ui_lib_get_screen(), LV_SCR_LOAD_ANIM_MOVE_TOP, 500, 0, false);
+                break;
+            case DS_STATS:
+                lv_scr_load_anim(ui_stats_get_screen(), LV_SCR_LOAD_ANIM_MOVE_TOP, 500, 0, false);
+                break;
             case DS_MAIN_MENU:
             default:
                 lv_scr_load_anim(ui_mm_get_screen(), LV_SCR_LOAD_ANIM_MOVE_BOTTOM, 500, 0, false);
                 break;
         }
+        ui_gov_set_screen(s_cur_disp_state);
         lvgl_port_unlock();
     }
 
     return ESP_OK;
 }
 
-void app_main(void)
+enum {
+    BOOT_SDCARD,
+    BOOT_PLAYER,
+    BOOT_CODEC,
+    BOOT_DISPLAY,
+    BOOT_INPUT,
+};
+
+static void sdcard_changed(bool mounted)
 {
-    /* Initialize NVS — it is used to store PHY calibration data and save key-value pairs in flash memory*/
-    esp_err_t ret = nvs_flash_init();
-    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
-        ESP_ERROR_CHECK(nvs_flash_erase());
-        ret = nvs_flash_init();
+    if (mounted) {
+        // Refresh the library index in the background. Only files which
+        // changed since the last scan have their tags read again.
+        kz_tagdb_init();
+    } else {
+        kz_tagdb_release();
+        kz_seek_flush();
     }
-    ESP_ERROR_CHECK( ret );
-
-    /* This GPIO controls the SDMMC pullups - pull them up! */
-    gpio_reset_pin(26);
-    gpio_set_direction(26, GPIO_MODE_OUTPUT);
-    gpio_set_level(26, 1);
-
-    /* Force reset the screen! */
-    gpio_reset_pin(21);
-    gpio_set_direction(21, GPIO_MODE_OUTPUT);
-    gpio_set_level(21, 0);
-
-    ESP_LOGI(TAG, "[1.0] Initialize peripherals management");
-    esp_periph_config_t periph_cfg = DEFAULT_ESP_PERIPH_SET_CONFIG();
-    esp_periph_set_handle_t set = esp_periph_set_init(&periph_cfg);
+}
 
-    ESP_LOGI(TAG, "[1.1] Initialize and start peripherals");
-    audio_board_key_init(set);
-    audio_board_sdcard_init(set, SD_MODE_4_LINE);
+static void boot_sdcard(void)
+{
+    kz_sdcard_add_listener(sdcard_changed);
+    kz_sdcard_init(s_periph_set);
 
-    bt_be_init();
+    // Don't hold up boot forever without a card, it's picked up whenever
+    // one goes in
+    if (!kz_sdcard_wait_mounted(pdMS_TO_TICKS(BOOT_SDCARD_WAIT_MS))) {
+        ESP_LOGW(TAG, "No SD card, carrying on without one");
+    }
+}
 
+static void boot_player(void)
+{
     // launch player_backend task!
-    xTaskCreatePinnedToCore(player_main, "PLAYER", (8*1024), NULL, 5, NULL, APP_CPU_NUM);
+    xTaskCreatePinnedToCore(player_main, "PLAYER", (8*1024), NULL, CONFIG_KZ_SCHED_PLAYER_PRIO, NULL,
+                            CONFIG_KZ_SCHED_AUDIO_CORE);
+}
+
+static void boot_codec(void)
+{
+    // The codec calibrates against the I2S clocks, so give the player a
+    // moment to bring them up first
     vTaskDelay(pdMS_TO_TICKS(100));
 
     ESP_LOGI(TAG, "[ 2 ] Start codec chip");
-    audio_board_handle_t board_handle = audio_board_init();
-    audio_hal_ctrl_codec(board_handle->audio_hal, AUDIO_HAL_CODEC_MODE_DECODE, AUDIO_HAL_CTRL_START);
-
-    audio_hal_set_volume(board_handle->audio_hal, 50);
+    s_board_handle = audio_board_init();
+    audio_hal_ctrl_codec(s_board_handle->audio_hal, AUDIO_HAL_CODEC_MODE_DECODE, AUDIO_HAL_CTRL_START);
 
-    ESP_LOGI(TAG, "[ 3 ] Create and start input key service");
-    input_key_service_info_t input_key_info[] = INPUT_KEY_DEFAULT_INFO();
-    input_key_service_cfg_t input_cfg = INPUT_KEY_SERVICE_DEFAULT_CONFIG();
-    input_cfg.based_cfg.task_stack = (6 * 1024); // We need a bit more stack for the file explorer
-    input_cfg.handle = set;
-    periph_service_handle_t input_ser = input_key_service_create(&input_cfg);
-    input_key_service_add_key(input_ser, input_key_info, INPUT_KEY_NUM);
-    periph_service_set_callback(input_ser, input_key_service_cb, (void *)board_handle);
-
-    ESP_LOGI(TAG, "[3.7] Create bt peripheral");
-    esp_periph_handle_t bt_periph = bt_create_periph();
+    audio_hal_set_volume(s_board_handle->audio_hal, 50);
+}
 
-    ESP_LOGI(TAG, "[3.8] Start bt peripheral");
-    esp_periph_start(set, bt_periph);
+static void boot_display(void)
+{
+    // The panel shares the codec's I2C bus. Whichever of us gets there
+    // first starts the bus scheduler, and the other just waits for it.
+    i2c_config_t i2c_cfg = {
+        .mode = I2C_MODE_MASTER,
+        .sda_pullup_en = 0,
+        .scl_pullup_en = 0,
+        .master.clk_speed = 400000,
+    };
+    get_i2c_pins(I2C_NUM_0, &i2c_cfg);
+    ESP_ERROR_CHECK(i2c_sched_init(I2C_NUM_0, &i2c_cfg));
 
     ESP_LOGI(TAG, "Install panel IO");
     esp_lcd_panel_io_handle_t io_handle = NULL;
     esp_lcd_panel_io_i2c_config_t io_config = {
-        .dev_addr = 0x3D,
+        .dev_addr = SSD1306_I2C_ADDR,
         .control_phase_bytes = 1,               // According to SSD1306 datasheet
         .lcd_cmd_bits = 8,                      // According to SSD1306 datasheet
         .lcd_param_bits = 8,                    // According to SSD1306 datasheet
@@ -194,12 +246,17 @@ void app_main(void)
     };
     ESP_ERROR_CHECK(esp_lcd_new_panel_ssd1306(io_handle, &panel_config, &panel_handle));
 
+    // Only the init sequence goes through the panel IO. It's short, and the
+    // driver still serialises it with the scheduler's transfers.
     ESP_ERROR_CHECK(esp_lcd_panel_reset(panel_handle));
     ESP_ERROR_CHECK(esp_lcd_panel_init(panel_handle));
     ESP_ERROR_CHECK(esp_lcd_panel_disp_on_off(panel_handle, true));
 
     ESP_LOGI(TAG, "Initialize LVGL");
-    const lvgl_port_cfg_t lvgl_cfg = ESP_LVGL_PORT_INIT_CONFIG();
+    lvgl_port_cfg_t lvgl_cfg = ESP_LVGL_PORT_INIT_CONFIG();
+    lvgl_cfg.task_priority = CONFIG_KZ_SCHED_LVGL_PRIO;
+    lvgl_cfg.task_stack = CONFIG_KZ_SCHED_LVGL_STACK;
+    lvgl_cfg.task_affinity = CONFIG_KZ_SCHED_UI_CORE;
     lvgl_port_init(&lvgl_cfg);
 
     const lvgl_port_display_cfg_t disp_cfg = {
@@ -218,6 +275,9 @@ void app_main(void)
     };
     lvgl_port_lock(0);
     lv_disp_t * disp = lvgl_port_add_disp(&disp_cfg);
+    // Only send the parts of the screen which actually changed, and send
+    // them through the bus scheduler rather than the panel IO
+    kz_ssd1306_attach(disp, SSD1306_I2C_ADDR);
 
     /* Rotation of the screen */
     lv_disp_set_rotation(disp, LV_DISP_ROT_NONE);
@@ -228,101 +288,83 @@ void app_main(void)
     ui_np_init();
     ui_bt_init();
     ui_fe_init();
+    ui_lib_init();
+    ui_stats_init();
+    ui_gov_init();
 
-    while(1) {
-#if configUSE_TRACE_FACILITY != 0
-        heap_caps_print_heap_info(MALLOC_CAP_8BIT);
-        esp_err_t ret = print_real_time_stats(100);
-        if (ret != ESP_OK) {
-            ESP_LOGE(TAG, "Oh Noooooo: %d", ret);
-        }
-#endif
-        vTaskDelay(pdMS_TO_TICKS(1000));
-    }
+    // Push the main menu out now rather than on the next LVGL tick
+    lvgl_port_lock(0);
+    lv_refr_now(disp);
+    lvgl_port_unlock();
+    kz_boot_mark("First frame");
 }
 
-#if configUSE_TRACE_FACILITY != 0
-static esp_err_t print_real_time_stats(TickType_t xTicksToWait)
+static void boot_input(void)
 {
-    TaskStatus_t *start_array = NULL, *end_array = NULL;
-    UBaseType_t start_array_size, end_array_size;
-    uint32_t start_run_time, end_run_time;
-    esp_err_t ret;
-
-    //Allocate array to store current task states
-    start_array_size = uxTaskGetNumberOfTasks() + 10;
-    start_array = malloc(sizeof(TaskStatus_t) * start_array_size);
-    if (start_array == NULL) {
-        ret = ESP_ERR_NO_MEM;
-        goto exit;
-    }
-    //Get current task states
-    start_array_size = uxTaskGetSystemState(start_array, start_array_size, &start_run_time);
-    if (start_array_size == 0) {
-        ret = ESP_ERR_INVALID_SIZE;
-        goto exit;
-    }
+    ESP_LOGI(TAG, "[ 3 ] Create and start input key service");
+    input_key_service_info_t input_key_info[] = INPUT_KEY_DEFAULT_INFO();
+    input_key_service_cfg_t input_cfg = INPUT_KEY_SERVICE_DEFAULT_CONFIG();
+    input_cfg.based_cfg.task_stack = (6 * 1024); // We need a bit more stack for the file explorer
+    input_cfg.based_cfg.task_prio = CONFIG_KZ_SCHED_INPUT_PRIO;
+    input_cfg.based_cfg.task_core = CONFIG_KZ_SCHED_UI_CORE;
+    input_cfg.handle = s_periph_set;
+    periph_service_handle_t input_ser = input_key_service_create(&input_cfg);
+    input_key_service_add_key(input_ser, input_key_info, INPUT_KEY_NUM);
+    periph_service_set_callback(input_ser, input_key_service_cb, (void *)s_board_handle);
+}
 
-    vTaskDelay(xTicksToWait);
+static const kz_boot_stage_t s_boot_stages[] = {
+    [BOOT_SDCARD] = { "sdcard", boot_sdcard, 0, (4*1024), PRO_CPU_NUM },
+    [BOOT_PLAYER] = { "player", boot_player, KZ_BOOT_DEP(BOOT_SDCARD), (2*1024), APP_CPU_NUM },
+    [BOOT_CODEC] = { "codec", boot_codec, KZ_BOOT_DEP(BOOT_PLAYER), (4*1024), PRO_CPU_NUM },
+    [BOOT_DISPLAY] = { "display", boot_display, 0, (6*1024), APP_CPU_NUM },
+    [BOOT_INPUT] = { "input", boot_input, KZ_BOOT_DEP(BOOT_CODEC) | KZ_BOOT_DEP(BOOT_DISPLAY),
+                     (4*1024), PRO_CPU_NUM },
+};
 
-    //Allocate array to store tasks states post delay
-    end_array_size = uxTaskGetNumberOfTasks() + 10;
-    end_array = malloc(sizeof(TaskStatus_t) * end_array_size);
-    if (end_array == NULL) {
-        ret = ESP_ERR_NO_MEM;
-        goto exit;
-    }
-    //Get post delay task states
-    end_array_size = uxTaskGetSystemState(end_array, end_array_size, &end_run_time);
-    if (end_array_size == 0) {
-        ret = ESP_ERR_INVALID_SIZE;
-        goto exit;
+void app_main(void)
+{
+    /* Initialize NVS — it is used to store PHY calibration data and save key-value pairs in flash memory*/
+    esp_err_t ret = nvs_flash_init();
+    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_ERROR_CHECK(nvs_flash_erase());
+        ret = nvs_flash_init();
     }
+    ESP_ERROR_CHECK( ret );
 
-    //Calculate total_elapsed_time in units of run time stats clock period.
-    uint32_t total_elapsed_time = (end_run_time - start_run_time);
-    if (total_elapsed_time == 0) {
-        ret = ESP_ERR_INVALID_STATE;
-        goto exit;
-    }
+    /* This GPIO controls the SDMMC pullups - pull them up! */
+    gpio_reset_pin(26);
+    gpio_set_direction(26, GPIO_MODE_OUTPUT);
+    gpio_set_level(26, 1);
 
-    printf("|       Task       | RunTime | Percentage\n");
-    //Match each task in start_array to those in the end_array
-    for (int i = 0; i < start_array_size; i++) {
-        int k = -1;
-        for (int j = 0; j < end_array_size; j++) {
-            if (start_array[i].xHandle == end_array[j].xHandle) {
-                k = j;
-                //Mark that task have been matched by overwriting their handles
-                start_array[i].xHandle = NULL;
-                end_array[j].xHandle = NULL;
-                break;
-            }
-        }
-        //Check if matching task found
-        if (k >= 0) {
-            uint32_t task_elapsed_time = end_array[k].ulRunTimeCounter - start_array[i].ulRunTimeCounter;
-            uint32_t percentage_time = (task_elapsed_time * 100UL) / (total_elapsed_time * portNUM_PROCESSORS);
-            printf("| %16s |  %6"PRIu32" | %2"PRIu32"%%\n", start_array[i].pcTaskName, task_elapsed_time, percentage_time);
-        }
-    }
+    /* Force reset the screen! */
+    gpio_reset_pin(21);
+    gpio_set_direction(21, GPIO_MODE_OUTPUT);
+    gpio_set_level(21, 0);
 
-    //Print unmatched tasks
-    for (int i = 0; i < start_array_size; i++) {
-        if (start_array[i].xHandle != NULL) {
-            printf("| %16s | Deleted\n", start_array[i].pcTaskName);
-        }
-    }
-    for (int i = 0; i < end_array_size; i++) {
-        if (end_array[i].xHandle != NULL) {
-            printf("| %16s | Created\n", end_array[i].pcTaskName);
-        }
-    }
-    ret = ESP_OK;
+    ESP_LOGI(TAG, "[1.0] Initialize peripherals management");
+    esp_periph_config_t periph_cfg = DEFAULT_ESP_PERIPH_SET_CONFIG();
+    periph_cfg.task_prio = CONFIG_KZ_SCHED_INPUT_PRIO;
+    periph_cfg.task_core = CONFIG_KZ_SCHED_UI_CORE;
+    s_periph_set = esp_periph_set_init(&periph_cfg);
 
-exit:    //Common return path
-    free(start_array);
-    free(end_array);
-    return ret;
+    ESP_LOGI(TAG, "[1.1] Initialize and start peripherals");
+    audio_board_key_init(s_periph_set);
+    bt_be_init(s_periph_set);
+
+    // Everything else is staged so the SD card, codec and display come up
+    // in parallel. Bluetooth waits until the user first asks for it.
+    ESP_ERROR_CHECK(kz_boot_run(s_boot_stages, sizeof(s_boot_stages) / sizeof(*s_boot_stages)));
+
+    kz_console_init();
+    kz_telem_init();
+    kz_prof_init();
+    kz_stress_init();
+    kz_decbench_init();
+    kz_ssd1306_console_init();
+    kz_skipbench_init();
+    kz_prefetch_console_init();
+    kz_xfade_init();
+    kz_tone_init();
+    kz_vis_init();
 }
-#endif
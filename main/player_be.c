@@ -1,4 +1,6 @@
+#include <math.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
@@ -6,6 +8,7 @@
 
 #include "esp_log.h"
 #include "esp_random.h"
+#include "esp_timer.h"
 
 // ESP-ADF stuff
 #include "audio_element.h"
@@ -15,14 +18,6 @@
 #include "fatfs_stream.h"
 #include "i2s_stream.h"
 
-// Pull in ALL THE DECODERS!
-#include "mp3_decoder.h"
-#include "opus_decoder.h"
-#include "ogg_decoder.h"
-#include "flac_decoder.h"
-#include "wav_decoder.h"
-#include "aac_decoder.h"
-
 #include "esp_peripherals.h"
 #include "periph_service.h"
 #include "periph_sdcard.h"
@@ -31,27 +26,54 @@
 #include "board.h"
 
 #include "kz_util.h"
-#include "lvgl.h"
-#include "ui_common.h"
-#include "ui_np.h"
-
-#define PLAYER_DECODE_IN_PSRAM (true)
-
-typedef enum {
-    PLAYER_BE_PLAYLIST_MSG,
-    PLAYER_BE_PLAYPAUSE_MSG,
-    PLAYER_BE_NEXT_MSG,
-} player_be_msg_type;
-
-typedef struct {
-    player_be_msg_type type; // always PLAYER_BE_PLAYLIST_MSG
-    playlist_operator_t *pl_op;
-} playlist_msg;
+#include "kz_resample.h"
+#include "kz_tags.h"
+#include "kz_rgcache.h"
+#include "kz_resume.h"
+#include "kz_seek.h"
+#include "kz_boot.h"
+#include "kz_sdcard.h"
+#include "kz_rbtune.h"
+#include "kz_decoder.h"
+#include "kz_prefetch.h"
+#include "kz_mix.h"
+#include "kz_eq.h"
+#include "kz_tone.h"
+#include "kz_order.h"
+#include "player_msg.h"
+#include "player_be.h"
 
-typedef union {
-    player_be_msg_type type;
-    playlist_msg pl_msg;
-} player_be_msg_u;
+#ifdef CONFIG_KZ_SCHED_RSP_STACK_IN_PSRAM
+#define PLAYER_RSP_IN_PSRAM (true)
+#else
+#define PLAYER_RSP_IN_PSRAM (false)
+#endif
+#define PLAYER_RESAMPLE_QUALITY (KZ_RESAMPLE_MEDIUM)
+#define PLAYER_USE_REPLAYGAIN (true)
+// Only trust a loudness measurement once it has seen this many 400ms blocks
+#define PLAYER_RG_MIN_BLOCKS (25)
+// How often the play position is written to NVS while a track is playing
+#define PLAYER_CHECKPOINT_PERIOD_MS (30 * 1000)
+// How often the play position is published when nothing else is happening
+#define PLAYER_STATE_PERIOD_MS (250)
+// A reader only loses a race with a write of a few hundred bytes, so it
+// gets past one within a couple of tries
+#define PLAYER_STATE_TRIES (4)
+// Deep enough to hold a burst of presses while a track change is under way
+#define PLAYER_QUEUE_LEN (16)
+// A skip this soon after the last one is part of a burst, and the track is
+// only started once the presses stop
+#define PLAYER_SKIP_SETTLE_MS (150)
+// Previous restarts the track instead once it has played this long
+#define PLAYER_PREV_RESTART_MS (3 * 1000)
+// The next track's decoder is started this long before it's faded in, so
+// it has audio ready by then
+#define PLAYER_XFADE_LEAD_MS (1500)
+// How often a crossfade under way is checked on
+#define PLAYER_XFADE_POLL_MS (20)
+// Between the resamplers and the mixer
+#define PLAYER_MIX_RB_SIZE (8 * 1024)
+#define PLAYER_MAX_URL (256)
 
 static const char *TAG = "PLAYER_BE";
 
@@ -62,22 +84,106 @@ static playlist_operator_handle_t s_playlist = NULL;
 static playlist_operation_t s_pl_oper; // only valid if s_playlist is non-NULL 
 static uint32_t s_playlist_len = 0;
 
+// The reader, decoder and resampler feed the mixer and I2S writer through
+// a ring buffer of our own, so a track can be changed under a crossfade
+// without stopping the output
 static audio_pipeline_handle_t s_pipeline = NULL;
-static audio_element_handle_t s_hp_stream, s_fs_stream;
-static audio_element_handle_t s_mp3_stream, s_flac_stream, s_aac_stream,
-                              s_wav_stream, s_ogg_stream, s_opus_stream;
+static audio_pipeline_handle_t s_out_pipeline = NULL;
+static audio_element_handle_t s_hp_stream, s_fs_stream, s_rsp_stream, s_mix_stream, s_eq_stream;
+static ringbuf_handle_t s_mix_rb = NULL;
+static audio_element_handle_t s_decoders[KZ_DECODER_COUNT];
+// Stack placement each decoder was created with, to spot policy changes
+static kz_decoder_stack_t s_decoder_stack[KZ_DECODER_COUNT];
 static audio_element_handle_t s_current_decoder = NULL;
 static const char *s_current_ext_str = NULL;
 static audio_extension_e s_current_ext = AUD_EXT_UNKNOWN;
 static bool s_playmode_is_shuffle = true;
+static player_repeat_t s_repeat = PLAYER_REPEAT_ALL;
+static uint32_t s_current_key = 0;
+static const char *s_current_url = NULL;
+// The reader is still on the last track while a crossfade plays the start
+// of the current one from the side
+static bool s_source_lags = false;
+static float s_track_gain_db = 0.0f;
+static uint32_t s_track_ms = 0;         // from the tags, 0 if they don't say
+// Playback position is the time the reader was started from plus whatever
+// the I2S writer has played since the decoder reported the stream format
+static uint32_t s_pos_base_ms = 0;
+static int64_t s_hp_base_bytes = 0;
+static uint32_t s_hp_byte_rate = 0;
+// The I2S clocks as last set
+static int s_out_rate = 0, s_out_bits = 0, s_out_ch = 0;
 static audio_event_iface_handle_t s_evt;
 
+static kz_resume_t s_resume = {0};
+static bool s_resume_playlist_saved = false;
+static int64_t s_last_checkpoint = 0;
+
+// Where to carry on from once a pulled card comes back
+static bool s_card_resume_pending = false;
+static bool s_card_was_playing = false;
+static uint32_t s_card_resume_ms = 0;
+
 static TaskHandle_t s_task = NULL;
 
+// A skip that is waiting for the presses to stop before it starts
+static char *s_skip_url = NULL;
+static int64_t s_skip_start_us = 0;
+// The track change being timed to first audio, 0 when none
+static int64_t s_skip_press_us = 0;
+static uint32_t s_skip_presses = 0;     // 0 when the player moved on by itself
+static const char *s_skip_kind = NULL;
+static bool s_skip_head = false;
+static int64_t s_last_press_us = 0;
+
+typedef enum {
+    XFADE_NONE = 0,
+    XFADE_OPENING,          // the next track's decoder is starting up on the side
+    XFADE_READY,            // ... its format matches, waiting for the fade point
+    XFADE_FADING,           // the next track is now current, fading in over the last
+    XFADE_CATCHING_UP,      // the main pipeline has restarted on it and is catching up
+} xfade_state_t;
+
+static volatile uint32_t s_xfade_ms = 0;
+// The tone controls have changed and the EQ hasn't been told yet
+static volatile bool s_eq_changed = false;
+static xfade_state_t s_xfade = XFADE_NONE;
+static bool s_xfade_tried = false;      // once per track
+static uint32_t s_xfade_len_ms = 0;
+static char s_xfade_url[PLAYER_MAX_URL];
+static audio_pipeline_handle_t s_xfade_pipeline = NULL;
+static audio_element_handle_t s_xfade_decoder = NULL, s_xfade_rsp = NULL;
+static audio_element_info_t s_xfade_info;
+static ringbuf_handle_t s_xfade_rb = NULL;
+static int64_t s_xfade_start_us = 0;
+
+// The play order through the playlist and its history, so previous works
+// the same whether or not we're shuffling. The shuffle pick for the next
+// track is made early so its start can be decoded ahead of time.
+static kz_order_t s_order = {.next = -1, .random = esp_random};
+
+// Published for the UI with a sequence count. Only the player task writes,
+// making the count odd while it does, and a reader that sees an odd or a
+// changed count retries, so the player never waits on the UI.
+static player_state_t s_state = {0};
+static volatile uint32_t s_state_seq = 0;
+static volatile uint32_t s_max_busy_us = 0;
+
 BaseType_t player_set_playlist(playlist_operator_handle_t new_playlist, TickType_t ticksToWait) {
     player_be_msg_u m;
     m.pl_msg.type = PLAYER_BE_PLAYLIST_MSG;
     m.pl_msg.pl_op = new_playlist;
+    m.pl_msg.start = -1;
+    xQueueSendToBack(s_player_be_queue, &m, ticksToWait);
+    xTaskAbortDelay(s_task);
+    return 0;
+}
+
+BaseType_t player_set_playlist_from(playlist_operator_handle_t new_playlist, uint32_t start, TickType_t ticksToWait) {
+    player_be_msg_u m;
+    m.pl_msg.type = PLAYER_BE_PLAYLIST_MSG;
+    m.pl_msg.pl_op = new_playlist;
+    m.pl_msg.start = (int32_t)start;
     xQueueSendToBack(s_player_be_queue, &m, ticksToWait);
     xTaskAbortDelay(s_task);
     return 0;
@@ -91,21 +197,197 @@ esp_err_t player_playpause(void) {
     return ESP_OK;
 }
 
+esp_err_t player_seek(uint32_t ms) {
+    player_be_msg_u msg;
+    msg.seek_msg.type = PLAYER_BE_SEEK_MSG;
+    msg.seek_msg.ms = (int32_t)ms;
+    msg.seek_msg.relative = false;
+    xQueueSendToBack(s_player_be_queue, &msg, 0);
+    xTaskAbortDelay(s_task);
+    return ESP_OK;
+}
+
+esp_err_t player_skip(int32_t delta_ms) {
+    player_be_msg_u msg;
+    msg.seek_msg.type = PLAYER_BE_SEEK_MSG;
+    msg.seek_msg.ms = delta_ms;
+    msg.seek_msg.relative = true;
+    xQueueSendToBack(s_player_be_queue, &msg, 0);
+    xTaskAbortDelay(s_task);
+    return ESP_OK;
+}
+
+static void card_changed(bool mounted) {
+    player_be_msg_u msg;
+    msg.card_msg.type = PLAYER_BE_CARD_MSG;
+    msg.card_msg.mounted = mounted;
+    xQueueSendToBack(s_player_be_queue, &msg, 0);
+    xTaskAbortDelay(s_task);
+}
+
+static void state_write_begin(void) {
+    s_state_seq++;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static void state_write_end(void) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    s_state_seq++;
+}
+
+bool player_get_state(player_state_t *state) {
+    for (int i = 0; i < PLAYER_STATE_TRIES; ++i) {
+        uint32_t seq = s_state_seq;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (seq & 1) {
+            continue;
+        }
+        memcpy(state, &s_state, sizeof(*state));
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (seq == s_state_seq) {
+            return true;
+        }
+    }
+    return false;
+}
+
+uint32_t player_take_max_busy_us(void) {
+    uint32_t max = s_max_busy_us;
+    s_max_busy_us = 0;
+    return max;
+}
+
+static void note_busy(int64_t start) {
+    uint32_t us = (uint32_t)(esp_timer_get_time() - start);
+    if (us > s_max_busy_us) {
+        s_max_busy_us = us;
+    }
+}
+
+static uint32_t playing_position_ms(void) {
+    if (s_hp_byte_rate == 0) {
+        return s_pos_base_ms;
+    }
+    audio_element_info_t info = {0};
+    audio_element_getinfo(s_hp_stream, &info);
+    int64_t played = info.byte_pos - s_hp_base_bytes;
+    return s_pos_base_ms + (played > 0 ? (uint32_t)(played * 1000 / s_hp_byte_rate) : 0);
+}
+
+static void checkpoint_position(uint32_t pos_ms) {
+    if (!s_resume_playlist_saved) {
+        return;
+    }
+    s_resume.index = (uint32_t)s_pl_oper.get_url_id(s_playlist);
+    s_resume.pos_ms = pos_ms;
+    s_resume.shuffle = s_playmode_is_shuffle;
+    s_resume.repeat = (uint8_t)s_repeat;
+    kz_resume_checkpoint(&s_resume);
+    s_last_checkpoint = esp_timer_get_time();
+}
+
+// Keep a copy of a new playlist on the card so it can be restored at boot
+static void save_playlist(void) {
+    int64_t start = esp_timer_get_time();
+    s_resume_playlist_saved = (ESP_OK == kz_resume_save_playlist(s_playlist, &s_resume.pl_hash));
+    ESP_LOGI(TAG, "Saved %u entry playlist in %lld ms", (unsigned)s_playlist_len,
+             (esp_timer_get_time() - start) / 1000);
+}
+
+static void resume_after_card(void);
+static void configure_and_run_playlist(const char *url);
+
+// Start the play order afresh on the playlist's current track
+static void reset_order(void) {
+    if (!kz_order_reset(&s_order, s_playlist_len, (uint32_t)s_pl_oper.get_url_id(s_playlist))) {
+        ESP_LOGW(TAG, "No memory to track the shuffle, tracks may repeat");
+    }
+}
+
+static void reset_pipeline(audio_pipeline_handle_t pipeline) {
+    audio_pipeline_reset_ringbuffer(pipeline);
+    audio_pipeline_reset_elements(pipeline);
+    audio_pipeline_change_state(pipeline, AEL_STATE_INIT);
+}
+
+static void stop_source(void) {
+    audio_pipeline_stop(s_pipeline);
+    audio_pipeline_wait_for_stop(s_pipeline);
+}
+
+// Tear down the side pipeline. The mixer mustn't be reading from it: it
+// has to be stopped, have let go, or never have been asked to fade.
+static void end_crossfade(void) {
+    s_xfade = XFADE_NONE;
+    if (s_xfade_pipeline == NULL) {
+        return;
+    }
+    // Nothing it says on the way down is of any use
+    audio_pipeline_remove_listener(s_xfade_pipeline);
+    // Doesn't take the ring buffer into the mixer with it
+    kz_decoder_pipeline_destroy(s_xfade_pipeline);
+    rb_reset(s_xfade_rb);
+    s_xfade_pipeline = NULL;
+    s_xfade_decoder = NULL;
+    s_xfade_rsp = NULL;
+}
+
+// Stop everything, dropping any crossfade under way
+static void stop_playback(void) {
+    audio_pipeline_stop(s_out_pipeline);
+    audio_pipeline_wait_for_stop(s_out_pipeline);
+    end_crossfade();
+    stop_source();
+}
+
+static void reset_playback(void) {
+    reset_pipeline(s_pipeline);
+    reset_pipeline(s_out_pipeline);
+}
+
+static void run_playback(void) {
+    audio_pipeline_run(s_out_pipeline);
+    audio_pipeline_run(s_pipeline);
+}
+
 static esp_err_t playpause_playlist(void) {
+    if (s_card_resume_pending) {
+        if (kz_sdcard_is_mounted()) {
+            resume_after_card();
+        }
+        return ESP_OK;
+    }
     audio_element_state_t el_state = audio_element_get_state(s_hp_stream);
     switch (el_state) {
         case AEL_STATE_INIT :
             ESP_LOGI(TAG, "Starting audio pipeline");
-            audio_pipeline_run(s_pipeline);
+            run_playback();
             break;
         case AEL_STATE_RUNNING :
             ESP_LOGI(TAG, "Pausing audio pipeline");
+            audio_pipeline_pause(s_out_pipeline);
             audio_pipeline_pause(s_pipeline);
+            if (s_xfade_pipeline != NULL) {
+                audio_pipeline_pause(s_xfade_pipeline);
+            }
+            checkpoint_position(playing_position_ms());
             break;
         case AEL_STATE_PAUSED :
             ESP_LOGI(TAG, "Resuming audio pipeline");
+            if (s_xfade_pipeline != NULL) {
+                audio_pipeline_resume(s_xfade_pipeline);
+            }
             audio_pipeline_resume(s_pipeline);
+            audio_pipeline_resume(s_out_pipeline);
+            break;
+        case AEL_STATE_FINISHED : {
+            // Stopped at the end of the list without repeat
+            ESP_LOGI(TAG, "Starting the playlist over");
+            char *url = NULL;
+            s_pl_oper.choose(s_playlist, kz_order_first(&s_order, s_playmode_is_shuffle), &url);
+            configure_and_run_playlist(url);
             break;
+        }
         default :
             ESP_LOGI(TAG, "Unsupported state %d", el_state);
             return ESP_FAIL;
@@ -115,55 +397,61 @@ static esp_err_t playpause_playlist(void) {
 }
 
 static void set_decoder_info(audio_extension_e ext) {
-    switch (ext) {
-        case AUD_EXT_MP3:
-            s_current_decoder = s_mp3_stream;
-            s_current_ext = ext;
-            s_current_ext_str = "mp3";
-            break;
-        case AUD_EXT_FLAC:
-            s_current_decoder = s_flac_stream;
-            s_current_ext = ext;
-            s_current_ext_str = "flac";
-            break;
-        case AUD_EXT_OPUS:
-            s_current_decoder = s_opus_stream;
-            s_current_ext = ext;
-            s_current_ext_str = "opus";
-            break;
-        case AUD_EXT_OGG:
-            s_current_decoder = s_ogg_stream;
-            s_current_ext = ext;
-            s_current_ext_str = "ogg";
-            break;
-        case AUD_EXT_WAV:
-            s_current_decoder = s_wav_stream;
-            s_current_ext = ext;
-            s_current_ext_str = "wav";
-            break;
-        case AUD_EXT_MP4:
-        case AUD_EXT_AAC:
-        case AUD_EXT_M4A:
-        case AUD_EXT_TS:
-            s_current_decoder = s_aac_stream;
-            s_current_ext = ext;
-            s_current_ext_str = "aac";
-            break;
-        default:
-            s_current_decoder = NULL;
-            s_current_ext = AUD_EXT_UNKNOWN;
-            s_current_ext_str = NULL;
-    }
+    kz_decoder_t dec = kz_decoder_for_ext(ext);
+    s_current_decoder = dec != KZ_DECODER_NONE ? s_decoders[dec] : NULL;
+    s_current_ext = dec != KZ_DECODER_NONE ? ext : AUD_EXT_UNKNOWN;
+    s_current_ext_str = kz_decoder_tag(dec);
 }
 
-esp_err_t player_next(void) {
+static void send_skip(player_be_msg_type type) {
     player_be_msg_u msg;
-    msg.type = PLAYER_BE_NEXT_MSG;
-    xQueueSendToBack(s_player_be_queue, &msg, 0);
+    msg.skip_msg.type = type;
+    msg.skip_msg.count = 1;
+    msg.skip_msg.presses = 1;
+    msg.skip_msg.sent_us = esp_timer_get_time();
+    if (pdPASS != xQueueSendToBack(s_player_be_queue, &msg, 0)) {
+        ESP_LOGW(TAG, "Command queue full, dropping skip");
+    }
     xTaskAbortDelay(s_task);
+}
+
+esp_err_t player_prev(void) {
+    send_skip(PLAYER_BE_PREV_MSG);
+    return ESP_OK;
+}
+
+esp_err_t player_next(void) {
+    send_skip(PLAYER_BE_NEXT_MSG);
     return ESP_OK;
 }
 
+// How full each buffer along the pipeline is, reader end first
+size_t player_get_buffer_fill(uint8_t *pct, size_t max) {
+    audio_element_handle_t els[] = {s_fs_stream, s_current_decoder, s_rsp_stream, s_mix_stream,
+                                     s_eq_stream};
+    size_t n = 0;
+    for (; n < max && n < sizeof(els) / sizeof(*els); ++n) {
+        ringbuf_handle_t rb = els[n] != NULL ? audio_element_get_output_ringbuf(els[n]) : NULL;
+        int size = rb != NULL ? rb_get_size(rb) : 0;
+        pct[n] = size > 0 ? (uint8_t)(rb_bytes_filled(rb) * 100 / size) : 0;
+    }
+    return n;
+}
+
+// True when the I2S writer is playing but has nothing queued to write
+bool player_output_starved(void) {
+    ringbuf_handle_t rb = s_eq_stream != NULL ? audio_element_get_output_ringbuf(s_eq_stream) : NULL;
+    return rb != NULL && audio_element_get_state(s_hp_stream) == AEL_STATE_RUNNING && rb_bytes_filled(rb) == 0;
+}
+
+bool player_is_playing(void) {
+    return s_hp_stream != NULL && audio_element_get_state(s_hp_stream) == AEL_STATE_RUNNING;
+}
+
+const char *player_get_format(void) {
+    return s_current_ext_str;
+}
+
 void player_set_shuffle(bool is_shuffle) {
     s_playmode_is_shuffle = is_shuffle;
 }
@@ -172,64 +460,702 @@ bool player_get_shuffle(void) {
     return s_playmode_is_shuffle;
 }
 
-static void configure_and_run_playlist(const char *url) {
-    ESP_LOGI(TAG, "URL: %s", url);
-    ui_np_set_song_title(url + 14);
-    audio_pipeline_stop(s_pipeline);
-    audio_pipeline_wait_for_stop(s_pipeline);
+void player_set_repeat(player_repeat_t repeat) {
+    s_repeat = repeat;
+}
+
+player_repeat_t player_get_repeat(void) {
+    return s_repeat;
+}
+
+void player_set_crossfade(uint32_t ms) {
+    s_xfade_ms = ms < PLAYER_XFADE_MAX_MS ? ms : PLAYER_XFADE_MAX_MS;
+}
+
+uint32_t player_get_crossfade(void) {
+    return s_xfade_ms;
+}
+
+void player_update_eq(void) {
+    s_eq_changed = true;
+    // Picked up when the EQ is created if the player isn't up yet
+    if (s_task != NULL) {
+        xTaskAbortDelay(s_task);
+    }
+}
+
+// Work the EQ's coefficients out here rather than on the audio path
+static void apply_eq(void) {
+    kz_eq_band_t bands[KZ_EQ_MAX_BANDS];
+    s_eq_changed = false;
+    int count = kz_tone_get_bands(bands);
+    kz_eq_set_bands(s_eq_stream, bands, count);
+}
+
+// If the track that just stopped had no known gain, keep what we measured
+// while it was playing so it is normalized the next time around
+static void save_measured_gain(void) {
+    float lufs;
+    if (!PLAYER_USE_REPLAYGAIN || s_current_key == 0 || kz_rgcache_lookup(s_current_key, NULL)) {
+        return;
+    }
+    if (kz_resample_get_loudness(s_rsp_stream, PLAYER_RG_MIN_BLOCKS, &lufs)) {
+        ESP_LOGI(TAG, "Measured %.1f LUFS", lufs);
+        kz_rgcache_store(s_current_key, KZ_TAGS_RG_REFERENCE_LUFS - lufs, KZ_RGCACHE_SRC_MEASURED);
+    }
+}
+
+// Look the gain up in the cache, falling back to the file's tags, and set
+// it on the resampler the track plays through
+static void set_track_gain(audio_element_handle_t rsp, const char *url, const kz_tags_t *tags) {
+    float gain_db = 0.0f;
+    s_current_key = kz_path_hash(url);
+    s_track_gain_db = gain_db;
+    if (!PLAYER_USE_REPLAYGAIN) {
+        kz_resample_set_gain(rsp, gain_db);
+        return;
+    }
+
+    if (!kz_rgcache_lookup(s_current_key, &gain_db) && tags->has_track_gain) {
+        gain_db = tags->track_gain_db;
+        // Don't let the gain push the track's peak into clipping
+        if (tags->has_track_peak && gain_db > -20.0f * log10f(tags->track_peak)) {
+            gain_db = -20.0f * log10f(tags->track_peak);
+        }
+        kz_rgcache_store(s_current_key, gain_db, KZ_RGCACHE_SRC_TAG);
+    }
+    ESP_LOGI(TAG, "Track gain %.2f dB", gain_db);
+    s_track_gain_db = gain_db;
+    kz_resample_set_gain(rsp, gain_db);
+}
+
+// Read the track's tags and hand them to the Now Playing screen and gain stage
+static void load_track_info(const char *url, audio_element_handle_t rsp) {
+    kz_tags_t tags;
+    int64_t start = esp_timer_get_time();
+    kz_tags_get(url + FILE_PREFIX_LEN, &tags);
+    ESP_LOGD(TAG, "Tag scan read %u bytes in %lld us",
+             (unsigned)tags.bytes_read, esp_timer_get_time() - start);
+
+    kz_tags_default_title(url + FILE_PREFIX_LEN, &tags);
+    state_write_begin();
+    s_state.track++;
+    strlcpy(s_state.title, tags.title, sizeof(s_state.title));
+    strlcpy(s_state.artist, tags.artist, sizeof(s_state.artist));
+    strlcpy(s_state.album, tags.album, sizeof(s_state.album));
+    s_state.index = (uint32_t)s_pl_oper.get_url_id(s_playlist);
+    s_state.format = kz_decoder_tag(kz_decoder_for_ext(kz_get_ext(url)));
+    s_state.sample_rate = 0;
+    s_state.bits = 0;
+    s_state.channels = 0;
+    state_write_end();
+    s_track_ms = tags.duration_ms;
+    s_xfade_tried = false;
+    set_track_gain(rsp, url, &tags);
+}
 
+static void publish_stream_info(const audio_element_info_t *info) {
+    state_write_begin();
+    s_state.sample_rate = info->sample_rates;
+    s_state.bits = info->bits;
+    s_state.channels = info->channels;
+    state_write_end();
+}
+
+// From the last press of a skip to the new track's first audio leaving the
+// resampler at out_us
+static void publish_skip_time(int64_t out_us) {
+    uint32_t ms = (uint32_t)((out_us - s_skip_press_us) / 1000);
+    const char *from = s_skip_head ? " (from its head)" : "";
+    if (s_skip_presses == 0) {
+        // Only logged, the UI's timing is of presses
+        ESP_LOGI(TAG, "%s took %u ms from the end of the last track%s", s_skip_kind, (unsigned)ms, from);
+        s_skip_press_us = 0;
+        return;
+    }
+    ESP_LOGI(TAG, "%s of %u presses took %u ms from the last press%s", s_skip_kind,
+             (unsigned)s_skip_presses, (unsigned)ms, from);
+    state_write_begin();
+    s_state.skip_presses = s_skip_presses;
+    s_state.skip_ms = ms;
+    s_state.skip_press_us = s_skip_press_us;
+    s_state.skip_head = s_skip_head;
+    state_write_end();
+    s_skip_press_us = 0;
+    s_skip_presses = 0;
+}
+
+static void publish_progress(void) {
+    bool playing = player_is_playing();
+    uint32_t pos_ms = playing_position_ms();
+    state_write_begin();
+    s_state.playing = playing;
+    s_state.shuffle = s_playmode_is_shuffle;
+    s_state.repeat = s_repeat;
+    s_state.pos_ms = pos_ms;
+    s_state.count = s_playlist_len;
+    state_write_end();
+}
+
+static bool decoder_stale(kz_decoder_t dec) {
+    if (dec == KZ_DECODER_NONE) {
+        return false;
+    }
+    return s_decoder_stack[dec] != kz_decoder_get_stack(dec) ||
+           audio_element_get_output_ringbuf_size(s_decoders[dec]) != kz_rbtune_get_size(kz_decoder_tag(dec));
+}
+
+// Must be called with the pipeline unlinked
+static void refresh_decoder(kz_decoder_t dec) {
+    if (dec == KZ_DECODER_NONE) {
+        return;
+    }
+    const char *tag = kz_decoder_tag(dec);
+    int rb_size = kz_rbtune_get_size(tag);
+    if (s_decoder_stack[dec] == kz_decoder_get_stack(dec)) {
+        audio_element_set_output_ringbuf_size(s_decoders[dec], rb_size);
+        return;
+    }
+    // The stack is only allocated when the element is created
+    audio_element_handle_t el = kz_decoder_create(dec, kz_decoder_get_stack(dec), rb_size);
+    if (el == NULL) {
+        ESP_LOGE(TAG, "Unable to recreate the %s decoder", tag);
+        return;
+    }
+    audio_pipeline_unregister(s_pipeline, s_decoders[dec]);
+    audio_element_deinit(s_decoders[dec]);
+    s_decoders[dec] = el;
+    s_decoder_stack[dec] = kz_decoder_get_stack(dec);
+    audio_pipeline_register(s_pipeline, el, tag);
+    ESP_LOGI(TAG, "Recreated the %s decoder with its stack in %s", tag,
+             kz_decoder_stack_name(s_decoder_stack[dec]));
+}
+
+// Tell the resampler what it's being given, and set the I2S clocks for
+// what it makes of that. Setting the clocks again would be heard, so
+// they're left alone when nothing has changed.
+static void set_output_format(int rate, int bits, int channels) {
+    kz_resample_set_src_info(s_rsp_stream, rate, bits, channels);
+    audio_element_info_t info = {0};
+    audio_element_getinfo(s_hp_stream, &info);
+    int out_rate = kz_resample_out_rate(s_rsp_stream, rate, bits, channels);
+    if (out_rate != s_out_rate || bits != s_out_bits || channels != s_out_ch) {
+        info.sample_rates = out_rate;
+        info.bits = bits;
+        info.channels = channels;
+        i2s_stream_set_clk(s_hp_stream, info.sample_rates, info.bits, info.channels);
+        audio_element_setinfo(s_hp_stream, &info);
+        audio_element_info_t mix_info = {0};
+        audio_element_getinfo(s_mix_stream, &mix_info);
+        mix_info.sample_rates = out_rate;
+        mix_info.bits = bits;
+        mix_info.channels = channels;
+        audio_element_setinfo(s_mix_stream, &mix_info);
+        audio_element_setinfo(s_eq_stream, &mix_info);
+        kz_eq_set_rate(s_eq_stream, out_rate);
+        s_out_rate = out_rate;
+        s_out_bits = bits;
+        s_out_ch = channels;
+    }
+    if (s_hp_byte_rate == 0) {
+        s_hp_base_bytes = info.byte_pos;
+        s_hp_byte_rate = out_rate * channels * bits / 8;
+    }
+}
+
+// Point the reader at url, relinking for its decoder, with the pipeline
+// stopped. Relinking is also what gives the decoder a newly tuned buffer
+// size or stack placement.
+static void load_source(const char *url) {
     audio_extension_e ext = kz_get_ext(url);
     audio_element_set_uri(s_fs_stream, url);
-    audio_pipeline_reset_ringbuffer(s_pipeline);
-    audio_pipeline_reset_elements(s_pipeline);
-    audio_pipeline_change_state(s_pipeline, AEL_STATE_INIT);
-
-    if (s_current_ext != ext) {
+    s_source_lags = false;
+    if (s_current_ext != ext || decoder_stale(kz_decoder_for_ext(ext))) {
         audio_pipeline_unlink(s_pipeline);
         audio_element_terminate(s_current_decoder);
+        refresh_decoder(kz_decoder_for_ext(ext));
         set_decoder_info(ext);
-        audio_pipeline_relink(s_pipeline, (const char *[]) {"fs", s_current_ext_str, "hp"}, 3);
+        audio_pipeline_relink(s_pipeline, (const char *[]) {"fs", s_current_ext_str, "rsp"}, 3);
         audio_pipeline_set_listener(s_pipeline, s_evt);
+        audio_element_set_output_ringbuf(s_rsp_stream, s_mix_rb);
     }
-    audio_pipeline_run(s_pipeline);
 }
 
-static void advance_playlist() {
-    char *url = NULL;
-    if (s_playmode_is_shuffle) {
-        uint32_t next_song = esp_random() % s_playlist_len;
-        s_pl_oper.choose(s_playlist, next_song, &url);
+static void configure_and_run_playlist(const char *url) {
+    kz_prefetch_head_t head;
+    ESP_LOGI(TAG, "URL: %s", url);
+    kz_rbtune_track_stop();
+    stop_playback();
+    save_measured_gain();
+    load_track_info(url, s_rsp_stream);
+    s_current_url = url;
+    s_pos_base_ms = 0;
+    s_hp_byte_rate = 0;
+    s_card_resume_pending = false;
+
+    reset_playback();
+    // With the start of the track already decoded, it plays while the
+    // decoder opens the file and catches up. Otherwise hold the resampler
+    // until the new decoder tells us the stream format.
+    s_skip_head = kz_prefetch_take(url, &head);
+    if (s_skip_head) {
+        kz_resample_set_head(s_rsp_stream, head.pcm, head.len);
+        set_output_format(head.rate, head.bits, head.channels);
     } else {
-        s_pl_oper.next(s_playlist, 1, &url);
+        kz_resample_set_src_info(s_rsp_stream, 0, 0, 0);
+    }
+    load_source(url);
+    run_playback();
+    checkpoint_position(0);
+}
+
+static char *pick_next(int32_t count) {
+    char *url = NULL;
+    s_pl_oper.choose(s_playlist, kz_order_next(&s_order, s_playmode_is_shuffle, count), &url);
+    return url;
+}
+
+// Back through what was actually played. With nothing remembered, step
+// back through the list in order, or just restart the track when shuffling.
+static char *pick_prev(int32_t count) {
+    char *url = NULL;
+    s_pl_oper.choose(s_playlist, kz_order_prev(&s_order, s_playmode_is_shuffle, count), &url);
+    return url;
+}
+
+// Copy out the track a single next would play, without moving to it.
+// False at the end of the list when not repeating.
+static bool peek_next(char *buf, size_t len) {
+    uint32_t cur = (uint32_t)s_pl_oper.get_url_id(s_playlist);
+    uint32_t next;
+    if (!kz_order_peek(&s_order, s_playmode_is_shuffle, s_repeat != PLAYER_REPEAT_OFF, &next)) {
+        return false;
+    }
+    // Only looking, so put the playlist back where it was. It hands out
+    // the same buffer each time, hence the copy.
+    char *url = NULL;
+    bool found = ESP_OK == s_pl_oper.choose(s_playlist, next, &url) && url != NULL &&
+                 strlcpy(buf, url, len) < len;
+    s_pl_oper.choose(s_playlist, cur, &url);
+    return found;
+}
+
+// Have the start of whichever track a single next would play decoded in
+// the background
+static void prefetch_next(void) {
+    char url[PLAYER_MAX_URL];
+    if (peek_next(url, sizeof(url))) {
+        kz_prefetch_start(url);
     }
+}
+
+static void advance_playlist() {
+    configure_and_run_playlist(pick_next(1));
+}
+
+// Put the reader back to byte_pos within the current track, which starts
+// at ms, keeping the decoder and links as they are. Decoders that need
+// their stream headers get them replayed into the ring buffer first.
+static void restart_reader(int64_t byte_pos, uint32_t ms, const uint8_t *prefix, size_t prefix_len) {
+    kz_rbtune_track_stop();
+    stop_playback();
+    reset_playback();
+    // Part way through a crossfade, the reader is still on the last track
+    if (s_source_lags) {
+        load_source(s_current_url);
+        kz_resample_set_gain(s_rsp_stream, s_track_gain_db);
+    }
+    kz_resample_set_src_info(s_rsp_stream, 0, 0, 0);
+    s_skip_head = false;
+    if (prefix_len > 0) {
+        rb_write(audio_element_get_output_ringbuf(s_fs_stream), (char *)prefix, prefix_len, 0);
+    }
+    audio_element_set_byte_pos(s_fs_stream, byte_pos);
+    s_pos_base_ms = ms;
+    s_hp_byte_rate = 0;
+    s_card_resume_pending = false;
+    s_xfade_tried = false;
+    run_playback();
+}
+
+// Play the current track again from the top without reopening anything
+// but the file
+static void restart_track(void) {
+    restart_reader(0, 0, NULL, 0);
+    checkpoint_position(0);
+}
+
+// The last track ran out
+static void track_finished(void) {
+    s_skip_press_us = esp_timer_get_time();
+    s_skip_presses = 0;
+    if (s_repeat == PLAYER_REPEAT_ONE) {
+        s_skip_kind = "Repeat";
+        restart_track();
+        return;
+    }
+    if (s_repeat == PLAYER_REPEAT_OFF && kz_order_at_end(&s_order, s_playmode_is_shuffle)) {
+        // Left finished, for play to start the list over
+        ESP_LOGI(TAG, "End of the playlist");
+        s_skip_press_us = 0;
+        kz_rbtune_track_stop();
+        return;
+    }
+    s_skip_kind = "Advance";
+    advance_playlist();
+}
+
+// Start decoding the next track in a pipeline of its own, ahead of the
+// point where it's faded in. Its resampler holds its audio back until the
+// fade starts.
+static void start_crossfade(void) {
+    char *url = s_xfade_url;
+    if (!peek_next(url, sizeof(s_xfade_url))) {
+        return;
+    }
+    kz_resample_cfg_t rsp_cfg = DEFAULT_KZ_RESAMPLE_CONFIG();
+    rsp_cfg.quality = PLAYER_RESAMPLE_QUALITY;
+    rsp_cfg.task_core = CONFIG_KZ_SCHED_AUDIO_CORE;
+    rsp_cfg.task_prio = CONFIG_KZ_SCHED_RSP_PRIO;
+    rsp_cfg.stack_in_ext = true;
+    audio_element_handle_t rsp = kz_resample_init(&rsp_cfg);
+
+    // The decoder has to keep up in real time, but only for a few seconds,
+    // so its stack can go in PSRAM. Under names of their own so their tasks
+    // can't be confused with the main pipeline's.
+    audio_element_handle_t decoder;
+    audio_pipeline_handle_t pipeline = kz_decoder_pipeline_create(url, KZ_DECODER_STACK_PSRAM,
+                                                                  CONFIG_KZ_SCHED_FS_PRIO, &rsp, 1,
+                                                                  (const char *[]) {"xf_fs", "xf_dec", "xf_rsp"},
+                                                                  &decoder);
+    if (pipeline == NULL) {
+        ESP_LOGW(TAG, "No crossfade into %s", url);
+        return;
+    }
+    audio_element_set_output_ringbuf(rsp, s_xfade_rb);
+    audio_pipeline_set_listener(pipeline, s_evt);
+    audio_pipeline_run(pipeline);
+
+    s_xfade_pipeline = pipeline;
+    s_xfade_decoder = decoder;
+    s_xfade_rsp = rsp;
+    s_xfade_len_ms = s_xfade_ms < s_track_ms / 2 ? s_xfade_ms : s_track_ms / 2;
+    s_xfade = XFADE_OPENING;
+    ESP_LOGI(TAG, "Opening the next track for a %u ms crossfade", (unsigned)s_xfade_len_ms);
+}
+
+// The next track's decoder has reported. The mixer can only fade between
+// tracks that come out of their resamplers in the same 16 bit format, so
+// anything else is cut to as usual.
+static void check_crossfade_format(void) {
+    audio_element_info_t info = {0};
+    audio_element_getinfo(s_xfade_decoder, &info);
+    int rate = kz_resample_out_rate(s_xfade_rsp, info.sample_rates, info.bits, info.channels);
+    if (info.bits != 16 || rate != s_out_rate || info.bits != s_out_bits || info.channels != s_out_ch) {
+        ESP_LOGI(TAG, "Next track plays at %d Hz, %d bits, %d ch against %d Hz, %d bits, %d ch, not crossfading",
+                 rate, info.bits, info.channels, s_out_rate, s_out_bits, s_out_ch);
+        end_crossfade();
+        return;
+    }
+    s_xfade_info = info;
+    s_xfade = XFADE_READY;
+}
+
+// The fade point has come. The next track becomes the current one, and its
+// audio is let through to the mixer.
+static void begin_fade(void) {
+    // Shuffle or repeat may have changed which track is next since this one
+    // was opened. Then it's dropped before the mixer reads from it, and the
+    // current track plays out and cuts to the right one as usual.
+    char next[PLAYER_MAX_URL];
+    if (!peek_next(next, sizeof(next)) || strcmp(next, s_xfade_url) != 0) {
+        ESP_LOGI(TAG, "The next track changed, not crossfading");
+        end_crossfade();
+        return;
+    }
+    if (!kz_mix_start_fade(s_mix_stream, s_xfade_len_ms)) {
+        // The last track ran out first, and the player moves on as usual
+        end_crossfade();
+        return;
+    }
+    save_measured_gain();
+    char *url = pick_next(1);
+    load_track_info(url, s_xfade_rsp);
+    s_current_url = url;
+    s_source_lags = true;
+    publish_stream_info(&s_xfade_info);
+    // Same format, so only the start of the position moves
+    audio_element_info_t info = {0};
+    audio_element_getinfo(s_hp_stream, &info);
+    s_pos_base_ms = 0;
+    s_hp_base_bytes = info.byte_pos;
+    kz_resample_set_src_info(s_xfade_rsp, s_xfade_info.sample_rates, s_xfade_info.bits,
+                             s_xfade_info.channels);
+    s_xfade = XFADE_FADING;
+    s_xfade_start_us = esp_timer_get_time();
+    checkpoint_position(0);
+    ESP_LOGI(TAG, "Crossfading into the next track over %u ms", (unsigned)s_xfade_len_ms);
+}
+
+// The last track has played out of the mixer. The main pipeline restarts
+// on the new one from the top, and the mixer drops what it decodes until
+// it's level with the side pipeline, then switches back to it.
+static void hand_over(void) {
+    kz_rbtune_track_stop();
+    stop_source();
+    reset_pipeline(s_pipeline);
+    load_source(s_current_url);
+    kz_resample_set_src_info(s_rsp_stream, 0, 0, 0);
+    kz_resample_set_gain(s_rsp_stream, s_track_gain_db);
+    kz_mix_hand_over(s_mix_stream);
+    audio_pipeline_run(s_pipeline);
+    s_xfade = XFADE_CATCHING_UP;
+}
+
+// Start on the next track early enough to fade it in over the end of this
+// one, or move a crossfade under way along
+static void step_crossfade(void) {
+    switch (s_xfade) {
+        case XFADE_NONE: {
+            if (s_xfade_ms == 0 || s_xfade_tried || s_track_ms == 0 || s_repeat == PLAYER_REPEAT_ONE ||
+                s_skip_url != NULL || s_card_resume_pending || s_out_bits != 16 || s_hp_byte_rate == 0 ||
+                !player_is_playing()) {
+                return;
+            }
+            uint32_t len = s_xfade_ms < s_track_ms / 2 ? s_xfade_ms : s_track_ms / 2;
+            if (playing_position_ms() + len + PLAYER_XFADE_LEAD_MS >= s_track_ms) {
+                s_xfade_tried = true;
+                start_crossfade();
+            }
+            break;
+        }
+        case XFADE_READY:
+            if (playing_position_ms() + s_xfade_len_ms >= s_track_ms) {
+                begin_fade();
+            }
+            break;
+        case XFADE_FADING:
+            if (kz_mix_input_ended(s_mix_stream)) {
+                hand_over();
+            }
+            break;
+        case XFADE_CATCHING_UP:
+            if (kz_mix_released(s_mix_stream)) {
+                ESP_LOGI(TAG, "Crossfade done after %lld ms", (esp_timer_get_time() - s_xfade_start_us) / 1000);
+                end_crossfade();
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+// Start a skip that was held back during a burst of presses
+static void start_pending_skip(void) {
+    if (s_skip_url == NULL) {
+        return;
+    }
+    char *url = s_skip_url;
+    s_skip_url = NULL;
     configure_and_run_playlist(url);
 }
 
+// The first skip of a burst starts straight away so a single press isn't
+// delayed. Later ones just stop the audio, and only the track the burst
+// ends on is started, once the presses have settled.
+static void skip_tracks(const skip_msg *msg) {
+    bool burst = msg->sent_us - s_last_press_us < PLAYER_SKIP_SETTLE_MS * 1000LL;
+    bool prev = msg->type == PLAYER_BE_PREV_MSG;
+    int32_t count = msg->count;
+    s_last_press_us = msg->sent_us;
+    s_skip_press_us = msg->sent_us;
+    s_skip_presses += msg->presses;
+    s_skip_kind = prev ? "Previous" : "Next";
+    // The first previous goes back to the start of a track that's well
+    // under way. It's only the same file again, so nothing is relinked.
+    if (prev && s_skip_url == NULL && playing_position_ms() > PLAYER_PREV_RESTART_MS) {
+        if (--count == 0) {
+            s_skip_kind = "Restart";
+            restart_track();
+            return;
+        }
+    }
+    char *url = prev ? pick_prev(count) : pick_next(count);
+    if (!burst && s_skip_url == NULL) {
+        configure_and_run_playlist(url);
+        return;
+    }
+    if (s_skip_url == NULL) {
+        kz_rbtune_track_stop();
+        stop_playback();
+    }
+    s_skip_url = url;
+    s_skip_start_us = msg->sent_us + PLAYER_SKIP_SETTLE_MS * 1000LL;
+}
+
+// Take everything queued, with runs of skips or seeks folded into one
+// and anything a later command makes pointless dropped
+static size_t take_commands(player_be_msg_u *batch, size_t max) {
+    size_t n = 0;
+    player_be_msg_u msg;
+    while (n < max && pdPASS == xQueueReceive(s_player_be_queue, &msg, 0)) {
+        n = player_msg_batch_add(batch, n, &msg);
+    }
+    return n;
+}
+
+// Restart the reader part way into the current track. Decoders that need
+// their stream headers get them replayed into the ring buffer first.
+static bool seek_to(uint32_t ms) {
+    kz_seek_pos_t pos;
+    int64_t start = esp_timer_get_time();
+    if (s_current_url == NULL || ESP_OK != kz_seek_find(s_current_url + FILE_PREFIX_LEN, ms, &pos)) {
+        ESP_LOGW(TAG, "Can't seek in this track");
+        return false;
+    }
+    if (ms >= pos.duration_ms) {
+        advance_playlist();
+        return true;
+    }
+
+    restart_reader(pos.byte_pos, pos.ms, pos.prefix, pos.prefix_len);
+
+    ESP_LOGI(TAG, "Seek to %u ms landed on %u ms after %u reads in %lld us (%s)", (unsigned)ms,
+             (unsigned)pos.ms, (unsigned)pos.reads, esp_timer_get_time() - start, s_current_ext_str);
+    return true;
+}
+
+// Stop before the reader runs off a card that has gone away, remembering
+// where we were so the same spot can be picked up again
+static void hold_for_card(bool was_playing) {
+    if (s_card_resume_pending || s_current_url == NULL) {
+        return;
+    }
+    s_card_resume_ms = playing_position_ms();
+    s_card_was_playing = was_playing;
+    s_card_resume_pending = true;
+    kz_rbtune_track_stop();
+    stop_playback();
+    checkpoint_position(s_card_resume_ms);
+    ESP_LOGI(TAG, "Card removed, holding at %u ms", (unsigned)s_card_resume_ms);
+}
+
+static void resume_after_card(void) {
+    struct stat st;
+    int64_t start = esp_timer_get_time();
+    s_card_resume_pending = false;
+    // A different card may have gone in
+    if (stat(s_current_url + FILE_PREFIX_LEN, &st) != 0) {
+        ESP_LOGW(TAG, "Track is no longer on the card");
+        return;
+    }
+    if (s_card_resume_ms == 0 || !seek_to(s_card_resume_ms)) {
+        configure_and_run_playlist(s_current_url);
+    }
+    ESP_LOGI(TAG, "Playback restarted %lld ms after the card was mounted",
+             (esp_timer_get_time() - start) / 1000);
+}
+
+static void handle_card_change(bool mounted) {
+    if (mounted) {
+        // The card may have been out at boot, or swapped for another
+        kz_rgcache_load();
+    }
+    if (!mounted && s_skip_url != NULL) {
+        // Start the skip's track once the card is back instead
+        s_current_url = s_skip_url;
+        s_skip_url = NULL;
+        s_card_resume_ms = 0;
+        s_card_was_playing = true;
+        s_card_resume_pending = true;
+    } else if (!mounted) {
+        audio_element_state_t el_state = audio_element_get_state(s_hp_stream);
+        if (el_state == AEL_STATE_RUNNING || el_state == AEL_STATE_PAUSED) {
+            hold_for_card(el_state == AEL_STATE_RUNNING);
+        }
+    } else if (s_card_resume_pending && s_card_was_playing) {
+        resume_after_card();
+    }
+}
+
 void player_main(void) {
-    s_player_be_queue = xQueueCreate(4, sizeof(player_be_msg_u));
+    s_player_be_queue = xQueueCreate(PLAYER_QUEUE_LEN, sizeof(player_be_msg_u));
     s_task = xTaskGetHandle("PLAYER");
+    kz_sdcard_add_listener(card_changed);
+    kz_rbtune_load();
+    if (ESP_OK != kz_prefetch_init()) {
+        ESP_LOGW(TAG, "Track changes will wait for the decoder");
+    }
 
-    // create an empty pipeline
+    // create empty pipelines
     audio_pipeline_cfg_t pipeline_cfg = DEFAULT_AUDIO_PIPELINE_CONFIG();
     s_pipeline = audio_pipeline_init(&pipeline_cfg);
     mem_assert(s_pipeline);
+    s_out_pipeline = audio_pipeline_init(&pipeline_cfg);
+    mem_assert(s_out_pipeline);
 
     // Initialize the I2S stream
     i2s_stream_cfg_t i2s_cfg = I2S_STREAM_CFG_DEFAULT();
     i2s_cfg.type = AUDIO_STREAM_WRITER;
+    i2s_cfg.task_core = CONFIG_KZ_SCHED_IO_CORE;
+    i2s_cfg.task_prio = CONFIG_KZ_SCHED_I2S_PRIO;
     s_hp_stream = i2s_stream_init(&i2s_cfg);
 
     // Initialize the FATFS file reader stream
     fatfs_stream_cfg_t fatfs_cfg = FATFS_STREAM_CFG_DEFAULT();
     fatfs_cfg.type = AUDIO_STREAM_READER;
+    fatfs_cfg.task_core = CONFIG_KZ_SCHED_IO_CORE;
+    fatfs_cfg.task_prio = CONFIG_KZ_SCHED_FS_PRIO;
     s_fs_stream = fatfs_stream_init(&fatfs_cfg);
 
-    // Loop until we get a valid playlist
+    // Initialize the resampler which brings everything up to the codec's 48kHz
+    kz_resample_cfg_t rsp_cfg = DEFAULT_KZ_RESAMPLE_CONFIG();
+    rsp_cfg.quality = PLAYER_RESAMPLE_QUALITY;
+    rsp_cfg.task_core = CONFIG_KZ_SCHED_AUDIO_CORE;
+    rsp_cfg.task_prio = CONFIG_KZ_SCHED_RSP_PRIO;
+    rsp_cfg.stack_in_ext = PLAYER_RSP_IN_PSRAM;
+    s_rsp_stream = kz_resample_init(&rsp_cfg);
+    kz_rgcache_load();
+
+    // The mixer passes the resampler's output through, and fades the next
+    // track in over it from a side pipeline when crossfading
+    kz_mix_cfg_t mix_cfg = DEFAULT_KZ_MIX_CONFIG();
+    mix_cfg.task_core = CONFIG_KZ_SCHED_AUDIO_CORE;
+    mix_cfg.task_prio = CONFIG_KZ_SCHED_RSP_PRIO;
+    mix_cfg.stack_in_ext = PLAYER_RSP_IN_PSRAM;
+    s_mix_stream = kz_mix_init(&mix_cfg);
+    s_mix_rb = rb_create(PLAYER_MIX_RB_SIZE, 1);
+    s_xfade_rb = rb_create(PLAYER_MIX_RB_SIZE, 1);
+    mem_assert(s_mix_stream && s_mix_rb && s_xfade_rb);
+    audio_element_set_input_ringbuf(s_mix_stream, s_mix_rb);
+    audio_element_set_multi_input_ringbuf(s_mix_stream, s_xfade_rb, 0);
+
+    // Tone controls, for everything that comes out of the mixer
+    kz_eq_cfg_t eq_cfg = DEFAULT_KZ_EQ_CONFIG();
+    eq_cfg.task_core = CONFIG_KZ_SCHED_AUDIO_CORE;
+    eq_cfg.task_prio = CONFIG_KZ_SCHED_RSP_PRIO;
+    eq_cfg.stack_in_ext = PLAYER_RSP_IN_PSRAM;
+    s_eq_stream = kz_eq_init(&eq_cfg);
+    mem_assert(s_eq_stream);
+    apply_eq();
+
+    // Pick up where we left off if the last playlist is still on the card
+    bool resumed = false;
+    if (ESP_OK == kz_resume_load(&s_resume)) {
+        s_playmode_is_shuffle = s_resume.shuffle;
+        s_repeat = s_resume.repeat <= PLAYER_REPEAT_OFF ? (player_repeat_t)s_resume.repeat : PLAYER_REPEAT_ALL;
+        resumed = (ESP_OK == kz_resume_load_playlist(s_resume.pl_hash, &s_playlist));
+        s_resume_playlist_saved = resumed;
+    }
+
+    // Otherwise loop until we get a valid playlist
     player_be_msg_u be_msg;
+    int32_t first_index = -1;
     while (s_playlist == NULL) {
         xQueueReceive(s_player_be_queue, &be_msg, portMAX_DELAY);
         if (be_msg.type == PLAYER_BE_PLAYLIST_MSG) {
             s_playlist = be_msg.pl_msg.pl_op;
+            first_index = be_msg.pl_msg.start;
         }
     }
     // Now that we have a valid playlist, setup our associated data
@@ -238,73 +1164,102 @@ void player_main(void) {
 
     // set the fatfs stream to point at the start
     char *url = NULL;
-    if (s_playmode_is_shuffle) {
+    if (resumed && s_resume.index >= s_playlist_len) {
+        s_resume.index = 0;
+        s_resume.pos_ms = 0;
+    }
+    if (resumed) {
+        s_pl_oper.choose(s_playlist, s_resume.index, &url);
+    } else if (first_index >= 0 && (uint32_t)first_index < s_playlist_len) {
+        // e.g. a track picked from the library before anything had played
+        s_pl_oper.choose(s_playlist, first_index, &url);
+    } else if (s_playmode_is_shuffle) {
         uint32_t next_song = esp_random() % s_playlist_len;
         s_pl_oper.choose(s_playlist, next_song, &url);
     } else {
         s_pl_oper.current(s_playlist, &url);
     }
-    ui_np_set_song_title(url + 14);
+    reset_order();
     audio_element_set_uri(s_fs_stream, url);
+    load_track_info(url, s_rsp_stream);
+    s_current_url = url;
+    if (!resumed) {
+        save_playlist();
+    }
 
-    mp3_decoder_cfg_t mp3_cfg = DEFAULT_MP3_DECODER_CONFIG();
-    mp3_cfg.out_rb_size = (16 * 1024);
-    mp3_cfg.stack_in_ext = PLAYER_DECODE_IN_PSRAM;
-    s_mp3_stream = mp3_decoder_init(&mp3_cfg);
-
-    flac_decoder_cfg_t flac_cfg = DEFAULT_FLAC_DECODER_CONFIG();
-    flac_cfg.out_rb_size = (16 * 1024);
-    flac_cfg.stack_in_ext = PLAYER_DECODE_IN_PSRAM;
-    s_flac_stream  = flac_decoder_init(&flac_cfg);
-
-    opus_decoder_cfg_t opus_cfg = DEFAULT_OPUS_DECODER_CONFIG();
-    opus_cfg.out_rb_size = (16 * 1024);
-    opus_cfg.stack_in_ext = PLAYER_DECODE_IN_PSRAM;
-    s_opus_stream  = decoder_opus_init(&opus_cfg);
-
-    ogg_decoder_cfg_t ogg_cfg = DEFAULT_OGG_DECODER_CONFIG();
-    ogg_cfg.out_rb_size = (16 * 1024);
-    ogg_cfg.stack_in_ext = PLAYER_DECODE_IN_PSRAM;
-    s_ogg_stream  = ogg_decoder_init(&ogg_cfg);
-
-    wav_decoder_cfg_t wav_cfg = DEFAULT_WAV_DECODER_CONFIG();
-    wav_cfg.out_rb_size = (16 * 1024);
-    wav_cfg.stack_in_ext = PLAYER_DECODE_IN_PSRAM;
-    s_wav_stream  = wav_decoder_init(&wav_cfg);
-
-    aac_decoder_cfg_t aac_cfg = DEFAULT_AAC_DECODER_CONFIG();
-    aac_cfg.out_rb_size = (16 * 1024);
-    aac_cfg.stack_in_ext = PLAYER_DECODE_IN_PSRAM;
-    s_aac_stream  = aac_decoder_init(&aac_cfg);
+    kz_decoder_load_policy();
+    for (int i = 0; i < KZ_DECODER_COUNT; ++i) {
+        s_decoder_stack[i] = kz_decoder_get_stack(i);
+        s_decoders[i] = kz_decoder_create(i, s_decoder_stack[i], kz_rbtune_get_size(kz_decoder_tag(i)));
+    }
 
     set_decoder_info(kz_get_ext(url));
 
     // at this point we should have everything we need to start playing!
     // build up the pipeline!
     audio_pipeline_register(s_pipeline, s_fs_stream, "fs");
-    audio_pipeline_register(s_pipeline, s_mp3_stream, "mp3");
-    audio_pipeline_register(s_pipeline, s_flac_stream, "flac");
-    audio_pipeline_register(s_pipeline, s_opus_stream, "opus");
-    audio_pipeline_register(s_pipeline, s_ogg_stream, "ogg");
-    audio_pipeline_register(s_pipeline, s_wav_stream, "wav");
-    audio_pipeline_register(s_pipeline, s_aac_stream, "aac");
-    audio_pipeline_register(s_pipeline, s_hp_stream, "hp");
-
-    const char *link_tag[3] = {"fs", s_current_ext_str, "hp"};
+    for (int i = 0; i < KZ_DECODER_COUNT; ++i) {
+        audio_pipeline_register(s_pipeline, s_decoders[i], kz_decoder_tag(i));
+    }
+    audio_pipeline_register(s_pipeline, s_rsp_stream, "rsp");
+    audio_pipeline_register(s_out_pipeline, s_mix_stream, "mix");
+    audio_pipeline_register(s_out_pipeline, s_eq_stream, "eq");
+    audio_pipeline_register(s_out_pipeline, s_hp_stream, "hp");
+
+    const char *link_tag[3] = {"fs", s_current_ext_str, "rsp"};
     audio_pipeline_link(s_pipeline, &link_tag[0], 3);
+    audio_element_set_output_ringbuf(s_rsp_stream, s_mix_rb);
+    audio_pipeline_link(s_out_pipeline, (const char *[]) {"mix", "eq", "hp"}, 3);
 
     audio_event_iface_cfg_t evt_cfg = AUDIO_EVENT_IFACE_DEFAULT_CFG();
     s_evt = audio_event_iface_init(&evt_cfg);
 
     audio_pipeline_set_listener(s_pipeline, s_evt);
+    audio_pipeline_set_listener(s_out_pipeline, s_evt);
 
+    if (resumed) {
+        ESP_LOGI(TAG, "Resuming track %u at %u ms", (unsigned)s_resume.index, (unsigned)s_resume.pos_ms);
+        if (s_resume.pos_ms == 0 || !seek_to(s_resume.pos_ms)) {
+            run_playback();
+        }
+    }
+
+    bool first_audio = true;
     while (1) {
         audio_event_iface_msg_t msg;
-        while (pdPASS == xQueueReceive(s_player_be_queue, &be_msg, 0)) {
-            if (be_msg.type == PLAYER_BE_NEXT_MSG) {
-                advance_playlist();
+        static player_be_msg_u batch[PLAYER_QUEUE_LEN];
+        size_t batch_len = take_commands(batch, PLAYER_QUEUE_LEN);
+        for (size_t i = 0; i < batch_len; ++i) {
+            be_msg = batch[i];
+            int64_t start = esp_timer_get_time();
+            if (be_msg.type == PLAYER_BE_PLAYLIST_MSG) {
+                s_skip_url = NULL;
+            } else if (be_msg.type != PLAYER_BE_NEXT_MSG && be_msg.type != PLAYER_BE_PREV_MSG &&
+                       be_msg.type != PLAYER_BE_CARD_MSG) {
+                // Anything else applies to the track the skip lands on
+                start_pending_skip();
+            }
+            if (be_msg.type == PLAYER_BE_CARD_MSG) {
+                handle_card_change(be_msg.card_msg.mounted);
+            } else if (s_card_resume_pending && !kz_sdcard_is_mounted() &&
+                       be_msg.type != PLAYER_BE_PLAYPAUSE_MSG) {
+                // Nothing can be opened until the card is back
+                ESP_LOGW(TAG, "Ignoring request while the card is out");
+                if (be_msg.type == PLAYER_BE_PLAYLIST_MSG) {
+                    playlist_operation_t pl_op;
+                    be_msg.pl_msg.pl_op->get_operation(&pl_op);
+                    pl_op.destroy(be_msg.pl_msg.pl_op);
+                }
+            } else if (be_msg.type == PLAYER_BE_NEXT_MSG || be_msg.type == PLAYER_BE_PREV_MSG) {
+                skip_tracks(&be_msg.skip_msg);
             } else if (be_msg.type == PLAYER_BE_PLAYPAUSE_MSG) {
                 playpause_playlist();
+            } else if (be_msg.type == PLAYER_BE_SEEK_MSG) {
+                int64_t target = be_msg.seek_msg.ms;
+                if (be_msg.seek_msg.relative) {
+                    target += playing_position_ms();
+                }
+                seek_to(target > 0 ? (uint32_t)target : 0);
             } else if (be_msg.type == PLAYER_BE_PLAYLIST_MSG) {
                 ESP_LOGI(TAG, "Received a playlist!");
                 s_pl_oper.destroy(s_playlist);
@@ -312,18 +1267,54 @@ void player_main(void) {
                 // setup our associated data
                 s_playlist->get_operation(&s_pl_oper);
                 s_playlist_len = (uint32_t)s_pl_oper.get_url_num(s_playlist);
-                if (s_playmode_is_shuffle) {
+                if (be_msg.pl_msg.start >= 0 && (uint32_t)be_msg.pl_msg.start < s_playlist_len) {
+                    s_pl_oper.choose(s_playlist, be_msg.pl_msg.start, &url);
+                } else if (s_playmode_is_shuffle) {
                     uint32_t next_song = esp_random() % s_playlist_len;
                     s_pl_oper.choose(s_playlist, next_song, &url);
                 } else {
                     s_pl_oper.current(s_playlist, &url);
                 }
+                reset_order();
+                s_resume_playlist_saved = false;
                 configure_and_run_playlist(url);
+                save_playlist();
+                checkpoint_position(0);
+            }
+            note_busy(start);
+        }
+        int64_t now = esp_timer_get_time();
+        if (s_skip_url != NULL && now >= s_skip_start_us) {
+            start_pending_skip();
+            note_busy(now);
+        }
+        if (s_skip_press_us != 0 && s_skip_url == NULL) {
+            int64_t out_us = kz_resample_first_output_us(s_rsp_stream);
+            if (out_us >= s_skip_press_us) {
+                publish_skip_time(out_us);
             }
         }
-        if (ESP_OK != audio_event_iface_listen(s_evt, &msg, pdMS_TO_TICKS(1000))) {
+        step_crossfade();
+        if (s_eq_changed) {
+            apply_eq();
+        }
+        publish_progress();
+        if (audio_element_get_state(s_hp_stream) == AEL_STATE_RUNNING &&
+            esp_timer_get_time() - s_last_checkpoint > PLAYER_CHECKPOINT_PERIOD_MS * 1000LL) {
+            checkpoint_position(playing_position_ms());
+        }
+        uint32_t wait_ms = PLAYER_STATE_PERIOD_MS;
+        if (s_skip_url != NULL) {
+            int64_t left_us = s_skip_start_us - esp_timer_get_time();
+            wait_ms = left_us > 1000 ? (uint32_t)(left_us / 1000) : 1;
+        }
+        if (s_xfade != XFADE_NONE && wait_ms > PLAYER_XFADE_POLL_MS) {
+            wait_ms = PLAYER_XFADE_POLL_MS;
+        }
+        if (ESP_OK != audio_event_iface_listen(s_evt, &msg, pdMS_TO_TICKS(wait_ms))) {
             continue;
         }
+        int64_t start = esp_timer_get_time();
         if (msg.source_type == AUDIO_ELEMENT_TYPE_ELEMENT) {
             // Set music info for a new song to be played
             if (msg.source == (void *) s_current_decoder
@@ -332,20 +1323,39 @@ void player_main(void) {
                 audio_element_getinfo(s_current_decoder, &music_info);
                 ESP_LOGI(TAG, "[ * ] Received music info from decoder, sample_rates=%d, bits=%d, ch=%d, dur=%d",
                          music_info.sample_rates, music_info.bits, music_info.channels, music_info.duration);
-                i2s_stream_set_clk(s_hp_stream, music_info.sample_rates, music_info.bits, music_info.channels);
-                audio_element_setinfo(s_hp_stream, &music_info);
+                if (first_audio) {
+                    kz_boot_mark(resumed ? "First audio (resumed)" : "First audio");
+                    first_audio = false;
+                }
+                kz_rbtune_track_start(s_current_ext_str, s_current_decoder,
+                                      music_info.sample_rates * music_info.channels * music_info.bits / 8);
+                publish_stream_info(&music_info);
+                set_output_format(music_info.sample_rates, music_info.bits, music_info.channels);
+                prefetch_next();
+                note_busy(start);
+                continue;
+            }
+            if (msg.source == (void *) s_xfade_decoder && s_xfade == XFADE_OPENING
+                && msg.cmd == AEL_MSG_CMD_REPORT_MUSIC_INFO) {
+                check_crossfade_format();
+                note_busy(start);
                 continue;
             }
             // Advance to the next song when previous finishes
             if (msg.source == (void *) s_hp_stream
                 && msg.cmd == AEL_MSG_CMD_REPORT_STATUS) {
                 audio_element_state_t el_state = audio_element_get_state(s_hp_stream);
-                if (el_state == AEL_STATE_FINISHED) {
-                    ESP_LOGI(TAG, "[ * ] Finished, advancing to the next song");
-                    advance_playlist();
+                if (el_state == AEL_STATE_FINISHED && !kz_sdcard_is_mounted()) {
+                    // The reader hit the end of a pulled card before the
+                    // unmount event got to us
+                    hold_for_card(true);
+                } else if (el_state == AEL_STATE_FINISHED) {
+                    ESP_LOGI(TAG, "[ * ] Finished");
+                    track_finished();
                 }
             }
         }
+        note_busy(start);
     }
 
 //    ESP_LOGI(TAG, "[ 7 ] Stop audio_pipeline");
@@ -1,6 +1,68 @@
+#define PLAYER_TITLE_LEN 96
+#define PLAYER_NAME_LEN 64
+// Longest crossfade between tracks
+#define PLAYER_XFADE_MAX_MS (10 * 1000)
+
+typedef enum {
+    PLAYER_REPEAT_ALL = 0,      // wrap round at the end of the playlist
+    PLAYER_REPEAT_ONE,
+    PLAYER_REPEAT_OFF,          // stop after the last track, or once a shuffle has played them all
+} player_repeat_t;
+
+// What the player is doing, as last published by the player task
+typedef struct {
+    uint32_t track;             // changes with every track loaded
+    char title[PLAYER_TITLE_LEN];
+    char artist[PLAYER_NAME_LEN];
+    char album[PLAYER_NAME_LEN];
+    uint32_t index;             // position in the playlist
+    uint32_t count;
+    bool playing;
+    bool shuffle;
+    player_repeat_t repeat;
+    uint32_t pos_ms;
+    const char *format;         // decoder tag, NULL before the first track
+    uint32_t sample_rate;       // 0 until the decoder reports the stream
+    uint8_t bits;
+    uint8_t channels;
+    // The last skip, timed from its final press to the new track's first
+    // audio leaving the resampler. Presses that arrive close together are
+    // folded into one skip.
+    uint32_t skip_presses;
+    uint32_t skip_ms;
+    int64_t skip_press_us;
+    bool skip_head;             // started from the track's pre-decoded head
+} player_state_t;
+
 BaseType_t player_set_playlist(playlist_operator_handle_t new_playlist, TickType_t ticksToWait);
+// As above, but start with track start of the playlist even when shuffling
+BaseType_t player_set_playlist_from(playlist_operator_handle_t new_playlist, uint32_t start, TickType_t ticksToWait);
 esp_err_t player_playpause(void);
 esp_err_t player_next(void);
+// Back to the start of the track, or to the one before if it has only
+// just started
+esp_err_t player_prev(void);
+esp_err_t player_seek(uint32_t ms);
+esp_err_t player_skip(int32_t delta_ms);
 void player_set_shuffle(bool is_shuffle);
 bool player_get_shuffle(void);
+void player_set_repeat(player_repeat_t repeat);
+player_repeat_t player_get_repeat(void);
+// Fade each track into the next over ms, 0 to cut straight from one to the
+// next. Only between tracks in the same 16 bit format after resampling;
+// anything else is still a cut.
+void player_set_crossfade(uint32_t ms);
+uint32_t player_get_crossfade(void);
+// The EQ settings kept by kz_tone have changed
+void player_update_eq(void);
+size_t player_get_buffer_fill(uint8_t *pct, size_t max);
+bool player_output_starved(void);
+bool player_is_playing(void);
+const char *player_get_format(void);
 void player_main(void);
+// Copy the latest state without blocking either side. False when the
+// player was part way through publishing; try again on the next refresh.
+bool player_get_state(player_state_t *state);
+// Worst time the player task spent handling one command or pipeline event
+// since the last call
+uint32_t player_take_max_busy_us(void);
@@ -0,0 +1,42 @@
+#include "player_msg.h"
+
+bool player_msg_supersedes(const player_be_msg_u *later, const player_be_msg_u *earlier) {
+    if (earlier->type == PLAYER_BE_SEEK_MSG) {
+        // The seek would only land in a track that's about to be left
+        return later->type == PLAYER_BE_NEXT_MSG || later->type == PLAYER_BE_PREV_MSG ||
+               later->type == PLAYER_BE_PLAYLIST_MSG;
+    }
+    if (earlier->type == PLAYER_BE_NEXT_MSG || earlier->type == PLAYER_BE_PREV_MSG) {
+        return later->type == PLAYER_BE_PLAYLIST_MSG;
+    }
+    return false;
+}
+
+bool player_msg_coalesce(player_be_msg_u *into, const player_be_msg_u *msg) {
+    if ((into->type == PLAYER_BE_NEXT_MSG || into->type == PLAYER_BE_PREV_MSG) && msg->type == into->type) {
+        into->skip_msg.count += msg->skip_msg.count;
+        into->skip_msg.presses += msg->skip_msg.presses;
+        into->skip_msg.sent_us = msg->skip_msg.sent_us;
+        return true;
+    }
+    if (into->type == PLAYER_BE_SEEK_MSG && msg->type == PLAYER_BE_SEEK_MSG) {
+        if (msg->seek_msg.relative) {
+            into->seek_msg.ms += msg->seek_msg.ms;
+        } else {
+            into->seek_msg = msg->seek_msg;
+        }
+        return true;
+    }
+    return false;
+}
+
+size_t player_msg_batch_add(player_be_msg_u *batch, size_t n, const player_be_msg_u *msg) {
+    while (n > 0 && player_msg_supersedes(msg, &batch[n - 1])) {
+        n--;
+    }
+    if (n > 0 && player_msg_coalesce(&batch[n - 1], msg)) {
+        return n;
+    }
+    batch[n++] = *msg;
+    return n;
+}
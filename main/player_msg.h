@@ -0,0 +1,63 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef ESP_PLATFORM
+#include "playlist.h"
+#else
+typedef struct playlist_operator playlist_operator_t;
+#endif
+
+// Commands queued to the player task, and how a batch of them taken off the
+// queue at once is folded down. Portable, so host_test/test_player_msg.c can
+// check the folding.
+
+typedef enum {
+    PLAYER_BE_PLAYLIST_MSG,
+    PLAYER_BE_PLAYPAUSE_MSG,
+    PLAYER_BE_NEXT_MSG,
+    PLAYER_BE_PREV_MSG,
+    PLAYER_BE_SEEK_MSG,
+    PLAYER_BE_CARD_MSG,
+} player_be_msg_type;
+
+typedef struct {
+    player_be_msg_type type; // always PLAYER_BE_PLAYLIST_MSG
+    playlist_operator_t *pl_op;
+    int32_t start;          // index of the first track, -1 to pick as usual
+} playlist_msg;
+
+typedef struct {
+    player_be_msg_type type; // always PLAYER_BE_SEEK_MSG
+    int32_t ms;
+    bool relative;
+} seek_msg;
+
+typedef struct {
+    player_be_msg_type type; // always PLAYER_BE_CARD_MSG
+    bool mounted;
+} card_msg;
+
+typedef struct {
+    player_be_msg_type type; // PLAYER_BE_NEXT_MSG or PLAYER_BE_PREV_MSG
+    int32_t count;          // tracks to move by
+    uint32_t presses;
+    int64_t sent_us;        // when the last of them was sent
+} skip_msg;
+
+typedef union {
+    player_be_msg_type type;
+    playlist_msg pl_msg;
+    seek_msg seek_msg;
+    card_msg card_msg;
+    skip_msg skip_msg;
+} player_be_msg_u;
+
+// True when later makes earlier pointless, e.g. a seek followed by a skip
+bool player_msg_supersedes(const player_be_msg_u *later, const player_be_msg_u *earlier);
+// Fold msg into a command of the same kind, returning false if they can't be
+bool player_msg_coalesce(player_be_msg_u *into, const player_be_msg_u *msg);
+// Add msg to the end of a batch of n commands, dropping whatever it makes
+// pointless and folding it into the last one where it can. Returns the new
+// length, which is never more than n + 1.
+size_t player_msg_batch_add(player_be_msg_u *batch, size_t n, const player_be_msg_u *msg);
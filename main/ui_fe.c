@@ -19,12 +19,11 @@
 #include "kz_util.h"
 #include "player_be.h"
 #include "ui_common.h"
+#include "ui_gov.h"
 #include "ui_fe.h"
 
 #define TAG "UI_FE"
 
-#define FILE_PREFIX_LEN 6
-
 typedef struct {
     lv_obj_t * list_handle;
     char *name;
@@ -58,7 +57,7 @@ static void set_highlighted_line(size_t line) {
     lv_obj_set_style_text_color(s_fe_list[s_hl_line].list_handle, lv_color_white(), LV_PART_MAIN | LV_STATE_DEFAULT);
     lv_obj_set_style_bg_color(s_fe_list[s_hl_line].list_handle, lv_color_black(), LV_PART_MAIN | LV_STATE_DEFAULT);
     lv_obj_set_style_bg_opa(s_fe_list[s_hl_line].list_handle, LV_OPA_COVER, LV_PART_MAIN | LV_STATE_DEFAULT);
-    lv_label_set_long_mode(s_fe_list[s_hl_line].list_handle, LV_LABEL_LONG_SCROLL_CIRCULAR);
+    ui_gov_marquee(s_fe_list[s_hl_line].list_handle);
     lvgl_port_unlock();
 }
 
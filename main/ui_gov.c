@@ -0,0 +1,186 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+#include "lvgl.h"
+#include "esp_lvgl_port.h"
+
+#include "kz_prof.h"
+#include "kz_ssd1306.h"
+#include "ui_common.h"
+#include "ui_gov.h"
+
+#define UI_GOV_PERIOD_MS 100
+// Fast refresh while a screen slides in
+#define UI_GOV_TRANSITION_MS 500
+#define UI_GOV_TRANSITION_REFR_MS 33
+#define UI_GOV_DIM_MS (30 * 1000)
+#define UI_GOV_DIM_REFR_MS 500
+#define UI_GOV_MARQUEE_CYCLES 3
+#define UI_GOV_MAX_MARQUEES 4
+// Audio core load, in hundredths of a percent, to back off at and recover from
+#define UI_GOV_BUSY_LOAD 8500
+#define UI_GOV_IDLE_LOAD 7000
+
+#define UI_GOV_CONTRAST_BRIGHT 0x7f
+#define UI_GOV_CONTRAST_DIM 0x01
+
+static const char *TAG = "UI_GOV";
+
+// Refresh period for each screen, indexed by disp_state_t
+static const uint16_t s_refr_ms[] = {
+    [DS_NO_CHANGE] = 100,
+    [DS_MAIN_MENU] = 100,
+    [DS_NOW_PLAYING] = 50,
+    [DS_BLUETOOTH] = 100,
+    [DS_FILE_EXP] = 50,
+    [DS_LIBRARY] = 50,
+    [DS_STATS] = 200,
+};
+
+typedef struct {
+    lv_obj_t *label;
+    uint32_t start;         // tick the current run of cycles began
+    bool running;
+} ui_gov_marquee_t;
+
+static ui_gov_marquee_t s_marquees[UI_GOV_MAX_MARQUEES];
+static disp_state_t s_screen = DS_MAIN_MENU;
+static uint32_t s_screen_tick = 0;
+static uint32_t s_refr_period = 0;
+static bool s_dimmed = false;
+static bool s_busy = false;
+static volatile uint32_t s_input_tick = 0;
+static volatile bool s_poked = false;
+
+static void set_dimmed(bool dimmed) {
+    uint8_t contrast = dimmed ? UI_GOV_CONTRAST_DIM : UI_GOV_CONTRAST_BRIGHT;
+    kz_ssd1306_set_contrast(contrast);
+    s_dimmed = dimmed;
+}
+
+static void set_marquee(ui_gov_marquee_t *m, bool run) {
+    lv_label_set_long_mode(m->label, run ? LV_LABEL_LONG_SCROLL_CIRCULAR : LV_LABEL_LONG_DOT);
+    m->running = run;
+    m->start = lv_tick_get();
+}
+
+static void update_marquees(bool restart) {
+    lv_obj_t *act = lv_scr_act();
+    for (int i = 0; i < UI_GOV_MAX_MARQUEES; ++i) {
+        ui_gov_marquee_t *m = &s_marquees[i];
+        if (m->label == NULL) {
+            continue;
+        }
+        bool run = !s_dimmed && !s_busy && lv_obj_get_screen(m->label) == act;
+        if (run && m->running && !restart) {
+            // Only scrolling labels have an animation, and its time is one
+            // trip round the text
+            lv_anim_t *a = lv_anim_get(m->label, NULL);
+            run = a == NULL || lv_tick_elaps(m->start) < (uint32_t)a->time * UI_GOV_MARQUEE_CYCLES;
+        }
+        if (run != m->running || (run && restart)) {
+            set_marquee(m, run);
+        }
+    }
+}
+
+static void gov_cb(lv_timer_t *timer) {
+    bool restart = s_poked;
+    s_poked = false;
+
+    bool idle = lv_tick_elaps(s_input_tick) > UI_GOV_DIM_MS;
+    if (idle != s_dimmed) {
+        set_dimmed(idle);
+    }
+
+    kz_prof_summary_t prof;
+    if (kz_prof_get_summary(&prof)) {
+        uint16_t load = prof.core_load[CONFIG_KZ_SCHED_AUDIO_CORE];
+        bool busy = s_busy ? load > UI_GOV_IDLE_LOAD : load > UI_GOV_BUSY_LOAD;
+        if (busy != s_busy) {
+            // This runs in the LVGL task, so it's LVGL which gives way
+            vTaskPrioritySet(NULL, busy ? tskIDLE_PRIORITY + 1 : CONFIG_KZ_SCHED_LVGL_PRIO);
+            s_busy = busy;
+            ESP_LOGI(TAG, "Audio core at %u%%, %s redraws", load / 100, busy ? "slowing" : "restoring");
+        }
+    }
+
+    uint32_t period = s_refr_ms[s_screen];
+    if (lv_tick_elaps(s_screen_tick) < UI_GOV_TRANSITION_MS) {
+        period = UI_GOV_TRANSITION_REFR_MS;
+    } else if (s_dimmed) {
+        period = UI_GOV_DIM_REFR_MS;
+    } else if (s_busy) {
+        period *= 2;
+    }
+    if (period != s_refr_period) {
+        lv_timer_set_period(_lv_disp_get_refr_timer(ui_get_display()), period);
+        s_refr_period = period;
+    }
+
+    update_marquees(restart);
+}
+
+esp_err_t ui_gov_init(void) {
+    if (ui_get_display() == NULL) {
+        return ESP_FAIL;
+    }
+    lvgl_port_lock(0);
+    s_input_tick = lv_tick_get();
+    set_dimmed(false);
+    lv_timer_create(gov_cb, UI_GOV_PERIOD_MS, NULL);
+    lvgl_port_unlock();
+    return ESP_OK;
+}
+
+void ui_gov_set_screen(disp_state_t state) {
+    if (state < sizeof(s_refr_ms) / sizeof(*s_refr_ms)) {
+        s_screen = state;
+        s_screen_tick = lv_tick_get();
+        s_poked = true;
+    }
+}
+
+// The lists rebuild their rows with lv_obj_clean(), so labels go away under
+// us. Drop each one's slot as it's deleted.
+static void marquee_deleted_cb(lv_event_t *e) {
+    lv_obj_t *label = lv_event_get_target(e);
+    for (int i = 0; i < UI_GOV_MAX_MARQUEES; ++i) {
+        if (s_marquees[i].label == label) {
+            s_marquees[i].label = NULL;
+            s_marquees[i].running = false;
+        }
+    }
+}
+
+void ui_gov_marquee(lv_obj_t *label) {
+    lv_obj_t *screen = lv_obj_get_screen(label);
+    ui_gov_marquee_t *slot = NULL;
+    for (int i = 0; i < UI_GOV_MAX_MARQUEES; ++i) {
+        if (s_marquees[i].label == label ||
+            (s_marquees[i].label != NULL && lv_obj_get_screen(s_marquees[i].label) == screen)) {
+            slot = &s_marquees[i];
+            break;
+        }
+        if (slot == NULL && s_marquees[i].label == NULL) {
+            slot = &s_marquees[i];
+        }
+    }
+    if (slot == NULL) {
+        return;
+    }
+    if (slot->label != label) {
+        if (slot->label != NULL) {
+            lv_obj_remove_event_cb(slot->label, marquee_deleted_cb);
+        }
+        lv_obj_add_event_cb(label, marquee_deleted_cb, LV_EVENT_DELETE, NULL);
+        slot->label = label;
+    }
+    set_marquee(slot, true);
+}
+
+void ui_gov_poke(void) {
+    s_input_tick = lv_tick_get();
+    s_poked = true;
+}
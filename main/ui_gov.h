@@ -0,0 +1,14 @@
+#include "esp_err.h"
+#include "lvgl.h"
+
+// Keeps LVGL from redrawing more than each screen needs: caps the refresh
+// rate per screen, stops marquees once they've been read, dims the panel
+// when idle and backs off while the decoder is busy. Needs ui_common.h.
+esp_err_t ui_gov_init(void);
+void ui_gov_set_screen(disp_state_t state);
+// Let the governor pause and restart a scrolling label. The last label
+// registered on a screen replaces the one before, and a label is forgotten
+// when it's deleted. Call with the LVGL lock.
+void ui_gov_marquee(lv_obj_t *label);
+// Note user input, waking the panel and restarting marquees
+void ui_gov_poke(void);
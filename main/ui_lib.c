@@ -0,0 +1,254 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_err.h"
+#include "esp_log.h"
+
+#include "periph_service.h"
+#include "input_key_service.h"
+#include "board.h"
+
+#include "playlist.h"
+#include "dram_list.h"
+
+#include "lvgl.h"
+#include "esp_lvgl_port.h"
+#include "kz_tagdb.h"
+#include "player_be.h"
+#include "ui_common.h"
+#include "ui_gov.h"
+#include "ui_lib.h"
+
+#define TAG "UI_LIB"
+
+// Only one page of the library is ever held in RAM
+#define LIB_PAGE_SIZE 16
+
+typedef struct {
+    lv_obj_t * list_handle;
+    uint32_t id;
+    bool is_play_all;
+} ui_lib_row_t;
+
+// Local handles
+static lv_obj_t * s_screen = NULL;
+static lv_obj_t * s_top_bar = NULL;
+static lv_obj_t * s_lib_menu = NULL;
+static ui_lib_row_t s_rows[LIB_PAGE_SIZE + 1];
+static size_t s_row_count = 0;
+static size_t s_hl_line = 0;
+
+// Where we are in the artist -> album -> track hierarchy
+static kz_tagdb_level_e s_level = KZ_TAGDB_ARTISTS;
+static uint32_t s_artist = 0;
+static uint32_t s_album = 0;
+static uint32_t s_first = 0;
+static uint32_t s_total = 0;
+
+static void set_highlighted_line(size_t line) {
+    if (s_row_count == 0) {
+        return;
+    }
+    lvgl_port_lock(0);
+    lv_obj_set_style_text_color(s_rows[s_hl_line].list_handle, lv_color_black(), LV_PART_MAIN | LV_STATE_DEFAULT);
+    lv_obj_set_style_bg_color(s_rows[s_hl_line].list_handle, lv_color_white(), LV_PART_MAIN | LV_STATE_DEFAULT);
+    lv_label_set_long_mode(s_rows[s_hl_line].list_handle, LV_LABEL_LONG_CLIP);
+
+    s_hl_line = line;
+
+    lv_obj_set_style_text_color(s_rows[s_hl_line].list_handle, lv_color_white(), LV_PART_MAIN | LV_STATE_DEFAULT);
+    lv_obj_set_style_bg_color(s_rows[s_hl_line].list_handle, lv_color_black(), LV_PART_MAIN | LV_STATE_DEFAULT);
+    lv_obj_set_style_bg_opa(s_rows[s_hl_line].list_handle, LV_OPA_COVER, LV_PART_MAIN | LV_STATE_DEFAULT);
+    ui_gov_marquee(s_rows[s_hl_line].list_handle);
+
+    lv_obj_scroll_to_view(s_rows[s_hl_line].list_handle, LV_ANIM_ON);
+    lvgl_port_unlock();
+}
+
+static void add_row(const char *name, uint32_t id, bool is_play_all) {
+    lvgl_port_lock(0);
+    s_rows[s_row_count].list_handle = lv_list_add_text(s_lib_menu, name);
+    lv_label_set_long_mode(s_rows[s_row_count].list_handle, LV_LABEL_LONG_CLIP);
+    lvgl_port_unlock();
+    s_rows[s_row_count].id = id;
+    s_rows[s_row_count].is_play_all = is_play_all;
+    s_row_count++;
+}
+
+static uint32_t level_parent(void) {
+    return s_level == KZ_TAGDB_ALBUMS ? s_artist : s_album;
+}
+
+// Replace the list contents with the page starting at s_first
+static void load_page(void) {
+    lvgl_port_lock(0);
+    lv_obj_clean(s_lib_menu);
+    lvgl_port_unlock();
+    s_row_count = 0;
+    s_hl_line = 0;
+
+    s_total = kz_tagdb_count(s_level, level_parent());
+    if (s_total == 0) {
+        add_row(kz_tagdb_is_building() ? "Scanning card..." : "No music found", 0, false);
+        return;
+    }
+
+    if (s_level == KZ_TAGDB_TRACKS && s_first == 0) {
+        add_row(" " LV_SYMBOL_PLAY " Play All", 0, true);
+    }
+
+    kz_tagdb_item_t *items = malloc(sizeof(kz_tagdb_item_t) * LIB_PAGE_SIZE);
+    if (items == NULL) {
+        ESP_LOGE(TAG, "Unable to allocate library page!");
+        return;
+    }
+    size_t n = kz_tagdb_fetch(s_level, level_parent(), s_first, LIB_PAGE_SIZE, items);
+    for (size_t i = 0; i < n; ++i) {
+        add_row(items[i].name, items[i].id, false);
+    }
+    free(items);
+}
+
+esp_err_t ui_lib_init(void) {
+    lv_disp_t *disp = ui_get_display();
+    if (disp == NULL) {
+        return ESP_FAIL;
+    }
+
+    s_screen = lv_obj_create(NULL);
+
+    // Create a status bar
+    s_top_bar = ui_create_top_bar(s_screen);
+
+    lvgl_port_lock(0);
+    s_lib_menu = lv_list_create(s_screen);
+    lv_obj_set_width(s_lib_menu, LV_HOR_RES);
+    lv_obj_set_height(s_lib_menu, LV_VER_RES - 12);
+    lv_obj_align(s_lib_menu, LV_ALIGN_TOP_MID, 0, 12);
+    lvgl_port_unlock();
+
+    return ESP_OK;
+}
+
+// The database may have been rebuilt since we were last shown, so always
+// start again from the artist list
+lv_obj_t *ui_lib_get_screen(void) {
+    s_level = KZ_TAGDB_ARTISTS;
+    s_first = 0;
+    load_page();
+    set_highlighted_line(0);
+    return s_screen;
+}
+
+static void play_album(uint32_t album, uint32_t track) {
+    playlist_operator_handle_t pl;
+    if (ESP_OK != dram_list_create(&pl)) {
+        ESP_LOGW(TAG, "Error creating playlist!");
+        return;
+    }
+    playlist_operation_t pl_op;
+    pl->get_operation(&pl_op);
+
+    // The whole album goes in either way, so playback carries on past a
+    // chosen track
+    uint32_t count = kz_tagdb_count(KZ_TAGDB_TRACKS, album);
+    uint32_t start = 0;
+    kz_tagdb_item_t *items = malloc(sizeof(kz_tagdb_item_t) * LIB_PAGE_SIZE);
+    char url[264];
+    strcpy(url, "file:/");
+    if (items != NULL) {
+        for (uint32_t first = 0; first < count; first += LIB_PAGE_SIZE) {
+            size_t n = kz_tagdb_fetch(KZ_TAGDB_TRACKS, album, first, LIB_PAGE_SIZE, items);
+            for (size_t i = 0; i < n; ++i) {
+                if (ESP_OK == kz_tagdb_track_path(items[i].id, url + strlen("file:/"), sizeof(url) - strlen("file:/"))) {
+                    if (items[i].id == track) {
+                        start = (uint32_t)pl_op.get_url_num(pl);
+                    }
+                    dram_list_save(pl, url);
+                }
+            }
+        }
+        free(items);
+    }
+
+    if (pl_op.get_url_num(pl) == 0) {
+        pl_op.destroy(pl);
+    } else if (track == UINT32_MAX) {
+        player_set_playlist(pl, portMAX_DELAY);
+    } else {
+        player_set_playlist_from(pl, start, portMAX_DELAY);
+    }
+}
+
+// Process input from the front keys
+disp_state_t ui_lib_handle_input(periph_service_handle_t handle, periph_service_event_t *evt, audio_board_handle_t board_handle) {
+    disp_state_t ret = DS_NO_CHANGE;
+    if (evt->type != INPUT_KEY_SERVICE_ACTION_CLICK_RELEASE || s_row_count == 0) {
+        return ret;
+    }
+
+    bool should_update = false;
+    switch ((int)evt->data) {
+        case INPUT_KEY_USER_ID_UP:
+            if (s_hl_line > 0) {
+                set_highlighted_line(s_hl_line - 1);
+            } else if (s_total > LIB_PAGE_SIZE) {
+                // Step back a page, wrapping around to the last one
+                s_first = s_first >= LIB_PAGE_SIZE ? s_first - LIB_PAGE_SIZE :
+                          ((s_total - 1) / LIB_PAGE_SIZE) * LIB_PAGE_SIZE;
+                load_page();
+                set_highlighted_line(s_row_count - 1);
+            } else {
+                set_highlighted_line(s_row_count - 1);
+            }
+            break;
+        case INPUT_KEY_USER_ID_DOWN:
+            if (s_hl_line < s_row_count - 1) {
+                set_highlighted_line(s_hl_line + 1);
+            } else if (s_total > LIB_PAGE_SIZE) {
+                s_first = s_first + LIB_PAGE_SIZE < s_total ? s_first + LIB_PAGE_SIZE : 0;
+                load_page();
+                set_highlighted_line(0);
+            } else {
+                set_highlighted_line(0);
+            }
+            break;
+        case INPUT_KEY_USER_ID_CENTER:
+        case INPUT_KEY_USER_ID_RIGHT:
+            if (s_total == 0) {
+                break;
+            }
+            if (s_level == KZ_TAGDB_ARTISTS) {
+                s_artist = s_rows[s_hl_line].id;
+                s_level = KZ_TAGDB_ALBUMS;
+                should_update = true;
+            } else if (s_level == KZ_TAGDB_ALBUMS) {
+                s_album = s_rows[s_hl_line].id;
+                s_level = KZ_TAGDB_TRACKS;
+                should_update = true;
+            } else if ((int)evt->data == INPUT_KEY_USER_ID_CENTER) {
+                play_album(s_album, s_rows[s_hl_line].is_play_all ? UINT32_MAX : s_rows[s_hl_line].id);
+                ret = DS_NOW_PLAYING;
+            }
+            break;
+        case INPUT_KEY_USER_ID_LEFT:
+            if (s_level == KZ_TAGDB_TRACKS) {
+                s_level = KZ_TAGDB_ALBUMS;
+                should_update = true;
+            } else if (s_level == KZ_TAGDB_ALBUMS) {
+                s_level = KZ_TAGDB_ARTISTS;
+                should_update = true;
+            }
+            break;
+        default:
+            break;
+    }
+
+    if (should_update) {
+        s_first = 0;
+        load_page();
+        set_highlighted_line(0);
+    }
+
+    return ret;
+}
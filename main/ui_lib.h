@@ -0,0 +1,3 @@
+lv_obj_t *ui_lib_get_screen(void);
+esp_err_t ui_lib_init(void);
+disp_state_t ui_lib_handle_input(periph_service_handle_t handle, periph_service_event_t *evt, audio_board_handle_t board_handle);
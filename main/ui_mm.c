@@ -75,6 +75,8 @@ disp_state_t ui_mm_handle_input(periph_service_handle_t handle, periph_service_e
             case INPUT_KEY_USER_ID_CENTER:
                 if (s_cur_pos == 0) {
                     return DS_NOW_PLAYING;
+                } else if (s_cur_pos == 1) {
+                    return DS_LIBRARY;
                 } else if (s_cur_pos == 2) {
                     return DS_FILE_EXP;
                 } else if (s_cur_pos == 6) {
@@ -106,6 +108,11 @@ disp_state_t ui_mm_handle_input(periph_service_handle_t handle, periph_service_e
                 }
                 break;
         }
+    } else if (evt->type == INPUT_KEY_SERVICE_ACTION_PRESS) {
+        // Not on the menu - long press right on the settings icon
+        if ((int)evt->data == INPUT_KEY_USER_ID_RIGHT && s_cur_pos == 7) {
+            return DS_STATS;
+        }
     }
 
     return DS_NO_CHANGE;
@@ -1,3 +1,6 @@
+#include <stdio.h>
+#include <string.h>
+
 #include "lvgl.h"
 #include "esp_lvgl_port.h"
 
@@ -10,22 +13,146 @@
 
 #include "playlist.h"
 #include "player_be.h"
+#include "kz_vis.h"
 #include "ui_common.h"
+#include "ui_gov.h"
  static const char *TAG = "UI_NP";
 
+// Long pressing up/down skips through the track by this much
+#define UI_NP_SKIP_MS (10 * 1000)
+#define UI_NP_REFRESH_MS 100
+// The visualizer takes the artist line and the gap below it
+#define UI_NP_VIS_MS 50
+#define UI_NP_VIS_Y 30
+#define UI_NP_VIS_H 18
+#define UI_NP_VIS_BAR_W (LV_HOR_RES / KZ_VIS_BAR_COUNT)
+#define UI_NP_VU_H 7
+
 // Local handles for all of the UI elements
 static lv_obj_t * s_screen = NULL;
 static lv_obj_t * s_title_bar = NULL;
+static lv_obj_t * s_artist_bar = NULL;
 static lv_obj_t * s_shuffle_bar = NULL;
 static lv_obj_t * s_top_bar = NULL;
+static lv_obj_t * s_vis_bars[KZ_VIS_BAR_COUNT];
+static lv_obj_t * s_vu_bars[2];
+static lv_obj_t * s_vu_peaks[2];
+
+static char s_subtitle[2 * PLAYER_NAME_LEN + 4] = "";
+static uint32_t s_track = 0;
+static bool s_shuffle = false;
+static player_repeat_t s_repeat = PLAYER_REPEAT_ALL;
+static kz_vis_mode_e s_vis_mode = KZ_VIS_OFF;
+static kz_vis_frame_t s_vis_shown;
+
+static void set_mode_text(bool shuffle, player_repeat_t repeat) {
+    static const char *repeat_text[] = {
+        [PLAYER_REPEAT_ALL] = LV_SYMBOL_LOOP,
+        [PLAYER_REPEAT_ONE] = LV_SYMBOL_LOOP "1",
+        [PLAYER_REPEAT_OFF] = "",
+    };
+    lv_label_set_text_fmt(s_shuffle_bar, "%s %s", shuffle ? LV_SYMBOL_SHUFFLE : "", repeat_text[repeat]);
+    s_shuffle = shuffle;
+    s_repeat = repeat;
+}
 
-void ui_np_set_song_title(const char *title) {
-    if (s_title_bar == NULL)
+// Runs in the LVGL task, so the lock is already held. The player only
+// publishes its state and never touches the UI itself.
+static void refresh_cb(lv_timer_t *timer) {
+    static player_state_t state;
+    if (!player_get_state(&state)) {
         return;
+    }
+    ui_set_play(state.playing);
+    // Read directly rather than waiting for the player to publish the change
+    bool shuffle = player_get_shuffle();
+    player_repeat_t repeat = player_get_repeat();
+    if (shuffle != s_shuffle || repeat != s_repeat) {
+        set_mode_text(shuffle, repeat);
+    }
+    if (state.track == s_track) {
+        return;
+    }
+    s_track = state.track;
+    if (state.artist[0] != '\0' && state.album[0] != '\0') {
+        snprintf(s_subtitle, sizeof(s_subtitle), "%s - %s", state.artist, state.album);
+    } else {
+        snprintf(s_subtitle, sizeof(s_subtitle), "%s", state.artist[0] != '\0' ? state.artist : state.album);
+    }
+    lv_label_set_text(s_title_bar, state.title);
+    ui_gov_marquee(s_title_bar);
+    lv_label_set_text(s_artist_bar, s_subtitle);
+}
 
-    lvgl_port_lock(0);
-    lv_label_set_text(s_title_bar, title);
-    lvgl_port_unlock();
+// A plain filled rectangle. Moving or resizing one only invalidates its old
+// and new areas, so each frame redraws just the bars that changed.
+static lv_obj_t *create_block(lv_color_t color) {
+    lv_obj_t *obj = lv_obj_create(s_screen);
+    lv_obj_remove_style_all(obj);
+    lv_obj_set_style_bg_color(obj, color, LV_PART_MAIN | LV_STATE_DEFAULT);
+    lv_obj_set_style_bg_opa(obj, LV_OPA_COVER, LV_PART_MAIN | LV_STATE_DEFAULT);
+    lv_obj_add_flag(obj, LV_OBJ_FLAG_HIDDEN);
+    return obj;
+}
+
+static void set_shown(lv_obj_t *obj, bool shown) {
+    if (shown) {
+        lv_obj_clear_flag(obj, LV_OBJ_FLAG_HIDDEN);
+    } else {
+        lv_obj_add_flag(obj, LV_OBJ_FLAG_HIDDEN);
+    }
+}
+
+static void show_vis(kz_vis_mode_e mode) {
+    for (int b = 0; b < KZ_VIS_BAR_COUNT; ++b) {
+        set_shown(s_vis_bars[b], mode == KZ_VIS_SPECTRUM);
+        lv_obj_set_pos(s_vis_bars[b], b * UI_NP_VIS_BAR_W, UI_NP_VIS_Y + UI_NP_VIS_H - 1);
+        lv_obj_set_height(s_vis_bars[b], 1);
+    }
+    for (int ch = 0; ch < 2; ++ch) {
+        set_shown(s_vu_bars[ch], mode == KZ_VIS_VU);
+        set_shown(s_vu_peaks[ch], mode == KZ_VIS_VU);
+        lv_obj_set_width(s_vu_bars[ch], 1);
+        lv_obj_set_x(s_vu_peaks[ch], 0);
+    }
+    set_shown(s_artist_bar, mode == KZ_VIS_OFF);
+    // Back to silence, which is what a zeroed frame shows
+    memset(&s_vis_shown, 0, sizeof(s_vis_shown));
+    s_vis_mode = mode;
+}
+
+// Also in the LVGL task. Draws the last frame the visualizer worked out and
+// asks for the next, so it only does any work while it can be seen.
+static void vis_cb(lv_timer_t *timer) {
+    kz_vis_mode_e mode = kz_vis_get_mode();
+    if (mode != s_vis_mode) {
+        show_vis(mode);
+    }
+    if (mode == KZ_VIS_OFF || lv_scr_act() != s_screen) {
+        return;
+    }
+    kz_vis_frame_t frame;
+    if (kz_vis_get_frame(&frame)) {
+        for (int b = 0; b < KZ_VIS_BAR_COUNT && mode == KZ_VIS_SPECTRUM; ++b) {
+            if (frame.bars[b] == s_vis_shown.bars[b]) {
+                continue;
+            }
+            // Always a pixel high, so the row of bars stays visible in silence
+            int h = 1 + frame.bars[b] * (UI_NP_VIS_H - 1) / KZ_VIS_LEVEL_MAX;
+            lv_obj_set_pos(s_vis_bars[b], b * UI_NP_VIS_BAR_W, UI_NP_VIS_Y + UI_NP_VIS_H - h);
+            lv_obj_set_height(s_vis_bars[b], h);
+        }
+        for (int ch = 0; ch < 2 && mode == KZ_VIS_VU; ++ch) {
+            if (frame.vu[ch] != s_vis_shown.vu[ch]) {
+                lv_obj_set_width(s_vu_bars[ch], 1 + frame.vu[ch] * (LV_HOR_RES - 3) / KZ_VIS_LEVEL_MAX);
+            }
+            if (frame.vu_peak[ch] != s_vis_shown.vu_peak[ch]) {
+                lv_obj_set_x(s_vu_peaks[ch], frame.vu_peak[ch] * (LV_HOR_RES - 2) / KZ_VIS_LEVEL_MAX);
+            }
+        }
+        s_vis_shown = frame;
+    }
+    kz_vis_request();
 }
 
 lv_obj_t *ui_np_get_screen(void) {
@@ -48,13 +175,38 @@ esp_err_t ui_np_init(void) {
     lvgl_port_lock(0);
     s_title_bar = lv_label_create(s_screen);
     lv_label_set_text(s_title_bar, "Play a song! Like maybe... ring ring ring ring ring ring ring banana phoooooone!");
-    lv_label_set_long_mode(s_title_bar, LV_LABEL_LONG_SCROLL_CIRCULAR); /* Circular scroll */
+    ui_gov_marquee(s_title_bar); /* Circular scroll */
     lv_obj_set_width(s_title_bar, LV_HOR_RES);
     lv_obj_align(s_title_bar, LV_ALIGN_TOP_MID, 0, 12);
+    s_artist_bar = lv_label_create(s_screen);
+    lv_label_set_text(s_artist_bar, s_subtitle);
+    lv_label_set_long_mode(s_artist_bar, LV_LABEL_LONG_DOT);
+    ui_add_style_small(s_artist_bar);
+    lv_obj_set_width(s_artist_bar, LV_HOR_RES);
+    lv_obj_align(s_artist_bar, LV_ALIGN_TOP_MID, 0, 30);
     s_shuffle_bar = lv_label_create(s_screen);
     lv_obj_set_width(s_shuffle_bar, LV_HOR_RES);
-    lv_label_set_text(s_shuffle_bar, LV_SYMBOL_SHUFFLE);
+    set_mode_text(player_get_shuffle(), player_get_repeat());
     lv_obj_align(s_shuffle_bar, LV_ALIGN_BOTTOM_MID, 0, 0);
+    // Drawn in the text colour, whichever way round the theme has it
+    lv_color_t fg = lv_obj_get_style_text_color(s_artist_bar, LV_PART_MAIN);
+    for (int b = 0; b < KZ_VIS_BAR_COUNT; ++b) {
+        s_vis_bars[b] = create_block(fg);
+        lv_obj_set_width(s_vis_bars[b], UI_NP_VIS_BAR_W - 1);
+    }
+    for (int ch = 0; ch < 2; ++ch) {
+        int y = UI_NP_VIS_Y + 1 + ch * (UI_NP_VU_H + 2);
+        s_vu_bars[ch] = create_block(fg);
+        lv_obj_set_height(s_vu_bars[ch], UI_NP_VU_H);
+        lv_obj_set_y(s_vu_bars[ch], y);
+        s_vu_peaks[ch] = create_block(fg);
+        lv_obj_set_size(s_vu_peaks[ch], 2, UI_NP_VU_H);
+        lv_obj_set_y(s_vu_peaks[ch], y);
+    }
+    show_vis(kz_vis_get_mode());
+    lv_timer_create(vis_cb, UI_NP_VIS_MS, NULL);
+    // Picks up a track the player resumed before this screen existed
+    lv_timer_create(refresh_cb, UI_NP_REFRESH_MS, NULL);
     lvgl_port_unlock();
 
     return ESP_OK;
@@ -69,6 +221,9 @@ disp_state_t ui_np_handle_input(periph_service_handle_t handle, periph_service_e
             case INPUT_KEY_USER_ID_CENTER:
                 player_playpause();
                 break;
+            case INPUT_KEY_USER_ID_LEFT:
+                player_prev();
+                break;
             case INPUT_KEY_USER_ID_RIGHT:
                 player_next();
                 break;
@@ -95,15 +250,19 @@ disp_state_t ui_np_handle_input(periph_service_handle_t handle, periph_service_e
 
     if (evt->type == INPUT_KEY_SERVICE_ACTION_PRESS) {
         switch ((int)evt->data) {
+            case INPUT_KEY_USER_ID_UP:
+                player_skip(UI_NP_SKIP_MS);
+                break;
+            case INPUT_KEY_USER_ID_DOWN:
+                player_skip(-UI_NP_SKIP_MS);
+                break;
             case INPUT_KEY_USER_ID_RIGHT:
+                // The icon follows on the next refresh
                 player_set_shuffle(!player_get_shuffle());
-                lvgl_port_lock(0);
-                if (player_get_shuffle()) {
-                    lv_label_set_text(s_shuffle_bar, LV_SYMBOL_SHUFFLE);
-                } else {
-                    lv_label_set_text(s_shuffle_bar, "");
-                }
-                lvgl_port_unlock();
+                break;
+            case INPUT_KEY_USER_ID_LEFT:
+                // All, one, off and round again
+                player_set_repeat((player_get_repeat() + 1) % (PLAYER_REPEAT_OFF + 1));
                 break;
             default:
                 break;
@@ -0,0 +1,86 @@
+#include "esp_err.h"
+
+#include "periph_service.h"
+#include "input_key_service.h"
+#include "board.h"
+
+#include "lvgl.h"
+#include "esp_lvgl_port.h"
+#include "kz_telem.h"
+#include "ui_common.h"
+#include "ui_stats.h"
+
+// Hidden memory screen, reached by long pressing right on the settings icon
+
+#define UI_STATS_REFRESH_MS 1000
+
+static lv_obj_t * s_screen = NULL;
+static lv_obj_t * s_stats = NULL;
+
+// Runs in the LVGL task, so the lock is already held
+static void refresh_cb(lv_timer_t *timer) {
+    if (lv_scr_act() != s_screen) {
+        return;
+    }
+    kz_telem_sample_t s;
+    if (!kz_telem_latest(&s)) {
+        lv_label_set_text(s_stats, "No samples yet");
+        return;
+    }
+
+    // Whichever running task is closest to the end of its stack
+    kz_telem_task_t tasks[KZ_TELEM_TASK_COUNT];
+    size_t n = kz_telem_tasks(tasks, KZ_TELEM_TASK_COUNT);
+    const kz_telem_task_t *tightest = NULL;
+    for (size_t i = 0; i < n; ++i) {
+        if (tasks[i].stack_min != 0 && (tightest == NULL || tasks[i].stack_min < tightest->stack_min)) {
+            tightest = &tasks[i];
+        }
+    }
+
+    lv_label_set_text_fmt(s_stats,
+                          "INT %uk min %uk blk %uk\n"
+                          "PSR %uk min %uk blk %uk\n"
+                          "RB %u %u %u %u %u%%\n"
+                          "Stack %s %u",
+                          (unsigned)(s.int_free / 1024), (unsigned)(s.int_min / 1024),
+                          (unsigned)(s.int_largest / 1024),
+                          (unsigned)(s.psram_free / 1024), (unsigned)(s.psram_min / 1024),
+                          (unsigned)(s.psram_largest / 1024),
+                          s.rb_fill[0], s.rb_fill[1], s.rb_fill[2], s.rb_fill[3], s.rb_fill[4],
+                          tightest != NULL ? tightest->name : "-",
+                          tightest != NULL ? (unsigned)tightest->stack_min : 0);
+}
+
+esp_err_t ui_stats_init(void) {
+    lv_disp_t *disp = ui_get_display();
+    if (disp == NULL) {
+        return ESP_FAIL;
+    }
+    lvgl_port_lock(0);
+    s_screen = lv_obj_create(NULL);
+    lvgl_port_unlock();
+
+    ui_create_top_bar(s_screen);
+
+    lvgl_port_lock(0);
+    s_stats = lv_label_create(s_screen);
+    ui_add_style_small(s_stats);
+    lv_obj_set_width(s_stats, LV_HOR_RES);
+    lv_obj_align(s_stats, LV_ALIGN_TOP_LEFT, 0, 12);
+    lv_timer_create(refresh_cb, UI_STATS_REFRESH_MS, NULL);
+    lvgl_port_unlock();
+
+    return ESP_OK;
+}
+
+lv_obj_t *ui_stats_get_screen(void) {
+    return s_screen;
+}
+
+disp_state_t ui_stats_handle_input(periph_service_handle_t handle, periph_service_event_t *evt, audio_board_handle_t board_handle) {
+    if (evt->type == INPUT_KEY_SERVICE_ACTION_CLICK_RELEASE && (int)evt->data == INPUT_KEY_USER_ID_LEFT) {
+        return DS_MAIN_MENU;
+    }
+    return DS_NO_CHANGE;
+}